@@ -296,6 +296,200 @@ static NTSTATUS domain_client_validate(TALLOC_CTX *mem_ctx,
 	return nt_status;
 }
 
+/***********************************************************************
+ Did winbindd fail to get the logon to a DC of the domain, rather than
+ the DC rejecting it?
+************************************************************************/
+
+static BOOL winbind_domain_failure(NTSTATUS status)
+{
+	/* winbindd answers NO_SUCH_USER when it doesn't know the domain */
+	return NT_STATUS_EQUAL(status, NT_STATUS_NO_SUCH_USER) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_NO_SUCH_DOMAIN) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_NO_LOGON_SERVERS) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_DOMAIN_CONTROLLER_NOT_FOUND) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_CANT_ACCESS_DOMAIN_INFO) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_TRUSTED_RELATIONSHIP_FAILURE) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_TRUSTED_DOMAIN_FAILURE) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_NO_TRUST_SAM_ACCOUNT) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_IO_TIMEOUT) ||
+		NT_STATUS_EQUAL(status, NT_STATUS_UNSUCCESSFUL);
+}
+
+/***********************************************************************
+ Validate the user through winbindd instead of our own connection to
+ a DC.
+
+ Every smbd setting up its own connection, NETLOGON pipe and
+ credential chain to the DC multiplies the sessions on the DC by the
+ number of smbds and puts the connection setup into the first logon
+ of each client. winbindd already keeps an authenticated netlogon
+ channel per domain (schannel if "client schannel" allows it), queues
+ the SamLogon calls of all smbds onto it and fails over to another DC
+ when the one it uses goes away, so use that channel if it is there.
+
+ A DC keeps only one credential chain per machine account, so the
+ channel cannot be a pool of several pipes: a second ServerAuthenticate
+ from us would invalidate the first. That is why all smbds are funnelled
+ through winbindd's single channel rather than given pipes of their own.
+
+ Sets *try_direct if winbindd is not running, or if it could not get
+ the logon to a DC of the domain, in which case the caller connects to
+ the DC itself as before. A logon the DC rejected is not retried.
+************************************************************************/
+
+static NTSTATUS domain_client_validate_winbind(TALLOC_CTX *mem_ctx,
+					const auth_usersupplied_info *user_info,
+					const char *domain,
+					uchar chal[8],
+					auth_serversupplied_info **server_info,
+					BOOL *try_direct)
+{
+	struct winbindd_request request;
+	struct winbindd_response response;
+	NSS_STATUS result;
+	NTSTATUS nt_status;
+	NET_USER_INFO_3 info3;
+
+	*try_direct = False;
+
+	ZERO_STRUCT(request);
+	ZERO_STRUCT(response);
+
+	request.flags = WBFLAG_PAM_INFO3_NDR;
+
+	request.data.auth_crap.logon_parameters = user_info->logon_parameters;
+
+	fstrcpy(request.data.auth_crap.user, user_info->smb_name);
+	/* The client's own domain name, it is part of the NTLMv2 response */
+	fstrcpy(request.data.auth_crap.domain, user_info->client_domain);
+	fstrcpy(request.data.auth_crap.workstation, user_info->wksta_name);
+
+	memcpy(request.data.auth_crap.chal, chal,
+	       sizeof(request.data.auth_crap.chal));
+
+	request.data.auth_crap.lm_resp_len = MIN(user_info->lm_resp.length,
+						 sizeof(request.data.auth_crap.lm_resp));
+	request.data.auth_crap.nt_resp_len = MIN(user_info->nt_resp.length,
+						 sizeof(request.data.auth_crap.nt_resp));
+
+	memcpy(request.data.auth_crap.lm_resp, user_info->lm_resp.data,
+	       request.data.auth_crap.lm_resp_len);
+	memcpy(request.data.auth_crap.nt_resp, user_info->nt_resp.data,
+	       request.data.auth_crap.nt_resp_len);
+
+	/* we are contacting the privileged pipe */
+	become_root();
+	result = winbindd_priv_request_response(WINBINDD_PAM_AUTH_CRAP,
+						&request, &response);
+	unbecome_root();
+
+	if (result == NSS_STATUS_UNAVAIL) {
+		DEBUG(5,("domain_client_validate_winbind: winbindd not "
+			 "available, connecting to the DC directly\n"));
+		*try_direct = True;
+		return NT_STATUS_NO_LOGON_SERVERS;
+	}
+
+	nt_status = NT_STATUS(response.data.auth.nt_status);
+
+	if (result != NSS_STATUS_SUCCESS || response.extra_data.data == NULL) {
+		SAFE_FREE(response.extra_data.data);
+		if (NT_STATUS_IS_OK(nt_status)) {
+			nt_status = NT_STATUS_NO_LOGON_SERVERS;
+		}
+		DEBUG(3,("domain_client_validate_winbind: unable to validate "
+			 "password for user %s in domain %s. Error was %s.\n",
+			 user_info->smb_name, user_info->client_domain,
+			 nt_errstr(nt_status)));
+		*try_direct = winbind_domain_failure(nt_status);
+		return nt_status;
+	}
+
+	ZERO_STRUCT(info3);
+
+	nt_status = get_info3_from_ndr(mem_ctx, &response, &info3);
+	SAFE_FREE(response.extra_data.data);
+
+	if (!NT_STATUS_IS_OK(nt_status)) {
+		return nt_status;
+	}
+
+	nt_status = make_server_info_info3(mem_ctx,
+					user_info->smb_name,
+					domain,
+					server_info,
+					&info3);
+
+	if (NT_STATUS_IS_OK(nt_status)) {
+		(*server_info)->was_mapped |= user_info->was_mapped;
+
+		if ( ! (*server_info)->guest) {
+			/* if a real user check pam account restrictions */
+			/* only really perfomed if "obey pam restriction" is true */
+			nt_status = smb_pam_accountcheck((*server_info)->unix_name);
+			if (  !NT_STATUS_IS_OK(nt_status)) {
+				DEBUG(1, ("PAM account restriction prevents user login\n"));
+				return nt_status;
+			}
+		}
+	}
+
+	netsamlogon_cache_store( user_info->smb_name, &info3 );
+
+	return nt_status;
+}
+
+/***********************************************************************
+ Validate through winbindd's shared channel if we can, through our own
+ connection to a DC otherwise. "ntdomain:use winbind = no" always
+ connects directly.
+************************************************************************/
+
+static NTSTATUS domain_validate(TALLOC_CTX *mem_ctx,
+				const auth_usersupplied_info *user_info,
+				const char *domain,
+				uchar chal[8],
+				auth_serversupplied_info **server_info)
+{
+	fstring dc_name;
+	struct in_addr dc_ip;
+
+	if (lp_parm_bool(-1, "ntdomain", "use winbind", True)) {
+		NTSTATUS nt_status;
+		BOOL try_direct;
+
+		nt_status = domain_client_validate_winbind(mem_ctx,
+							user_info,
+							domain,
+							chal,
+							server_info,
+							&try_direct);
+		if (!try_direct) {
+			return nt_status;
+		}
+		DEBUG(5,("domain_validate: winbindd failed for domain %s (%s), "
+			 "connecting to the DC directly\n", domain,
+			 nt_errstr(nt_status)));
+	}
+
+	/* we need our DC to send the net_sam_logon() request to */
+
+	if ( !get_dc_name(domain, NULL, dc_name, &dc_ip) ) {
+		DEBUG(5,("domain_validate: unable to locate a DC for domain %s\n",
+			domain));
+		return NT_STATUS_NO_LOGON_SERVERS;
+	}
+
+	return domain_client_validate(mem_ctx,
+				user_info,
+				domain,
+				chal,
+				server_info,
+				dc_name,
+				dc_ip);
+}
+
 /****************************************************************************
  Check for a valid username and password in security=domain mode.
 ****************************************************************************/
@@ -308,8 +502,6 @@ static NTSTATUS check_ntdomain_security(const struct auth_context *auth_context,
 {
 	NTSTATUS nt_status = NT_STATUS_LOGON_FAILURE;
 	const char *domain = lp_workgroup();
-	fstring dc_name;
-	struct in_addr dc_ip;
 
 	if ( lp_server_role() != ROLE_DOMAIN_MEMBER ) {
 		DEBUG(0,("check_ntdomain_security: Configuration error!  Cannot use "
@@ -333,21 +525,11 @@ static NTSTATUS check_ntdomain_security(const struct auth_context *auth_context,
 		return NT_STATUS_NOT_IMPLEMENTED;
 	}
 
-	/* we need our DC to send the net_sam_logon() request to */
-
-	if ( !get_dc_name(domain, NULL, dc_name, &dc_ip) ) {
-		DEBUG(5,("check_ntdomain_security: unable to locate a DC for domain %s\n",
-			user_info->domain));
-		return NT_STATUS_NO_LOGON_SERVERS;
-	}
-	
-	nt_status = domain_client_validate(mem_ctx,
-					user_info,
-					domain,
-					(uchar *)auth_context->challenge.data,
-					server_info,
-					dc_name,
-					dc_ip);
+	nt_status = domain_validate(mem_ctx,
+				user_info,
+				domain,
+				(uchar *)auth_context->challenge.data,
+				server_info);
 		
 	return nt_status;
 }
@@ -380,8 +562,6 @@ static NTSTATUS check_trustdomain_security(const struct auth_context *auth_conte
 	char *trust_password;
 	time_t last_change_time;
 	DOM_SID sid;
-	fstring dc_name;
-	struct in_addr dc_ip;
 
 	if (!user_info || !server_info || !auth_context) {
 		DEBUG(1,("check_trustdomain_security: Critical variables not present.  Failing.\n"));
@@ -434,22 +614,14 @@ static NTSTATUS check_trustdomain_security(const struct auth_context *auth_conte
 	}
 #endif
 
-	/* use get_dc_name() for consistency even through we know that it will be 
-	   a netbios name */
+	/* domain_validate() uses get_dc_name() for consistency even
+	   through we know that it will be a netbios name */
 	   
-	if ( !get_dc_name(user_info->domain, NULL, dc_name, &dc_ip) ) {
-		DEBUG(5,("check_trustdomain_security: unable to locate a DC for domain %s\n",
-			user_info->domain));
-		return NT_STATUS_NO_LOGON_SERVERS;
-	}
-	
-	nt_status = domain_client_validate(mem_ctx,
-					user_info,
-					user_info->domain,
-					(uchar *)auth_context->challenge.data,
-					server_info,
-					dc_name,
-					dc_ip);
+	nt_status = domain_validate(mem_ctx,
+				user_info,
+				user_info->domain,
+				(uchar *)auth_context->challenge.data,
+				server_info);
 
 	return nt_status;
 }
@@ -980,6 +980,195 @@ static struct nt_user_token *create_local_nt_token(TALLOC_CTX *mem_ctx,
 	return result;
 }
 
+/*******************************************************************
+ Token cache.
+
+ For a user in a lot of groups building the token is expensive: the
+ aliases are expanded through passdb and every group SID is converted
+ to a gid, each possibly a round trip to winbindd. The result only
+ depends on the user SID, the group SIDs the DC (or passdb) gave us
+ and the id mappings, so keep it in gencache where every smbd can find
+ it. The key carries a digest of the group SIDs, so a change in the
+ user's memberships is a different key, and the idmap generation, so
+ a change in the mappings or local aliases makes the old entries
+ unreachable. Privileges are still looked up on every fetch.
+*******************************************************************/
+
+static char *token_cache_key(TALLOC_CTX *mem_ctx,
+			     auth_serversupplied_info *server_info,
+			     uint32 generation)
+{
+	const DOM_SID *user_sid = pdb_get_user_sid(server_info->sam_account);
+	struct MD5Context md5_ctx;
+	uint8 digest[16];
+	uint8 guest = server_info->guest ? 1 : 0;
+	char *key;
+	size_t i;
+
+	if (user_sid == NULL) {
+		return NULL;
+	}
+
+	MD5Init(&md5_ctx);
+	MD5Update(&md5_ctx, &guest, sizeof(guest));
+	for (i = 0; i < server_info->num_sids; i++) {
+		char buf[sizeof(DOM_SID)];
+		size_t len = sid_size(&server_info->sids[i]);
+
+		if (len > sizeof(buf) ||
+		    !sid_linearize(buf, len, &server_info->sids[i])) {
+			return NULL;
+		}
+		MD5Update(&md5_ctx, (const unsigned char *)buf, len);
+	}
+	MD5Final(digest, &md5_ctx);
+
+	key = talloc_asprintf(mem_ctx, "TOKEN/%s/%u/",
+			      sid_string_static(user_sid),
+			      (unsigned int)generation);
+	for (i = 0; key && i < sizeof(digest); i++) {
+		key = talloc_asprintf_append(key, "%02x", digest[i]);
+	}
+	return key;
+}
+
+static BOOL token_cache_fetch(auth_serversupplied_info *server_info)
+{
+	TALLOC_CTX *mem_ctx;
+	struct nt_user_token *token;
+	char *key, *value = NULL;
+	const char *p;
+	fstring tok;
+	BOOL in_gids = False;
+
+	if (lp_parm_int(-1, "auth", "token cache time", 300) <= 0) {
+		return False;
+	}
+
+	mem_ctx = talloc_new(NULL);
+	if (mem_ctx == NULL) {
+		return False;
+	}
+
+	key = token_cache_key(mem_ctx, server_info, idmap_generation());
+	if (key == NULL || !gencache_get(key, &value, NULL)) {
+		TALLOC_FREE(mem_ctx);
+		return False;
+	}
+
+	token = TALLOC_ZERO_P(server_info, NT_USER_TOKEN);
+	if (token == NULL) {
+		goto fail;
+	}
+
+	server_info->n_groups = 0;
+	server_info->groups = NULL;
+
+	/* "<sid> <sid> ... ; <gid> <gid> ..." */
+
+	p = value;
+	while (next_token(&p, tok, " ", sizeof(tok))) {
+		DOM_SID sid;
+
+		if (strcmp(tok, ";") == 0) {
+			in_gids = True;
+			continue;
+		}
+
+		if (in_gids) {
+			if (!add_gid_to_array_unique(server_info,
+						     (gid_t)strtoul(tok, NULL, 10),
+						     &server_info->groups,
+						     &server_info->n_groups)) {
+				goto fail;
+			}
+			continue;
+		}
+
+		if (!string_to_sid(&sid, tok) ||
+		    !add_sid_to_array(token, &sid, &token->user_sids,
+				      &token->num_sids)) {
+			goto fail;
+		}
+	}
+
+	if (!in_gids || token->num_sids == 0) {
+		DEBUG(1, ("token_cache_fetch: bad entry for %s\n", key));
+		gencache_del(key);
+		goto fail;
+	}
+
+	get_privileges_for_sids(&token->privileges, token->user_sids,
+				token->num_sids);
+
+	server_info->ptok = token;
+
+	DEBUG(10, ("token_cache_fetch: %s: %u sids, %u gids\n", key,
+		   (unsigned int)token->num_sids,
+		   (unsigned int)server_info->n_groups));
+
+	SAFE_FREE(value);
+	TALLOC_FREE(mem_ctx);
+	return True;
+
+ fail:
+	TALLOC_FREE(token);
+	TALLOC_FREE(server_info->groups);
+	server_info->n_groups = 0;
+	SAFE_FREE(value);
+	TALLOC_FREE(mem_ctx);
+	return False;
+}
+
+static void token_cache_store(auth_serversupplied_info *server_info,
+			      uint32 generation)
+{
+	TALLOC_CTX *mem_ctx;
+	int ttl = lp_parm_int(-1, "auth", "token cache time", 300);
+	char *key, *value;
+	size_t i;
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	/* Keyed on the generation read before the token was built. If
+	 * the mappings or aliases changed while we were building it the
+	 * token may already be stale, so don't hand it out. */
+
+	if (idmap_generation() != generation) {
+		DEBUG(10, ("token_cache_store: idmap generation changed, "
+			   "not caching\n"));
+		return;
+	}
+
+	mem_ctx = talloc_new(NULL);
+	if (mem_ctx == NULL) {
+		return;
+	}
+
+	key = token_cache_key(mem_ctx, server_info, generation);
+	value = talloc_strdup(mem_ctx, "");
+
+	for (i = 0; value && i < server_info->ptok->num_sids; i++) {
+		value = talloc_asprintf_append(value, "%s ",
+			sid_string_static(&server_info->ptok->user_sids[i]));
+	}
+	if (value) {
+		value = talloc_asprintf_append(value, ";");
+	}
+	for (i = 0; value && i < server_info->n_groups; i++) {
+		value = talloc_asprintf_append(value, " %u",
+			(unsigned int)server_info->groups[i]);
+	}
+
+	if (key && value) {
+		gencache_set(key, value, time(NULL) + ttl);
+	}
+
+	TALLOC_FREE(mem_ctx);
+}
+
 /*
  * Create the token to use from server_info->sam_account and
  * server_info->sids (the info3/sam groups). Find the unix gids.
@@ -989,6 +1178,8 @@ NTSTATUS create_local_token(auth_serversupplied_info *server_info)
 {
 	TALLOC_CTX *mem_ctx;
 	NTSTATUS status;
+	BOOL cacheable = False;
+	uint32 generation = 0;
 	size_t i;
 	
 
@@ -1014,7 +1205,10 @@ NTSTATUS create_local_token(auth_serversupplied_info *server_info)
 						    &server_info->unix_name,
 						    &server_info->ptok);
 		
+	} else if (token_cache_fetch(server_info)) {
+		goto done;
 	} else {
+		generation = idmap_generation();
 		server_info->ptok = create_local_nt_token(
 			server_info,
 			pdb_get_user_sid(server_info->sam_account),
@@ -1022,6 +1216,7 @@ NTSTATUS create_local_token(auth_serversupplied_info *server_info)
 			server_info->num_sids, server_info->sids);
 		status = server_info->ptok ?
 			NT_STATUS_OK : NT_STATUS_NO_SUCH_USER;
+		cacheable = NT_STATUS_IS_OK(status);
 	}
 
 	if (!NT_STATUS_IS_OK(status)) {
@@ -1043,12 +1238,21 @@ NTSTATUS create_local_token(auth_serversupplied_info *server_info)
 		if (!sid_to_gid(sid, &gid)) {
 			DEBUG(10, ("Could not convert SID %s to gid, "
 				   "ignoring it\n", sid_string_static(sid)));
+			/* might be a passing winbind/idmap failure, don't
+			   hand a short gid list to every smbd for the
+			   cache time */
+			cacheable = False;
 			continue;
 		}
 		add_gid_to_array_unique(server_info, gid, &server_info->groups,
 					&server_info->n_groups);
 	}
-	
+
+	if (cacheable) {
+		token_cache_store(server_info, generation);
+	}
+
+ done:
 	debug_nt_user_token(DBGC_AUTH, 10, server_info->ptok);
 
 	status = log_nt_token(mem_ctx, server_info->ptok);
@@ -1519,7 +1723,7 @@ static NTSTATUS make_new_server_info_guest(auth_serversupplied_info **server_inf
 	return NT_STATUS_OK;
 }
 
-static auth_serversupplied_info *copy_serverinfo(auth_serversupplied_info *src)
+auth_serversupplied_info *copy_serverinfo(auth_serversupplied_info *src)
 {
 	auth_serversupplied_info *dst;
 
@@ -2049,6 +2253,35 @@ NTSTATUS make_server_info_info3(TALLOC_CTX *mem_ctx,
 	return NT_STATUS_OK;
 }
 
+/***************************************************************************
+ Unmarshall the info3 winbindd returns for WBFLAG_PAM_INFO3_NDR.
+***************************************************************************/
+
+NTSTATUS get_info3_from_ndr(TALLOC_CTX *mem_ctx, struct winbindd_response *response, NET_USER_INFO_3 *info3)
+{
+	uint8 *info3_ndr;
+	size_t len = response->length - sizeof(struct winbindd_response);
+	prs_struct ps;
+	if (len > 0) {
+		info3_ndr = (uint8 *)response->extra_data.data;
+		if (!prs_init(&ps, len, mem_ctx, UNMARSHALL)) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		prs_copy_data_in(&ps, (char *)info3_ndr, len);
+		prs_set_offset(&ps,0);
+		if (!net_io_user_info3("", info3, &ps, 1, 3, False)) {
+			DEBUG(2, ("get_info3_from_ndr: could not parse info3 struct!\n"));
+			return NT_STATUS_UNSUCCESSFUL;
+		}
+		prs_mem_free(&ps);
+
+		return NT_STATUS_OK;
+	} else {
+		DEBUG(2, ("get_info3_from_ndr: No info3 struct found!\n"));
+		return NT_STATUS_UNSUCCESSFUL;
+	}
+}
+
 /***************************************************************************
  Free a user_info struct
 ***************************************************************************/
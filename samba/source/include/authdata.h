@@ -167,6 +167,7 @@ typedef struct pac_data {
 	uint32 num_buffers;
 	uint32 version;
 	PAC_BUFFER *pac_buffer;
+	uint8 digest[16];	/* MD5 of the verified PAC, not marshalled */
 } PAC_DATA;
 
 
@@ -29,6 +29,7 @@
 #define CLI_BUFFER_SIZE (0xFFFF)
 #define CLI_SAMBA_MAX_LARGE_READX_SIZE (127*1024) /* Works for Samba servers */
 #define CLI_WINDOWS_MAX_LARGE_READX_SIZE ((64*1024)-2) /* Windows servers are broken.... */
+#define CLI_MAX_PIPE_READS 8 /* Outstanding SMBreadX on one pipe, see cli_read_pipe_multi() */
 
 /*
  * These definitions depend on smb.h
@@ -157,6 +158,32 @@ struct cli_state {
 
 	BOOL force_dos_errors;
 	BOOL case_sensitive; /* False by default. */
+
+	/* Requests sent with cli_request_new(), see libsmb/async_smb.c */
+	struct cli_request *outstanding_requests;
+	struct cli_request *queued_requests; /* over max_mux, not sent yet */
+	struct cli_request *queue_next_send; /* cli_send_smb() queues for it */
+	struct event_context *event_ctx;
+	struct fd_event *fd_event;
+};
+
+/*
+ * An SMB request whose reply is delivered through an event context
+ * instead of being waited for. fn is called once the reply is in inbuf
+ * (a copy owned by the request) or status says the connection failed.
+ */
+struct cli_request {
+	struct cli_request *prev, *next;
+	struct cli_state *cli;
+	struct event_context *event_ctx;
+	uint16 mid;
+	BOOL outstanding;
+	BOOL queued;
+	char *outbuf;		/* the request while it is queued */
+	NTSTATUS status;
+	char *inbuf;
+	void (*fn)(struct cli_request *req);
+	void *private_data;
 };
 
 typedef struct file_info {
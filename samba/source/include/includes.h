@@ -779,6 +779,7 @@ enum flush_reason_enum {
     CLOSE_FLUSH,
     SYNC_FLUSH,
     SIZECHANGE_FLUSH,
+    AGED_FLUSH,
     /* NUM_FLUSH_REASONS must remain the last value in the enumeration. */
     NUM_FLUSH_REASONS};
 
@@ -9,6 +9,16 @@
 #include "include/libsmbclient.h"
 
 
+#define SMBC_SERVER_CACHE_HASH_SIZE 512
+
+/*
+ * An SMB session shared by the SMBCSRVs of several shares on one server.
+ * The last SMBCSRV to go away shuts the connection down.
+ */
+struct smbc_session {
+	int refcount;
+};
+
 struct _SMBCSRV {
 	struct cli_state *cli;
 	dev_t dev;
@@ -16,6 +26,21 @@ struct _SMBCSRV {
 	BOOL no_pathinfo2;
         BOOL no_nt_session;
 
+	/*
+	 * Our tree connect on cli. Only switched to when cli is shared
+	 * (session != NULL), otherwise cli always holds it.
+	 */
+	struct smbc_session *session;
+	uint16 cnum;
+	BOOL dfsroot;
+	fstring share;
+
+	/*
+	 * Non-zero while a caller holds on to this server across calls
+	 * that may reap the server cache. Pinned servers are never reaped.
+	 */
+	int pin_count;
+
 	SMBCSRV *next, *prev;
 	
 };
@@ -106,6 +131,31 @@ struct smbc_internal_data {
          * and retrieved with smbc_option_set() and smbc_option_get().
          */
         void * _user_data;
+
+        /*
+         * Hash index over the internal server cache (libsmb_cache.c),
+         * keyed on server, workgroup and user.
+         */
+        struct smbc_server_cache * _server_cache_hash[SMBC_SERVER_CACHE_HASH_SIZE];
+        int _server_cache_count;
+        time_t _server_cache_last_reap;
+
+        /*
+         * Drop cached connections unused for this many seconds, and the
+         * least recently used ones beyond this many. 0 means no limit.
+         */
+        int _server_cache_max_idle;
+        int _server_cache_max_servers;
+
+        struct smbc_server_cache_stats _server_cache_stats;
+
+        /*
+         * Event context and memory of the smbc_async_*() operations,
+         * created by the first one.
+         */
+        struct event_context * _async_ev;
+        TALLOC_CTX * _async_mem_ctx;
+        int _async_outstanding;
 };	
 
 
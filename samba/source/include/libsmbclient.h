@@ -64,6 +64,11 @@ extern "C" {
 *   \ingroup libsmbclient
 *   Functions that don't fit in to other categories
 */
+/** \defgroup async Asynchronous Functions
+*   \ingroup libsmbclient
+*   Functions that start an operation and report its result through a
+*   callback, so that many operations can be in flight on one connection
+*/
 /*-------------------------------------------------------------------*/   
 
 /* Make sure we have the following includes for now ... */
@@ -665,6 +670,46 @@ void *
 smbc_option_get(SMBCCTX *context,
                 char *option_name);
 
+/**@ingroup structure
+ * Server connection cache counters, see smbc_get_server_cache_stats().
+ */
+struct smbc_server_cache_stats
+{
+	/** Requests satisfied by a cached connection */
+	unsigned long hits;
+	/** Requests that found no cached connection */
+	unsigned long misses;
+	/** New SMB sessions set up */
+	unsigned long connects;
+	/** Shares connected on an existing session */
+	unsigned long session_reuses;
+	/** Cached connections found dead and replaced */
+	unsigned long reconnects;
+	/** Connections dropped for being idle or over the limit */
+	unsigned long evictions;
+	/** Server connections currently open */
+	unsigned long servers;
+};
+
+/**@ingroup misc
+ * Get the server connection cache counters of a context.
+ *
+ * The cache is tuned with smbc_option_set(): "server_cache_max_idle"
+ * drops connections unused for that many seconds and
+ * "server_cache_max_servers" keeps at most that many, dropping the least
+ * recently used. Connections with open files are never dropped. Both
+ * default to 0, no limit.
+ *
+ * @param context   A pointer to an initialized SMBCCTX
+ *
+ * @param stats     Filled in with the current counters
+ *
+ * @return          0 on success, < 0 on error with errno set:
+ *                  - EINVAL NULL context or stats given
+ */
+int smbc_get_server_cache_stats(SMBCCTX *context,
+                                struct smbc_server_cache_stats *stats);
+
 /**@ingroup misc
  * Initialize a SBMCCTX (a context).
  *
@@ -2190,4 +2235,121 @@ smbc_version(void);
 #endif
 
 
+/**@ingroup async
+ * Completion function of an asynchronous operation.
+ *
+ * @param c         The context the operation was started on
+ *
+ * @param file      The file the operation was on, for smbc_async_open()
+ *                  the newly opened file. NULL for smbc_async_close() and
+ *                  smbc_async_stat().
+ *
+ * @param result    The number of bytes read or written, 0 for the other
+ *                  operations, or -1 on error
+ *
+ * @param err       The errno value if result is -1
+ *
+ * @param private_data
+ *                  As passed when the operation was started
+ */
+typedef void (*smbc_async_fn)(SMBCCTX *c, SMBCFILE *file, ssize_t result,
+                              int err, void *private_data);
+
+/**@ingroup async
+ * Asynchronous operations on a context.
+ *
+ * Each of these sends its request and returns at once. The result is
+ * delivered to fn from within smbc_async_process(), in whatever order the
+ * servers answer. Any number of operations may be started, also on the
+ * same file. At most the server's max_mux less one of them are sent to a
+ * server at a time (one slot is left for synchronous calls), the rest
+ * wait in a queue and go out as replies come in. Connecting to a server
+ * and DFS referrals are still done synchronously when the operation is
+ * started.
+ *
+ * Reads and writes are positioned and do not move the file offset used by
+ * read() and write(). A read or write transfers at most what fits into
+ * one SMB (about 60k for reads, max_xmit for writes), so be prepared for
+ * short counts. Buffers must stay valid until the callback has run.
+ *
+ * Synchronous calls can be mixed with asynchronous ones on the same
+ * context; call smbc_async_process() with a timeout of 0 afterwards, as
+ * replies that arrived during a synchronous call are only delivered there.
+ * Operations still outstanding when the context is freed are dropped
+ * without calling their callbacks.
+ *
+ * @return          0 if the operation was started, < 0 on error with errno
+ *                  set, in which case fn is not called:
+ *                  - EINVAL  Invalid context, name or buffer
+ *                  - EBADF   file is not an open file
+ *                  - EISDIR  smbc_async_open() of a directory
+ *                  - ENOMEM  Out of memory or the request could not be sent
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+int smbc_async_open(SMBCCTX *c, const char *fname, int flags,
+                    smbc_async_fn fn, void *private_data);
+
+int smbc_async_read(SMBCCTX *c, SMBCFILE *file, void *buf, size_t count,
+                    off_t offset, smbc_async_fn fn, void *private_data);
+
+int smbc_async_write(SMBCCTX *c, SMBCFILE *file, const void *buf,
+                     size_t count, off_t offset,
+                     smbc_async_fn fn, void *private_data);
+
+int smbc_async_close(SMBCCTX *c, SMBCFILE *file,
+                     smbc_async_fn fn, void *private_data);
+
+int smbc_async_stat(SMBCCTX *c, const char *fname, struct stat *st,
+                    smbc_async_fn fn, void *private_data);
+#ifdef __cplusplus
+}
+#endif
+
+
+/**@ingroup async
+ * Wait for replies to asynchronous operations and run their callbacks.
+ *
+ * @param c         The context
+ *
+ * @param timeout_ms
+ *                  How long to wait for a reply, 0 to only poll, < 0 to
+ *                  wait until one arrives
+ *
+ * @return          The number of operations still outstanding, < 0 on
+ *                  error with errno set.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+int smbc_async_process(SMBCCTX *c, int timeout_ms);
+#ifdef __cplusplus
+}
+#endif
+
+
+/**@ingroup async
+ * Get the sockets with outstanding asynchronous operations, to wait for
+ * them in an application's own poll() or select() loop. Call
+ * smbc_async_process() with a timeout of 0 when one becomes readable.
+ *
+ * @param c         The context
+ *
+ * @param fds       Filled in with up to max_fds file descriptors
+ *
+ * @param max_fds   The size of fds
+ *
+ * @return          The number of descriptors, which may be more than
+ *                  max_fds, or < 0 on error with errno set.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+int smbc_async_get_fds(SMBCCTX *c, int *fds, int max_fds);
+#ifdef __cplusplus
+}
+#endif
+
+
 #endif /* SMBCLIENT_H_INCLUDED */
@@ -51,6 +51,14 @@
 /* maximum number of file caches per smbd */
 #define MAX_WRITE_CACHES 10
 
+/* maximum number of separate dirty extents in one write cache */
+#define MAX_WRITE_CACHE_EXTENTS 64
+
+/* seconds dirty data may sit in a write cache before an idle smbd
+   pushes it out, and how often we look */
+#define WRITE_CACHE_MAX_AGE 2
+#define WRITE_CACHE_FLUSH_INTERVAL 1
+
 /* define what facility to use for syslog */
 #ifndef SYSLOG_FACILITY
 #define SYSLOG_FACILITY LOG_DAEMON
@@ -79,6 +79,11 @@
  */
 #define MSG_PVFS_NOTIFY       3016
 
+/* inotify broker (see smbd/notify_inotify.c) */
+#define MSG_SMB_NOTIFY_BROKER_WATCH	3017
+#define MSG_SMB_NOTIFY_BROKER_UNWATCH	3018
+#define MSG_SMB_NOTIFY_BROKER_EVENT	3019
+
 /* winbind messages */
 #define MSG_WINBIND_FINISHED     4001
 #define MSG_WINBIND_FORGET_STATE 4002
@@ -81,6 +81,15 @@ typedef struct _output_data {
 
 	/* The amount of data sent from the current PDU. */
 	uint32 current_pdu_sent;
+
+	/*
+	 * Plain responses only have their headers marshalled into
+	 * current_pdu. The last current_pdu_data_len bytes of the PDU
+	 * are read straight out of rdata, starting at
+	 * current_pdu_data_offset, saving a copy of every reply byte.
+	 */
+	uint32 current_pdu_data_offset;
+	uint32 current_pdu_data_len;
 } output_data;
 
 typedef struct _input_data {
@@ -44,6 +44,26 @@ struct printjob {
 	NT_DEVICEMODE *nt_devmode;
 };
 
+/* Change events reported by print interfaces that can follow a queue
+   incrementally instead of listing it in full on every update. The job
+   is described exactly as queue_get() would return it. */
+enum print_queue_event_type {
+	PRINT_QUEUE_EVENT_JOB_ADDED,
+	PRINT_QUEUE_EVENT_JOB_CHANGED,
+	PRINT_QUEUE_EVENT_JOB_REMOVED
+};
+
+struct print_queue_event {
+	enum print_queue_event_type type;
+	print_queue_struct job;
+};
+
+/* Backend subscription state, kept in the print tdb between updates. */
+struct print_queue_cookie {
+	uint32 id;	/* backend subscription id, 0 if none */
+	uint32 seq;	/* last event sequence number consumed */
+};
+
 /* Information for print interfaces */
 struct printif
 {
@@ -61,6 +81,19 @@ struct printif
   int (*job_pause)(int snum, struct printjob *pjob);
   int (*job_resume)(int snum, struct printjob *pjob);
   int (*job_submit)(int snum, struct printjob *pjob);
+
+  /* Optional incremental queue tracking. queue_subscribe() (re)creates
+     the backend subscription just before a full queue_get(), and
+     queue_get_changes() returns the events seen since the last call, or
+     -1 if the caller has to fall back to a full queue_get(). */
+  int (*queue_subscribe)(const char *printer_name,
+                         char *lpq_command,
+                         struct print_queue_cookie *cookie);
+  int (*queue_get_changes)(const char *printer_name,
+                           char *lpq_command,
+                           struct print_queue_cookie *cookie,
+                           struct print_queue_event **events,
+                           print_status_struct *status);
 };
 
 extern struct printif	generic_printif;
@@ -39,5 +39,8 @@ struct sessionid {
 	uint32  pid;
 	fstring ip_addr;
 	time_t connect_start;
+	uint32  num_files; /* updated at most every SESSION_NUM_FILES_DELAY secs */
 };
 
+#define SESSION_NUM_FILES_DELAY 1
+
@@ -414,12 +414,21 @@ typedef struct {
 	BOOL  wr_discard; /* discard all further data */
 } write_bmpx_struct;
 
-typedef struct write_cache {
-	SMB_OFF_T file_size;
+struct write_cache_extent {
+	struct write_cache_extent *prev, *next;
 	SMB_OFF_T offset;
-	size_t alloc_size;
 	size_t data_size;
+	size_t alloc_size;
 	char *data;
+};
+
+typedef struct write_cache {
+	SMB_OFF_T file_size;
+	size_t alloc_size; /* Max dirty bytes held over all extents. */
+	size_t data_size; /* Dirty bytes currently held. */
+	unsigned int num_extents;
+	time_t dirty_since; /* When the oldest dirty data arrived. */
+	struct write_cache_extent *extents; /* Sorted, non-overlapping. */
 } write_cache;
 
 typedef struct {
@@ -480,6 +489,21 @@ struct sys_notify_context {
 	void *private_data; 	/* For use by the system backend */
 };
 
+/*
+ * notify.tdb has one record per watched directory, keyed by
+ * NOTIFY_DB_PREFIX followed by the directory path. The record is an array
+ * of these, one per watch.
+ */
+
+#define NOTIFY_DB_PREFIX "NOTIFY/"
+
+struct notify_db_entry {
+	struct server_id server;
+	uint32 filter;
+	uint32 subdir_filter;
+	uint64 private_data;	/* Only meaningful to the watching server */
+};
+
 struct notify_change_buf {
 	/*
 	 * If no requests are pending, changes are queued here. Simple array,
@@ -542,6 +566,7 @@ typedef struct files_struct {
 	BOOL lockdb_clean;
 	BOOL initial_delete_on_close; /* Only set at NTCreateX if file was created. */
 	BOOL posix_open;
+	BOOL session_counted; /* in the num_files of its vuid's session */
 	char *fsp_name;
 
 	struct vfs_fsp_data *vfs_extension;
@@ -1798,6 +1823,8 @@ typedef struct user_struct {
 
 	char *session_keystr; /* used by utmp and pam session code.  
 				 TDB key string */
+	uint32 num_files; /* open files, see session_file_opened() */
+	struct timed_event *num_files_te; /* pending sessionid.tdb update */
 	int homes_snum;
 
 	struct auth_serversupplied_info *server_info;
@@ -37,7 +37,7 @@
 
 #define PROF_SHMEM_KEY ((key_t)0x07021999)
 #define PROF_SHM_MAGIC 0x6349985
-#define PROF_SHM_VERSION 11
+#define PROF_SHM_VERSION 14
 
 /* time values in the following structure are in microseconds */
 
@@ -754,6 +754,16 @@ struct profile_stats {
 	unsigned statcache_misses;
 	unsigned statcache_hits;
 
+/* attribute cache counters */
+	unsigned attrcache_lookups;
+	unsigned attrcache_misses;
+	unsigned attrcache_hits;
+
+/* directory stat prefetch counters */
+	unsigned statprefetch_batches;
+	unsigned statprefetch_hits;
+	unsigned statprefetch_misses;
+
 /* write cache counters */
 	unsigned writecache_read_hits;
 	unsigned writecache_abutted_writes;
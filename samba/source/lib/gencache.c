@@ -27,11 +27,56 @@
 #define DBGC_CLASS DBGC_TDB
 
 #define TIMEOUT_LEN 12
-#define CACHE_DATA_FMT	"%12u/%s"
-#define READ_CACHE_DATA_FMT_TEMPLATE "%%12u/%%%us"
+
+/*
+ * Entries are stored as a fixed binary header followed by the value
+ * string (including its terminating NUL):
+ *
+ *	 0 magic
+ *	 4 expiry time
+ *	 8 flags (none defined yet)
+ *	12 length of the value
+ *	16 value
+ *
+ * The magic starts with a NUL byte, which the old text format
+ * ("%12u/%s") never does, so both formats can be told apart and old
+ * records are converted as they are found.
+ *
+ * Next to the entries we keep a coarse expiry index: every entry is
+ * appended to the list of keys for the time bucket in which it expires.
+ * Every now and then the buckets that lie wholly in the past are walked
+ * and their expired entries deleted, so the cache no longer grows with
+ * entries nobody asks for again.
+ *
+ * Callers may hold entry locks (gencache_lock_entry()) around any of
+ * the calls here, so the purge never waits for a chain lock. It skips
+ * whatever is busy. gencache_get() deletes an expired entry when it
+ * finds one, and gencache_set() doesn't purge at all.
+ */
+
+#define GENCACHE_MAGIC		0x32434700	/* "\0GC2" on disk */
+#define GENCACHE_HDR_LEN	16
+
+#define GENCACHE_INTERNAL_PREFIX	"@GENCACHE/"
+#define GENCACHE_VERSION_KEY		"@GENCACHE/VERSION"
+#define GENCACHE_PURGE_KEY		"@GENCACHE/PURGE"
+#define GENCACHE_EXPIRY_KEY_FMT		"@GENCACHE/EXPIRY/%u"
+#define GENCACHE_VERSION		2
+
+/* Width of one expiry index bucket in seconds */
+#define GENCACHE_BUCKET_SECS		300
+
+/* Don't try to purge more often than this per process */
+#define GENCACHE_PURGE_INTERVAL		60
+
+/* Index buckets to walk in one incremental purge */
+#define GENCACHE_PURGE_MAX_BUCKETS	64
 
 static TDB_CONTEXT *cache;
 static BOOL cache_readonly;
+static time_t last_purge;
+
+static void gencache_purge(time_t now);
 
 /**
  * @file gencache.c
@@ -40,6 +85,191 @@ static BOOL cache_readonly;
  *
  **/
 
+static TDB_DATA string_key(const char *keystr)
+{
+	TDB_DATA key;
+
+	key.dptr = CONST_DISCARD(char *, keystr);
+	key.dsize = strlen(keystr)+1;
+	return key;
+}
+
+static uint32 gencache_bucket(time_t t)
+{
+	return (uint32)t / GENCACHE_BUCKET_SECS;
+}
+
+/**
+ * Decode a cache record in either format without copying it.
+ *
+ * @param data the record as found in the tdb
+ * @param timeout filled with the expiry time
+ * @param value pointed at the NUL terminated value inside data
+ * @param is_text set to True if this is an old text record
+ *
+ * @retval true if the record could be decoded
+ **/
+
+static BOOL gencache_decode(TDB_DATA data, time_t *timeout,
+			    const char **value, BOOL *is_text)
+{
+	uint32 len;
+
+	if (data.dptr == NULL) {
+		return False;
+	}
+
+	if (data.dsize >= GENCACHE_HDR_LEN &&
+	    IVAL(data.dptr, 0) == GENCACHE_MAGIC) {
+		len = IVAL(data.dptr, 12);
+		if (len == 0 || len > data.dsize - GENCACHE_HDR_LEN ||
+		    data.dptr[GENCACHE_HDR_LEN + len - 1] != '\0') {
+			return False;
+		}
+		*timeout = (time_t)IVAL(data.dptr, 4);
+		*value = data.dptr + GENCACHE_HDR_LEN;
+		*is_text = False;
+		return True;
+	}
+
+	/* Old "%12u/%s" text record */
+
+	if (data.dsize <= TIMEOUT_LEN + 1 ||
+	    data.dptr[TIMEOUT_LEN] != '/' ||
+	    data.dptr[data.dsize-1] != '\0') {
+		return False;
+	}
+
+	*timeout = (time_t)strtoul(data.dptr, NULL, 10);
+	*value = data.dptr + TIMEOUT_LEN + 1;
+	*is_text = True;
+	return True;
+}
+
+/**
+ * Store one entry in the binary format and put it into the expiry index.
+ **/
+
+static BOOL gencache_store(TDB_DATA keybuf, const char *value,
+			   time_t timeout, BOOL index_entry)
+{
+	TDB_DATA databuf;
+	size_t len = strlen(value)+1;
+	uint32 bucket, now_bucket;
+	fstring idxkey;
+	int ret;
+
+	databuf.dsize = GENCACHE_HDR_LEN + len;
+	databuf.dptr = (char *)SMB_MALLOC(databuf.dsize);
+	if (databuf.dptr == NULL) {
+		return False;
+	}
+
+	SIVAL(databuf.dptr, 0, GENCACHE_MAGIC);
+	SIVAL(databuf.dptr, 4, (uint32)timeout);
+	SIVAL(databuf.dptr, 8, 0);
+	SIVAL(databuf.dptr, 12, len);
+	memcpy(databuf.dptr + GENCACHE_HDR_LEN, value, len);
+
+	ret = tdb_store(cache, keybuf, databuf, 0);
+	SAFE_FREE(databuf.dptr);
+
+	if (ret != 0) {
+		return False;
+	}
+
+	if (!index_entry) {
+		return True;
+	}
+
+	/*
+	 * Entries that are already due go into the current bucket, which
+	 * is the oldest one the purge has not walked yet.
+	 */
+
+	bucket = gencache_bucket(timeout);
+	now_bucket = gencache_bucket(time(NULL));
+	if (bucket < now_bucket) {
+		bucket = now_bucket;
+	}
+
+	fstr_sprintf(idxkey, GENCACHE_EXPIRY_KEY_FMT, bucket);
+	if (tdb_append(cache, string_key(idxkey), keybuf) != 0) {
+		DEBUG(5, ("Could not index cache entry %s: %s\n",
+			  keybuf.dptr, tdb_errorstr(cache)));
+	}
+
+	return True;
+}
+
+/**
+ * Convert all old text records and put them into the expiry index.
+ * Runs once, when a cache written by an older version is first opened.
+ **/
+
+static int gencache_upgrade_fn(TDB_CONTEXT *tdb, TDB_DATA key,
+			       TDB_DATA data, void *private_data)
+{
+	time_t timeout;
+	const char *value;
+	BOOL is_text;
+	char *valstr;
+
+	if (key.dsize == 0 || key.dptr[key.dsize-1] != '\0' ||
+	    strncmp(key.dptr, GENCACHE_INTERNAL_PREFIX,
+		    strlen(GENCACHE_INTERNAL_PREFIX)) == 0) {
+		return 0;
+	}
+
+	if (!gencache_decode(data, &timeout, &value, &is_text)) {
+		DEBUG(2, ("Removing invalid gencache entry %s\n", key.dptr));
+		tdb_delete(tdb, key);
+		return 0;
+	}
+
+	if (timeout <= time(NULL)) {
+		tdb_delete(tdb, key);
+		return 0;
+	}
+
+	/* data is tdb's buffer, which the store below may reuse */
+	valstr = SMB_STRDUP(value);
+	if (valstr == NULL) {
+		return -1;
+	}
+	gencache_store(key, valstr, timeout, True);
+	SAFE_FREE(valstr);
+
+	return 0;
+}
+
+static void gencache_upgrade(void)
+{
+	TDB_DATA vkey = string_key(GENCACHE_VERSION_KEY);
+	int32 version;
+	int count;
+
+	if (tdb_chainlock(cache, vkey) != 0) {
+		return;
+	}
+
+	/* Somebody else might have beaten us to it */
+	version = tdb_fetch_int32(cache, GENCACHE_VERSION_KEY);
+	if (version == GENCACHE_VERSION) {
+		tdb_chainunlock(cache, vkey);
+		return;
+	}
+
+	count = tdb_traverse(cache, gencache_upgrade_fn, NULL);
+
+	tdb_store_int32(cache, GENCACHE_PURGE_KEY,
+			(int32)gencache_bucket(time(NULL)));
+	tdb_store_int32(cache, GENCACHE_VERSION_KEY, GENCACHE_VERSION);
+	tdb_chainunlock(cache, vkey);
+
+	DEBUG(3, ("gencache_upgrade: converted cache with %d records\n",
+		  count));
+}
 
 /**
  * Cache initialisation function. Opens cache tdb file or creates
@@ -75,6 +305,12 @@ BOOL gencache_init(void)
 		DEBUG(5, ("Attempt to open gencache.tdb has failed.\n"));
 		return False;
 	}
+
+	if (!cache_readonly &&
+	    tdb_fetch_int32(cache, GENCACHE_VERSION_KEY) != GENCACHE_VERSION) {
+		gencache_upgrade();
+	}
+
 	return True;
 }
 
@@ -111,11 +347,26 @@ BOOL gencache_shutdown(void)
  * @retval false on failure
  **/
  
+static int gencache_bucket_parser(TDB_DATA key, TDB_DATA data,
+				  void *private_data)
+{
+	uint32 *pbucket = (uint32 *)private_data;
+	time_t timeout;
+	const char *value;
+	BOOL is_text;
+
+	if (gencache_decode(data, &timeout, &value, &is_text) && !is_text) {
+		*pbucket = gencache_bucket(timeout);
+	}
+	return 0;
+}
+
 BOOL gencache_set(const char *keystr, const char *value, time_t timeout)
 {
-	int ret;
-	TDB_DATA keybuf, databuf;
-	char* valstr = NULL;
+	TDB_DATA keybuf;
+	uint32 old_bucket = (uint32)-1;
+	time_t now = time(NULL);
+	BOOL index_entry;
 	
 	/* fail completely if get null pointers passed */
 	SMB_ASSERT(keystr && value);
@@ -126,23 +377,22 @@ BOOL gencache_set(const char *keystr, const char *value, time_t timeout)
 		return False;
 	}
 
-	asprintf(&valstr, CACHE_DATA_FMT, (int)timeout, value);
-	if (!valstr)
-		return False;
-
-	keybuf.dptr = CONST_DISCARD(char *, keystr);
-	keybuf.dsize = strlen(keystr)+1;
-	databuf.dptr = valstr;
-	databuf.dsize = strlen(valstr)+1;
+	keybuf = string_key(keystr);
 	DEBUG(10, ("Adding cache entry with key = %s; value = %s and timeout ="
 	           " %s (%d seconds %s)\n", keybuf.dptr, value,ctime(&timeout),
-		   (int)(timeout - time(NULL)), 
-		   timeout > time(NULL) ? "ahead" : "in the past"));
+		   (int)(timeout - now), 
+		   timeout > now ? "ahead" : "in the past"));
 
-	ret = tdb_store(cache, keybuf, databuf, 0);
-	SAFE_FREE(valstr);
-	
-	return ret == 0;
+	/*
+	 * Refreshing an entry usually keeps it in the same expiry bucket,
+	 * don't grow the index with another copy of the key then.
+	 */
+
+	tdb_parse_record(cache, keybuf, gencache_bucket_parser, &old_bucket);
+	index_entry = (old_bucket != gencache_bucket(timeout)) ||
+		(timeout <= now);
+
+	return gencache_store(keybuf, value, timeout, index_entry);
 }
 
 /**
@@ -190,11 +440,45 @@ BOOL gencache_del(const char *keystr)
  * @retval False for failure
  **/
 
+struct gencache_get_state {
+	time_t timeout;
+	char *value;
+	BOOL want_value;
+	BOOL want_expired;
+	BOOL found;
+	BOOL is_text;
+	BOOL oom;
+};
+
+static int gencache_get_parser(TDB_DATA key, TDB_DATA data,
+			       void *private_data)
+{
+	struct gencache_get_state *state =
+		(struct gencache_get_state *)private_data;
+	const char *value;
+
+	if (!gencache_decode(data, &state->timeout, &value,
+			     &state->is_text)) {
+		return 0;
+	}
+
+	state->found = True;
+
+	/* Only copy what the caller wants */
+	if (state->want_value &&
+	    (state->want_expired || state->timeout > time(NULL))) {
+		state->value = SMB_STRDUP(value);
+		state->oom = (state->value == NULL);
+	}
+
+	return 0;
+}
+
 BOOL gencache_get(const char *keystr, char **valstr, time_t *timeout)
 {
-	TDB_DATA keybuf, databuf;
-	time_t t;
-	char *endptr;
+	TDB_DATA keybuf;
+	struct gencache_get_state state;
+	time_t now;
 
 	/* fail completely if get null pointers passed */
 	SMB_ASSERT(keystr);
@@ -203,50 +487,61 @@ BOOL gencache_get(const char *keystr, char **valstr, time_t *timeout)
 		return False;
 	}
 	
-	keybuf.dptr = CONST_DISCARD(char *, keystr);
-	keybuf.dsize = strlen(keystr)+1;
-	databuf = tdb_fetch(cache, keybuf);
+	keybuf = string_key(keystr);
 
-	if (databuf.dptr == NULL) {
+	ZERO_STRUCT(state);
+	/* Converting an old record needs the value */
+	state.want_value = True;
+
+	tdb_parse_record(cache, keybuf, gencache_get_parser, &state);
+
+	if (!state.found) {
 		DEBUG(10, ("Cache entry with key = %s couldn't be found\n",
 			   keystr));
 		return False;
 	}
 
-	t = strtol(databuf.dptr, &endptr, 10);
-
-	if ((endptr == NULL) || (*endptr != '/')) {
-		DEBUG(2, ("Invalid gencache data format: %s\n", databuf.dptr));
-		SAFE_FREE(databuf.dptr);
-		return False;
-	}
+	now = time(NULL);
 
 	DEBUG(10, ("Returning %s cache entry: key = %s, value = %s, "
-		   "timeout = %s", t > time(NULL) ? "valid" :
-		   "expired", keystr, endptr+1, ctime(&t)));
+		   "timeout = %s", state.timeout > now ? "valid" :
+		   "expired", keystr, state.value ? state.value : "",
+		   ctime(&state.timeout)));
 
-	if (t <= time(NULL)) {
+	if (state.timeout <= now) {
 
 		/* We're expired, delete the entry */
-		tdb_delete(cache, keybuf);
+		if (!cache_readonly) {
+			tdb_delete(cache, keybuf);
+			gencache_purge(now);
+		}
 
-		SAFE_FREE(databuf.dptr);
+		SAFE_FREE(state.value);
 		return False;
 	}
 
+	if (state.oom) {
+		DEBUG(0, ("strdup failed\n"));
+		return False;
+	}
+
+	if (state.is_text && !cache_readonly) {
+		/* Left behind by an older version, convert it */
+		gencache_store(keybuf, state.value, state.timeout, True);
+	}
+
 	if (valstr) {
-		*valstr = SMB_STRDUP(endptr+1);
-		if (*valstr == NULL) {
-			SAFE_FREE(databuf.dptr);
-			DEBUG(0, ("strdup failed\n"));
-			return False;
-		}
+		*valstr = state.value;
+	} else {
+		SAFE_FREE(state.value);
 	}
-	
-	SAFE_FREE(databuf.dptr);
 
 	if (timeout) {
-		*timeout = t;
+		*timeout = state.timeout;
+	}
+
+	if (!cache_readonly) {
+		gencache_purge(now);
 	}
 
 	return True;
@@ -268,11 +563,7 @@ void gencache_iterate(void (*fn)(const char* key, const char *value, time_t time
                       void* data, const char* keystr_pattern)
 {
 	TDB_LIST_NODE *node, *first_node;
-	TDB_DATA databuf;
-	char *keystr = NULL, *valstr = NULL, *entry = NULL;
-	time_t timeout = 0;
-	int status;
-	unsigned u;
+	char *keystr = NULL;
 
 	/* fail completely if get null pointers passed */
 	SMB_ASSERT(fn && keystr_pattern);
@@ -284,62 +575,47 @@ void gencache_iterate(void (*fn)(const char* key, const char *value, time_t time
 	first_node = node;
 	
 	while (node) {
-		char *fmt;
+		struct gencache_get_state state;
 
 		/* ensure null termination of the key string */
 		keystr = SMB_STRNDUP(node->node_key.dptr, node->node_key.dsize);
 		if (!keystr) {
 			break;
 		}
+
+		/* The expiry index and friends are not cache entries */
+		if (strncmp(keystr, GENCACHE_INTERNAL_PREFIX,
+			    strlen(GENCACHE_INTERNAL_PREFIX)) == 0) {
+			SAFE_FREE(keystr);
+			node = node->next;
+			continue;
+		}
 		
 		/* 
 		 * We don't use gencache_get function, because we need to iterate through
 		 * all of the entries. Validity verification is up to fn routine.
 		 */
-		databuf = tdb_fetch(cache, node->node_key);
-		if (!databuf.dptr || databuf.dsize <= TIMEOUT_LEN) {
-			SAFE_FREE(databuf.dptr);
+		ZERO_STRUCT(state);
+		state.want_value = True;
+		state.want_expired = True;
+		tdb_parse_record(cache, node->node_key, gencache_get_parser,
+				 &state);
+
+		if (!state.found || state.value == NULL) {
+			/* gone or invalid */
 			SAFE_FREE(keystr);
+			if (state.oom) {
+				break;
+			}
 			node = node->next;
 			continue;
 		}
-		entry = SMB_STRNDUP(databuf.dptr, databuf.dsize);
-		if (!entry) {
-			SAFE_FREE(databuf.dptr);
-			SAFE_FREE(keystr);
-			break;
-		}
-
-		SAFE_FREE(databuf.dptr);
-
-		valstr = (char *)SMB_MALLOC(databuf.dsize + 1 - TIMEOUT_LEN);
-		if (!valstr) {
-			SAFE_FREE(entry);
-			SAFE_FREE(keystr);
-			break;
-		}
 
-		asprintf(&fmt, READ_CACHE_DATA_FMT_TEMPLATE, (unsigned int)databuf.dsize - TIMEOUT_LEN);
-		if (!fmt) {
-			SAFE_FREE(valstr);
-			SAFE_FREE(entry);
-			SAFE_FREE(keystr);
-			break;
-		}
-		status = sscanf(entry, fmt, &u, valstr);
-		SAFE_FREE(fmt);
-
-		if ( status != 2 ) {
-			DEBUG(0,("gencache_iterate: invalid return from sscanf %d\n",status));
-		}
-		timeout = u;
-		
 		DEBUG(10, ("Calling function with arguments (key = %s, value = %s, timeout = %s)\n",
-		           keystr, valstr, ctime(&timeout)));
-		fn(keystr, valstr, timeout, data);
+		           keystr, state.value, ctime(&state.timeout)));
+		fn(keystr, state.value, state.timeout, data);
 		
-		SAFE_FREE(valstr);
-		SAFE_FREE(entry);
+		SAFE_FREE(state.value);
 		SAFE_FREE(keystr);
 		node = node->next;
 	}
@@ -347,6 +623,124 @@ void gencache_iterate(void (*fn)(const char* key, const char *value, time_t time
 	tdb_search_list_free(first_node);
 }
 
+/**
+ * Delete the expired entries listed in one expiry index bucket and the
+ * bucket itself.
+ *
+ * @return the number of entries deleted
+ **/
+
+static int gencache_purge_bucket(uint32 bucket, time_t now)
+{
+	fstring idxkey;
+	TDB_DATA key, list;
+	size_t ofs;
+	int deleted = 0;
+
+	fstr_sprintf(idxkey, GENCACHE_EXPIRY_KEY_FMT, bucket);
+	key = string_key(idxkey);
+
+	/* Nobody may append between the fetch and the delete. If
+	 * somebody is appending right now leave the bucket alone. */
+	if (tdb_chainlock_nonblock(cache, key) != 0) {
+		return 0;
+	}
+	list = tdb_fetch(cache, key);
+	if (list.dptr != NULL) {
+		tdb_delete(cache, key);
+	}
+	tdb_chainunlock(cache, key);
+
+	if (list.dptr == NULL) {
+		return 0;
+	}
+
+	for (ofs = 0; ofs < list.dsize; ) {
+		TDB_DATA entry;
+		struct gencache_get_state state;
+		char *end = (char *)memchr(list.dptr + ofs, '\0',
+					   list.dsize - ofs);
+
+		if (end == NULL) {
+			/* truncated */
+			break;
+		}
+
+		entry.dptr = list.dptr + ofs;
+		entry.dsize = end - entry.dptr + 1;
+		ofs += entry.dsize;
+
+		/*
+		 * The entry might have been refreshed since it was put
+		 * into this bucket, so look at its real expiry under the
+		 * chain lock. An expired entry skipped because its chain
+		 * is busy is deleted when it is next read.
+		 */
+
+		if (tdb_chainlock_nonblock(cache, entry) != 0) {
+			continue;
+		}
+		ZERO_STRUCT(state);
+		tdb_parse_record(cache, entry, gencache_get_parser, &state);
+		if (state.found && state.timeout <= now &&
+		    tdb_delete(cache, entry) == 0) {
+			deleted++;
+		}
+		tdb_chainunlock(cache, entry);
+	}
+
+	SAFE_FREE(list.dptr);
+	return deleted;
+}
+
+/**
+ * Incrementally delete expired entries. Claims the next expiry index
+ * buckets that lie wholly in the past, at most GENCACHE_PURGE_MAX_BUCKETS
+ * of them, and walks them after letting go of the claim. Every chain
+ * lock is taken without waiting, so the purge can't deadlock with a
+ * caller holding an entry lock.
+ **/
+
+static void gencache_purge(time_t now)
+{
+	TDB_DATA pkey;
+	uint32 first, next, cur;
+	int deleted = 0;
+
+	if (cache_readonly || now - last_purge < GENCACHE_PURGE_INTERVAL) {
+		return;
+	}
+	last_purge = now;
+
+	pkey = string_key(GENCACHE_PURGE_KEY);
+
+	/* Somebody else is claiming buckets right now, leave it to them */
+	if (tdb_chainlock_nonblock(cache, pkey) != 0) {
+		return;
+	}
+
+	cur = gencache_bucket(now);
+	first = (uint32)tdb_fetch_int32(cache, GENCACHE_PURGE_KEY);
+	if (first == (uint32)-1 || first > cur) {
+		first = cur;
+	}
+	next = MIN(cur, first + GENCACHE_PURGE_MAX_BUCKETS);
+
+	if (next != first) {
+		tdb_store_int32(cache, GENCACHE_PURGE_KEY, (int32)next);
+	}
+	tdb_chainunlock(cache, pkey);
+
+	for (cur = first; cur < next; cur++) {
+		deleted += gencache_purge_bucket(cur, now);
+	}
+
+	if (deleted != 0) {
+		DEBUG(10, ("gencache_purge: deleted %d expired entries from "
+			   "%u buckets\n", deleted, next - first));
+	}
+}
+
 /********************************************************************
  lock a key
 ********************************************************************/
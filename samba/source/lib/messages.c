@@ -124,8 +124,8 @@ BOOL message_init(void)
 	if (tdb)
 		return True;
 
-	tdb = tdb_open_log(lock_path("messages.tdb"), 
-		       0, TDB_CLEAR_IF_FIRST|TDB_DEFAULT, 
+	tdb = tdb_open_log(volatile_path("messages.tdb"), 
+		       0, TDB_CLEAR_IF_FIRST|TDB_VOLATILE|TDB_DEFAULT, 
 		       O_RDWR|O_CREAT,0600);
 
 	if (!tdb) {
@@ -694,7 +694,7 @@ BOOL message_send_all(TDB_CONTEXT *conn_tdb, int msg_type,
 	msg_all.duplicates = duplicates_allowed;
 	msg_all.n_sent = 0;
 
-	tdb_traverse(conn_tdb, traverse_fn, &msg_all);
+	tdb_traverse_snapshot(conn_tdb, traverse_fn, &msg_all);
 	if (n_sent)
 		*n_sent = msg_all.n_sent;
 	return True;
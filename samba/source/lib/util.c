@@ -2622,6 +2622,34 @@ char *lock_path(const char *name)
 	return fname;
 }
 
+/*****************************************************************
+ Return a path for one of the databases smbd clears on startup
+ (locking.tdb, messages.tdb and friends). They go in
+ "tdb:volatile directory" if that is set - meant to be a tmpfs, as
+ nothing in them has to survive a restart - and in the lock directory
+ otherwise.
+*****************************************************************/
+
+char *volatile_path(const char *name)
+{
+	static pstring fname;
+	const char *dir = lp_parm_const_string(-1, "tdb", "volatile directory", NULL);
+
+	if (dir == NULL || *dir == '\0')
+		return lock_path(name);
+
+	pstrcpy(fname,dir);
+	trim_char(fname,'\0','/');
+
+	if (!directory_exist(fname,NULL))
+		mkdir(fname,0755);
+
+	pstrcat(fname,"/");
+	pstrcat(fname,name);
+
+	return fname;
+}
+
 /*****************************************************************
  A useful function for returning a path in the Samba pid directory.
 *****************************************************************/
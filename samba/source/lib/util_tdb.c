@@ -670,6 +670,32 @@ static void tdb_log(TDB_CONTEXT *tdb, enum tdb_debug_level level, const char *fo
  the samba DEBUG() system.
 ****************************************************************************/
 
+/****************************************************************************
+ Grow a freshly opened volatile tdb to "tdb presize:<file name>" KB, so
+ that a database cleared on every start doesn't grow through lots of
+ small expansions (and remaps) while serving clients. E.g.
+ "tdb presize:locking.tdb = 65536".
+****************************************************************************/
+
+static void tdb_presize(TDB_CONTEXT *tdb, const char *name, int tdb_flags,
+			int open_flags)
+{
+	const char *base = strrchr(name, '/');
+	int kb;
+
+	if (!(tdb_flags & TDB_VOLATILE) || (open_flags & O_ACCMODE) == O_RDONLY)
+		return;
+
+	kb = lp_parm_int(-1, "tdb presize", base ? base+1 : name, 0);
+	if (kb <= 0)
+		return;
+
+	if (tdb_reserve(tdb, (size_t)kb * 1024) == -1) {
+		DEBUG(2,("tdb_presize: could not grow %s to %dk: %s\n",
+			 name, kb, tdb_errorstr(tdb)));
+	}
+}
+
 TDB_CONTEXT *tdb_open_log(const char *name, int hash_size, int tdb_flags,
 			  int open_flags, mode_t mode)
 {
@@ -679,6 +705,12 @@ TDB_CONTEXT *tdb_open_log(const char *name, int hash_size, int tdb_flags,
 	if (!lp_use_mmap())
 		tdb_flags |= TDB_NOMMAP;
 
+	/* lock the chains of the clear-if-first databases with robust
+	   mutexes instead of fcntl, see tdb/common/mutex.c */
+	if ((tdb_flags & TDB_CLEAR_IF_FIRST) &&
+	    lp_parm_bool(-1, "tdb", "mutex locking", False))
+		tdb_flags |= TDB_MUTEX_LOCKING;
+
 	log_ctx.log_fn = tdb_log;
 	log_ctx.log_private = NULL;
 
@@ -687,6 +719,8 @@ TDB_CONTEXT *tdb_open_log(const char *name, int hash_size, int tdb_flags,
 	if (!tdb)
 		return NULL;
 
+	tdb_presize(tdb, name, tdb_flags, open_flags);
+
 	return tdb;
 }
 
@@ -919,6 +953,8 @@ struct tdb_wrap *tdb_wrap_open(TALLOC_CTX *mem_ctx,
 		return NULL;
 	}
 
+	tdb_presize(w->tdb, name, tdb_flags, open_flags);
+
 	talloc_set_destructor(w, tdb_wrap_destructor);
 
 	DLIST_ADD(tdb_list, w);
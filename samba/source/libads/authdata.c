@@ -924,6 +924,15 @@ static void dump_pac_logon_info(PAC_LOGON_INFO *logon_info) {
 
 	dump_pac_logon_info(logon_info);
 
+	{
+		struct MD5Context md5_ctx;
+
+		/* identifies this PAC (and so this ticket) for caching */
+		MD5Init(&md5_ctx);
+		MD5Update(&md5_ctx, pac_data_blob->data, pac_data_blob->length);
+		MD5Final(my_pac->digest, &md5_ctx);
+	}
+
 	*pac_data = my_pac;
 
 	nt_status = NT_STATUS_OK;
@@ -33,34 +33,257 @@
 const krb5_data *krb5_princ_component(krb5_context, krb5_principal, int );
 #endif
 
+/**********************************************************************************
+ In-memory index of the system keytab.
+
+ Verifying a ticket used to walk the whole keytab once for every principal
+ name we accept, unparsing every entry and calling krb5_rd_req() for each
+ entry whose name matched - several times over for the same principal when
+ it has keys of several enctypes or kvnos. Instead we read the keytab once
+ into an index of (principal, kvno, enctype), reload it when the keytab
+ file changes, and only call krb5_rd_req() for the accepted principals that
+ actually have a key for the ticket's kvno and enctype. smbd loads the index
+ before forking so the children start with it.
+***********************************************************************************/
+
+/* How long to trust the index of a keytab we can't stat */
+#define KEYTAB_INDEX_TTL 300
+
+struct keytab_index_entry {
+	char *principal;
+	krb5_kvno kvno;
+	krb5_enctype enctype;
+};
+
+static struct {
+	BOOL loaded;
+	pstring name;
+	time_t mtime;
+	time_t loaded_at;
+	int num_entries;
+	struct keytab_index_entry *entries;
+} keytab_index;
+
+static void keytab_index_free(void)
+{
+	int i;
+
+	for (i = 0; i < keytab_index.num_entries; i++) {
+		SAFE_FREE(keytab_index.entries[i].principal);
+	}
+	SAFE_FREE(keytab_index.entries);
+	keytab_index.num_entries = 0;
+	keytab_index.loaded = False;
+}
+
+/* The file behind a keytab name, NULL for non-file keytabs */
+
+static const char *keytab_index_file(const char *name)
+{
+	if (strncmp(name, "FILE:", 5) == 0) {
+		return name + 5;
+	}
+	if (strncmp(name, "WRFILE:", 7) == 0) {
+		return name + 7;
+	}
+	if (name[0] == '/') {
+		return name;
+	}
+	return NULL;
+}
+
+static BOOL keytab_index_load(krb5_context context)
+{
+	krb5_error_code ret;
+	krb5_keytab keytab = NULL;
+	krb5_kt_cursor kt_cursor;
+	krb5_keytab_entry kt_entry;
+	pstring name;
+	const char *file;
+	time_t mtime = 0;
+	time_t now = time(NULL);
+	int allocated = 0;
+
+	ret = krb5_kt_default_name(context, name, sizeof(name));
+	if (ret) {
+		DEBUG(1, ("keytab_index_load: krb5_kt_default_name failed (%s)\n",
+			  error_message(ret)));
+		return False;
+	}
+
+	file = keytab_index_file(name);
+	if (file != NULL) {
+		SMB_STRUCT_STAT st;
+
+		if (sys_stat(file, &st) == 0) {
+			mtime = st.st_mtime;
+		}
+	}
+
+	if (keytab_index.loaded && strcmp(keytab_index.name, name) == 0) {
+		if (file != NULL && mtime == keytab_index.mtime) {
+			return True;
+		}
+		if (file == NULL &&
+		    now - keytab_index.loaded_at < KEYTAB_INDEX_TTL) {
+			return True;
+		}
+	}
+
+	keytab_index_free();
+
+	ret = krb5_kt_default(context, &keytab);
+	if (ret) {
+		DEBUG(1, ("keytab_index_load: krb5_kt_default failed (%s)\n",
+			  error_message(ret)));
+		return False;
+	}
+
+	ZERO_STRUCT(kt_cursor);
+	ret = krb5_kt_start_seq_get(context, keytab, &kt_cursor);
+	if (ret) {
+		DEBUG(3, ("keytab_index_load: krb5_kt_start_seq_get failed (%s)\n",
+			  error_message(ret)));
+		krb5_kt_close(context, keytab);
+		return False;
+	}
+
+	ZERO_STRUCT(kt_entry);
+	while (krb5_kt_next_entry(context, keytab, &kt_entry, &kt_cursor) == 0) {
+		struct keytab_index_entry *e;
+		char *princ_s = NULL;
+
+		if (smb_krb5_unparse_name(context, kt_entry.principal,
+					  &princ_s) != 0) {
+			smb_krb5_kt_free_entry(context, &kt_entry);
+			ZERO_STRUCT(kt_entry);
+			continue;
+		}
+
+		if (keytab_index.num_entries == allocated) {
+			allocated = allocated ? allocated * 2 : 16;
+			keytab_index.entries = SMB_REALLOC_ARRAY(
+				keytab_index.entries,
+				struct keytab_index_entry, allocated);
+			if (keytab_index.entries == NULL) {
+				keytab_index.num_entries = 0;
+				SAFE_FREE(princ_s);
+				smb_krb5_kt_free_entry(context, &kt_entry);
+				break;
+			}
+		}
+
+		e = &keytab_index.entries[keytab_index.num_entries++];
+		e->principal = princ_s;
+		e->kvno = kt_entry.vno;
+#ifdef HAVE_KRB5_KEYTAB_ENTRY_KEYBLOCK /* Heimdal */
+		e->enctype = kt_entry.keyblock.keytype;
+#elif defined(HAVE_KRB5_KEYTAB_ENTRY_KEY) /* MIT */
+		e->enctype = kt_entry.key.enctype;
+#else
+#error UNKNOWN_KRB5_KEYTAB_ENTRY_FORMAT
+#endif
+
+		smb_krb5_kt_free_entry(context, &kt_entry);
+		ZERO_STRUCT(kt_entry);
+	}
+
+	krb5_kt_end_seq_get(context, keytab, &kt_cursor);
+	krb5_kt_close(context, keytab);
+
+	pstrcpy(keytab_index.name, name);
+	keytab_index.mtime = mtime;
+	keytab_index.loaded_at = now;
+	keytab_index.loaded = True;
+
+	DEBUG(5, ("keytab_index_load: indexed %d entries of %s\n",
+		  keytab_index.num_entries, name));
+
+	return True;
+}
+
+/**********************************************************************************
+ Load the keytab index up front (smbd calls this before it starts forking).
+***********************************************************************************/
+
+void ads_keytab_index_preload(void)
+{
+	krb5_context context = NULL;
+
+	if (!lp_use_kerberos_keytab()) {
+		return;
+	}
+
+	initialize_krb5_error_table();
+	if (krb5_init_context(&context) != 0) {
+		return;
+	}
+	keytab_index_load(context);
+	krb5_free_context(context);
+}
+
+/*
+ * Find the index entry of a principal for the ticket's key. Prefer the exact
+ * kvno, but keytabs made by "net ads keytab" may carry a different (or no)
+ * kvno, so settle for the right enctype. A zero kvno or enctype matches any.
+ */
+
+static struct keytab_index_entry *keytab_index_find(const char *principal,
+						    krb5_kvno kvno,
+						    krb5_enctype enctype)
+{
+	struct keytab_index_entry *found = NULL;
+	int i;
+
+	for (i = 0; i < keytab_index.num_entries; i++) {
+		struct keytab_index_entry *e = &keytab_index.entries[i];
+
+		if (!strequal(e->principal, principal)) {
+			continue;
+		}
+		if (enctype != 0 && e->enctype != enctype) {
+			continue;
+		}
+		if (kvno == 0 || e->kvno == kvno) {
+			return e;
+		}
+		if (found == NULL) {
+			found = e;
+		}
+	}
+	return found;
+}
+
+/**********************************************************************************
+ Try to verify a ticket against one principal from the keytab and hand back
+ the key it was encrypted with.
+***********************************************************************************/
+
 static krb5_error_code ads_keytab_verify_for_principal(krb5_context context,
 					krb5_auth_context   auth_context,
-					const krb5_keytab_entry * kt_entry,
+					const struct keytab_index_entry *e,
 					const DATA_BLOB *   ticket,
-					const char *	    svc_principal,
 					krb5_ticket **	    pp_tkt,
 					krb5_keyblock **    keyblock)
 {
 	krb5_error_code ret = 0;
 	krb5_keytab keytab = NULL;
+	krb5_principal princ = NULL;
+	krb5_keytab_entry kt_entry;
 	krb5_data   packet;
-	char *	    entry_princ_s = NULL;
 
-	ret = krb5_kt_default(context, &keytab);
-	if (ret) {
-		DEBUG(1, ("ads_keytab_verify_for_principal: krb5_kt_default failed (%s)\n", error_message(ret)));
-		goto out;
-	}
+	ZERO_STRUCT(kt_entry);
 
-	ret = smb_krb5_unparse_name(context, kt_entry->principal, &entry_princ_s);
+	ret = smb_krb5_parse_name(context, e->principal, &princ);
 	if (ret) {
-		DEBUG(1, ("ads_keytab_verify_for_principal: smb_krb5_unparse_name failed (%s)\n",
-			error_message(ret)));
+		DEBUG(1, ("ads_keytab_verify_for_principal: smb_krb5_parse_name(%s) failed (%s)\n",
+			e->principal, error_message(ret)));
 		goto out;
 	}
 
-	if (!strequal(entry_princ_s, svc_principal)) {
-		ret = KRB5KRB_AP_ERR_BADMATCH;
+	ret = krb5_kt_default(context, &keytab);
+	if (ret) {
+		DEBUG(1, ("ads_keytab_verify_for_principal: krb5_kt_default failed (%s)\n", error_message(ret)));
 		goto out;
 	}
 
@@ -68,25 +291,44 @@ static krb5_error_code ads_keytab_verify_for_principal(krb5_context context,
 	packet.data = (char *)ticket->data;
 	*pp_tkt = NULL;
 
-	ret = krb5_rd_req_return_keyblock_from_keytab(context,
-				&auth_context, &packet,
-				kt_entry, keytab,
-				pp_tkt, keyblock);
-
+	ret = krb5_rd_req(context, &auth_context, &packet, princ, keytab,
+			  NULL, pp_tkt);
 	if (ret) {
 		DEBUG(3,("ads_keytab_verify_for_principal: "
 			    "failed for principal %s: %s\n",
-			entry_princ_s, error_message(ret)));
+			e->principal, error_message(ret)));
 		goto out;
 	}
 
-
 	DEBUG(3,("ads_keytab_verify_for_principal: succeeded for principal %s\n",
-		entry_princ_s));
+		e->principal));
+
+	/* The key of the kvno and enctype we matched the ticket against */
+
+	ret = krb5_kt_get_entry(context, keytab, princ, e->kvno, e->enctype,
+				&kt_entry);
+	if (ret == 0) {
+#ifdef HAVE_KRB5_KEYTAB_ENTRY_KEYBLOCK /* Heimdal */
+		ret = krb5_copy_keyblock(context, &kt_entry.keyblock, keyblock);
+#elif defined(HAVE_KRB5_KEYTAB_ENTRY_KEY) /* MIT */
+		ret = krb5_copy_keyblock(context, &kt_entry.key, keyblock);
+#else
+#error UNKNOWN_KRB5_KEYTAB_ENTRY_FORMAT
+#endif
+		smb_krb5_kt_free_entry(context, &kt_entry);
+	}
+
+	if (ret) {
+		DEBUG(0,("ads_keytab_verify_for_principal: failed to get key: %s\n",
+			error_message(ret)));
+		krb5_free_ticket(context, *pp_tkt);
+		*pp_tkt = NULL;
+	}
 
 out:
-	/* Free the name we parsed. */
-	SAFE_FREE(entry_princ_s);
+	if (princ) {
+		krb5_free_principal(context, princ);
+	}
 
 	if (keytab) {
 		krb5_kt_close(context, keytab);
@@ -109,13 +351,13 @@ static BOOL ads_keytab_verify_ticket(krb5_context context,
 					krb5_keyblock **keyblock,
 					krb5_error_code *perr)
 {
-	krb5_error_code ret = 0;
+	krb5_error_code ret = KRB5_KT_NOTFOUND;
 	BOOL auth_ok = False;
-	krb5_keytab keytab = NULL;
-	krb5_kt_cursor kt_cursor;
-	krb5_keytab_entry kt_entry;
 	char *valid_princ_formats[9];
 	fstring my_name, my_fqdn;
+	krb5_data packet;
+	krb5_kvno kvno = 0;
+	krb5_enctype enctype = 0;
 	int i;
 
 	const char * lkdc_realm = lp_parm_talloc_string(GLOBAL_SECTION_SNUM,
@@ -127,6 +369,23 @@ static BOOL ads_keytab_verify_ticket(krb5_context context,
 	*keyblock = NULL;
 	*perr = 0;
 
+	if (!keytab_index_load(context)) {
+		TALLOC_FREE(lkdc_realm);
+		*perr = KRB5_KT_NOTFOUND;
+		return False;
+	}
+
+	/* If the library can tell us which key the ticket needs, only
+	 * principals having that key are candidates. */
+
+	packet.length = ticket->length;
+	packet.data = (char *)ticket->data;
+	if (smb_krb5_get_keyinfo_from_ap_req(context, &packet, &kvno,
+					     &enctype) != 0) {
+		kvno = 0;
+		enctype = 0;
+	}
+
 	/* Generate the list of principal names which we expect
 	 * clients might want to use for authenticating to the file
 	 * service.  We allow name$,{host,cifs}/{name,fqdn,name.REALM}. */
@@ -152,75 +411,52 @@ static BOOL ads_keytab_verify_ticket(krb5_context context,
 	}
 
 	for (i = 0; i < ARRAY_SIZE(valid_princ_formats); i++) {
+		struct keytab_index_entry *e;
+		int j;
 
-		ZERO_STRUCT(kt_entry);
-		ZERO_STRUCT(kt_cursor);
-
-		ret = krb5_kt_default(context, &keytab);
-		if (ret) {
-			DEBUG(1, ("ads_keytab_verify_ticket: krb5_kt_default failed (%s)\n", error_message(ret)));
-			goto out;
-		}
-
-		/* Iterate through the keytab.  For each key, if the principal
-		 * name case-insensitively matches one of the allowed formats,
-		 * try verifying the ticket using that principal.
-		 */
-
-		ret = krb5_kt_start_seq_get(context, keytab, &kt_cursor);
-		if (ret) {
-			DEBUG(1, ("ads_keytab_verify_ticket: krb5_kt_start_seq_get failed (%s)\n", error_message(ret)));
-			goto out;
+		if (valid_princ_formats[i] == NULL) {
+			continue;
 		}
 
-		while (!auth_ok && (krb5_kt_next_entry(context, keytab, &kt_entry, &kt_cursor) == 0)) {
-
-			/* In MIT Kerberos, it is not legal to interleave krb5_rd_req()
-			 * with krb5_kt_start_seq_get() and krb5_kt_end_seq_get() on the
-			 * same krb5_keytab object. We have to keep a separate
-			 * krb5_keytab object around for the krb5_rd_req().
-			 */
-			ret = ads_keytab_verify_for_principal(context,
-				auth_context, &kt_entry, ticket,
-				valid_princ_formats[i], pp_tkt, keyblock);
-
-			if (ret == 0) {
-				auth_ok = True;
-			}
-
-			/* Free the entry we just read. */
-			smb_krb5_kt_free_entry(context, &kt_entry);
-			ZERO_STRUCT(kt_entry);
-
-			if (auth_ok) {
-				/* success, let's go. */
+		/* e.g. my_fqdn == my_name: don't try the same name twice */
+		for (j = 0; j < i; j++) {
+			if (valid_princ_formats[j] &&
+			    strequal(valid_princ_formats[j],
+				     valid_princ_formats[i])) {
 				break;
 			}
+		}
+		if (j < i) {
+			continue;
+		}
 
-			/* workaround for MIT:
-			* as krb5_ktfile_get_entry will explicitly
-			* close the krb5_keytab as soon as krb5_rd_req
-			* has sucessfully decrypted the ticket but the
-			* ticket is not valid yet (due to clockskew)
-			* there is no point in querying more keytab
-			* entries - Guenther */
-			if (ret == KRB5KRB_AP_ERR_TKT_NYV ||
-			    ret == KRB5KRB_AP_ERR_TKT_EXPIRED ||
-			    ret == KRB5KRB_AP_ERR_SKEW ||
-			    ret == KRB5KRB_AP_ERR_REPEAT) {
-			    break;
-			}
-
+		e = keytab_index_find(valid_princ_formats[i], kvno, enctype);
+		if (e == NULL) {
+			continue;
 		}
 
-		krb5_kt_end_seq_get(context, keytab, &kt_cursor);
-		krb5_kt_close(context, keytab);
-		keytab = NULL;
-	}
+		ret = ads_keytab_verify_for_principal(context,
+			auth_context, e, ticket, pp_tkt, keyblock);
 
-	ZERO_STRUCT(kt_cursor);
+		if (ret == 0) {
+			auth_ok = True;
+			break;
+		}
 
-out:
+		/* workaround for MIT:
+		* as krb5_ktfile_get_entry will explicitly
+		* close the krb5_keytab as soon as krb5_rd_req
+		* has sucessfully decrypted the ticket but the
+		* ticket is not valid yet (due to clockskew)
+		* there is no point in querying more keytab
+		* entries - Guenther */
+		if (ret == KRB5KRB_AP_ERR_TKT_NYV ||
+		    ret == KRB5KRB_AP_ERR_TKT_EXPIRED ||
+		    ret == KRB5KRB_AP_ERR_SKEW ||
+		    ret == KRB5KRB_AP_ERR_REPEAT) {
+			break;
+		}
+	}
 
 	TALLOC_FREE(lkdc_realm);
 
@@ -228,25 +464,6 @@ out:
 		SAFE_FREE(valid_princ_formats[i]);
 	}
 
-	{
-		krb5_keytab_entry zero_kt_entry;
-		ZERO_STRUCT(zero_kt_entry);
-		if (memcmp(&zero_kt_entry, &kt_entry, sizeof(krb5_keytab_entry))) {
-			smb_krb5_kt_free_entry(context, &kt_entry);
-		}
-	}
-
-	{
-		krb5_kt_cursor zero_csr;
-		ZERO_STRUCT(zero_csr);
-		if ((memcmp(&kt_cursor, &zero_csr, sizeof(krb5_kt_cursor)) != 0) && keytab) {
-			krb5_kt_end_seq_get(context, keytab, &kt_cursor);
-		}
-	}
-
-	if (keytab) {
-		krb5_kt_close(context, keytab);
-	}
 	*perr = ret;
 	return auth_ok;
 }
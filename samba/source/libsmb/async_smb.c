@@ -0,0 +1,426 @@
+/* 
+   Unix SMB/CIFS implementation.
+   Asynchronous SMB client requests
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "includes.h"
+
+/****************************************************************************
+ The rest of libsmb sends a request and then sits in cli_receive_smb()
+ until the reply is there. A cli_request instead is sent and remembered
+ by its mid on the cli_state; the socket is watched by an fd event and
+ each reply is handed to the request it belongs to, in whatever order the
+ server answers. Up to the server's max_mux less one requests are in
+ flight on a connection, the last slot is left for synchronous calls.
+ Windows servers drop a connection that goes over max_mux, so further
+ requests are queued by cli_request_new() and sent as replies come in.
+ Synchronous calls that keep several requests in flight themselves ask
+ cli_request_sync_mux() how many they may send.
+
+ Synchronous calls can still be made on the same cli_state: replies to
+ outstanding requests that show up while cli_receive_smb() waits for its
+ own are taken over here and completed from the event loop, never from
+ inside the synchronous call.
+
+ Completion functions must not cli_shutdown() the connection.
+****************************************************************************/
+
+static void cli_request_done(struct cli_request *req);
+static void cli_request_defer(struct cli_request *req);
+
+/****************************************************************************
+ Stop watching the socket once nothing is in flight or queued.
+****************************************************************************/
+
+static void cli_request_idle(struct cli_state *cli)
+{
+	if (cli->outstanding_requests == NULL &&
+	    cli->queued_requests == NULL) {
+		TALLOC_FREE(cli->fd_event);
+	}
+}
+
+static int cli_request_destructor(struct cli_request *req)
+{
+	struct cli_state *cli = req->cli;
+
+	if (cli == NULL) {
+		return 0;
+	}
+
+	if (cli->queue_next_send == req) {
+		cli->queue_next_send = NULL;
+	}
+	if (req->outstanding) {
+		DLIST_REMOVE(cli->outstanding_requests, req);
+	}
+	if (req->queued) {
+		DLIST_REMOVE(cli->queued_requests, req);
+	}
+	cli_request_idle(cli);
+	return 0;
+}
+
+static BOOL cli_request_slot_free(struct cli_state *cli)
+{
+	struct cli_request *req;
+	size_t max_inflight = MAX(cli->max_mux, 2) - 1;
+	size_t num = 0;
+
+	for (req = cli->outstanding_requests; req; req = req->next) {
+		if (++num >= max_inflight) {
+			return False;
+		}
+	}
+	return True;
+}
+
+/****************************************************************************
+ How many requests a synchronous call may have in flight at once next to
+ the outstanding ones, at least one. Queued requests are only sent from
+ the event loop, so this does not shrink while the call runs.
+****************************************************************************/
+
+int cli_request_sync_mux(struct cli_state *cli)
+{
+	struct cli_request *req;
+	int mux = MAX(cli->max_mux, 2) - 1;
+
+	for (req = cli->outstanding_requests; req; req = req->next) {
+		mux--;
+	}
+	return MAX(mux, 1);
+}
+
+/****************************************************************************
+ Called by cli_send_smb() instead of sending, for a request cli_request_new()
+ had to queue: keep a copy of the SMB to send later.
+****************************************************************************/
+
+BOOL cli_request_queue(struct cli_state *cli)
+{
+	struct cli_request *req = cli->queue_next_send;
+
+	cli->queue_next_send = NULL;
+
+	req->outbuf = (char *)talloc_memdup(req, cli->outbuf,
+					    smb_len(cli->outbuf) + 4);
+	return (req->outbuf != NULL);
+}
+
+/****************************************************************************
+ Send queued requests while there is room. Only called from the event
+ loop, never while a synchronous call is using cli->outbuf.
+****************************************************************************/
+
+static void cli_request_dispatch(struct cli_state *cli)
+{
+	struct cli_request *req;
+
+	while ((req = cli->queued_requests) != NULL && req->outbuf != NULL &&
+	       cli->queue_next_send == NULL && cli_request_slot_free(cli)) {
+		char *outbuf = cli->outbuf;
+		uint16 mid = cli->mid;
+		BOOL ok;
+
+		DLIST_REMOVE(cli->queued_requests, req);
+		req->queued = False;
+		DLIST_ADD(cli->outstanding_requests, req);
+		req->outstanding = True;
+
+		/* cli_send_smb() signs it now, in the order of the wire */
+		cli->outbuf = req->outbuf;
+		ok = cli_send_smb(cli);
+		cli->outbuf = outbuf;
+		cli->mid = mid;
+		TALLOC_FREE(req->outbuf);
+
+		if (!ok) {
+			DLIST_REMOVE(cli->outstanding_requests, req);
+			req->outstanding = False;
+			req->status = NT_STATUS_CONNECTION_DISCONNECTED;
+			cli_request_defer(req);
+		}
+	}
+}
+
+/****************************************************************************
+ Copy the reply in cli->inbuf into the request it answers, if any.
+****************************************************************************/
+
+static struct cli_request *cli_request_find_reply(struct cli_state *cli)
+{
+	struct cli_request *req;
+	uint16 mid = SVAL(cli->inbuf, smb_mid);
+
+	for (req = cli->outstanding_requests; req; req = req->next) {
+		if (req->mid == mid) {
+			break;
+		}
+	}
+
+	if (req == NULL) {
+		return NULL;
+	}
+
+	DLIST_REMOVE(cli->outstanding_requests, req);
+	req->outstanding = False;
+	cli_request_idle(cli);
+
+	req->inbuf = (char *)talloc_memdup(req, cli->inbuf,
+					   smb_len(cli->inbuf) + 4);
+	req->status = (req->inbuf == NULL) ? NT_STATUS_NO_MEMORY : NT_STATUS_OK;
+
+	return req;
+}
+
+/****************************************************************************
+ Socket readable: read one reply and complete its request.
+****************************************************************************/
+
+static void cli_state_handler(struct event_context *event_ctx,
+			      struct fd_event *event,
+			      uint16 flags,
+			      void *private_data)
+{
+	struct cli_state *cli = (struct cli_state *)private_data;
+	struct cli_request *req;
+
+	if (!cli_receive_any_smb(cli)) {
+		DEBUG(3, ("cli_state_handler: connection to %s failed\n",
+			  cli->desthost));
+
+		while ((req = cli->outstanding_requests) != NULL ||
+		       (req = cli->queued_requests) != NULL) {
+			if (req->outstanding) {
+				DLIST_REMOVE(cli->outstanding_requests, req);
+				req->outstanding = False;
+			} else {
+				DLIST_REMOVE(cli->queued_requests, req);
+				req->queued = False;
+			}
+			req->status = NT_STATUS_CONNECTION_DISCONNECTED;
+			cli_request_idle(cli);
+			cli_request_done(req);
+		}
+		return;
+	}
+
+	req = cli_request_find_reply(cli);
+	if (req == NULL) {
+		DEBUG(5, ("cli_state_handler: discarding reply for unknown "
+			  "mid %u\n", (unsigned int)SVAL(cli->inbuf, smb_mid)));
+	} else {
+		cli_request_done(req);
+	}
+
+	cli_request_dispatch(cli);
+}
+
+/****************************************************************************
+ Remember that the request with this mid is in flight on cli. Must be
+ called right before the request is sent with a single cli_send_smb().
+ If max_mux requests are in flight already, that cli_send_smb() only
+ queues the request.
+****************************************************************************/
+
+struct cli_request *cli_request_new(TALLOC_CTX *mem_ctx,
+				    struct event_context *event_ctx,
+				    struct cli_state *cli, uint16 mid,
+				    void (*fn)(struct cli_request *req),
+				    void *private_data)
+{
+	struct cli_request *req;
+
+	if (cli->fd == -1) {
+		return NULL;
+	}
+
+	if (cli->fd_event != NULL && cli->event_ctx != event_ctx) {
+		DEBUG(0, ("cli_request_new: connection to %s already has "
+			  "requests on another event context\n",
+			  cli->desthost));
+		return NULL;
+	}
+
+	req = TALLOC_ZERO_P(mem_ctx, struct cli_request);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	req->cli = cli;
+	req->event_ctx = event_ctx;
+	req->mid = mid;
+	req->fn = fn;
+	req->private_data = private_data;
+
+	if (cli->fd_event == NULL) {
+		cli->fd_event = event_add_fd(event_ctx, NULL, cli->fd,
+					     EVENT_FD_READ, cli_state_handler,
+					     cli);
+		if (cli->fd_event == NULL) {
+			TALLOC_FREE(req);
+			return NULL;
+		}
+		cli->event_ctx = event_ctx;
+	}
+
+	if (cli->queued_requests != NULL || !cli_request_slot_free(cli)) {
+		DLIST_ADD_END(cli->queued_requests, req, struct cli_request *);
+		req->queued = True;
+		cli->queue_next_send = req;
+	} else {
+		DLIST_ADD(cli->outstanding_requests, req);
+		req->outstanding = True;
+	}
+	talloc_set_destructor(req, cli_request_destructor);
+
+	return req;
+}
+
+/****************************************************************************
+ Send the request built in cli->outbuf without waiting for the reply.
+****************************************************************************/
+
+struct cli_request *cli_request_send(TALLOC_CTX *mem_ctx,
+				     struct event_context *event_ctx,
+				     struct cli_state *cli,
+				     void (*fn)(struct cli_request *req),
+				     void *private_data)
+{
+	struct cli_request *req;
+
+	req = cli_request_new(mem_ctx, event_ctx, cli,
+			      SVAL(cli->outbuf, smb_mid), fn, private_data);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	if (!cli_send_smb(cli)) {
+		TALLOC_FREE(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+static void cli_request_done(struct cli_request *req)
+{
+	if (req->fn != NULL) {
+		req->fn(req);
+	}
+}
+
+static void cli_request_deferred(struct event_context *event_ctx,
+				 struct timed_event *te,
+				 const struct timeval *now,
+				 void *private_data)
+{
+	struct cli_request *req = (struct cli_request *)private_data;
+	struct cli_state *cli = req->cli;
+
+	TALLOC_FREE(te);
+	cli_request_done(req);
+
+	/* a synchronous call took the reply, its slot is free now */
+	if (cli != NULL) {
+		cli_request_dispatch(cli);
+	}
+}
+
+static void cli_request_defer(struct cli_request *req)
+{
+	if (event_add_timed(req->event_ctx, req, timeval_zero(),
+			    "cli_request_deferred", cli_request_deferred,
+			    req) == NULL) {
+		DEBUG(0, ("cli_request_defer: out of memory, completing "
+			  "mid %u now\n", (unsigned int)req->mid));
+		cli_request_done(req);
+	}
+}
+
+/****************************************************************************
+ Called by cli_receive_smb() for every SMB it reads while requests are
+ outstanding. Returns True if the SMB was a reply to one of them, which
+ then completes on the next pass through the event loop.
+****************************************************************************/
+
+BOOL cli_request_take_reply(struct cli_state *cli)
+{
+	struct cli_request *req = cli_request_find_reply(cli);
+
+	if (req == NULL) {
+		return False;
+	}
+
+	cli_request_defer(req);
+	return True;
+}
+
+/****************************************************************************
+ The connection is going away, fail everything still in flight.
+****************************************************************************/
+
+void cli_request_shutdown(struct cli_state *cli)
+{
+	struct cli_request *req;
+
+	cli->queue_next_send = NULL;
+
+	while ((req = cli->outstanding_requests) != NULL ||
+	       (req = cli->queued_requests) != NULL) {
+		if (req->outstanding) {
+			DLIST_REMOVE(cli->outstanding_requests, req);
+			req->outstanding = False;
+		} else {
+			DLIST_REMOVE(cli->queued_requests, req);
+			req->queued = False;
+		}
+		req->cli = NULL;
+		req->status = NT_STATUS_CONNECTION_DISCONNECTED;
+		cli_request_defer(req);
+	}
+
+	TALLOC_FREE(cli->fd_event);
+}
+
+/****************************************************************************
+ The status of a completed request: a transport failure or the error in
+ the reply.
+****************************************************************************/
+
+NTSTATUS cli_request_status(struct cli_request *req)
+{
+	uint8 eclass;
+	uint32 ecode;
+
+	if (!NT_STATUS_IS_OK(req->status)) {
+		return req->status;
+	}
+
+	if (SVAL(req->inbuf, smb_flg2) & FLAGS2_32_BIT_ERROR_CODES) {
+		return NT_STATUS(IVAL(req->inbuf, smb_rcls));
+	}
+
+	eclass = CVAL(req->inbuf, smb_rcls);
+	ecode = SVAL(req->inbuf, smb_err);
+	if (eclass == 0) {
+		return NT_STATUS_OK;
+	}
+
+	return dos_to_ntstatus(eclass, ecode);
+}
@@ -75,10 +75,10 @@ static BOOL client_receive_smb(int fd,char *buffer, size_t bufsize, unsigned int
 }
 
 /****************************************************************************
- Recv an smb.
+ Recv the next smb, whichever request it is the reply to.
 ****************************************************************************/
 
-BOOL cli_receive_smb(struct cli_state *cli)
+BOOL cli_receive_any_smb(struct cli_state *cli)
 {
 	BOOL ret;
 
@@ -145,6 +145,23 @@ BOOL cli_receive_smb(struct cli_state *cli)
 	return True;
 }
 
+/****************************************************************************
+ Recv an smb. Replies to asynchronous requests (see async_smb.c) that
+ arrive in the meantime are passed on, the caller gets the reply to the
+ request it sent last.
+****************************************************************************/
+
+BOOL cli_receive_smb(struct cli_state *cli)
+{
+	while (cli_receive_any_smb(cli)) {
+		if (cli->outstanding_requests == NULL ||
+		    !cli_request_take_reply(cli)) {
+			return True;
+		}
+	}
+	return False;
+}
+
 static ssize_t write_socket(int fd, const char *buf, size_t len)
 {
         ssize_t ret=0;
@@ -174,6 +191,14 @@ BOOL cli_send_smb(struct cli_state *cli)
 	if (cli->fd == -1)
 		return False;
 
+	if (cli->queue_next_send != NULL) {
+		/* too many requests in flight, see cli_request_new() */
+		if (!cli_request_queue(cli)) {
+			return False;
+		}
+		goto sent;
+	}
+
 	cli_calculate_sign_mac(cli);
 
 	len = smb_len(cli->outbuf) + 4;
@@ -190,6 +215,7 @@ BOOL cli_send_smb(struct cli_state *cli)
 		}
 		nwritten += ret;
 	}
+ sent:
 	/* Increment the mid so we can tell between responses. */
 	cli->mid++;
 	if (!cli->mid)
@@ -435,6 +461,8 @@ void cli_shutdown(struct cli_state *cli)
 	if ( (cli->cnum != (uint16)-1) && (cli->smb_rw_error != DO_NOT_DO_TDIS ) ) {
 		cli_tdis(cli);
 	}
+
+	cli_request_shutdown(cli);
         
 	SAFE_FREE(cli->outbuf);
 	SAFE_FREE(cli->inbuf);
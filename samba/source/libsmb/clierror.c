@@ -339,7 +339,7 @@ static const struct {
  The following mappings need tidying up and moving into libsmb/errormap.c...
 ****************************************************************************/
 
-static int cli_errno_from_nt(NTSTATUS status)
+int cli_errno_from_nt(NTSTATUS status)
 {
 	int i;
         DEBUG(10,("cli_errno_from_nt: 32 bit codes: code=%08x\n", NT_STATUS_V(status)));
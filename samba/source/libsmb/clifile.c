@@ -719,11 +719,10 @@ int cli_nt_create(struct cli_state *cli, const char *fname, uint32 DesiredAccess
 }
 
 /****************************************************************************
- Open a file
- WARNING: if you open with O_WRONLY then getattrE won't work!
+ Build an SMBopenX in cli->outbuf.
 ****************************************************************************/
 
-int cli_open(struct cli_state *cli, const char *fname, int flags, int share_mode)
+static void cli_setup_open(struct cli_state *cli, const char *fname, int flags, int share_mode)
 {
 	char *p;
 	unsigned openfn=0;
@@ -784,6 +783,16 @@ int cli_open(struct cli_state *cli, const char *fname, int flags, int share_mode
 	p += clistr_push(cli, p, fname, -1, STR_TERMINATE);
 
 	cli_setup_bcc(cli, p);
+}
+
+/****************************************************************************
+ Open a file
+ WARNING: if you open with O_WRONLY then getattrE won't work!
+****************************************************************************/
+
+int cli_open(struct cli_state *cli, const char *fname, int flags, int share_mode)
+{
+	cli_setup_open(cli, fname, flags, share_mode);
 
 	cli_send_smb(cli);
 	if (!cli_receive_smb(cli)) {
@@ -798,10 +807,41 @@ int cli_open(struct cli_state *cli, const char *fname, int flags, int share_mode
 }
 
 /****************************************************************************
- Close a file.
+ Send an open without waiting for the reply, see async_smb.c.
 ****************************************************************************/
 
-BOOL cli_close(struct cli_state *cli, int fnum)
+struct cli_request *cli_open_send(TALLOC_CTX *mem_ctx,
+				  struct event_context *event_ctx,
+				  struct cli_state *cli, const char *fname,
+				  int flags, int share_mode,
+				  void (*fn)(struct cli_request *req),
+				  void *private_data)
+{
+	cli_setup_open(cli, fname, flags, share_mode);
+	return cli_request_send(mem_ctx, event_ctx, cli, fn, private_data);
+}
+
+/****************************************************************************
+ Get the fnum from a completed cli_open_send().
+****************************************************************************/
+
+NTSTATUS cli_open_recv(struct cli_request *req, int *pfnum)
+{
+	NTSTATUS status = cli_request_status(req);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	*pfnum = SVAL(req->inbuf, smb_vwv2);
+	return NT_STATUS_OK;
+}
+
+/****************************************************************************
+ Build an SMBclose in cli->outbuf.
+****************************************************************************/
+
+static void cli_setup_close(struct cli_state *cli, int fnum)
 {
 	memset(cli->outbuf,'\0',smb_size);
 	memset(cli->inbuf,'\0',smb_size);
@@ -814,6 +854,15 @@ BOOL cli_close(struct cli_state *cli, int fnum)
 
 	SSVAL(cli->outbuf,smb_vwv0,fnum);
 	SIVALS(cli->outbuf,smb_vwv1,-1);
+}
+
+/****************************************************************************
+ Close a file.
+****************************************************************************/
+
+BOOL cli_close(struct cli_state *cli, int fnum)
+{
+	cli_setup_close(cli, fnum);
 
 	cli_send_smb(cli);
 	if (!cli_receive_smb(cli)) {
@@ -823,6 +872,20 @@ BOOL cli_close(struct cli_state *cli, int fnum)
 	return !cli_is_error(cli);
 }
 
+/****************************************************************************
+ Send a close without waiting for the reply, see async_smb.c.
+****************************************************************************/
+
+struct cli_request *cli_close_send(TALLOC_CTX *mem_ctx,
+				   struct event_context *event_ctx,
+				   struct cli_state *cli, int fnum,
+				   void (*fn)(struct cli_request *req),
+				   void *private_data)
+{
+	cli_setup_close(cli, fnum);
+	return cli_request_send(mem_ctx, event_ctx, cli, fn, private_data);
+}
+
 
 /****************************************************************************
  send a lock with a specified locktype 
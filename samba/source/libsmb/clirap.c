@@ -730,6 +730,117 @@ BOOL cli_qpathinfo2(struct cli_state *cli, const char *fname,
 	return True;
 }
 
+/****************************************************************************
+ Send a qpathinfo SMB_QUERY_FILE_ALL_INFO call without waiting for the
+ reply, see async_smb.c.
+****************************************************************************/
+
+struct cli_request *cli_qpathinfo2_send(TALLOC_CTX *mem_ctx,
+					struct event_context *event_ctx,
+					struct cli_state *cli,
+					const char *fname,
+					void (*fn)(struct cli_request *req),
+					void *private_data)
+{
+	unsigned int param_len = 0;
+	uint16 setup = TRANSACT2_QPATHINFO;
+	pstring param;
+	struct cli_request *req;
+	char *p;
+
+	p = param;
+	memset(p, 0, 6);
+	SSVAL(p, 0, SMB_QUERY_FILE_ALL_INFO);
+	p += 6;
+	p += clistr_push(cli, p, fname, sizeof(pstring)-6, STR_TERMINATE);
+
+	param_len = PTR_DIFF(p, param);
+
+	/*
+	 * A request that does not fit into one SMB makes cli_send_trans()
+	 * wait for the interim reply, which would end up here.
+	 */
+	if (param_len > cli->max_xmit - 502) {
+		return NULL;
+	}
+
+	req = cli_request_new(mem_ctx, event_ctx, cli, cli->mid,
+			      fn, private_data);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	if (!cli_send_trans(cli, SMBtrans2, 
+                            NULL,                         /* name */
+                            -1, 0,                        /* fid, flags */
+                            &setup, 1, 0,                 /* setup, length, max */
+                            param, param_len, 10,         /* param, length, max */
+                            NULL, 0, cli->max_xmit        /* data, length, max */
+                           )) {
+		TALLOC_FREE(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+/****************************************************************************
+ Get the results of a completed cli_qpathinfo2_send(), any of the
+ pointers may be NULL.
+****************************************************************************/
+
+NTSTATUS cli_qpathinfo2_recv(struct cli_request *req,
+			     struct timespec *create_time,
+			     struct timespec *access_time,
+			     struct timespec *write_time,
+			     struct timespec *change_time,
+			     SMB_OFF_T *size, uint16 *mode,
+			     SMB_INO_T *ino)
+{
+	NTSTATUS status = cli_request_status(req);
+	unsigned int data_len, data_off;
+	char *rdata;
+
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	data_len = SVAL(req->inbuf, smb_drcnt);
+	data_off = SVAL(req->inbuf, smb_droff);
+
+	/* The reply is small enough to never be split. */
+	if (data_len != SVAL(req->inbuf, smb_tdrcnt) || data_len < 72 ||
+	    data_off + data_len > smb_len(req->inbuf)) {
+		return NT_STATUS_INVALID_NETWORK_RESPONSE;
+	}
+
+	rdata = smb_base(req->inbuf) + data_off;
+
+	if (create_time) {
+                *create_time = interpret_long_date(rdata+0);
+	}
+	if (access_time) {
+		*access_time = interpret_long_date(rdata+8);
+	}
+	if (write_time) {
+		*write_time = interpret_long_date(rdata+16);
+	}
+	if (change_time) {
+		*change_time = interpret_long_date(rdata+24);
+	}
+	if (mode) {
+		*mode = SVAL(rdata, 32);
+	}
+	if (size) {
+                *size = IVAL2_TO_SMB_BIG_UINT(rdata,48);
+	}
+	if (ino) {
+		*ino = IVAL(rdata, 64);
+	}
+
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
  Send a qfileinfo QUERY_FILE_NAME_INFO call.
 ****************************************************************************/
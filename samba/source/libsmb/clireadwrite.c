@@ -21,11 +21,11 @@
 #include "includes.h"
 
 /****************************************************************************
-Issue a single SMBread and don't wait for a reply.
+Build an SMBreadX in cli->outbuf.
 ****************************************************************************/
 
-static BOOL cli_issue_read(struct cli_state *cli, int fnum, off_t offset, 
-			   size_t size, int i)
+static void cli_setup_read(struct cli_state *cli, int fnum, off_t offset, 
+			   size_t size)
 {
 	BOOL bigoffset = False;
 
@@ -47,15 +47,72 @@ static BOOL cli_issue_read(struct cli_state *cli, int fnum, off_t offset,
 	SSVAL(cli->outbuf,smb_vwv5,size);
 	SSVAL(cli->outbuf,smb_vwv6,size);
 	SSVAL(cli->outbuf,smb_vwv7,((size >> 16) & 1));
-	SSVAL(cli->outbuf,smb_mid,cli->mid + i);
 
 	if (bigoffset) {
 		SIVAL(cli->outbuf,smb_vwv10,(((SMB_BIG_UINT)offset)>>32) & 0xffffffff);
 	}
+}
+
+/****************************************************************************
+Issue a single SMBread and don't wait for a reply.
+****************************************************************************/
+
+static BOOL cli_issue_read(struct cli_state *cli, int fnum, off_t offset, 
+			   size_t size, int i)
+{
+	cli_setup_read(cli, fnum, offset, size);
+	SSVAL(cli->outbuf,smb_mid,cli->mid + i);
 
 	return cli_send_smb(cli);
 }
 
+/****************************************************************************
+ Send an SMBreadX of at most one readX worth of data, the reply is
+ delivered through event_ctx. See async_smb.c.
+****************************************************************************/
+
+struct cli_request *cli_read_send(TALLOC_CTX *mem_ctx,
+				  struct event_context *event_ctx,
+				  struct cli_state *cli, int fnum,
+				  off_t offset, size_t size,
+				  void (*fn)(struct cli_request *req),
+				  void *private_data)
+{
+	cli_setup_read(cli, fnum, offset, MIN(size, cli_read_max_size(cli)));
+	return cli_request_send(mem_ctx, event_ctx, cli, fn, private_data);
+}
+
+/****************************************************************************
+ Get the data of a completed cli_read_send(). *pdata points into the
+ request and is valid as long as it is.
+****************************************************************************/
+
+NTSTATUS cli_read_recv(struct cli_request *req, char **pdata,
+		       size_t *preceived)
+{
+	NTSTATUS status = cli_request_status(req);
+	size_t size, offset;
+
+	if (!NT_STATUS_IS_OK(status) &&
+	    !NT_STATUS_EQUAL(status, STATUS_BUFFER_OVERFLOW)) {
+		return status;
+	}
+
+	size = SVAL(req->inbuf, smb_vwv5);
+	size |= (((unsigned int)(SVAL(req->inbuf, smb_vwv7) & 1)) << 16);
+	offset = SVAL(req->inbuf, smb_vwv6);
+
+	if (offset + size > smb_len(req->inbuf)) {
+		DEBUG(3, ("cli_read_recv: invalid data offset %u size %u\n",
+			  (unsigned int)offset, (unsigned int)size));
+		return NT_STATUS_INVALID_NETWORK_RESPONSE;
+	}
+
+	*pdata = smb_base(req->inbuf) + offset;
+	*preceived = size;
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
   Read size bytes at offset offset using SMBreadX.
 ****************************************************************************/
@@ -75,15 +132,7 @@ ssize_t cli_read(struct cli_state *cli, int fnum, char *buf, off_t offset, size_
 	 * rounded down to a multiple of 1024.
 	 */
 
-	if (cli->capabilities & CAP_LARGE_READX) {
-		if (cli->is_samba) {
-			readsize = CLI_SAMBA_MAX_LARGE_READX_SIZE;
-		} else {
-			readsize = CLI_WINDOWS_MAX_LARGE_READX_SIZE;
-		}
-	} else {
-		readsize = (cli->max_xmit - (smb_size+32)) & ~1023;
-	}
+	readsize = cli_read_max_size(cli);
 
 	while (total < size) {
 		readsize = MIN(readsize, size-total);
@@ -154,6 +203,126 @@ ssize_t cli_read(struct cli_state *cli, int fnum, char *buf, off_t offset, size_
 	return total;
 }
 
+/****************************************************************************
+ Largest amount a single SMBreadX can return on this connection.
+****************************************************************************/
+
+size_t cli_read_max_size(struct cli_state *cli)
+{
+	if (cli->capabilities & CAP_LARGE_READX) {
+		return cli->is_samba ? CLI_SAMBA_MAX_LARGE_READX_SIZE :
+			CLI_WINDOWS_MAX_LARGE_READX_SIZE;
+	}
+	return (cli->max_xmit - (smb_size+32)) & ~1023;
+}
+
+/****************************************************************************
+ Read from a named pipe with num_reads SMBreadX requests of size bytes, as
+ many in flight at once as the async requests on cli leave room for under
+ the server's max_mux. Pipe reads are not positioned, each reply returns the
+ next message (RPC fragment) from the pipe. The data of all replies ends
+ up in buf in the order the requests were sent, *pnread is the total.
+
+ The caller must know there are at least num_reads messages waiting - a
+ read on an empty pipe blocks on Windows servers.
+****************************************************************************/
+
+BOOL cli_read_pipe_multi(struct cli_state *cli, int fnum, char *buf,
+			 size_t size, int num_reads, size_t *pnread)
+{
+	uint16 mids[CLI_MAX_PIPE_READS];
+	size_t lens[CLI_MAX_PIPE_READS];
+	BOOL ok = True;
+	int i, issued, received;
+	int mpx = cli_request_sync_mux(cli);
+	size_t total = 0;
+
+	*pnread = 0;
+
+	if (num_reads <= 0 || num_reads > CLI_MAX_PIPE_READS ||
+	    size > cli_read_max_size(cli)) {
+		return False;
+	}
+
+	/* Collect every reply, even after an error, to keep in step. */
+
+	for (issued = received = 0; received < num_reads; received++) {
+		uint16 mid;
+		size_t size2;
+
+		while (issued < num_reads && issued - received < mpx) {
+			mids[issued] = cli->mid;
+			lens[issued] = 0;
+			if (!cli_issue_read(cli, fnum, 0, size, 0)) {
+				return False;
+			}
+			issued++;
+		}
+
+		if (!cli_receive_smb(cli)) {
+			return False;
+		}
+
+		mid = SVAL(cli->inbuf, smb_mid);
+		for (i = 0; i < issued; i++) {
+			if (mids[i] == mid) {
+				break;
+			}
+		}
+		if (i == issued) {
+			DEBUG(0,("cli_read_pipe_multi: unexpected mid %u\n",
+				 (unsigned int)mid));
+			return False;
+		}
+
+		if (cli_is_error(cli)) {
+			NTSTATUS status = NT_STATUS_OK;
+			uint8 eclass = 0;
+			uint32 ecode = 0;
+
+			if (cli_is_nt_error(cli)) {
+				status = cli_nt_error(cli);
+			} else {
+				cli_dos_error(cli, &eclass, &ecode);
+			}
+
+			if (!(eclass == ERRDOS && ecode == ERRmoredata) &&
+			    !NT_STATUS_EQUAL(status, STATUS_BUFFER_OVERFLOW)) {
+				ok = False;
+				continue;
+			}
+		}
+
+		size2 = SVAL(cli->inbuf, smb_vwv5);
+		size2 |= (((unsigned int)(SVAL(cli->inbuf, smb_vwv7) & 1)) << 16);
+
+		if (size2 > size) {
+			DEBUG(5,("server returned more than we wanted!\n"));
+			ok = False;
+			continue;
+		}
+
+		memcpy(buf + i*size, smb_base(cli->inbuf) + SVAL(cli->inbuf,smb_vwv6),
+		       size2);
+		lens[i] = size2;
+	}
+
+	if (!ok) {
+		return False;
+	}
+
+	/* Close the gaps left by short replies. */
+	for (i = 0; i < num_reads; i++) {
+		if (total != i*size) {
+			memmove(buf + total, buf + i*size, lens[i]);
+		}
+		total += lens[i];
+	}
+
+	*pnread = total;
+	return True;
+}
+
 #if 0  /* relies on client_receive_smb(), now a static in libsmb/clientgen.c */
 
 /* This call is INCOMPATIBLE with SMB signing.  If you remove the #if 0
@@ -257,9 +426,9 @@ ssize_t cli_readraw(struct cli_state *cli, int fnum, char *buf, off_t offset, si
 issue a single SMBwrite and don't wait for a reply
 ****************************************************************************/
 
-static BOOL cli_issue_write(struct cli_state *cli, int fnum, off_t offset, 
+static BOOL cli_setup_write(struct cli_state *cli, int fnum, off_t offset, 
 			    uint16 mode, const char *buf,
-			    size_t size, int i)
+			    size_t size)
 {
 	char *p;
 	BOOL large_writex = False;
@@ -320,12 +489,73 @@ static BOOL cli_issue_write(struct cli_state *cli, int fnum, off_t offset,
 	memcpy(p, buf, size);
 	cli_setup_bcc(cli, p+size);
 
+	return True;
+}
+
+/****************************************************************************
+Issue a single SMBwrite and don't wait for a reply.
+****************************************************************************/
+
+static BOOL cli_issue_write(struct cli_state *cli, int fnum, off_t offset, 
+			    uint16 mode, const char *buf,
+			    size_t size, int i)
+{
+	if (!cli_setup_write(cli, fnum, offset, mode, buf, size)) {
+		return False;
+	}
+
 	SSVAL(cli->outbuf,smb_mid,cli->mid + i);
 	
 	show_msg(cli->outbuf);
 	return cli_send_smb(cli);
 }
 
+/****************************************************************************
+ Largest amount a single SMBwriteX sends, as used by cli_write().
+****************************************************************************/
+
+size_t cli_write_max_size(struct cli_state *cli)
+{
+	return cli->max_xmit - (smb_size+32);
+}
+
+/****************************************************************************
+ Send an SMBwriteX of at most cli_write_max_size() bytes, the reply is
+ delivered through event_ctx. See async_smb.c.
+****************************************************************************/
+
+struct cli_request *cli_write_send(TALLOC_CTX *mem_ctx,
+				   struct event_context *event_ctx,
+				   struct cli_state *cli, int fnum,
+				   uint16 mode, const char *buf,
+				   off_t offset, size_t size,
+				   void (*fn)(struct cli_request *req),
+				   void *private_data)
+{
+	if (!cli_setup_write(cli, fnum, offset, mode, buf,
+			     MIN(size, cli_write_max_size(cli)))) {
+		return NULL;
+	}
+	return cli_request_send(mem_ctx, event_ctx, cli, fn, private_data);
+}
+
+/****************************************************************************
+ Get the result of a completed cli_write_send().
+****************************************************************************/
+
+NTSTATUS cli_write_recv(struct cli_request *req, size_t *pwritten)
+{
+	NTSTATUS status = cli_request_status(req);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	*pwritten = SVAL(req->inbuf, smb_vwv2);
+	*pwritten += (((size_t)(SVAL(req->inbuf, smb_vwv4)))<<16);
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
   write to a file
   write_mode: 0x0001 disallow write cacheing
@@ -341,16 +571,11 @@ ssize_t cli_write(struct cli_state *cli,
 	ssize_t bwritten = 0;
 	unsigned int issued = 0;
 	unsigned int received = 0;
-	int mpx = 1;
-	int block = cli->max_xmit - (smb_size+32);
+	/* Leave the slots of outstanding async requests alone. */
+	int mpx = cli_request_sync_mux(cli);
+	int block = cli_write_max_size(cli);
 	int blocks = (size + (block-1)) / block;
 
-	if(cli->max_mux > 1) {
-		mpx = cli->max_mux-1;
-	} else {
-		mpx = 1;
-	}
-
 	while (received < blocks) {
 
 		while ((issued - received < mpx) && (issued < blocks)) {
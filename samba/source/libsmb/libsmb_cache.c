@@ -28,10 +28,16 @@
 #include "../include/libsmb_internal.h"
 
 int smbc_default_cache_functions(SMBCCTX * context);
+SMBCSRV * smbc_find_cached_session(SMBCCTX * context, const char * server,
+				   const char * workgroup, const char * user);
 
 /*
- * Structure we use if internal caching mechanism is used 
- * nothing fancy here.
+ * Structure we use if internal caching mechanism is used.
+ *
+ * context->server_cache is the list of all entries, most recently used
+ * first. Entries are also hashed on server, workgroup and user into
+ * context->internal->_server_cache_hash, so a lookup only compares the
+ * entries for the same server and user instead of the whole cache.
  */
 struct smbc_server_cache {
 	char *server_name;
@@ -39,10 +45,112 @@ struct smbc_server_cache {
 	char *workgroup;
 	char *username;
 	SMBCSRV *server;
+	uint32 hash;
+	time_t last_used;
 	
 	struct smbc_server_cache *next, *prev;
+	struct smbc_server_cache *hash_next;
 };
 	
+static uint32 smbc_server_cache_hash(const char * server,
+				     const char * workgroup,
+				     const char * username)
+{
+	const char *strs[3];
+	uint32 value = 5381;
+	int i;
+
+	strs[0] = server;
+	strs[1] = workgroup;
+	strs[2] = username;
+
+	/* djb2 over the strings, terminators included */
+	for (i = 0; i < 3; i++) {
+		const unsigned char *p = (const unsigned char *)strs[i];
+		do {
+			value = (value << 5) + value + *p;
+		} while (*p++);
+	}
+
+	return value;
+}
+
+static struct smbc_server_cache ** smbc_server_cache_bucket(SMBCCTX * context,
+							     uint32 hash)
+{
+	return &context->internal->_server_cache_hash[hash % SMBC_SERVER_CACHE_HASH_SIZE];
+}
+
+static void smbc_server_cache_unhash(SMBCCTX * context,
+				     struct smbc_server_cache * srvcache)
+{
+	struct smbc_server_cache **pp;
+
+	for (pp = smbc_server_cache_bucket(context, srvcache->hash); *pp;
+	     pp = &(*pp)->hash_next) {
+		if (*pp == srvcache) {
+			*pp = srvcache->hash_next;
+			srvcache->hash_next = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * Drop cached servers that have been idle for too long, and the least
+ * recently used ones while there are more than the limit. Servers with
+ * open files and pinned servers are kept. Only runs once a second unless
+ * forced.
+ */
+static void smbc_reap_cached_servers(SMBCCTX * context, BOOL force)
+{
+	struct smbc_internal_data *internal = context->internal;
+	struct smbc_server_cache * srv;
+	struct smbc_server_cache * prev;
+	time_t now = time(NULL);
+
+	if (internal->_server_cache_max_idle <= 0 &&
+	    internal->_server_cache_max_servers <= 0) {
+		return;
+	}
+
+	if (!force && now == internal->_server_cache_last_reap) {
+		return;
+	}
+	internal->_server_cache_last_reap = now;
+
+	/* Oldest entries are at the end. */
+	for (srv = (struct smbc_server_cache *)context->server_cache;
+	     srv && srv->next; srv = srv->next)
+		;
+
+	for (; srv; srv = prev) {
+		BOOL idle = (internal->_server_cache_max_idle > 0 &&
+			     now - srv->last_used >= internal->_server_cache_max_idle);
+		BOOL over = (internal->_server_cache_max_servers > 0 &&
+			     internal->_server_cache_count > internal->_server_cache_max_servers);
+
+		prev = srv->prev;
+
+		if (!idle && !over) {
+			break;
+		}
+
+		/* A caller is still using it, look at the next oldest. */
+		if (srv->server->pin_count > 0) {
+			continue;
+		}
+
+		DEBUG(4, ("smbc_reap_cached_servers: dropping //%s/%s (%s)\n",
+			  srv->server_name, srv->share_name,
+			  idle ? "idle" : "over limit"));
+
+		if ((context->callbacks.remove_unused_server_fn)(context,
+								 srv->server) == 0) {
+			internal->_server_cache_stats.evictions++;
+		}
+	}
+}
 
 
 /*
@@ -89,7 +197,18 @@ static int smbc_add_cached_server(SMBCCTX * context, SMBCSRV * newsrv,
 		goto failed;
 	}
 
+	srvcache->hash = smbc_server_cache_hash(server, workgroup, username);
+	srvcache->last_used = time(NULL);
+
 	DLIST_ADD((context->server_cache), srvcache);
+	srvcache->hash_next = *smbc_server_cache_bucket(context, srvcache->hash);
+	*smbc_server_cache_bucket(context, srvcache->hash) = srvcache;
+	context->internal->_server_cache_count++;
+
+	/* Our caller is about to hand newsrv out, don't reap it. */
+	newsrv->pin_count++;
+	smbc_reap_cached_servers(context, True);
+	newsrv->pin_count--;
 	return 0;
 
  failed:
@@ -113,16 +232,26 @@ static SMBCSRV * smbc_get_cached_server(SMBCCTX * context, const char * server,
 				  const char * share, const char * workgroup, const char * user)
 {
 	struct smbc_server_cache * srv = NULL;
+	struct smbc_server_cache * next = NULL;
+	uint32 hash = smbc_server_cache_hash(server, workgroup, user);
+
+	smbc_reap_cached_servers(context, False);
 	
-	/* Search the cache lines */
-	for (srv=((struct smbc_server_cache *)context->server_cache);srv;srv=srv->next) {
+	/* Search the cache lines for this server and user */
+	for (srv = *smbc_server_cache_bucket(context, hash); srv; srv = next) {
+
+		/* The entry may be removed below. */
+		next = srv->hash_next;
 
-		if (strcmp(server,srv->server_name)  == 0 &&
+		if (srv->hash == hash &&
+		    strcmp(server,srv->server_name)  == 0 &&
 		    strcmp(workgroup,srv->workgroup) == 0 &&
 		    strcmp(user, srv->username)  == 0) {
 
                         /* If the share name matches, we're cool */
                         if (strcmp(share, srv->share_name) == 0) {
+				srv->last_used = time(NULL);
+				DLIST_PROMOTE(context->server_cache, srv);
                                 return srv->server;
                         }
 
@@ -177,6 +306,8 @@ static SMBCSRV * smbc_get_cached_server(SMBCCTX * context, const char * server,
                                 }
 
 
+				srv->last_used = time(NULL);
+				DLIST_PROMOTE(context->server_cache, srv);
                                 return srv->server;
                         }
                 }
@@ -186,6 +317,41 @@ static SMBCSRV * smbc_get_cached_server(SMBCCTX * context, const char * server,
 }
 
 
+/*
+ * Find a cached connection to server for this user whose session a new
+ * share can be connected on. Only the internal cache knows which
+ * connections belong to whom, so this always fails with an external one.
+ */
+SMBCSRV * smbc_find_cached_session(SMBCCTX * context, const char * server,
+				   const char * workgroup, const char * user)
+{
+	struct smbc_server_cache * srv = NULL;
+	uint32 hash;
+
+	if (context->callbacks.get_cached_srv_fn != smbc_get_cached_server ||
+	    context->options.one_share_per_server) {
+		return NULL;
+	}
+
+	hash = smbc_server_cache_hash(server, workgroup, user);
+
+	for (srv = *smbc_server_cache_bucket(context, hash); srv; srv = srv->hash_next) {
+		if (srv->hash == hash &&
+		    strcmp(server, srv->server_name) == 0 &&
+		    strcmp(workgroup, srv->workgroup) == 0 &&
+		    strcmp(user, srv->username) == 0 &&
+		    /* The attribute server has its own connection. */
+		    *srv->share_name != '\0' &&
+		    strcmp(srv->share_name, "*IPC$") != 0 &&
+		    srv->server->cli != NULL) {
+			return srv->server;
+		}
+	}
+
+	return NULL;
+}
+
+
 /* 
  * Search the server cache for a server and remove it
  * returns 0 on success
@@ -200,6 +366,8 @@ static int smbc_remove_cached_server(SMBCCTX * context, SMBCSRV * server)
 
 			/* remove this sucker */
 			DLIST_REMOVE(context->server_cache, srv);
+			smbc_server_cache_unhash(context, srv);
+			context->internal->_server_cache_count--;
 			SAFE_FREE(srv->server_name);
 			SAFE_FREE(srv->share_name);
 			SAFE_FREE(srv->workgroup);
@@ -67,6 +67,8 @@ typedef struct DOS_ATTR_DESC {
  * Functions exported by libsmb_cache.c that we need here
  */
 int smbc_default_cache_functions(SMBCCTX *context);
+SMBCSRV * smbc_find_cached_session(SMBCCTX * context, const char * server,
+				   const char * workgroup, const char * user);
 
 /* 
  * check if an element is part of the list. 
@@ -489,6 +491,58 @@ smbc_errno(SMBCCTX *context,
 	return ret;
 }
 
+/*
+ * Remember which tree connect on srv->cli belongs to srv.
+ */
+static void
+smbc_save_tree(SMBCSRV *srv)
+{
+        srv->cnum = srv->cli->cnum;
+        srv->dfsroot = srv->cli->dfsroot;
+        fstrcpy(srv->share, srv->cli->share);
+}
+
+/*
+ * Make srv's share the current tree connect of a shared session. Must be
+ * called before using srv->cli for anything that goes to the share.
+ */
+static void
+smbc_select_tree(SMBCSRV *srv)
+{
+        if (srv->session == NULL || srv->cli == NULL) {
+                return;
+        }
+
+        srv->cli->cnum = srv->cnum;
+        srv->cli->dfsroot = srv->dfsroot;
+        fstrcpy(srv->cli->share, srv->share);
+}
+
+/*
+ * Let go of srv's connection: disconnect its share if the session is
+ * still used by other shares, otherwise shut the session down.
+ */
+static void
+smbc_release_cli(SMBCSRV *srv)
+{
+        struct smbc_session *session = srv->session;
+
+        if (srv->cli == NULL) {
+                return;
+        }
+
+        if (session != NULL && --session->refcount > 0) {
+                smbc_select_tree(srv);
+                cli_tdis(srv->cli);
+        } else {
+                cli_shutdown(srv->cli);
+                SAFE_FREE(session);
+        }
+
+        srv->session = NULL;
+        srv->cli = NULL;
+}
+
 /* 
  * Check a server for being alive and well.
  * returns 0 if the server is in shape. Returns 1 on error 
@@ -537,8 +591,7 @@ smbc_remove_unused_server(SMBCCTX * context,
 
 	DLIST_REMOVE(context->internal->_servers, srv);
 
-	cli_shutdown(srv->cli);
-	srv->cli = NULL;
+	smbc_release_cli(srv);
 
 	DEBUG(3, ("smbc_remove_usused_server: %p removed.\n", srv));
 
@@ -598,6 +651,7 @@ find_server(SMBCCTX *context,
                          * Try to remove it and check for more possible
                          * servers in the cache
                          */
+                        context->internal->_server_cache_stats.reconnects++;
 			if ((context->callbacks.remove_unused_server_fn)(context,
                                                                          srv)) { 
                                 /*
@@ -617,12 +671,92 @@ find_server(SMBCCTX *context,
 			goto check_server_cache; 
 		}
 
+                context->internal->_server_cache_stats.hits++;
 		return srv;
  	}
 
+        context->internal->_server_cache_stats.misses++;
         return NULL;
 }
 
+/*
+ * Connect share on the session of an existing connection to the same
+ * server for the same user, saving the negprot and session setup.
+ */
+static SMBCSRV *
+smbc_server_on_session(SMBCCTX *context,
+                       const char *server,
+                       const char *share,
+                       fstring workgroup,
+                       fstring username,
+                       fstring password)
+{
+        SMBCSRV *base;
+        SMBCSRV *srv;
+        struct cli_state *c;
+
+        if (*share == '\0') {
+                return NULL;
+        }
+
+        base = smbc_find_cached_session(context, server, workgroup, username);
+        if (!base || (context->callbacks.check_server_fn)(context, base)) {
+                return NULL;
+        }
+
+        srv = SMB_MALLOC_P(SMBCSRV);
+        if (!srv) {
+                return NULL;
+        }
+        ZERO_STRUCTP(srv);
+
+        if (base->session == NULL) {
+                base->session = SMB_MALLOC_P(struct smbc_session);
+                if (base->session == NULL) {
+                        SAFE_FREE(srv);
+                        return NULL;
+                }
+                base->session->refcount = 1;
+        }
+
+        c = base->cli;
+
+        if (!cli_send_tconX(c, share, "?????",
+                            password, strlen(password)+1)) {
+                DEBUG(4, ("smbc_server_on_session: tconX to //%s/%s "
+                          "failed: %s\n", server, share, cli_errstr(c)));
+                smbc_select_tree(base);
+                SAFE_FREE(srv);
+                return NULL;
+        }
+
+        srv->cli = c;
+        srv->session = base->session;
+        srv->session->refcount++;
+        srv->dev = (dev_t)(str_checksum(server) ^ str_checksum(share));
+        smbc_save_tree(srv);
+
+        errno = 0;
+        base->pin_count++;
+        if ((context->callbacks.add_cached_srv_fn)(context, srv,
+                                                   server, share,
+                                                   workgroup, username)) {
+                base->pin_count--;
+                DEBUG(3, (" Failed to add server to cache\n"));
+                smbc_release_cli(srv);
+                SAFE_FREE(srv);
+                return NULL;
+        }
+        base->pin_count--;
+
+        DEBUG(2, ("Server connect ok: //%s/%s: %p (on session of %p)\n",
+                  server, share, srv, base));
+
+        context->internal->_server_cache_stats.session_reuses++;
+        DLIST_ADD(context->internal->_servers, srv);
+        return srv;
+}
+
 /*
  * Connect to a server, possibly on an existing connection
  *
@@ -716,6 +850,7 @@ smbc_server(SMBCCTX *context,
                         if (srv) {
                                 srv->dev = (dev_t)(str_checksum(server) ^
                                                    str_checksum(share));
+                                smbc_save_tree(srv);
                         }
                 }
         }
@@ -724,6 +859,7 @@ smbc_server(SMBCCTX *context,
         if (srv) {
 
                 /* ... then we're done here.  Give 'em what they came for. */
+                smbc_select_tree(srv);
                 return srv;
         }
 
@@ -733,6 +869,13 @@ smbc_server(SMBCCTX *context,
                 return NULL;
         }
 
+        /* Maybe we are already logged on to the server, just not to this share */
+        srv = smbc_server_on_session(context, server, share,
+                                     workgroup, username, password);
+        if (srv) {
+                return srv;
+        }
+
 	make_nmb_name(&calling, context->netbios_name, 0x0);
 	make_nmb_name(&called , server, 0x20);
 
@@ -878,6 +1021,7 @@ smbc_server(SMBCCTX *context,
         srv->no_pathinfo = False;
         srv->no_pathinfo2 = False;
         srv->no_nt_session = False;
+        smbc_save_tree(srv);
 
 	/* now add it to the cache (internal or external)  */
 	/* Let the cache function set errno if it wants to */
@@ -897,6 +1041,7 @@ smbc_server(SMBCCTX *context,
 	DEBUG(2, ("Server connect ok: //%s/%s: %p\n", 
 		  server, share, srv));
 
+        context->internal->_server_cache_stats.connects++;
 	DLIST_ADD(context->internal->_servers, srv);
 	return srv;
 
@@ -1291,6 +1436,7 @@ smbc_read_ctx(SMBCCTX *context,
         }
 	
 	/*d_printf(">>>read: resolving %s\n", path);*/
+	smbc_select_tree(file->srv);
 	if (!cli_resolve_path("", file->srv->cli, path,
                               &targetcli, targetpath))
 	{
@@ -1374,6 +1520,7 @@ smbc_write_ctx(SMBCCTX *context,
         }
 	
 	/*d_printf(">>>write: resolving %s\n", path);*/
+	smbc_select_tree(file->srv);
 	if (!cli_resolve_path("", file->srv->cli, path,
                               &targetcli, targetpath))
 	{
@@ -1446,6 +1593,7 @@ smbc_close_ctx(SMBCCTX *context,
         }
 	
 	/*d_printf(">>>close: resolving %s\n", path);*/
+	smbc_select_tree(file->srv);
 	if (!cli_resolve_path("", file->srv->cli, path,
                               &targetcli, targetpath))
 	{
@@ -1947,6 +2095,7 @@ smbc_lseek_ctx(SMBCCTX *context,
 			}
 		
 		/*d_printf(">>>lseek: resolving %s\n", path);*/
+		smbc_select_tree(file->srv);
 		if (!cli_resolve_path("", file->srv->cli, path,
                                       &targetcli, targetpath))
 		{
@@ -2196,6 +2345,7 @@ smbc_fstat_ctx(SMBCCTX *context,
         }
 	
 	/*d_printf(">>>fstat: resolving %s\n", path);*/
+	smbc_select_tree(file->srv);
 	if (!cli_resolve_path("", file->srv->cli, path,
                               &targetcli, targetpath))
 	{
@@ -2704,6 +2854,15 @@ smbc_opendir_ctx(SMBCCTX *context,
                         if (!srv) {
                                 continue;
                         }
+
+                        /*
+                         * Keep the one we list through from being reaped
+                         * while connecting to the next master browser.
+                         */
+                        if (dir->srv) {
+                                dir->srv->pin_count--;
+                        }
+                        srv->pin_count++;
                 
                         dir->srv = srv;
                         dir->dir_type = SMBC_WORKGROUP;
@@ -2719,6 +2878,10 @@ smbc_opendir_ctx(SMBCCTX *context,
                         }
                 }
 
+                if (dir->srv) {
+                        dir->srv->pin_count--;
+                }
+
                 SAFE_FREE(ip_list);
         } else { 
                 /*
@@ -5381,9 +5544,12 @@ smbc_setxattr_ctx(SMBCCTX *context,
 	}
 
         if (! srv->no_nt_session) {
+                /* Getting the attribute server may reap the cache. */
+                srv->pin_count++;
                 ipc_srv = smbc_attr_server(context, server, share,
                                            workgroup, user, password,
                                            &pol);
+                srv->pin_count--;
                 if (! ipc_srv) {
                         srv->no_nt_session = True;
                 }
@@ -5675,9 +5841,12 @@ smbc_getxattr_ctx(SMBCCTX *context,
         }
 
         if (! srv->no_nt_session) {
+                /* Getting the attribute server may reap the cache. */
+                srv->pin_count++;
                 ipc_srv = smbc_attr_server(context, server, share,
                                            workgroup, user, password,
                                            &pol);
+                srv->pin_count--;
                 if (! ipc_srv) {
                         srv->no_nt_session = True;
                 }
@@ -5808,9 +5977,12 @@ smbc_removexattr_ctx(SMBCCTX *context,
         }
 
         if (! srv->no_nt_session) {
+                /* Getting the attribute server may reap the cache. */
+                srv->pin_count++;
                 ipc_srv = smbc_attr_server(context, server, share,
                                            workgroup, user, password,
                                            &pol);
+                srv->pin_count--;
                 if (! ipc_srv) {
                         srv->no_nt_session = True;
                 }
@@ -6215,6 +6387,647 @@ smbc_unlink_print_job_ctx(SMBCCTX *context,
 
 }
 
+/*
+ * Asynchronous operations.
+ *
+ * Each operation sends its request with the libsmb cli_*_send() functions
+ * and completes in the callback of the resulting cli_request, which runs
+ * from smbc_async_process() through the context's event context.  See
+ * libsmb/async_smb.c.
+ */
+
+struct smbc_async_state {
+        SMBCCTX *context;
+        smbc_async_fn fn;
+        void *private_data;
+        SMBCFILE *file;
+        SMBCSRV *srv;
+        void *buf;
+        size_t count;
+        struct stat *st;
+        char *fname;
+        char *path;
+};
+
+static int
+smbc_async_state_destructor(struct smbc_async_state *state)
+{
+        if (state->srv != NULL) {
+                state->srv->pin_count--;
+        }
+        return 0;
+}
+
+static struct smbc_async_state *
+smbc_async_state_new(SMBCCTX *context,
+                     smbc_async_fn fn,
+                     void *private_data)
+{
+        struct smbc_internal_data *internal;
+        struct smbc_async_state *state;
+
+        if (!context || !context->internal ||
+            !context->internal->_initialized || !fn) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        internal = context->internal;
+
+        if (internal->_async_ev == NULL) {
+                internal->_async_mem_ctx = talloc_init("smbc_async");
+                internal->_async_ev = event_context_init(NULL);
+                if (internal->_async_mem_ctx == NULL ||
+                    internal->_async_ev == NULL) {
+                        TALLOC_FREE(internal->_async_mem_ctx);
+                        TALLOC_FREE(internal->_async_ev);
+                        errno = ENOMEM;
+                        return NULL;
+                }
+        }
+
+        state = TALLOC_ZERO_P(internal->_async_mem_ctx,
+                              struct smbc_async_state);
+        if (state == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        state->context = context;
+        state->fn = fn;
+        state->private_data = private_data;
+        talloc_set_destructor(state, smbc_async_state_destructor);
+
+        return state;
+}
+
+/*
+ * The request is in flight: account for it, or give up on it.
+ */
+static int
+smbc_async_started(struct smbc_async_state *state,
+                   struct cli_request *req)
+{
+        if (req == NULL) {
+                TALLOC_FREE(state);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        state->context->internal->_async_outstanding++;
+        return 0;
+}
+
+static void
+smbc_async_complete(struct smbc_async_state *state,
+                    SMBCFILE *file,
+                    ssize_t result,
+                    NTSTATUS status)
+{
+        SMBCCTX *context = state->context;
+        smbc_async_fn fn = state->fn;
+        void *private_data = state->private_data;
+        int err = 0;
+
+        if (!NT_STATUS_IS_OK(status)) {
+                err = cli_errno_from_nt(status);
+                result = -1;
+        }
+
+        context->internal->_async_outstanding--;
+
+        /* This also frees the cli_request. */
+        TALLOC_FREE(state);
+
+        fn(context, file, result, err, private_data);
+}
+
+/*
+ * The connection an open file's requests go to, following DFS.
+ */
+static struct cli_state *
+smbc_async_file_cli(SMBCCTX *context,
+                    SMBCFILE *file)
+{
+	fstring server, share, user, password;
+	pstring path, targetpath;
+	struct cli_state *targetcli;
+
+	if (!file || !DLIST_CONTAINS(context->internal->_files, file) ||
+            !file->file) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	if (smbc_parse_path(context, file->fname,
+                            NULL, 0,
+                            server, sizeof(server),
+                            share, sizeof(share),
+                            path, sizeof(path),
+                            user, sizeof(user),
+                            password, sizeof(password),
+                            NULL, 0)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+	smbc_select_tree(file->srv);
+	if (!cli_resolve_path("", file->srv->cli, path,
+                              &targetcli, targetpath)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+        return targetcli;
+}
+
+/*
+ * The connection and path on it of a URL, connecting if necessary. The
+ * server is pinned until the state it is stored in is freed.
+ */
+static struct cli_state *
+smbc_async_path_cli(SMBCCTX *context,
+                    const char *fname,
+                    SMBCSRV **psrv,
+                    pstring targetpath)
+{
+	fstring server, share, user, password, workgroup;
+	pstring path;
+	struct cli_state *targetcli;
+	SMBCSRV *srv;
+
+	if (!fname) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (smbc_parse_path(context, fname,
+                            workgroup, sizeof(workgroup),
+                            server, sizeof(server),
+                            share, sizeof(share),
+                            path, sizeof(path),
+                            user, sizeof(user),
+                            password, sizeof(password),
+                            NULL, 0)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+	if (user[0] == (char)0) fstrcpy(user, context->user);
+
+	srv = smbc_server(context, True,
+                          server, share, workgroup, user, password);
+	if (!srv) {
+		return NULL;  /* smbc_server sets errno */
+	}
+
+	if (!cli_resolve_path("", srv->cli, path, &targetcli, targetpath)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+        srv->pin_count++;
+        *psrv = srv;
+        return targetcli;
+}
+
+static void
+smbc_async_discard(struct cli_request *req)
+{
+        TALLOC_FREE(req);
+}
+
+static void
+smbc_async_open_done(struct cli_request *req)
+{
+        struct smbc_async_state *state =
+                (struct smbc_async_state *)req->private_data;
+        SMBCCTX *context = state->context;
+        SMBCFILE *file;
+        NTSTATUS status;
+        int fnum;
+
+        status = cli_open_recv(req, &fnum);
+        if (!NT_STATUS_IS_OK(status)) {
+                smbc_async_complete(state, NULL, -1, status);
+                return;
+        }
+
+        file = SMB_MALLOC_P(SMBCFILE);
+        if (file) {
+                ZERO_STRUCTP(file);
+                file->fname = SMB_STRDUP(state->fname);
+        }
+        if (!file || !file->fname) {
+                SAFE_FREE(file);
+                /* Don't leave the file open on the server. */
+                cli_close_send(context->internal->_async_mem_ctx,
+                               context->internal->_async_ev,
+                               req->cli, fnum, smbc_async_discard, NULL);
+                smbc_async_complete(state, NULL, -1, NT_STATUS_NO_MEMORY);
+                return;
+        }
+
+        file->cli_fd  = fnum;
+        file->srv     = state->srv;
+        file->offset  = 0;
+        file->file    = True;
+
+        DLIST_ADD(context->internal->_files, file);
+
+        smbc_async_complete(state, file, 0, NT_STATUS_OK);
+}
+
+int
+smbc_async_open(SMBCCTX *context,
+                const char *fname,
+                int flags,
+                smbc_async_fn fn,
+                void *private_data)
+{
+        struct smbc_async_state *state;
+        struct cli_state *targetcli;
+        struct cli_request *req;
+        pstring targetpath;
+
+        state = smbc_async_state_new(context, fn, private_data);
+        if (state == NULL) {
+                return -1;
+        }
+
+        targetcli = smbc_async_path_cli(context, fname, &state->srv,
+                                        targetpath);
+        if (targetcli == NULL) {
+                TALLOC_FREE(state);
+                return -1;
+        }
+
+        if (strlen(targetpath) == 0 ||
+            targetpath[strlen(targetpath) - 1] == '\\') {
+                TALLOC_FREE(state);
+                errno = EISDIR;
+                return -1;
+        }
+
+        state->fname = talloc_strdup(state, fname);
+        if (state->fname == NULL) {
+                TALLOC_FREE(state);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        DEBUG(4, ("smbc_async_open(%s)\n", fname));
+
+        req = cli_open_send(state, context->internal->_async_ev, targetcli,
+                            targetpath, flags, context->internal->_share_mode,
+                            smbc_async_open_done, state);
+
+        return smbc_async_started(state, req);
+}
+
+static void
+smbc_async_read_done(struct cli_request *req)
+{
+        struct smbc_async_state *state =
+                (struct smbc_async_state *)req->private_data;
+        NTSTATUS status;
+        char *data;
+        size_t received;
+
+        status = cli_read_recv(req, &data, &received);
+        if (!NT_STATUS_IS_OK(status)) {
+                smbc_async_complete(state, state->file, -1, status);
+                return;
+        }
+
+        received = MIN(received, state->count);
+        memcpy(state->buf, data, received);
+
+        smbc_async_complete(state, state->file, received, NT_STATUS_OK);
+}
+
+int
+smbc_async_read(SMBCCTX *context,
+                SMBCFILE *file,
+                void *buf,
+                size_t count,
+                off_t offset,
+                smbc_async_fn fn,
+                void *private_data)
+{
+        struct smbc_async_state *state;
+        struct cli_state *targetcli;
+        struct cli_request *req;
+
+        if (buf == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        state = smbc_async_state_new(context, fn, private_data);
+        if (state == NULL) {
+                return -1;
+        }
+
+        targetcli = smbc_async_file_cli(context, file);
+        if (targetcli == NULL) {
+                TALLOC_FREE(state);
+                return -1;
+        }
+
+        DEBUG(4, ("smbc_async_read(%p, %d, %.0f)\n",
+                  file, (int)count, (double)offset));
+
+        state->file = file;
+        state->buf = buf;
+        state->count = count;
+
+        req = cli_read_send(state, context->internal->_async_ev, targetcli,
+                            file->cli_fd, offset, count,
+                            smbc_async_read_done, state);
+
+        return smbc_async_started(state, req);
+}
+
+static void
+smbc_async_write_done(struct cli_request *req)
+{
+        struct smbc_async_state *state =
+                (struct smbc_async_state *)req->private_data;
+        NTSTATUS status;
+        size_t written = 0;
+
+        status = cli_write_recv(req, &written);
+
+        smbc_async_complete(state, state->file, written, status);
+}
+
+int
+smbc_async_write(SMBCCTX *context,
+                 SMBCFILE *file,
+                 const void *buf,
+                 size_t count,
+                 off_t offset,
+                 smbc_async_fn fn,
+                 void *private_data)
+{
+        struct smbc_async_state *state;
+        struct cli_state *targetcli;
+        struct cli_request *req;
+
+        if (buf == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        state = smbc_async_state_new(context, fn, private_data);
+        if (state == NULL) {
+                return -1;
+        }
+
+        targetcli = smbc_async_file_cli(context, file);
+        if (targetcli == NULL) {
+                TALLOC_FREE(state);
+                return -1;
+        }
+
+        DEBUG(4, ("smbc_async_write(%p, %d, %.0f)\n",
+                  file, (int)count, (double)offset));
+
+        state->file = file;
+
+        req = cli_write_send(state, context->internal->_async_ev, targetcli,
+                             file->cli_fd, 0, (const char *)buf,
+                             offset, count, smbc_async_write_done, state);
+
+        return smbc_async_started(state, req);
+}
+
+static void
+smbc_async_close_done(struct cli_request *req)
+{
+        struct smbc_async_state *state =
+                (struct smbc_async_state *)req->private_data;
+        SMBCFILE *file = state->file;
+
+        /* The file was taken off the list when the close was sent. */
+        SAFE_FREE(file->fname);
+        SAFE_FREE(file);
+
+        smbc_async_complete(state, NULL, 0, cli_request_status(req));
+}
+
+int
+smbc_async_close(SMBCCTX *context,
+                 SMBCFILE *file,
+                 smbc_async_fn fn,
+                 void *private_data)
+{
+        struct smbc_async_state *state;
+        struct cli_state *targetcli;
+        struct cli_request *req;
+
+        state = smbc_async_state_new(context, fn, private_data);
+        if (state == NULL) {
+                return -1;
+        }
+
+        targetcli = smbc_async_file_cli(context, file);
+        if (targetcli == NULL) {
+                TALLOC_FREE(state);
+                return -1;
+        }
+
+        DEBUG(4, ("smbc_async_close(%p)\n", file));
+
+        state->file = file;
+
+        req = cli_close_send(state, context->internal->_async_ev, targetcli,
+                             file->cli_fd, smbc_async_close_done, state);
+        if (smbc_async_started(state, req) != 0) {
+                return -1;
+        }
+
+        /* No more operations on it from now on. */
+        DLIST_REMOVE(context->internal->_files, file);
+        return 0;
+}
+
+static void
+smbc_async_stat_done(struct cli_request *req)
+{
+        struct smbc_async_state *state =
+                (struct smbc_async_state *)req->private_data;
+        struct stat *st = state->st;
+	struct timespec write_time_ts;
+        struct timespec access_time_ts;
+        struct timespec change_time_ts;
+	SMB_OFF_T size = 0;
+	uint16 mode = 0;
+	SMB_INO_T ino = 0;
+        NTSTATUS status;
+
+        status = cli_qpathinfo2_recv(req, NULL, &access_time_ts,
+                                     &write_time_ts, &change_time_ts,
+                                     &size, &mode, &ino);
+        if (!NT_STATUS_IS_OK(status)) {
+                smbc_async_complete(state, NULL, -1, status);
+                return;
+        }
+
+	st->st_ino = ino;
+
+	smbc_setup_stat(state->context, st, state->path, size, mode);
+
+	set_atimespec(st, access_time_ts);
+	set_ctimespec(st, change_time_ts);
+	set_mtimespec(st, write_time_ts);
+	st->st_dev   = state->srv->dev;
+
+        smbc_async_complete(state, NULL, 0, NT_STATUS_OK);
+}
+
+int
+smbc_async_stat(SMBCCTX *context,
+                const char *fname,
+                struct stat *st,
+                smbc_async_fn fn,
+                void *private_data)
+{
+        struct smbc_async_state *state;
+        struct cli_state *targetcli;
+        struct cli_request *req;
+        pstring targetpath;
+
+        if (st == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        state = smbc_async_state_new(context, fn, private_data);
+        if (state == NULL) {
+                return -1;
+        }
+
+        targetcli = smbc_async_path_cli(context, fname, &state->srv,
+                                        targetpath);
+        if (targetcli == NULL) {
+                TALLOC_FREE(state);
+                return -1;
+        }
+
+        state->st = st;
+        state->path = talloc_strdup(state, targetpath);
+        if (state->path == NULL) {
+                TALLOC_FREE(state);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        DEBUG(4, ("smbc_async_stat(%s)\n", fname));
+
+        req = cli_qpathinfo2_send(state, context->internal->_async_ev,
+                                  targetcli, targetpath,
+                                  smbc_async_stat_done, state);
+
+        return smbc_async_started(state, req);
+}
+
+int
+smbc_async_process(SMBCCTX *context,
+                   int timeout_ms)
+{
+        struct event_context *ev;
+        struct timeval now, timeout;
+        fd_set r_fds, w_fds;
+        int maxfd;
+        int selrtn;
+        BOOL fired;
+
+        if (!context || !context->internal ||
+            !context->internal->_initialized) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ev = context->internal->_async_ev;
+        if (ev == NULL) {
+                return 0;
+        }
+
+        do {
+                if (timeout_ms < 0) {
+                        timeout = timeval_set(60, 0);
+                } else {
+                        timeout = timeval_set(timeout_ms / 1000,
+                                              (timeout_ms % 1000) * 1000);
+                }
+
+                FD_ZERO(&r_fds);
+                FD_ZERO(&w_fds);
+                maxfd = 0;
+                now = timeval_current();
+                event_add_to_select_args(ev, &now, &r_fds, &w_fds,
+                                         &timeout, &maxfd);
+
+                selrtn = sys_select(maxfd+1, &r_fds, &w_fds, NULL, &timeout);
+                if (selrtn == -1) {
+                        if (errno != EINTR) {
+                                return -1;
+                        }
+                        FD_ZERO(&r_fds);
+                        FD_ZERO(&w_fds);
+                        selrtn = 0;
+                }
+
+                fired = run_events(ev, selrtn, &r_fds, &w_fds);
+
+        } while (timeout_ms < 0 && !fired &&
+                 context->internal->_async_outstanding > 0);
+
+        return context->internal->_async_outstanding;
+}
+
+int
+smbc_async_get_fds(SMBCCTX *context,
+                   int *fds,
+                   int max_fds)
+{
+        struct timeval now, timeout;
+        fd_set r_fds, w_fds;
+        int maxfd = 0;
+        int fd, num_fds = 0;
+
+        if (!context || !context->internal ||
+            !context->internal->_initialized || (max_fds > 0 && !fds)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (context->internal->_async_ev == NULL) {
+                return 0;
+        }
+
+        FD_ZERO(&r_fds);
+        FD_ZERO(&w_fds);
+        now = timeval_current();
+        timeout = timeval_zero();
+        event_add_to_select_args(context->internal->_async_ev, &now,
+                                 &r_fds, &w_fds, &timeout, &maxfd);
+
+        for (fd = 0; fd <= maxfd; fd++) {
+                if (!FD_ISSET(fd, &r_fds) && !FD_ISSET(fd, &w_fds)) {
+                        continue;
+                }
+                if (num_fds < max_fds) {
+                        fds[num_fds] = fd;
+                }
+                num_fds++;
+        }
+
+        return num_fds;
+}
+
 /*
  * Get a new empty handle to fill in with your own info 
  */
@@ -6326,7 +7139,7 @@ smbc_free_context(SMBCCTX *context,
                         while (s) {
                                 DEBUG(1, ("Forced shutdown: %p (fd=%d)\n",
                                           s, s->cli->fd));
-                                cli_shutdown(s->cli);
+                                smbc_release_cli(s);
                                 (context->callbacks.remove_cached_srv_fn)(context,
                                                                           s);
                                 next = s->next;
@@ -6360,6 +7173,8 @@ smbc_free_context(SMBCCTX *context,
         }
 
         /* Things we have to clean up */
+        TALLOC_FREE(context->internal->_async_mem_ctx);
+        TALLOC_FREE(context->internal->_async_ev);
         SAFE_FREE(context->workgroup);
         SAFE_FREE(context->netbios_name);
         SAFE_FREE(context->user);
@@ -6437,6 +7252,21 @@ smbc_option_set(SMBCCTX *context,
                  */
                 option_value.v = va_arg(ap, void *);
                 context->internal->_user_data = option_value.v;
+        } else if (strcmp(option_name, "server_cache_max_idle") == 0) {
+                /*
+                 * Disconnect cached servers which have not been used for
+                 * this many seconds.  0 (the default) keeps them forever.
+                 */
+                option_value.i = va_arg(ap, int);
+                context->internal->_server_cache_max_idle = option_value.i;
+        } else if (strcmp(option_name, "server_cache_max_servers") == 0) {
+                /*
+                 * Keep at most this many cached server connections,
+                 * disconnecting the least recently used ones.  0 (the
+                 * default) means no limit.
+                 */
+                option_value.i = va_arg(ap, int);
+                context->internal->_server_cache_max_servers = option_value.i;
         }
 
         va_end(ap);
@@ -6486,12 +7316,49 @@ smbc_option_get(SMBCCTX *context,
                  * with smbc_option_get()
                  */
                 return context->internal->_user_data;
+        } else if (strcmp(option_name, "server_cache_max_idle") == 0) {
+#if defined(__intptr_t_defined) || defined(HAVE_INTPTR_T)
+		return (void *) (intptr_t) context->internal->_server_cache_max_idle;
+#else
+		return (void *) context->internal->_server_cache_max_idle;
+#endif
+        } else if (strcmp(option_name, "server_cache_max_servers") == 0) {
+#if defined(__intptr_t_defined) || defined(HAVE_INTPTR_T)
+		return (void *) (intptr_t) context->internal->_server_cache_max_servers;
+#else
+		return (void *) context->internal->_server_cache_max_servers;
+#endif
         }
 
         return NULL;
 }
 
 
+/*
+ * Get the server connection cache counters
+ */
+int
+smbc_get_server_cache_stats(SMBCCTX *context,
+                            struct smbc_server_cache_stats *stats)
+{
+        SMBCSRV *srv;
+
+        if (!context || !context->internal || !stats) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        *stats = context->internal->_server_cache_stats;
+
+        stats->servers = 0;
+        for (srv = context->internal->_servers; srv; srv = srv->next) {
+                stats->servers++;
+        }
+
+        return 0;
+}
+
+
 /*
  * Initialise the library etc 
  *
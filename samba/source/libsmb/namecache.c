@@ -167,6 +167,50 @@ BOOL namecache_store(const char *name, int name_type,
 }
 
 
+/**
+ * Remember that a name could not be resolved, so that the next lookup
+ * fails at once instead of waiting out every resolver's timeout again.
+ * Negative entries live for "name cache:negative timeout" seconds.
+ *
+ * @param name netbios name that failed to resolve
+ * @param name_type netbios name type of @param name
+ **/
+
+BOOL namecache_store_negative(const char *name, int name_type)
+{
+	time_t expiry;
+	int timeout;
+	char *key;
+	BOOL ret;
+
+	if (!gencache_init()) return False;
+
+	if (name_type > 255) {
+		return False; /* Don't store non-real name types. */
+	}
+
+	timeout = lp_parm_int(-1, "name cache", "negative timeout", 60);
+	timeout = MIN(timeout, lp_name_cache_timeout());
+	if (timeout <= 0) {
+		return False;
+	}
+
+	key = namecache_key(name, name_type);
+	if (!key) {
+		return False;
+	}
+
+	DEBUG(5, ("namecache_store_negative: %s#%02x is unresolvable for "
+		  "%d seconds\n", name, name_type, timeout));
+
+	/* An empty address list marks the entry as negative */
+	expiry = time(NULL) + timeout;
+	ret = gencache_set(key, "", expiry);
+	SAFE_FREE(key);
+	return ret;
+}
+
+
 /**
  * Look up a name in the cache.
  *
@@ -177,7 +221,8 @@ BOOL namecache_store(const char *name, int name_type,
  * @param num_names number of entries found
  *
  * @return true upon successful fetch or
- *         false if name isn't found in the cache or has expired
+ *         false if name isn't found in the cache or has expired.
+ *         A negative entry returns true with no addresses.
  **/
 
 BOOL namecache_fetch(const char *name, int name_type, struct ip_service **ip_list,
@@ -214,6 +259,15 @@ BOOL namecache_fetch(const char *name, int name_type, struct ip_service **ip_lis
 		DEBUG(5, ("name %s#%02X found.\n", name, name_type));
 	}
 	
+	if (*value == '\0') {
+		DEBUG(5, ("name %s#%02X is negatively cached.\n", name,
+			  name_type));
+		*ip_list = NULL;
+		SAFE_FREE(key);
+		SAFE_FREE(value);
+		return True;
+	}
+
 	/*
 	 * Split up the stored value into the list of IP adresses
 	 */
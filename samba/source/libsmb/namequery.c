@@ -460,6 +460,72 @@ static int remove_duplicate_addrs2( struct ip_service *iplist, int count )
 	return count;
 }
 
+/****************************************************************************
+ Fill in a name query request packet.
+****************************************************************************/
+
+static void name_query_packet(struct packet_struct *p, int fd,
+			      const char *name, int name_type,
+			      BOOL bcast, BOOL recurse, struct in_addr to_ip)
+{
+	struct nmb_packet *nmb = &p->packet.nmb;
+
+	memset((char *)p,'\0',sizeof(*p));
+
+	nmb->header.name_trn_id = generate_trn_id();
+	nmb->header.opcode = 0;
+	nmb->header.response = False;
+	nmb->header.nm_flags.bcast = bcast;
+	nmb->header.nm_flags.recursion_available = False;
+	nmb->header.nm_flags.recursion_desired = recurse;
+	nmb->header.nm_flags.trunc = False;
+	nmb->header.nm_flags.authoritative = False;
+	nmb->header.rcode = 0;
+	nmb->header.qdcount = 1;
+	nmb->header.ancount = 0;
+	nmb->header.nscount = 0;
+	nmb->header.arcount = 0;
+	
+	make_nmb_name(&nmb->question.question_name,name,name_type);
+	
+	nmb->question.question_type = 0x20;
+	nmb->question.question_class = 0x1;
+	
+	p->ip = to_ip;
+	p->port = NMB_PORT;
+	p->fd = fd;
+	p->timestamp = time(NULL);
+	p->packet_type = NMB_PACKET;
+}
+
+/****************************************************************************
+ Append the addresses of a positive name query response to ip_list.
+****************************************************************************/
+
+static BOOL name_query_add_answers(struct packet_struct *p2,
+				   struct in_addr **ip_list, int *count)
+{
+	struct nmb_packet *nmb2 = &p2->packet.nmb;
+	int i;
+
+	*ip_list = SMB_REALLOC_ARRAY( *ip_list, struct in_addr,
+				(*count) + nmb2->answers->rdlength/6 );
+	if (*ip_list == NULL) {
+		*count = 0;
+		return False;
+	}
+	
+	DEBUG(2,("Got a positive name query response from %s ( ", inet_ntoa(p2->ip)));
+	for (i=0;i<nmb2->answers->rdlength/6;i++) {
+		putip((char *)&(*ip_list)[(*count)],&nmb2->answers->rdata[2+i*6]);
+		DEBUGADD(2,("%s ",inet_ntoa((*ip_list)[(*count)])));
+		(*count)++;
+	}
+	DEBUGADD(2,(")\n"));
+
+	return True;
+}
+
 /****************************************************************************
  Do a netbios name query to find someones IP.
  Returns an array of IP addresses or NULL if none.
@@ -473,7 +539,7 @@ struct in_addr *name_query(int fd,const char *name,int name_type,
 			   BOOL *timed_out)
 {
 	BOOL found=False;
-	int i, retries = 3;
+	int retries = 3;
 	int retry_time = bcast?250:2000;
 	struct timeval tval;
 	struct packet_struct p;
@@ -490,34 +556,10 @@ struct in_addr *name_query(int fd,const char *name,int name_type,
 		*timed_out = False;
 	}
 	
-	memset((char *)&p,'\0',sizeof(p));
 	(*count) = 0;
 	(*flags) = 0;
 	
-	nmb->header.name_trn_id = generate_trn_id();
-	nmb->header.opcode = 0;
-	nmb->header.response = False;
-	nmb->header.nm_flags.bcast = bcast;
-	nmb->header.nm_flags.recursion_available = False;
-	nmb->header.nm_flags.recursion_desired = recurse;
-	nmb->header.nm_flags.trunc = False;
-	nmb->header.nm_flags.authoritative = False;
-	nmb->header.rcode = 0;
-	nmb->header.qdcount = 1;
-	nmb->header.ancount = 0;
-	nmb->header.nscount = 0;
-	nmb->header.arcount = 0;
-	
-	make_nmb_name(&nmb->question.question_name,name,name_type);
-	
-	nmb->question.question_type = 0x20;
-	nmb->question.question_class = 0x1;
-	
-	p.ip = to_ip;
-	p.port = NMB_PORT;
-	p.fd = fd;
-	p.timestamp = time(NULL);
-	p.packet_type = NMB_PACKET;
+	name_query_packet(&p, fd, name, name_type, bcast, recurse, to_ip);
 	
 	GetTimeOfDay(&tval);
 	
@@ -592,23 +634,12 @@ struct in_addr *name_query(int fd,const char *name,int name_type,
 				continue;
 			}
 			
-			ip_list = SMB_REALLOC_ARRAY( ip_list, struct in_addr,
-						(*count) + nmb2->answers->rdlength/6 );
-			
-			if (!ip_list) {
+			if (!name_query_add_answers(p2, &ip_list, count)) {
 				DEBUG(0,("name_query: Realloc failed.\n"));
 				free_packet(p2);
 				return( NULL );
 			}
 			
-			DEBUG(2,("Got a positive name query response from %s ( ", inet_ntoa(p2->ip)));
-			for (i=0;i<nmb2->answers->rdlength/6;i++) {
-				putip((char *)&ip_list[(*count)],&nmb2->answers->rdata[2+i*6]);
-				DEBUGADD(2,("%s ",inet_ntoa(ip_list[(*count)])));
-				(*count)++;
-			}
-			DEBUGADD(2,(")\n"));
-			
 			found=True;
 			retries=0;
 			/* We add the flags back ... */
@@ -1134,6 +1165,624 @@ static BOOL resolve_ads(const char *name, int name_type,
 	return True;
 }
 
+/********************************************************
+ Resolve via the "name resolve order" methods one after the
+ other, the way we always used to.
+*********************************************************/
+
+static BOOL resolve_name_serial(const char *name, int *pname_type,
+				const char *sitename, const char *resolve_order,
+				struct ip_service **return_iplist,
+				int *return_count)
+{
+	int name_type = *pname_type;
+	const char *ptr = resolve_order;
+	fstring tok;
+
+	while (next_token(&ptr, tok, LIST_SEP, sizeof(tok))) {
+		if((strequal(tok, "host") || strequal(tok, "hosts"))) {
+			if (resolve_hosts(name, name_type, return_iplist, return_count)) {
+				return True;
+			}
+		} else if(strequal( tok, "kdc")) {
+			/* deal with KDC_NAME_TYPE names here.  This will result in a
+				SRV record lookup */
+			if (resolve_ads(name, KDC_NAME_TYPE, sitename, return_iplist, return_count)) {
+				/* Ensure we don't namecache this with the KDC port. */
+				*pname_type = KDC_NAME_TYPE;
+				return True;
+			}
+		} else if(strequal( tok, "ads")) {
+			/* deal with 0x1c names here.  This will result in a
+				SRV record lookup */
+			if (resolve_ads(name, name_type, sitename, return_iplist, return_count)) {
+				return True;
+			}
+		} else if(strequal( tok, "lmhosts")) {
+			if (resolve_lmhosts(name, name_type, return_iplist, return_count)) {
+				return True;
+			}
+		} else if(strequal( tok, "wins")) {
+			/* don't resolve 1D via WINS */
+			if (name_type != 0x1D && resolve_wins(name, name_type, return_iplist, return_count)) {
+				return True;
+			}
+		} else if(strequal( tok, "bcast")) {
+			if (name_resolve_bcast(name, name_type, return_iplist, return_count)) {
+				return True;
+			}
+		} else {
+			DEBUG(0,("resolve_name: unknown name switch type %s\n", tok));
+		}
+	}
+
+	return False;
+}
+
+/********************************************************
+ Parallel name resolution.
+
+ Going through the methods one by one means an unknown name
+ costs the WINS timeout (three tries of 2 seconds per server)
+ plus the broadcast timeout plus whatever DNS takes. Instead
+ all WINS and broadcast queries are sent together from one
+ socket as soon as the first method that is not a local file
+ is reached, so they are in flight while the (blocking) DNS
+ lookups run. The first answer wins and the rest of the
+ queries are dropped. For domain controller lists (#1c) the
+ answers of all methods are merged instead.
+*********************************************************/
+
+/* How often to look at the unexpected packet queue, as name_query() */
+#define NB_RACE_POLL_MS		90
+
+/* How long to wait for more DCs once the first one has answered */
+#define NB_RACE_MERGE_GRACE_MS	250
+
+#define RESOLVE_MAX_METHODS	16
+
+enum resolve_method {
+	RESOLVE_LMHOSTS,
+	RESOLVE_HOSTS,
+	RESOLVE_KDC,
+	RESOLVE_ADS,
+	RESOLVE_WINS,
+	RESOLVE_BCAST
+};
+
+struct nb_race_query {
+	BOOL active;
+	BOOL bcast;
+	struct packet_struct p;
+	struct timeval sent;
+	int retries;
+	int retry_time;
+
+	/* WINS only: the tag and how many of its servers we tried */
+	const char *tag;
+	int tries;
+};
+
+struct nb_race {
+	int fd;
+	const char *name;
+	int name_type;
+	struct in_addr src_ip;
+	char **wins_tags;
+	int num_queries;
+	struct nb_race_query *queries;
+
+	struct in_addr *wins_ips;
+	int num_wins_ips;
+	struct in_addr *bcast_ips;
+	int num_bcast_ips;
+};
+
+static BOOL nb_race_send(struct nb_race_query *q)
+{
+	if (!send_packet(&q->p)) {
+		return False;
+	}
+	GetTimeOfDay(&q->sent);
+	return True;
+}
+
+/********************************************************
+ Send the query of a WINS tag to the next server of the
+ tag that is not known to be dead.
+*********************************************************/
+
+static BOOL nb_race_wins_next(struct nb_race *race, struct nb_race_query *q)
+{
+	int srv_count = wins_srv_count_tag(q->tag);
+
+	while (q->tries < srv_count) {
+		struct in_addr wins_ip = wins_srv_ip_tag(q->tag, race->src_ip);
+
+		q->tries++;
+
+		if (global_in_nmbd && ismyip(wins_ip)) {
+			/* yikes! we'll loop forever */
+			continue;
+		}
+
+		/* skip any that have been unresponsive lately */
+		if (wins_srv_is_dead(wins_ip, race->src_ip)) {
+			continue;
+		}
+
+		DEBUG(3,("nb_race_wins_next: using WINS server %s and tag "
+			 "'%s'\n", inet_ntoa(wins_ip), q->tag));
+
+		name_query_packet(&q->p, race->fd, race->name,
+				  race->name_type, False, True, wins_ip);
+		q->retries = 2;
+		q->retry_time = 2000;
+
+		if (nb_race_send(q)) {
+			q->active = True;
+			return True;
+		}
+	}
+
+	q->active = False;
+	return False;
+}
+
+static BOOL nb_race_active(struct nb_race *race)
+{
+	int i;
+
+	for (i = 0; i < race->num_queries; i++) {
+		if (race->queries[i].active) {
+			return True;
+		}
+	}
+	return False;
+}
+
+static BOOL nb_race_answered(struct nb_race *race)
+{
+	return (race->num_wins_ips + race->num_bcast_ips) > 0;
+}
+
+static void nb_race_end(struct nb_race *race)
+{
+	if (race->fd != -1) {
+		close(race->fd);
+		race->fd = -1;
+	}
+	if (race->wins_tags) {
+		wins_srv_tags_free(race->wins_tags);
+		race->wins_tags = NULL;
+	}
+	SAFE_FREE(race->queries);
+	SAFE_FREE(race->wins_ips);
+	SAFE_FREE(race->bcast_ips);
+}
+
+/********************************************************
+ Send the WINS and broadcast queries for a name.
+*********************************************************/
+
+static BOOL nb_race_start(struct nb_race *race, const char *name,
+			  int name_type, BOOL wins, BOOL bcast)
+{
+	int num_tags = 0;
+	int num_ifaces = 0;
+	int i;
+
+	ZERO_STRUCTP(race);
+	race->fd = -1;
+	race->name = name;
+	race->name_type = name_type;
+
+	if (lp_disable_netbios()) {
+		DEBUG(5,("nb_race_start(%s#%02x): netbios is disabled\n",
+			 name, name_type));
+		return False;
+	}
+
+	/* don't resolve 1D via WINS */
+	if (name_type == 0x1D || wins_srv_count() < 1) {
+		wins = False;
+	}
+
+	if (wins) {
+		race->wins_tags = wins_srv_tags();
+		for (num_tags = 0; race->wins_tags && race->wins_tags[num_tags];
+		     num_tags++) {
+			;
+		}
+	}
+
+	if (bcast) {
+		num_ifaces = iface_count();
+	}
+
+	if (num_tags + num_ifaces == 0) {
+		nb_race_end(race);
+		return False;
+	}
+
+	race->queries = SMB_CALLOC_ARRAY(struct nb_race_query,
+					 num_tags + num_ifaces);
+	if (race->queries == NULL) {
+		nb_race_end(race);
+		return False;
+	}
+
+	/* the address we will be sending from */
+	race->src_ip = *interpret_addr2(lp_socket_address());
+
+	race->fd = open_socket_in(SOCK_DGRAM, 0, 3, race->src_ip.s_addr,
+				  True);
+	if (race->fd == -1) {
+		nb_race_end(race);
+		return False;
+	}
+
+	if (num_ifaces) {
+		set_socket_options(race->fd, "SO_BROADCAST");
+	}
+
+	DEBUG(3,("nb_race_start: querying %s<0x%x> via %d WINS tag(s) and "
+		 "%d interface(s)\n", name, name_type, num_tags, num_ifaces));
+
+	for (i = 0; i < num_tags; i++) {
+		struct nb_race_query *q = &race->queries[race->num_queries++];
+
+		q->tag = race->wins_tags[i];
+		nb_race_wins_next(race, q);
+	}
+
+	for (i = num_ifaces-1; i >= 0; i--) {
+		struct nb_race_query *q = &race->queries[race->num_queries++];
+
+		q->bcast = True;
+		name_query_packet(&q->p, race->fd, name, name_type,
+				  True, True, *iface_n_bcast(i));
+		q->retries = 2;
+		q->retry_time = 250;
+		q->active = nb_race_send(q);
+	}
+
+	if (!nb_race_active(race)) {
+		nb_race_end(race);
+		return False;
+	}
+
+	return True;
+}
+
+/********************************************************
+ Handle a name query response for one of our queries.
+*********************************************************/
+
+static void nb_race_packet(struct nb_race *race, struct packet_struct *p2)
+{
+	struct nmb_packet *nmb2 = &p2->packet.nmb;
+	struct nb_race_query *q = NULL;
+	int i;
+
+	if (!nmb2->header.response) {
+		return;
+	}
+
+	for (i = 0; i < race->num_queries; i++) {
+		if (race->queries[i].active &&
+		    race->queries[i].p.packet.nmb.header.name_trn_id ==
+		    nmb2->header.name_trn_id) {
+			q = &race->queries[i];
+			break;
+		}
+	}
+
+	if (q == NULL) {
+		return;
+	}
+
+	debug_nmb_packet(p2);
+
+	if (!q->bcast && nmb2->header.opcode == 0 && nmb2->header.rcode) {
+		/*
+		 * A negative response from a WINS server: the name
+		 * isn't in this group of WINS servers.
+		 */
+		DEBUG(3,("nb_race_packet: negative name query response, "
+			 "rcode 0x%02x from %s\n", nmb2->header.rcode,
+			 inet_ntoa(p2->ip)));
+		q->active = False;
+		return;
+	}
+
+	if (nmb2->header.opcode != 0 ||
+	    nmb2->header.nm_flags.bcast ||
+	    nmb2->header.rcode ||
+	    !nmb2->header.ancount) {
+		/* Could be a redirect, discard it like name_query() */
+		return;
+	}
+
+	if (q->bcast) {
+		name_query_add_answers(p2, &race->bcast_ips,
+				       &race->num_bcast_ips);
+		/* keep listening for other hosts, but don't ask again */
+		q->retries = 0;
+	} else {
+		name_query_add_answers(p2, &race->wins_ips,
+				       &race->num_wins_ips);
+		q->active = False;
+	}
+}
+
+/********************************************************
+ Process replies, retransmissions and timeouts for up to
+ timeout_ms milliseconds (forever if negative), until no
+ query is outstanding or, if stop_on_answer is set, until
+ the first positive answer.
+*********************************************************/
+
+static void nb_race_poll(struct nb_race *race, int timeout_ms,
+			 BOOL stop_on_answer)
+{
+	struct timeval start, now;
+	struct packet_struct *p2;
+	int i;
+
+	GetTimeOfDay(&start);
+
+	while (1) {
+		int elapsed, wait;
+
+		GetTimeOfDay(&now);
+
+		for (i = 0; i < race->num_queries; i++) {
+			struct nb_race_query *q = &race->queries[i];
+
+			if (!q->active ||
+			    TvalDiff(&q->sent, &now) <= q->retry_time) {
+				continue;
+			}
+
+			if (q->retries > 0) {
+				q->retries--;
+				if (nb_race_send(q)) {
+					continue;
+				}
+			}
+
+			if (q->bcast) {
+				q->active = False;
+			} else {
+				/* Timed out wating for WINS server to respond.  Mark it dead. */
+				wins_srv_died(q->p.ip, race->src_ip);
+				nb_race_wins_next(race, q);
+			}
+		}
+
+		/* replies nmbd picked up for us */
+		for (i = 0; i < race->num_queries; i++) {
+			struct nb_race_query *q = &race->queries[i];
+
+			if (!q->active) {
+				continue;
+			}
+			p2 = receive_unexpected(NMB_PACKET,
+						q->p.packet.nmb.header.name_trn_id,
+						NULL);
+			if (p2) {
+				nb_race_packet(race, p2);
+				free_packet(p2);
+			}
+		}
+
+		if (stop_on_answer && nb_race_answered(race)) {
+			return;
+		}
+
+		if (!nb_race_active(race)) {
+			return;
+		}
+
+		elapsed = TvalDiff(&start, &now);
+		wait = NB_RACE_POLL_MS;
+		if (timeout_ms >= 0) {
+			if (elapsed >= timeout_ms) {
+				return;
+			}
+			wait = MIN(wait, timeout_ms - elapsed);
+		}
+
+		p2 = receive_packet(race->fd, NMB_PACKET, wait);
+		while (p2) {
+			nb_race_packet(race, p2);
+			free_packet(p2);
+			p2 = receive_packet(race->fd, NMB_PACKET, 0);
+		}
+	}
+}
+
+static BOOL resolve_name_parallel(const char *name, int *pname_type,
+				  const char *sitename,
+				  const char *resolve_order,
+				  struct ip_service **return_iplist,
+				  int *return_count)
+{
+	int name_type = *pname_type;
+	BOOL merge = (name_type == 0x1c);
+	enum resolve_method methods[RESOLVE_MAX_METHODS];
+	struct ip_service *lists[RESOLVE_MAX_METHODS];
+	int counts[RESOLVE_MAX_METHODS];
+	int num_methods = 0;
+	BOOL use_wins = False, use_bcast = False;
+	BOOL racing = False, found = False;
+	BOOL used_wins = False, used_bcast = False;
+	struct nb_race race;
+	const char *ptr = resolve_order;
+	fstring tok;
+	int i, total;
+
+	while (next_token(&ptr, tok, LIST_SEP, sizeof(tok))) {
+		enum resolve_method m;
+
+		if (strequal(tok, "host") || strequal(tok, "hosts")) {
+			m = RESOLVE_HOSTS;
+		} else if (strequal(tok, "kdc")) {
+			m = RESOLVE_KDC;
+		} else if (strequal(tok, "ads")) {
+			m = RESOLVE_ADS;
+		} else if (strequal(tok, "lmhosts")) {
+			m = RESOLVE_LMHOSTS;
+		} else if (strequal(tok, "wins")) {
+			m = RESOLVE_WINS;
+			use_wins = True;
+		} else if (strequal(tok, "bcast")) {
+			m = RESOLVE_BCAST;
+			use_bcast = True;
+		} else {
+			DEBUG(0,("resolve_name: unknown name switch type %s\n", tok));
+			continue;
+		}
+
+		if (num_methods == RESOLVE_MAX_METHODS) {
+			break;
+		}
+		lists[num_methods] = NULL;
+		counts[num_methods] = 0;
+		methods[num_methods++] = m;
+	}
+
+	/* The local and DNS methods, in order */
+
+	for (i = 0; i < num_methods && !(found && !merge); i++) {
+		BOOL ok = False;
+
+		if (methods[i] == RESOLVE_WINS || methods[i] == RESOLVE_BCAST) {
+			continue;
+		}
+
+		if (methods[i] != RESOLVE_LMHOSTS) {
+			/* About to block, get the NetBIOS queries going first */
+			if (!racing && (use_wins || use_bcast)) {
+				racing = nb_race_start(&race, name, name_type,
+						       use_wins, use_bcast);
+			}
+			if (racing && !merge) {
+				nb_race_poll(&race, 0, True);
+				if (nb_race_answered(&race)) {
+					break;
+				}
+			}
+		}
+
+		switch (methods[i]) {
+		case RESOLVE_LMHOSTS:
+			ok = resolve_lmhosts(name, name_type, &lists[i],
+					     &counts[i]);
+			break;
+		case RESOLVE_HOSTS:
+			ok = resolve_hosts(name, name_type, &lists[i],
+					   &counts[i]);
+			break;
+		case RESOLVE_KDC:
+			ok = resolve_ads(name, KDC_NAME_TYPE, sitename,
+					 &lists[i], &counts[i]);
+			break;
+		case RESOLVE_ADS:
+			ok = resolve_ads(name, name_type, sitename,
+					 &lists[i], &counts[i]);
+			break;
+		default:
+			break;
+		}
+
+		if (!ok) {
+			SAFE_FREE(lists[i]);
+			counts[i] = 0;
+		}
+		found |= (counts[i] > 0);
+	}
+
+	/* Then wait for the NetBIOS answers if we still need them */
+
+	if ((use_wins || use_bcast) && (merge || !found)) {
+		if (!racing) {
+			racing = nb_race_start(&race, name, name_type,
+					       use_wins, use_bcast);
+		}
+		if (racing) {
+			if (!found) {
+				nb_race_poll(&race, -1, True);
+			}
+			if (merge && (found || nb_race_answered(&race))) {
+				nb_race_poll(&race, NB_RACE_MERGE_GRACE_MS,
+					     False);
+			}
+		}
+	}
+
+	if (racing) {
+		/* pick up anything that is already waiting */
+		nb_race_poll(&race, 0, False);
+
+		for (i = 0; i < num_methods; i++) {
+			if (methods[i] == RESOLVE_WINS && !used_wins) {
+				used_wins = True;
+				sort_ip_list(race.wins_ips, race.num_wins_ips);
+				if (convert_ip2service(&lists[i], race.wins_ips,
+						       race.num_wins_ips)) {
+					counts[i] = race.num_wins_ips;
+				}
+			} else if (methods[i] == RESOLVE_BCAST && !used_bcast) {
+				used_bcast = True;
+				sort_ip_list(race.bcast_ips, race.num_bcast_ips);
+				if (convert_ip2service(&lists[i], race.bcast_ips,
+						       race.num_bcast_ips)) {
+					counts[i] = race.num_bcast_ips;
+				}
+			}
+		}
+
+		nb_race_end(&race);
+	}
+
+	/* Collect the answer(s) in "name resolve order" */
+
+	total = 0;
+	for (i = 0; i < num_methods; i++) {
+		if (counts[i] == 0 || (total > 0 && !merge)) {
+			SAFE_FREE(lists[i]);
+			continue;
+		}
+
+		if (methods[i] == RESOLVE_KDC) {
+			/* Ensure we don't namecache this with the KDC port. */
+			*pname_type = KDC_NAME_TYPE;
+		}
+
+		if (total == 0) {
+			*return_iplist = lists[i];
+		} else {
+			*return_iplist = SMB_REALLOC_ARRAY(*return_iplist,
+							   struct ip_service,
+							   total + counts[i]);
+			if (*return_iplist == NULL) {
+				SAFE_FREE(lists[i]);
+				total = 0;
+				continue;
+			}
+			memcpy(&(*return_iplist)[total], lists[i],
+			       counts[i] * sizeof(struct ip_service));
+			SAFE_FREE(lists[i]);
+		}
+		total += counts[i];
+	}
+
+	*return_count = total;
+	return total > 0;
+}
+
 /*******************************************************************
  Internal interface to resolve a name into an IP address.
  Use this function if the string is either an IP address, DNS
@@ -1151,11 +1800,11 @@ BOOL internal_resolve_name(const char *name, int name_type,
 			   int *return_count, const char *resolve_order)
 {
 	pstring name_resolve_list;
-	fstring tok;
 	const char *ptr;
 	BOOL allones = (strcmp(name,"255.255.255.255") == 0);
 	BOOL allzeros = (strcmp(name,"0.0.0.0") == 0);
 	BOOL is_address = is_ipaddress(name);
+	BOOL default_order;
 	BOOL result = False;
 	int i;
 
@@ -1188,17 +1837,27 @@ BOOL internal_resolve_name(const char *name, int name_type,
 		*return_count = 1;
 		return True;
 	}
+
+	/*
+	 * Negative results are only cached for, and believed by, lookups
+	 * with the full "name resolve order". A lookup restricted to
+	 * e.g. "ads" failing says nothing about the other methods.
+	 */
+	default_order = (resolve_order == NULL ||
+			 strcmp(resolve_order, lp_name_resolve_order()) == 0);
   
 	/* Check name cache */
 
 	if (namecache_fetch(name, name_type, return_iplist, return_count)) {
 		/* This could be a negative response */
-		return (*return_count > 0);
+		if (*return_count > 0 || default_order) {
+			return (*return_count > 0);
+		}
 	}
 
 	/* set the name resolution order */
 
-	if ( strcmp( resolve_order, "NULL") == 0 ) {
+	if ( resolve_order && strcmp( resolve_order, "NULL") == 0 ) {
 		DEBUG(8,("internal_resolve_name: all lookups disabled\n"));
 		return False;
 	}
@@ -1216,58 +1875,28 @@ BOOL internal_resolve_name(const char *name, int name_type,
 	}
 
 	/* iterate through the name resolution backends */
-  
-	while (next_token(&ptr, tok, LIST_SEP, sizeof(tok))) {
-		if((strequal(tok, "host") || strequal(tok, "hosts"))) {
-			if (resolve_hosts(name, name_type, return_iplist, return_count)) {
-				result = True;
-				goto done;
-			}
-		} else if(strequal( tok, "kdc")) {
-			/* deal with KDC_NAME_TYPE names here.  This will result in a
-				SRV record lookup */
-			if (resolve_ads(name, KDC_NAME_TYPE, sitename, return_iplist, return_count)) {
-				result = True;
-				/* Ensure we don't namecache this with the KDC port. */
-				name_type = KDC_NAME_TYPE;
-				goto done;
-			}
-		} else if(strequal( tok, "ads")) {
-			/* deal with 0x1c names here.  This will result in a
-				SRV record lookup */
-			if (resolve_ads(name, name_type, sitename, return_iplist, return_count)) {
-				result = True;
-				goto done;
-			}
-		} else if(strequal( tok, "lmhosts")) {
-			if (resolve_lmhosts(name, name_type, return_iplist, return_count)) {
-				result = True;
-				goto done;
-			}
-		} else if(strequal( tok, "wins")) {
-			/* don't resolve 1D via WINS */
-			if (name_type != 0x1D && resolve_wins(name, name_type, return_iplist, return_count)) {
-				result = True;
-				goto done;
-			}
-		} else if(strequal( tok, "bcast")) {
-			if (name_resolve_bcast(name, name_type, return_iplist, return_count)) {
-				result = True;
-				goto done;
-			}
-		} else {
-			DEBUG(0,("resolve_name: unknown name switch type %s\n", tok));
-		}
+
+	if (lp_parm_bool(-1, "name resolve", "parallel", True)) {
+		result = resolve_name_parallel(name, &name_type, sitename,
+					       ptr, return_iplist,
+					       return_count);
+	} else {
+		result = resolve_name_serial(name, &name_type, sitename,
+					     ptr, return_iplist, return_count);
 	}
 
-	/* All of the resolve_* functions above have returned false. */
+	if (!result) {
+		/* All of the resolve_* functions above have returned false. */
 
-	SAFE_FREE(*return_iplist);
-	*return_count = 0;
+		SAFE_FREE(*return_iplist);
+		*return_count = 0;
 
-	return False;
+		if (default_order) {
+			namecache_store_negative(name, name_type);
+		}
 
-  done:
+		return False;
+	}
 
 	/* Remove duplicate entries.  Some queries, notably #1c (domain
 	controllers) return the PDC in iplist[0] and then all domain
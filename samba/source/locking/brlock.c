@@ -264,13 +264,14 @@ void brl_init(int read_only)
 	if (tdb) {
 		return;
 	}
-	tdb = tdb_open_log(lock_path("brlock.tdb"),
+	tdb = tdb_open_log(volatile_path("brlock.tdb"),
 			lp_open_files_db_hash_size(),
-			TDB_DEFAULT|(read_only?0x0:TDB_CLEAR_IF_FIRST),
+			TDB_DEFAULT|TDB_SIZE_CLASSES|
+			(read_only?0x0:(TDB_CLEAR_IF_FIRST|TDB_VOLATILE)),
 			read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644 );
 	if (!tdb) {
 		DEBUG(0,("Failed to open byte range locking database %s\n",
-			lock_path("brlock.tdb")));
+			volatile_path("brlock.tdb")));
 		return;
 	}
 
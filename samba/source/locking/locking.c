@@ -390,9 +390,10 @@ BOOL locking_init(int read_only)
 	if (tdb)
 		return True;
 
-	tdb = tdb_open_log(lock_path("locking.tdb"), 
+	tdb = tdb_open_log(volatile_path("locking.tdb"), 
 			lp_open_files_db_hash_size(),
-			TDB_DEFAULT|(read_only?0x0:TDB_CLEAR_IF_FIRST), 
+			TDB_DEFAULT|TDB_SIZE_CLASSES|
+			(read_only?0x0:(TDB_CLEAR_IF_FIRST|TDB_VOLATILE)), 
 			read_only?O_RDONLY:O_RDWR|O_CREAT,
 			0644);
 
@@ -1420,5 +1421,5 @@ int share_mode_forall(void (*fn)(const struct share_mode_entry *, const char *,
 	state.fn = fn;
 	state.private_data = private_data;
 
-	return tdb_traverse(tdb, traverse_fn, (void *)&state);
+	return tdb_traverse_snapshot(tdb, traverse_fn, (void *)&state);
 }
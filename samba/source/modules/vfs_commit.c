@@ -27,23 +27,65 @@
  * can produce better throughput than suddenly dumping massive amounts of
  * writes onto a disk.
  *
+ * Where sync_file_range() is available we remember which ranges of the
+ * file have been written and start write-out of them in the background as
+ * they accumulate. By the time we have to wait for the data to be durable
+ * most of it is already on its way to disk, so the client's write that
+ * crosses the threshold doesn't stall for the length of a whole-file sync.
+ *
+ * We only wait for durability on an explicit flush or close, when more
+ * than dthresh bytes are outstanding, or when the oldest outstanding data
+ * is older than the configured lag.
+ *
  * Tunables:
  *
  *  commit: dthresh         Amount of dirty data that can accumulate
  *			                before we commit (sync) it.
  *
+ *  commit: writeout        Amount of newly written data after which
+ *                          we start background write-out (default 1M,
+ *                          never more than dthresh).
+ *
+ *  commit: lag             Seconds written data may stay uncommitted
+ *                          (default 0, no limit).
+ *
  *  commit: debug           Debug level at which to emit messages.
  *
  */
 
 #define MODULE "commit"
 
+/* Dirty ranges tracked per file before we start coalescing them. */
+#define COMMIT_MAX_RANGES 8
+
 static int module_debug;
 
+struct commit_range
+{
+	SMB_OFF_T start;
+	SMB_OFF_T end;
+};
+
 struct commit_info
 {
         SMB_OFF_T dbytes;	/* Dirty (uncommitted) bytes */
         SMB_OFF_T dthresh;	/* Dirty data threshold */
+	SMB_OFF_T wbytes;	/* Written bytes not yet sent to write-out */
+	SMB_OFF_T wthresh;	/* Write-out threshold */
+	time_t dirty_since;	/* When dbytes last became non-zero */
+	int nranges;
+	struct commit_range ranges[COMMIT_MAX_RANGES];
+};
+
+/* Per share statistics, reported at disconnect. */
+struct commit_stats
+{
+	int lag;
+	unsigned int num_commits;
+	SMB_BIG_UINT commit_usec;
+	SMB_BIG_UINT max_commit_usec;
+	unsigned int num_writeouts;
+	SMB_BIG_UINT writeout_bytes;
 };
 
 static void flush_fd_data(int fd)
@@ -62,6 +104,142 @@ static void flush_fd_data(int fd)
 #endif
 }
 
+/* Remember that [start, end) has been written. When we run out of slots
+ * the new range is merged into its nearest neighbour; writing out a
+ * little too much is harmless.
+ */
+static void add_dirty_range(
+        struct commit_info *    c,
+        SMB_OFF_T               start,
+        SMB_OFF_T               end)
+{
+	int i, j, best;
+
+	for (i = 0; i < c->nranges; i++) {
+		if (end < c->ranges[i].start || start > c->ranges[i].end) {
+			continue;
+		}
+
+		/* Overlaps or abuts, grow it and fold in any others
+		 * it now reaches.
+		 */
+		c->ranges[i].start = MIN(c->ranges[i].start, start);
+		c->ranges[i].end = MAX(c->ranges[i].end, end);
+
+		for (j = 0; j < c->nranges; j++) {
+			if (j == i ||
+			    c->ranges[j].end < c->ranges[i].start ||
+			    c->ranges[j].start > c->ranges[i].end) {
+				continue;
+			}
+			c->ranges[i].start = MIN(c->ranges[i].start, c->ranges[j].start);
+			c->ranges[i].end = MAX(c->ranges[i].end, c->ranges[j].end);
+			c->ranges[j] = c->ranges[--c->nranges];
+			if (i == c->nranges) {
+				i = j;
+			}
+			j = -1;
+		}
+		return;
+	}
+
+	if (c->nranges == COMMIT_MAX_RANGES) {
+		SMB_OFF_T gap, best_gap = -1;
+
+		/* Merge the new range into its nearest neighbour. */
+		best = 0;
+		for (i = 0; i < c->nranges; i++) {
+			gap = (start > c->ranges[i].end) ?
+				start - c->ranges[i].end :
+				c->ranges[i].start - end;
+			if (best_gap == -1 || gap < best_gap) {
+				best_gap = gap;
+				best = i;
+			}
+		}
+		c->ranges[best].start = MIN(c->ranges[best].start, start);
+		c->ranges[best].end = MAX(c->ranges[best].end, end);
+		return;
+	}
+
+	c->ranges[c->nranges].start = start;
+	c->ranges[c->nranges].end = end;
+	c->nranges++;
+}
+
+/* Start write-out of everything written since last time, without
+ * waiting for it.
+ */
+static void start_writeout(
+        struct vfs_handle_struct *	handle,
+        files_struct *		        fsp,
+        struct commit_info *            c)
+{
+#if defined(HAVE_SYNC_FILE_RANGE)
+	struct commit_stats *stats;
+	int i;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, stats, struct commit_stats, return);
+
+	for (i = 0; i < c->nranges; i++) {
+		if (sync_file_range(fsp->fh->fd, c->ranges[i].start,
+				c->ranges[i].end - c->ranges[i].start,
+				SYNC_FILE_RANGE_WRITE) == -1) {
+			DEBUG(module_debug,
+				("%s: sync_file_range on %s failed: %s\n",
+				 MODULE, fsp->fsp_name, strerror(errno)));
+		}
+		stats->writeout_bytes +=
+			c->ranges[i].end - c->ranges[i].start;
+	}
+
+	stats->num_writeouts++;
+#endif
+	c->nranges = 0;
+	c->wbytes = 0;
+}
+
+/* Wait until all data written so far is on disk. */
+static void commit_now(
+        struct vfs_handle_struct *	handle,
+        files_struct *		        fsp,
+        struct commit_info *            c)
+{
+	struct commit_stats *stats;
+	struct timeval start, end;
+	SMB_BIG_UINT usec;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, stats, struct commit_stats, return);
+
+	DEBUG(module_debug,
+		("%s: flushing %lu dirty bytes\n",
+		 MODULE, (unsigned long)c->dbytes));
+
+	GetTimeOfDay(&start);
+
+	/* Anything not yet on its way to disk goes now, then we wait
+	 * for the lot.
+	 */
+	if (c->nranges) {
+		start_writeout(handle, fsp, c);
+	}
+	flush_fd_data(fsp->fh->fd);
+
+	GetTimeOfDay(&end);
+	usec = usec_time_diff(&end, &start);
+
+	stats->num_commits++;
+	stats->commit_usec += usec;
+	if (usec > stats->max_commit_usec) {
+		stats->max_commit_usec = usec;
+	}
+
+	c->dbytes = 0;
+	c->wbytes = 0;
+	c->nranges = 0;
+	c->dirty_since = 0;
+}
+
 static void commit_all(
         struct vfs_handle_struct *	handle,
         files_struct *		        fsp)
@@ -70,12 +248,7 @@ static void commit_all(
 
         if ((c = VFS_FETCH_FSP_EXTENSION(handle, fsp))) {
                 if (c->dbytes) {
-                        DEBUG(module_debug,
-                                ("%s: flushing %lu dirty bytes\n",
-                                 MODULE, (unsigned long)c->dbytes));
-
-			flush_fd_data(fsp->fh->fd);
-                        c->dbytes = 0;
+			commit_now(handle, fsp, c);
                 }
         }
 }
@@ -83,33 +256,83 @@ static void commit_all(
 static void commit(
         struct vfs_handle_struct *	handle,
         files_struct *		        fsp,
+        SMB_OFF_T                       offset,
         ssize_t			        last_write)
 {
         struct commit_info *c;
+	struct commit_stats *stats;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, stats, struct commit_stats, return);
 
         if ((c = VFS_FETCH_FSP_EXTENSION(handle, fsp))) {
 
                 if (last_write > 0) {
+			if (c->dbytes == 0) {
+				c->dirty_since = time(NULL);
+			}
                         c->dbytes += last_write;
+			c->wbytes += last_write;
+			add_dirty_range(c, offset, offset + last_write);
                 }
 
-                if (c->dbytes > c->dthresh) {
-                        DEBUG(module_debug,
-                                ("%s: flushing %lu dirty bytes\n",
-                                 MODULE, (unsigned long)c->dbytes));
-
-			flush_fd_data(fsp->fh->fd);
-                        c->dbytes = 0;
-                }
+                if ((c->dthresh && c->dbytes > c->dthresh) ||
+		    (stats->lag && c->dbytes &&
+		     time(NULL) - c->dirty_since >= stats->lag)) {
+			commit_now(handle, fsp, c);
+                } else if (c->wbytes >= c->wthresh) {
+			start_writeout(handle, fsp, c);
+		}
         }
 }
 
+static void commit_disconnect(
+        struct vfs_handle_struct *  handle)
+{
+	struct commit_stats *stats;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, stats, struct commit_stats,
+				SMB_VFS_NEXT_DISCONNECT(handle); return);
+
+	if (stats->num_commits) {
+		DEBUG(module_debug,
+			("%s: %s: %u commits, avg %lu usec, max %lu usec, "
+			 "%u write-outs of %llu bytes\n",
+			 MODULE, lp_servicename(SNUM(handle->conn)),
+			 stats->num_commits,
+			 (unsigned long)(stats->commit_usec / stats->num_commits),
+			 (unsigned long)stats->max_commit_usec,
+			 stats->num_writeouts,
+			 (unsigned long long)stats->writeout_bytes));
+	}
+
+	SMB_VFS_NEXT_DISCONNECT(handle);
+}
+
+static void free_commit_stats(void **pptr)
+{
+	SAFE_FREE(*pptr);
+}
+
 static int commit_connect(
         struct vfs_handle_struct *  handle,
         const char *                service,
         const char *                user)
 {
+	struct commit_stats *stats;
+
         module_debug = lp_parm_int(SNUM(handle->conn), MODULE, "debug", 100);
+
+	stats = SMB_MALLOC_P(struct commit_stats);
+	if (!stats) {
+		DEBUG(0,("commit_connect: out of memory\n"));
+		return -1;
+	}
+	ZERO_STRUCTP(stats);
+	stats->lag = lp_parm_int(SNUM(handle->conn), MODULE, "lag", 0);
+
+	SMB_VFS_HANDLE_SET_DATA(handle, stats, free_commit_stats,
+				struct commit_stats, return -1);
+
         return SMB_VFS_NEXT_CONNECT(handle, service, user);
 }
 
@@ -120,7 +343,11 @@ static int commit_open(
 	int		    flags,
 	mode_t		    mode)
 {
+	struct commit_stats *stats;
         SMB_OFF_T dthresh;
+	SMB_OFF_T wthresh;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, stats, struct commit_stats, return -1);
 
         /* Don't bother with read-only files. */
         if ((flags & O_ACCMODE) == O_RDONLY) {
@@ -129,13 +356,22 @@ static int commit_open(
 
         dthresh = conv_str_size(lp_parm_const_string(SNUM(handle->conn),
                                         MODULE, "dthresh", NULL));
+        wthresh = conv_str_size(lp_parm_const_string(SNUM(handle->conn),
+                                        MODULE, "writeout", NULL));
+	if (wthresh == 0) {
+		wthresh = 0x100000;
+	}
+	if (dthresh > 0 && wthresh > dthresh) {
+		wthresh = dthresh;
+	}
 
-        if (dthresh > 0) {
+        if (dthresh > 0 || stats->lag > 0) {
                 struct commit_info * c;
                 c = VFS_ADD_FSP_EXTENSION(handle, fsp, struct commit_info);
                 if (c) {
+			ZERO_STRUCTP(c);
                         c->dthresh = dthresh;
-                        c->dbytes = 0;
+			c->wthresh = wthresh;
                 }
         }
 
@@ -150,9 +386,10 @@ static ssize_t commit_write(
         size_t              count)
 {
         ssize_t ret;
+	SMB_OFF_T offset = fsp->fh->pos;
 
         ret = SMB_VFS_NEXT_WRITE(handle, fsp, fd, data, count);
-        commit(handle, fsp, ret);
+        commit(handle, fsp, offset, ret);
 
         return ret;
 }
@@ -168,12 +405,34 @@ static ssize_t commit_pwrite(
         ssize_t ret;
 
         ret = SMB_VFS_NEXT_PWRITE(handle, fsp, fd, data, count, offset);
-        commit(handle, fsp, ret);
+        commit(handle, fsp, offset, ret);
 
         return ret;
 }
 
-static ssize_t commit_close(
+static int commit_fsync(
+        vfs_handle_struct * handle,
+        files_struct *      fsp,
+        int                 fd)
+{
+        struct commit_info *c;
+	int ret;
+
+	/* An explicit flush does the whole job itself, all we have to
+	 * do is forget what we were tracking.
+	 */
+	ret = SMB_VFS_NEXT_FSYNC(handle, fsp, fd);
+	if (ret == 0 && (c = VFS_FETCH_FSP_EXTENSION(handle, fsp))) {
+		c->dbytes = 0;
+		c->wbytes = 0;
+		c->nranges = 0;
+		c->dirty_since = 0;
+	}
+
+	return ret;
+}
+
+static int commit_close(
         vfs_handle_struct * handle,
         files_struct *      fsp,
         int                 fd)
@@ -192,8 +451,12 @@ static vfs_op_tuple commit_ops [] =
                 SMB_VFS_OP_WRITE, SMB_VFS_LAYER_TRANSPARENT},
         {SMB_VFS_OP(commit_pwrite),
                 SMB_VFS_OP_PWRITE, SMB_VFS_LAYER_TRANSPARENT},
+        {SMB_VFS_OP(commit_fsync),
+                SMB_VFS_OP_FSYNC, SMB_VFS_LAYER_TRANSPARENT},
         {SMB_VFS_OP(commit_connect),
                 SMB_VFS_OP_CONNECT,  SMB_VFS_LAYER_TRANSPARENT},
+        {SMB_VFS_OP(commit_disconnect),
+                SMB_VFS_OP_DISCONNECT,  SMB_VFS_LAYER_TRANSPARENT},
 
         {SMB_VFS_OP(NULL), SMB_VFS_OP_NOOP, SMB_VFS_LAYER_NOOP}
 };
@@ -203,4 +466,3 @@ NTSTATUS vfs_commit_init(void)
 {
 	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION, MODULE, commit_ops);
 }
-
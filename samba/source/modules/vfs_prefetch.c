@@ -0,0 +1,459 @@
+/*
+ * Adaptive read prefetch VFS module.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "includes.h"
+
+/* Prefetch module.
+ *
+ * The readahead module fires on fixed offset boundaries with a fixed
+ * length and the cacheprime module only primes the start of a file. This
+ * module instead watches the reads made on each open file (pread,
+ * sendfile and aio_read alike) and works out whether the client is
+ * streaming through it, either sequentially or with a fixed stride.
+ *
+ * Once a pattern has held for a few reads we ask the kernel to start
+ * reading ahead of the client. The window starts small and doubles each
+ * time the client catches up with it, up to a maximum. When the pattern
+ * breaks the window is halved and we wait for the pattern to establish
+ * itself again.
+ *
+ * For large files read sequentially we can also tell the kernel to drop
+ * the pages the client has finished with, so streaming a multi-GB file
+ * doesn't push everything else out of the page cache.
+ *
+ * Tunables:
+ *
+ *  prefetch: min window        Initial prefetch window (default 128K).
+ *
+ *  prefetch: max window        Largest prefetch window (default 8M).
+ *
+ *  prefetch: trigger           Number of reads that must fit the pattern
+ *                              before we start prefetching (default 2).
+ *
+ *  prefetch: drop behind       Whether to drop pages behind a sequential
+ *                              reader (default no).
+ *
+ *  prefetch: drop behind size  Only drop behind on files at least this
+ *                              big (default 64M).
+ *
+ *  prefetch: debug             Debug level at which to emit messages.
+ */
+
+#define MODULE "prefetch"
+
+static int module_debug;
+
+struct prefetch_config
+{
+	size_t min_window;
+	size_t max_window;
+	unsigned int trigger;
+	BOOL drop_behind;
+	SMB_OFF_T drop_behind_size;
+};
+
+struct prefetch_stream
+{
+	SMB_OFF_T last_offset;		/* Start of the previous read */
+	size_t last_count;		/* Length of the previous read */
+	SMB_OFF_T stride;		/* Distance between the last two reads */
+	unsigned int hits;		/* Consecutive reads fitting the pattern */
+	size_t window;			/* Current prefetch window */
+	SMB_OFF_T prefetched_to;	/* End of the range already advised */
+	SMB_OFF_T dropped_to;		/* Everything below here was dropped */
+	SMB_OFF_T file_size;		/* Size at open time */
+
+	/* Statistics, reported at close. */
+	unsigned int num_prefetches;
+	SMB_BIG_UINT prefetched_bytes;
+	SMB_BIG_UINT dropped_bytes;
+};
+
+/*******************************************************************
+ Ask the kernel to start reading a range in the background.
+*******************************************************************/
+
+static void prefetch_range(int fd, SMB_OFF_T offset, size_t len)
+{
+#if defined(HAVE_LINUX_READAHEAD)
+	int err = readahead(fd, offset, len);
+	DEBUG(module_debug,("%s: readahead on fd %u, offset %llu, len %u "
+			    "returned %d\n", MODULE, (unsigned int)fd,
+			    (unsigned long long)offset, (unsigned int)len,
+			    err ));
+#elif defined(HAVE_POSIX_FADVISE)
+	int err = posix_fadvise(fd, offset, (off_t)len, POSIX_FADV_WILLNEED);
+	DEBUG(module_debug,("%s: posix_fadvise on fd %u, offset %llu, len %u "
+			    "returned %d\n", MODULE, (unsigned int)fd,
+			    (unsigned long long)offset, (unsigned int)len,
+			    err ));
+#else
+	static BOOL didmsg;
+	if (!didmsg) {
+		DEBUG(0,("%s: no readahead on this platform\n", MODULE));
+		didmsg = True;
+	}
+#endif
+}
+
+/*******************************************************************
+ Tell the kernel we won't need a range again.
+*******************************************************************/
+
+static BOOL drop_range(int fd, SMB_OFF_T offset, SMB_OFF_T len)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	int err = posix_fadvise(fd, offset, (off_t)len, POSIX_FADV_DONTNEED);
+	DEBUG(module_debug,("%s: dropping fd %u, offset %llu, len %llu "
+			    "returned %d\n", MODULE, (unsigned int)fd,
+			    (unsigned long long)offset,
+			    (unsigned long long)len, err ));
+	return (err == 0);
+#else
+	return False;
+#endif
+}
+
+/*******************************************************************
+ Account for a read and issue any prefetch or drop behind it calls
+ for. This is the heart of the module.
+*******************************************************************/
+
+static void prefetch_read(struct vfs_handle_struct *handle,
+			  files_struct *fsp,
+			  int fd,
+			  SMB_OFF_T offset,
+			  size_t count)
+{
+	struct prefetch_config *config;
+	struct prefetch_stream *s;
+	SMB_OFF_T end = offset + count;
+	SMB_OFF_T delta;
+	BOOL hit;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct prefetch_config,
+				return);
+
+	if (count == 0 || (s = VFS_FETCH_FSP_EXTENSION(handle, fsp)) == NULL) {
+		return;
+	}
+
+	delta = offset - s->last_offset;
+
+	if (offset == s->last_offset + (SMB_OFF_T)s->last_count) {
+		/* Sequential. */
+		hit = True;
+		s->stride = (SMB_OFF_T)count;
+	} else if (s->stride > 0 && delta == s->stride) {
+		/* Same stride as last time. */
+		hit = True;
+	} else if (offset > s->last_offset && end <= s->prefetched_to) {
+		/*
+		 * Clients with several reads in flight (Vista AIO,
+		 * multiple readX) can deliver them slightly out of
+		 * order. Anything landing inside the window we
+		 * already prefetched still counts.
+		 */
+		hit = True;
+	} else {
+		hit = False;
+	}
+
+	if (hit) {
+		s->hits++;
+	} else {
+		if (s->hits) {
+			DEBUG(module_debug,("%s: %s: pattern broken at "
+					    "offset %llu after %u reads\n",
+					    MODULE, fsp->fsp_name,
+					    (unsigned long long)offset,
+					    s->hits ));
+		}
+		s->hits = 0;
+		s->stride = delta > 0 ? delta : 0;
+		s->window = MAX(s->window / 2, config->min_window);
+		s->prefetched_to = 0;
+	}
+
+	s->last_offset = offset;
+	s->last_count = count;
+
+	if (s->hits < config->trigger) {
+		return;
+	}
+
+	/*
+	 * Issue the next window once the client has used up half of
+	 * what we already asked for, so the kernel stays ahead of it.
+	 */
+
+	if (s->prefetched_to < end + (SMB_OFF_T)(s->window / 2)) {
+		SMB_OFF_T start = MAX(s->prefetched_to, end);
+
+		if (s->stride > (SMB_OFF_T)count) {
+			/*
+			 * Strided reader. Prefetch the records it is
+			 * going to ask for rather than the gaps.
+			 */
+			SMB_OFF_T next = offset + s->stride;
+			size_t done = 0;
+
+			while (done < s->window && next < offset + s->stride * 16) {
+				if (next + (SMB_OFF_T)count > s->prefetched_to) {
+					prefetch_range(fd, next, count);
+					s->prefetched_bytes += count;
+				}
+				done += count;
+				next += s->stride;
+			}
+			s->prefetched_to = next - s->stride + count;
+		} else {
+			SMB_OFF_T stop = end + s->window;
+
+			if (s->file_size && stop > s->file_size) {
+				stop = s->file_size;
+			}
+			if (stop > start) {
+				prefetch_range(fd, start, (size_t)(stop - start));
+				s->prefetched_bytes += stop - start;
+			}
+			s->prefetched_to = MAX(stop, start);
+		}
+
+		s->num_prefetches++;
+
+		/* The client caught up with us: open the window up. */
+		s->window = MIN(s->window * 2, config->max_window);
+	}
+
+	/*
+	 * Drop behind a sequential reader on big files. We keep a
+	 * window's worth behind the client in case it backs up a little.
+	 */
+
+	if (config->drop_behind && s->stride == (SMB_OFF_T)count &&
+	    s->file_size >= config->drop_behind_size) {
+		SMB_OFF_T drop_to = offset - (SMB_OFF_T)config->max_window;
+
+		if (drop_to - s->dropped_to >= (SMB_OFF_T)config->max_window) {
+			if (drop_range(fd, s->dropped_to, drop_to - s->dropped_to)) {
+				s->dropped_bytes += drop_to - s->dropped_to;
+			}
+			s->dropped_to = drop_to;
+		}
+	}
+}
+
+/*******************************************************************
+ sendfile wrapper.
+*******************************************************************/
+
+static ssize_t prefetch_sendfile(struct vfs_handle_struct *handle,
+				 int tofd,
+				 files_struct *fsp,
+				 int fromfd,
+				 const DATA_BLOB *header,
+				 SMB_OFF_T offset,
+				 size_t count)
+{
+	prefetch_read(handle, fsp, fromfd, offset, count);
+	return SMB_VFS_NEXT_SENDFILE(handle,
+				     tofd,
+				     fsp,
+				     fromfd,
+				     header,
+				     offset,
+				     count);
+}
+
+/*******************************************************************
+ pread wrapper.
+*******************************************************************/
+
+static ssize_t prefetch_pread(vfs_handle_struct *handle,
+			      files_struct *fsp,
+			      int fd,
+			      void *data,
+			      size_t count,
+			      SMB_OFF_T offset)
+{
+	prefetch_read(handle, fsp, fd, offset, count);
+	return SMB_VFS_NEXT_PREAD(handle, fsp, fd, data, count, offset);
+}
+
+#if defined(WITH_AIO)
+/*******************************************************************
+ aio_read wrapper.
+*******************************************************************/
+
+static int prefetch_aio_read(struct vfs_handle_struct *handle,
+			     struct files_struct *fsp,
+			     SMB_STRUCT_AIOCB *aiocb)
+{
+	prefetch_read(handle, fsp, aiocb->aio_fildes, aiocb->aio_offset,
+		      aiocb->aio_nbytes);
+	return SMB_VFS_NEXT_AIO_READ(handle, fsp, aiocb);
+}
+#endif
+
+/*******************************************************************
+ Set up the per file stream state.
+*******************************************************************/
+
+static int prefetch_open(vfs_handle_struct *handle,
+			 const char *fname,
+			 files_struct *fsp,
+			 int flags,
+			 mode_t mode)
+{
+	struct prefetch_config *config;
+	struct prefetch_stream *s;
+	SMB_STRUCT_STAT sbuf;
+	int fd;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config, struct prefetch_config,
+				return -1);
+
+	fd = SMB_VFS_NEXT_OPEN(handle, fname, fsp, flags, mode);
+
+	/* Don't bother with write-only files. */
+	if (fd == -1 || (flags & O_ACCMODE) == O_WRONLY) {
+		return fd;
+	}
+
+	s = VFS_ADD_FSP_EXTENSION(handle, fsp, struct prefetch_stream);
+	if (s == NULL) {
+		return fd;
+	}
+
+	ZERO_STRUCTP(s);
+	s->window = config->min_window;
+
+	if (SMB_VFS_NEXT_FSTAT(handle, fsp, fd, &sbuf) == 0) {
+		s->file_size = sbuf.st_size;
+	}
+
+	return fd;
+}
+
+/*******************************************************************
+ Report what we did for this file.
+*******************************************************************/
+
+static int prefetch_close(vfs_handle_struct *handle,
+			  files_struct *fsp,
+			  int fd)
+{
+	struct prefetch_stream *s;
+
+	if ((s = VFS_FETCH_FSP_EXTENSION(handle, fsp)) && s->num_prefetches) {
+		DEBUG(module_debug,("%s: %s: %u prefetches, %llu bytes "
+				    "prefetched, %llu bytes dropped\n",
+				    MODULE, fsp->fsp_name, s->num_prefetches,
+				    (unsigned long long)s->prefetched_bytes,
+				    (unsigned long long)s->dropped_bytes ));
+	}
+
+	return SMB_VFS_NEXT_CLOSE(handle, fsp, fd);
+}
+
+/*******************************************************************
+ Directly called from main smbd when freeing handle.
+*******************************************************************/
+
+static void free_prefetch_data(void **pptr)
+{
+	SAFE_FREE(*pptr);
+}
+
+/*******************************************************************
+ Read the tunables once per connection.
+*******************************************************************/
+
+static int prefetch_connect(struct vfs_handle_struct *handle,
+			    const char *service,
+			    const char *user)
+{
+	struct prefetch_config *config = SMB_MALLOC_P(struct prefetch_config);
+	int snum = SNUM(handle->conn);
+
+	if (!config) {
+		DEBUG(0,("prefetch_connect: out of memory\n"));
+		return -1;
+	}
+	ZERO_STRUCTP(config);
+
+	module_debug = lp_parm_int(snum, MODULE, "debug", 100);
+
+	config->min_window = conv_str_size(lp_parm_const_string(snum,
+						MODULE, "min window", NULL));
+	if (config->min_window == 0) {
+		config->min_window = 0x20000;
+	}
+	config->max_window = conv_str_size(lp_parm_const_string(snum,
+						MODULE, "max window", NULL));
+	if (config->max_window == 0) {
+		config->max_window = 0x800000;
+	}
+	if (config->max_window < config->min_window) {
+		config->max_window = config->min_window;
+	}
+
+	config->trigger = lp_parm_int(snum, MODULE, "trigger", 2);
+
+	config->drop_behind = lp_parm_bool(snum, MODULE, "drop behind", False);
+	config->drop_behind_size = conv_str_size(lp_parm_const_string(snum,
+						MODULE, "drop behind size", NULL));
+	if (config->drop_behind_size == 0) {
+		config->drop_behind_size = 0x4000000;
+	}
+
+	SMB_VFS_HANDLE_SET_DATA(handle, config, free_prefetch_data,
+				struct prefetch_config, return -1);
+
+	return SMB_VFS_NEXT_CONNECT(handle, service, user);
+}
+
+/*******************************************************************
+ Functions we're replacing.
+ We don't replace read as it isn't used from smbd to read file
+ data.
+*******************************************************************/
+
+static vfs_op_tuple prefetch_ops [] =
+{
+	{SMB_VFS_OP(prefetch_open), SMB_VFS_OP_OPEN, SMB_VFS_LAYER_TRANSPARENT},
+	{SMB_VFS_OP(prefetch_close), SMB_VFS_OP_CLOSE, SMB_VFS_LAYER_TRANSPARENT},
+	{SMB_VFS_OP(prefetch_sendfile), SMB_VFS_OP_SENDFILE, SMB_VFS_LAYER_TRANSPARENT},
+	{SMB_VFS_OP(prefetch_pread), SMB_VFS_OP_PREAD, SMB_VFS_LAYER_TRANSPARENT},
+#if defined(WITH_AIO)
+	{SMB_VFS_OP(prefetch_aio_read), SMB_VFS_OP_AIO_READ, SMB_VFS_LAYER_TRANSPARENT},
+#endif
+	{SMB_VFS_OP(prefetch_connect), SMB_VFS_OP_CONNECT, SMB_VFS_LAYER_TRANSPARENT},
+	{SMB_VFS_OP(NULL), SMB_VFS_OP_NOOP, SMB_VFS_LAYER_NOOP}
+};
+
+/*******************************************************************
+ Module initialization boilerplate.
+*******************************************************************/
+
+NTSTATUS vfs_prefetch_init(void);
+NTSTATUS vfs_prefetch_init(void)
+{
+	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION, MODULE, prefetch_ops);
+}
@@ -983,6 +983,9 @@ static NTSTATUS idmap_new_mapping(TALLOC_CTX *ctx, struct id_map *map)
 		return NT_STATUS_NONE_MAPPED;
 	}
 
+	/* SIDs that did not map before do now */
+	idmap_generation_bump();
+
 	return NT_STATUS_OK;
 }
 
@@ -1455,6 +1458,8 @@ NTSTATUS idmap_set_mapping(const struct id_map *id)
 	ret = idmap_cache_set(idmap_cache, id);
 	IDMAP_CHECK_RET(ret);
 
+	idmap_generation_bump();
+
 done:
 	talloc_free(ctx);
 	return ret;
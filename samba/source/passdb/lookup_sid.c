@@ -1157,6 +1157,51 @@ void store_gid_sid_cache(const DOM_SID *psid, gid_t gid)
 	n_gid_sid_cache++;
 }
 
+/*****************************************************************
+ Generation number of the id mappings and group memberships.
+
+ Caches that hold the result of converting SIDs to unix ids (the
+ token cache in auth_util.c) include this in their keys. Anything that
+ changes a mapping or a membership bumps it, which makes all of those
+ entries unreachable at once. It lives in gencache so that it is
+ shared between smbd, winbindd and the admin tools.
+*****************************************************************/
+
+#define IDMAP_GENERATION_KEY "IDMAP/GENERATION"
+
+uint32 idmap_generation(void)
+{
+	char *value = NULL;
+	uint32 gen = 0;
+
+	if (gencache_get(IDMAP_GENERATION_KEY, &value, NULL)) {
+		gen = (uint32)strtoul(value, NULL, 10);
+		SAFE_FREE(value);
+	}
+	return gen;
+}
+
+void idmap_generation_bump(void)
+{
+	fstring value;
+	uint32 gen;
+
+	if (gencache_lock_entry(IDMAP_GENERATION_KEY) != 0) {
+		return;
+	}
+
+	gen = idmap_generation() + 1;
+	fstr_sprintf(value, "%u", (unsigned int)gen);
+
+	/* Outlives anything keyed on it */
+	gencache_set(IDMAP_GENERATION_KEY, value,
+		     time(NULL) + 365 * 24 * 60 * 60);
+
+	gencache_unlock_entry(IDMAP_GENERATION_KEY);
+
+	DEBUG(10, ("idmap_generation_bump: now %u\n", (unsigned int)gen));
+}
+
 /*****************************************************************
  *THE LEGACY* convert uid_t to SID function.
 *****************************************************************/  
@@ -682,19 +682,34 @@ NTSTATUS pdb_delete_dom_group(TALLOC_CTX *mem_ctx, uint32 rid)
 NTSTATUS pdb_add_group_mapping_entry(GROUP_MAP *map)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return pdb->add_group_mapping_entry(pdb, map);
+	NTSTATUS status = pdb->add_group_mapping_entry(pdb, map);
+
+	if (NT_STATUS_IS_OK(status)) {
+		idmap_generation_bump();
+	}
+	return status;
 }
 
 NTSTATUS pdb_update_group_mapping_entry(GROUP_MAP *map)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return pdb->update_group_mapping_entry(pdb, map);
+	NTSTATUS status = pdb->update_group_mapping_entry(pdb, map);
+
+	if (NT_STATUS_IS_OK(status)) {
+		idmap_generation_bump();
+	}
+	return status;
 }
 
 NTSTATUS pdb_delete_group_mapping_entry(DOM_SID sid)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return pdb->delete_group_mapping_entry(pdb, sid);
+	NTSTATUS status = pdb->delete_group_mapping_entry(pdb, sid);
+
+	if (NT_STATUS_IS_OK(status)) {
+		idmap_generation_bump();
+	}
+	return status;
 }
 
 BOOL pdb_enum_group_mapping(const DOM_SID *sid, enum lsa_SidType sid_name_use, GROUP_MAP **pp_rmap,
@@ -936,8 +951,12 @@ NTSTATUS pdb_create_alias(const char *name, uint32 *rid)
 BOOL pdb_delete_alias(const DOM_SID *sid)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return NT_STATUS_IS_OK(pdb->delete_alias(pdb, sid));
-							    
+
+	if (!NT_STATUS_IS_OK(pdb->delete_alias(pdb, sid))) {
+		return False;
+	}
+	idmap_generation_bump();
+	return True;
 }
 
 BOOL pdb_get_aliasinfo(const DOM_SID *sid, struct acct_info *info)
@@ -955,13 +974,23 @@ BOOL pdb_set_aliasinfo(const DOM_SID *sid, struct acct_info *info)
 NTSTATUS pdb_add_aliasmem(const DOM_SID *alias, const DOM_SID *member)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return pdb->add_aliasmem(pdb, alias, member);
+	NTSTATUS status = pdb->add_aliasmem(pdb, alias, member);
+
+	if (NT_STATUS_IS_OK(status)) {
+		idmap_generation_bump();
+	}
+	return status;
 }
 
 NTSTATUS pdb_del_aliasmem(const DOM_SID *alias, const DOM_SID *member)
 {
 	struct pdb_methods *pdb = pdb_get_methods();
-	return pdb->del_aliasmem(pdb, alias, member);
+	NTSTATUS status = pdb->del_aliasmem(pdb, alias, member);
+
+	if (NT_STATUS_IS_OK(status)) {
+		idmap_generation_bump();
+	}
+	return status;
 }
 
 NTSTATUS pdb_enum_aliasmem(const DOM_SID *alias,
@@ -1580,6 +1580,515 @@ cups_map_printer_name(http_t *http, 		/* I - HTTP connection */
 	return NULL;
 }
 
+/*
+ * Subscriptions are renewed by every full queue listing, which happens at
+ * least once every MAX_CACHE_VALID_TIME. Give them some slack past that.
+ */
+
+#define CUPS_SUBSCRIPTION_LEASE (2 * MAX_CACHE_VALID_TIME)
+
+/*
+ * 'cups_job_get()' - Get the attributes of a single job, in the form
+ *                    cups_queue_get() would have returned them.
+ */
+
+static BOOL cups_job_get(http_t *http, cups_lang_t *language,
+			 const char *uri, int job_id,
+			 print_queue_struct *q)
+{
+	ipp_t		*request = NULL,	/* IPP Request */
+			*response = NULL;	/* IPP Response */
+	ipp_attribute_t	*attr = NULL;		/* Current attribute */
+	ipp_jstate_t	job_status;		/* job-status attribute */
+	BOOL		ret = False;
+	static const char *jattrs[] =	/* Requested job attributes */
+			{
+			  "job-k-octets",
+			  "job-name",
+			  "job-originating-user-name",
+			  "job-priority",
+			  "job-state",
+			  "time-at-creation",
+			};
+
+	request = ippNew();
+
+	request->request.op.operation_id = IPP_GET_JOB_ATTRIBUTES;
+	request->request.op.request_id   = 1;
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET,
+                     "attributes-charset", NULL, cupsLangEncoding(language));
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE,
+                     "attributes-natural-language", NULL, language->language);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                     "printer-uri", NULL, uri);
+
+	ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+	              "job-id", job_id);
+
+        ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+	              "requested-attributes",
+		      (sizeof(jattrs) / sizeof(jattrs[0])),
+		      NULL, jattrs);
+
+	if ((response = cupsDoRequest(http, request, "/")) == NULL) {
+		DEBUG(3,("Unable to get job %d on %s - %s\n", job_id, uri,
+			 ippErrorString(cupsLastError())));
+		goto out;
+	}
+
+	if (response->request.status.status_code >= IPP_OK_CONFLICT) {
+		DEBUG(3,("Unable to get job %d on %s - %s\n", job_id, uri,
+			 ippErrorString(response->request.status.status_code)));
+		goto out;
+	}
+
+	memset(q, 0, sizeof(print_queue_struct));
+
+	q->job      = job_id;
+	q->priority = 50;
+	job_status  = IPP_JOB_PENDING;
+
+	if ((attr = ippFindAttribute(response, "job-k-octets",
+				     IPP_TAG_INTEGER)) != NULL)
+		q->size = attr->values[0].integer * 1024;
+
+	if ((attr = ippFindAttribute(response, "job-priority",
+				     IPP_TAG_INTEGER)) != NULL)
+		q->priority = attr->values[0].integer;
+
+	if ((attr = ippFindAttribute(response, "job-state",
+				     IPP_TAG_ENUM)) != NULL)
+		job_status = (ipp_jstate_t)(attr->values[0].integer);
+
+	if ((attr = ippFindAttribute(response, "time-at-creation",
+				     IPP_TAG_INTEGER)) != NULL)
+		q->time = attr->values[0].integer;
+
+	if ((attr = ippFindAttribute(response, "job-name",
+				     IPP_TAG_NAME)) == NULL)
+		goto out;
+	strncpy(q->fs_file, attr->values[0].string.text, sizeof(q->fs_file) - 1);
+
+	if ((attr = ippFindAttribute(response, "job-originating-user-name",
+				     IPP_TAG_NAME)) == NULL)
+		goto out;
+	strncpy(q->fs_user, attr->values[0].string.text, sizeof(q->fs_user) - 1);
+
+	q->status = job_status == IPP_JOB_PENDING ? LPQ_QUEUED :
+		    job_status == IPP_JOB_STOPPED ? LPQ_PAUSED :
+		    job_status == IPP_JOB_HELD ? LPQ_PAUSED :
+		    LPQ_PRINTING;
+
+	ret = True;
+
+ out:
+	if (response)
+		ippDelete(response);
+
+	return ret;
+}
+
+/*
+ * 'cups_queue_subscribe()' - Create a pull ("ippget") subscription to the
+ *                            job events of a queue, cancelling the one
+ *                            the cookie refers to.
+ */
+
+static int cups_queue_subscribe(const char *sharename,
+				char *lpq_command,
+				struct print_queue_cookie *cookie)
+{
+	fstring		printername;
+	const char	*mapped_printer = NULL;
+	http_t		*http = NULL;		/* HTTP connection to server */
+	ipp_t		*request = NULL,	/* IPP Request */
+			*response = NULL;	/* IPP Response */
+	ipp_attribute_t	*attr = NULL;		/* Current attribute */
+	cups_lang_t	*language = NULL;	/* Default language */
+	char		uri[HTTP_MAX_URI]; /* printer-uri attribute */
+	int		ret = 1;
+	static const char *events[] =	/* Subscribed events */
+			{
+			  "job-created",
+			  "job-completed",
+			  "job-state-changed",
+			  "job-config-changed",
+			  "printer-state-changed"
+			};
+
+	/* See cups_queue_get() for why the lpq command is the printer name. */
+	fstrcpy( printername, lpq_command );
+
+	DEBUG(5,("cups_queue_subscribe(%s, %u)\n", printername,
+		 (unsigned int)cookie->id));
+
+        cupsSetPasswordCB(cups_passwd_cb);
+
+	if ((http = cups_connect()) == NULL) {
+		goto out;
+	}
+
+	mapped_printer = cups_map_printer_name(http, printername);
+	if (!mapped_printer) {
+	    goto out;
+	}
+
+	slprintf(uri, sizeof(uri) - 1, "ipp://localhost/printers/%s", mapped_printer);
+
+	language = cupsLangDefault();
+
+       /*
+        * Drop the old subscription. If this fails its lease runs out
+	* on its own.
+	*/
+
+	if (cookie->id != 0) {
+		request = ippNew();
+
+		request->request.op.operation_id = IPP_CANCEL_SUBSCRIPTION;
+		request->request.op.request_id   = 1;
+
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET,
+			     "attributes-charset", NULL, cupsLangEncoding(language));
+
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE,
+			     "attributes-natural-language", NULL, language->language);
+
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+			     "printer-uri", NULL, uri);
+
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+			     "requesting-user-name", NULL, cupsUser());
+
+		ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+			      "notify-subscription-id", cookie->id);
+
+		if ((response = cupsDoRequest(http, request, "/")) != NULL) {
+			ippDelete(response);
+			response = NULL;
+		}
+
+		cookie->id = 0;
+		cookie->seq = 0;
+	}
+
+       /*
+	* Build an IPP_CREATE_PRINTER_SUBSCRIPTION request, which requires
+	* the following attributes:
+	*
+	*    attributes-charset
+	*    attributes-natural-language
+	*    printer-uri
+	*    notify-pull-method
+	*    notify-events
+	*/
+
+	request = ippNew();
+
+	request->request.op.operation_id = IPP_CREATE_PRINTER_SUBSCRIPTION;
+	request->request.op.request_id   = 1;
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET,
+                     "attributes-charset", NULL, cupsLangEncoding(language));
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE,
+                     "attributes-natural-language", NULL, language->language);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                     "printer-uri", NULL, uri);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		     "requesting-user-name", NULL, cupsUser());
+
+	ippAddString(request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+		     "notify-pull-method", NULL, "ippget");
+
+	ippAddStrings(request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+		      "notify-events",
+		      (sizeof(events) / sizeof(events[0])),
+		      NULL, events);
+
+	ippAddInteger(request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
+		      "notify-lease-duration", CUPS_SUBSCRIPTION_LEASE);
+
+	if ((response = cupsDoRequest(http, request, "/")) == NULL) {
+		DEBUG(0,("Unable to subscribe to %s - %s\n", uri,
+			 ippErrorString(cupsLastError())));
+		goto out;
+	}
+
+	if (response->request.status.status_code >= IPP_OK_CONFLICT) {
+		DEBUG(0,("Unable to subscribe to %s - %s\n", uri,
+			 ippErrorString(response->request.status.status_code)));
+		goto out;
+	}
+
+	if ((attr = ippFindAttribute(response, "notify-subscription-id",
+				     IPP_TAG_INTEGER)) == NULL) {
+		DEBUG(0,("No subscription id returned for %s\n", uri));
+		goto out;
+	}
+
+	cookie->id = attr->values[0].integer;
+	cookie->seq = 0;
+	ret = 0;
+
+ out:
+	if (response)
+		ippDelete(response);
+
+	if (language)
+		cupsLangFree(language);
+
+	if (http)
+		httpClose(http);
+
+	return ret;
+}
+
+/*
+ * 'cups_queue_get_changes()' - Get the job events of a queue since the
+ *                              last call.
+ */
+
+static int cups_queue_get_changes(const char *sharename,
+				  char *lpq_command,
+				  struct print_queue_cookie *cookie,
+				  struct print_queue_event **events,
+				  print_status_struct *status)
+{
+	fstring		printername;
+	const char	*mapped_printer = NULL;
+	http_t		*http = NULL;		/* HTTP connection to server */
+	ipp_t		*request = NULL,	/* IPP Request */
+			*response = NULL;	/* IPP Response */
+	ipp_attribute_t	*attr = NULL;		/* Current attribute */
+	cups_lang_t	*language = NULL;	/* Default language */
+	char		uri[HTTP_MAX_URI]; /* printer-uri attribute */
+	int		nevents = 0,		/* Number of events */
+			nalloc = 0;		/* Number of events allocated */
+	struct print_queue_event *list = NULL,	/* Events */
+			*ev;			/* Current event */
+	uint32		seq = cookie->seq;	/* Last sequence number seen */
+	int		ret = -1;
+
+	*events = NULL;
+
+	/* See cups_queue_get() for why the lpq command is the printer name. */
+	fstrcpy( printername, lpq_command );
+
+	DEBUG(5,("cups_queue_get_changes(%s, %u, %u)\n", printername,
+		 (unsigned int)cookie->id, (unsigned int)cookie->seq));
+
+        cupsSetPasswordCB(cups_passwd_cb);
+
+	if ((http = cups_connect()) == NULL) {
+		goto out;
+	}
+
+	mapped_printer = cups_map_printer_name(http, printername);
+	if (!mapped_printer) {
+	    goto out;
+	}
+
+	slprintf(uri, sizeof(uri) - 1, "ipp://localhost/printers/%s", mapped_printer);
+
+       /*
+	* Build an IPP_GET_NOTIFICATIONS request, which requires the
+	* following attributes:
+	*
+	*    attributes-charset
+	*    attributes-natural-language
+	*    notify-subscription-ids
+	*    notify-sequence-numbers
+	*/
+
+	request = ippNew();
+
+	request->request.op.operation_id = IPP_GET_NOTIFICATIONS;
+	request->request.op.request_id   = 1;
+
+	language = cupsLangDefault();
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET,
+                     "attributes-charset", NULL, cupsLangEncoding(language));
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE,
+                     "attributes-natural-language", NULL, language->language);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                     "printer-uri", NULL, uri);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		     "requesting-user-name", NULL, cupsUser());
+
+	ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+		      "notify-subscription-ids", cookie->id);
+
+	ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+		      "notify-sequence-numbers", cookie->seq + 1);
+
+	ippAddBoolean(request, IPP_TAG_OPERATION, "notify-wait", 0);
+
+	if ((response = cupsDoRequest(http, request, "/")) == NULL) {
+		DEBUG(0,("Unable to get notifications for %s - %s\n", uri,
+			 ippErrorString(cupsLastError())));
+		goto out;
+	}
+
+	if (response->request.status.status_code >= IPP_OK_CONFLICT) {
+		DEBUG(3,("Unable to get notifications for %s - %s\n", uri,
+			 ippErrorString(response->request.status.status_code)));
+		goto out;
+	}
+
+       /*
+        * Process the events...
+	*/
+
+	attr = response->attrs;
+
+	while (attr != NULL) {
+		const char	*event = NULL;	/* notify-subscribed-event */
+		const char	*job_name = NULL; /* job-name attribute */
+		int		job_id = 0;	/* notify-job-id attribute */
+		int		job_state = 0;	/* job-state attribute */
+		int		printer_state = 0; /* printer-state attribute */
+		uint32		event_seq = 0;	/* notify-sequence-number */
+
+	       /*
+		* Skip leading attributes until we hit an event...
+		*/
+
+		while (attr != NULL && attr->group_tag != IPP_TAG_EVENT_NOTIFICATION)
+        		attr = attr->next;
+
+		if (attr == NULL)
+			break;
+
+		while (attr != NULL &&
+		       attr->group_tag == IPP_TAG_EVENT_NOTIFICATION &&
+		       attr->name != NULL) {
+			if (strcmp(attr->name, "notify-sequence-number") == 0 &&
+			    attr->value_tag == IPP_TAG_INTEGER)
+				event_seq = attr->values[0].integer;
+
+			if (strcmp(attr->name, "notify-subscribed-event") == 0 &&
+			    attr->value_tag == IPP_TAG_KEYWORD)
+				event = attr->values[0].string.text;
+
+			if (strcmp(attr->name, "notify-job-id") == 0 &&
+			    attr->value_tag == IPP_TAG_INTEGER)
+				job_id = attr->values[0].integer;
+
+			if (strcmp(attr->name, "job-state") == 0 &&
+			    attr->value_tag == IPP_TAG_ENUM)
+				job_state = attr->values[0].integer;
+
+			if (strcmp(attr->name, "job-name") == 0 &&
+			    attr->value_tag == IPP_TAG_NAME)
+				job_name = attr->values[0].string.text;
+
+			if (strcmp(attr->name, "printer-state") == 0 &&
+			    attr->value_tag == IPP_TAG_ENUM)
+				printer_state = attr->values[0].integer;
+
+			if (strcmp(attr->name, "printer-state-message") == 0 &&
+			    attr->value_tag == IPP_TAG_TEXT)
+				fstrcpy(status->message, attr->values[0].string.text);
+
+        		attr = attr->next;
+		}
+
+		/* Step over the separator between two events. */
+		if (attr != NULL && attr->name == NULL)
+			attr = attr->next;
+
+		if (event_seq <= seq) {
+			/* Already seen this one. */
+			continue;
+		}
+
+		if (event_seq != seq + 1) {
+			/* CUPS has already discarded some events. */
+			DEBUG(3,("cups_queue_get_changes: missed events %u-%u on %s\n",
+				 (unsigned int)(seq + 1),
+				 (unsigned int)(event_seq - 1), uri));
+			goto out;
+		}
+
+		seq = event_seq;
+
+		if (printer_state != 0) {
+			if (printer_state == IPP_PRINTER_STOPPED)
+				status->status = LPSTAT_STOPPED;
+			else
+				status->status = LPSTAT_OK;
+		}
+
+		if (event == NULL || job_id == 0) {
+			continue;
+		}
+
+	       /*
+	        * Allocate memory as needed...
+		*/
+
+		if (nevents >= nalloc) {
+			nalloc += 16;
+
+			list = SMB_REALLOC_ARRAY(list, struct print_queue_event, nalloc);
+
+			if (list == NULL) {
+				DEBUG(0,("cups_queue_get_changes: Not enough memory!"));
+				nevents = 0;
+				goto out;
+			}
+		}
+
+		ev = list + nevents;
+		memset(ev, 0, sizeof(struct print_queue_event));
+
+		if (strcmp(event, "job-completed") == 0 ||
+		    job_state >= IPP_JOB_CANCELLED ||
+		    !cups_job_get(http, language, uri, job_id, &ev->job)) {
+			ev->type = PRINT_QUEUE_EVENT_JOB_REMOVED;
+			ev->job.job = job_id;
+			if (job_name != NULL)
+				strncpy(ev->job.fs_file, job_name,
+					sizeof(ev->job.fs_file) - 1);
+		} else if (strcmp(event, "job-created") == 0) {
+			ev->type = PRINT_QUEUE_EVENT_JOB_ADDED;
+		} else {
+			ev->type = PRINT_QUEUE_EVENT_JOB_CHANGED;
+		}
+
+		nevents++;
+	}
+
+	cookie->seq = seq;
+	*events = list;
+	list = NULL;
+	ret = nevents;
+
+ out:
+	SAFE_FREE(list);
+
+	if (response)
+		ippDelete(response);
+
+	if (language)
+		cupsLangFree(language);
+
+	if (http)
+		httpClose(http);
+
+	return ret;
+}
+
 /*******************************************************************
  * CUPS printing interface definitions...
  ******************************************************************/
@@ -1594,6 +2103,8 @@ struct printif	cups_printif =
 	cups_job_pause,
 	cups_job_resume,
 	cups_job_submit,
+	cups_queue_subscribe,
+	cups_queue_get_changes,
 };
 
 BOOL cups_pull_comment_location(NT_PRINTER_INFO_LEVEL_2 *printer)
@@ -1106,6 +1106,363 @@ done:
 	return result;
 }
 
+/****************************************************************************
+ Store the queue status after an update and mark the cache as fresh.
+****************************************************************************/
+
+static void store_queue_status(struct tdb_print_db *pdb, const char *sharename,
+			       print_status_struct *status, int qcount)
+{
+	print_status_struct old_status;
+	fstring keystr;
+	TDB_DATA data, key;
+
+	get_queue_status(sharename, &old_status);
+	if (old_status.qcount != qcount)
+		DEBUG(10,("store_queue_status: queue status change %d jobs -> %d jobs for printer %s\n",
+					old_status.qcount, qcount, sharename));
+
+	/* store the new queue status structure */
+	slprintf(keystr, sizeof(keystr)-1, "STATUS/%s", sharename);
+	key.dptr = keystr;
+	key.dsize = strlen(keystr);
+
+	status->qcount = qcount;
+	data.dptr = (char *)status;
+	data.dsize = sizeof(*status);
+	tdb_store(pdb->tdb, key, data, TDB_REPLACE);	
+
+	/*
+	 * Update the cache time again. We want to do this call
+	 * as little as possible...
+	 */
+
+	slprintf(keystr, sizeof(keystr)-1, "CACHE/%s", sharename);
+	tdb_store_int32(pdb->tdb, keystr, (int32)time(NULL));
+
+	/* clear the msg pending record for this queue */
+
+	snprintf(keystr, sizeof(keystr), "MSG_PENDING/%s", sharename);
+
+	if ( !tdb_store_uint32( pdb->tdb, keystr, 0 ) ) {
+		/* log a message but continue on */
+
+		DEBUG(0,("print_queue_update: failed to store MSG_PENDING flag for [%s]!\n",
+			sharename));
+	}
+}
+
+/****************************************************************************
+ Fetch the linearised queue written by store_queue_struct(), leaving room
+ for extra entries at the end of the array.
+****************************************************************************/
+
+static BOOL fetch_queue_struct(struct tdb_print_db *pdb, uint32 extra,
+			       print_queue_struct **ppqueue, uint32 *pqcount)
+{
+	TDB_DATA data;
+	print_queue_struct *queue = NULL;
+	uint32 qcount = 0;
+	size_t len = 0;
+	uint32 i;
+
+	*ppqueue = NULL;
+	*pqcount = 0;
+
+	data = tdb_fetch(pdb->tdb, string_tdb_data("INFO/linear_queue_array"));
+
+	if (data.dptr && data.dsize >= sizeof(qcount))
+		len += tdb_unpack(data.dptr + len, data.dsize - len, "d", &qcount);
+
+	if (qcount == 0 && extra == 0) {
+		SAFE_FREE(data.dptr);
+		return True;
+	}
+
+	if ((queue = SMB_MALLOC_ARRAY(print_queue_struct, qcount + extra)) == NULL) {
+		SAFE_FREE(data.dptr);
+		return False;
+	}
+
+	for( i  = 0; i < qcount; i++) {
+		uint32 qjob, qsize, qpage_count, qstatus, qpriority, qtime;
+		len += tdb_unpack(data.dptr + len, data.dsize - len, "ddddddff",
+				&qjob,
+				&qsize,
+				&qpage_count,
+				&qstatus,
+				&qpriority,
+				&qtime,
+				queue[i].fs_user,
+				queue[i].fs_file);
+		queue[i].job = qjob;
+		queue[i].size = qsize;
+		queue[i].page_count = qpage_count;
+		queue[i].status = qstatus;
+		queue[i].priority = qpriority;
+		queue[i].time = qtime;
+	}
+
+	SAFE_FREE(data.dptr);
+
+	*ppqueue = queue;
+	*pqcount = qcount;
+	return True;
+}
+
+/****************************************************************************
+ Fetch and store the backend subscription for incremental queue updates.
+****************************************************************************/
+
+static void fetch_queue_cookie(struct tdb_print_db *pdb, const char *sharename,
+			       struct print_queue_cookie *cookie)
+{
+	fstring keystr;
+	TDB_DATA data;
+
+	ZERO_STRUCTP(cookie);
+
+	slprintf(keystr, sizeof(keystr)-1, "CHANGES/%s", sharename);
+	data = tdb_fetch(pdb->tdb, string_tdb_data(keystr));
+	if (data.dptr) {
+		if (tdb_unpack(data.dptr, data.dsize, "dd",
+			       &cookie->id, &cookie->seq) == -1) {
+			ZERO_STRUCTP(cookie);
+		}
+		SAFE_FREE(data.dptr);
+	}
+}
+
+static void store_queue_cookie(struct tdb_print_db *pdb, const char *sharename,
+			       const struct print_queue_cookie *cookie)
+{
+	fstring keystr;
+	char buf[8];
+	TDB_DATA data;
+
+	slprintf(keystr, sizeof(keystr)-1, "CHANGES/%s", sharename);
+	data.dptr = buf;
+	data.dsize = tdb_pack(buf, sizeof(buf), "dd", cookie->id, cookie->seq);
+	tdb_store(pdb->tdb, string_tdb_data(keystr), data, TDB_REPLACE);
+}
+
+/****************************************************************************
+ (Re)create the backend subscription ahead of a full queue listing.
+****************************************************************************/
+
+static void print_queue_subscribe(struct tdb_print_db *pdb, const char *sharename,
+				  struct printif *current_printif,
+				  char *lpq_command)
+{
+	struct print_queue_cookie cookie;
+	fstring keystr;
+
+	if (current_printif->queue_subscribe == NULL)
+		return;
+
+	fetch_queue_cookie(pdb, sharename, &cookie);
+
+	if ((*(current_printif->queue_subscribe))(sharename, lpq_command,
+						  &cookie) != 0) {
+		DEBUG(3,("print_queue_subscribe: unable to subscribe to changes "
+			 "for %s\n", sharename));
+		ZERO_STRUCT(cookie);
+	}
+
+	store_queue_cookie(pdb, sharename, &cookie);
+
+	slprintf(keystr, sizeof(keystr)-1, "FULLSCAN/%s", sharename);
+	tdb_store_int32(pdb->tdb, keystr, (int32)time(NULL));
+}
+
+/****************************************************************************
+ Apply a single backend change event to the job records and to the
+ linearised queue.
+****************************************************************************/
+
+static BOOL print_queue_apply_event(struct tdb_print_db *pdb,
+				    const char *sharename,
+				    struct print_queue_event *event,
+				    TDB_DATA jcdata,
+				    print_queue_struct **ppqueue,
+				    uint32 *pqcount)
+{
+	print_queue_struct *q = &event->job;
+	print_queue_struct *queue = *ppqueue;
+	uint32 qcount = *pqcount;
+	struct printjob *pjob;
+	uint32 jobid;
+	uint32 i;
+	int32 njobs;
+
+	jobid = print_parse_jobid(q->fs_file);
+	if (jobid == (uint32)-1)
+		jobid = q->job + UNIX_JOB_START;
+
+	for (i = 0; i < qcount; i++) {
+		if (queue[i].job == jobid)
+			break;
+	}
+
+	pjob = print_job_find(sharename, jobid);
+
+	if (event->type == PRINT_QUEUE_EVENT_JOB_REMOVED) {
+		if (pjob && pjob->spooled) {
+			DEBUG(10,("print_queue_apply_event: job %u (system job %d) "
+				  "left the queue\n", (unsigned int)jobid, q->job));
+			pjob_delete(sharename, jobid);
+			tdb_change_int32_atomic(pdb->tdb, "INFO/total_jobs", &njobs, -1);
+		}
+		if (i < qcount) {
+			memmove(&queue[i], &queue[i+1],
+				(qcount - i - 1) * sizeof(print_queue_struct));
+			*pqcount = qcount - 1;
+		}
+		return True;
+	}
+
+	if (pjob == NULL || !pjob->smbjob) {
+		if (pjob == NULL)
+			tdb_change_int32_atomic(pdb->tdb, "INFO/total_jobs", &njobs, 1);
+		print_unix_job(sharename, q,
+			       jobid < UNIX_JOB_START ? jobid : (uint32)-1);
+	} else {
+		pjob->sysjob = q->job;
+
+		/* don't reset the status on jobs to be deleted */
+
+		if ( pjob->status != LPQ_DELETING )
+			pjob->status = q->status;
+
+		pjob_store(sharename, jobid, pjob);
+
+		check_job_changed(sharename, jcdata, jobid);
+	}
+
+	if ((pjob = print_job_find(sharename, jobid)) == NULL)
+		return True;
+
+	if (i == qcount) {
+		queue = SMB_REALLOC_ARRAY(queue, print_queue_struct, qcount + 1);
+		if (queue == NULL) {
+			DEBUG(0,("print_queue_apply_event: out of memory\n"));
+			return False;
+		}
+		ZERO_STRUCT(queue[i]);
+		*ppqueue = queue;
+		*pqcount = qcount + 1;
+	}
+
+	queue[i].job = jobid;
+	queue[i].size = pjob->size;
+	queue[i].page_count = pjob->page_count;
+	queue[i].status = pjob->status;
+	queue[i].priority = 1;
+	queue[i].time = pjob->starttime;
+	fstrcpy(queue[i].fs_user, pjob->user);
+	fstrcpy(queue[i].fs_file, pjob->jobname);
+
+	return True;
+}
+
+/****************************************************************************
+ Update the stored queue from the change events of a backend that supports
+ them. Returns False if a full listing of the queue is needed instead.
+****************************************************************************/
+
+static BOOL print_queue_update_incremental(struct tdb_print_db *pdb,
+					   const char *sharename,
+					   struct printif *current_printif,
+					   char *lpq_command)
+{
+	struct print_queue_cookie cookie;
+	struct print_queue_event *events = NULL;
+	print_status_struct status;
+	struct traverse_struct tstruct;
+	print_queue_struct *queue = NULL;
+	uint32 qcount = 0;
+	TDB_DATA jcdata;
+	fstring keystr;
+	time_t last_full_scan, time_now = time(NULL);
+	int i, nevents;
+	BOOL ret = False;
+
+	if (current_printif->queue_get_changes == NULL)
+		return False;
+
+	fetch_queue_cookie(pdb, sharename, &cookie);
+	if (cookie.id == 0)
+		return False;
+
+	/*
+	 * Still list the whole queue now and again. That cleans up jobs
+	 * left behind by smbds that died while spooling, and retries
+	 * deletions the backend refused.
+	 */
+
+	slprintf(keystr, sizeof(keystr)-1, "FULLSCAN/%s", sharename);
+	last_full_scan = (time_t)tdb_fetch_int32(pdb->tdb, keystr);
+	if (last_full_scan == (time_t)-1
+	    || (time_now - last_full_scan) >= MAX_CACHE_VALID_TIME
+	    || last_full_scan > time_now) {
+		return False;
+	}
+
+	get_queue_status(sharename, &status);
+
+	nevents = (*(current_printif->queue_get_changes))(sharename,
+		lpq_command, &cookie, &events, &status);
+
+	if (nevents == -1) {
+		DEBUG(5,("print_queue_update_incremental: backend lost track "
+			 "of %s, listing the whole queue\n", sharename));
+		SAFE_FREE(events);
+		return False;
+	}
+
+	DEBUG(5,("print_queue_update_incremental: %d change%s for %s\n",
+		 nevents, (nevents != 1) ? "s" : "", sharename));
+
+	if (!fetch_queue_struct(pdb, 0, &queue, &qcount))
+		goto out;
+
+	jcdata = get_jobs_changed_data(pdb);
+
+	for (i = 0; i < nevents; i++) {
+		if (!print_queue_apply_event(pdb, sharename, &events[i],
+					     jcdata, &queue, &qcount)) {
+			SAFE_FREE(jcdata.dptr);
+			goto out;
+		}
+	}
+
+	SAFE_FREE(jcdata.dptr);
+
+	if (nevents > 0) {
+		qsort(queue, qcount, sizeof(print_queue_struct),
+		      QSORT_CAST(printjob_comp));
+
+		ZERO_STRUCT(tstruct);
+		tstruct.queue = queue;
+		tstruct.qcount = qcount;
+		tstruct.snum = -1;
+		store_queue_struct(pdb, &tstruct);
+	}
+
+	/* Only consume the events once they have been applied. */
+	store_queue_cookie(pdb, sharename, &cookie);
+
+	store_queue_status(pdb, sharename, &status, qcount);
+
+	ret = True;
+
+  out:
+
+	SAFE_FREE(queue);
+	SAFE_FREE(events);
+	return ret;
+}
+
 /****************************************************************************
  main work for updating the lpq cahe for a printer queue
 ****************************************************************************/
@@ -1117,12 +1474,10 @@ static void print_queue_update_internal( const char *sharename,
 	int i, qcount;
 	print_queue_struct *queue = NULL;
 	print_status_struct status;
-	print_status_struct old_status;
 	struct printjob *pjob;
 	struct traverse_struct tstruct;
-	TDB_DATA data, key;
 	TDB_DATA jcdata;
-	fstring keystr, cachestr;
+	fstring cachestr;
 	struct tdb_print_db *pdb = get_print_db_byname(sharename);
 
 	if (!pdb) {
@@ -1141,6 +1496,24 @@ static void print_queue_update_internal( const char *sharename,
 	slprintf(cachestr, sizeof(cachestr)-1, "CACHE/%s", sharename);
 	tdb_store_int32(pdb->tdb, cachestr, (int)time(NULL));
 
+	/*
+	 * If the backend can report changes, apply them to the stored
+	 * queue and skip the full listing.
+	 */
+
+	if (print_queue_update_incremental(pdb, sharename, current_printif,
+					   lpq_command)) {
+		release_print_db( pdb );
+		return;
+	}
+
+	/*
+	 * Subscribe before listing the queue so that no change made
+	 * after the listing is missed by the next incremental update.
+	 */
+
+	print_queue_subscribe(pdb, sharename, current_printif, lpq_command);
+
         /* get the current queue using the appropriate interface */
 	ZERO_STRUCT(status);
 
@@ -1226,39 +1599,7 @@ static void print_queue_update_internal( const char *sharename,
 
 	tdb_store_int32(pdb->tdb, "INFO/total_jobs", tstruct.total_jobs);
 
-	get_queue_status(sharename, &old_status);
-	if (old_status.qcount != qcount)
-		DEBUG(10,("print_queue_update_internal: queue status change %d jobs -> %d jobs for printer %s\n",
-					old_status.qcount, qcount, sharename));
-
-	/* store the new queue status structure */
-	slprintf(keystr, sizeof(keystr)-1, "STATUS/%s", sharename);
-	key.dptr = keystr;
-	key.dsize = strlen(keystr);
-
-	status.qcount = qcount;
-	data.dptr = (char *)&status;
-	data.dsize = sizeof(status);
-	tdb_store(pdb->tdb, key, data, TDB_REPLACE);	
-
-	/*
-	 * Update the cache time again. We want to do this call
-	 * as little as possible...
-	 */
-
-	slprintf(keystr, sizeof(keystr)-1, "CACHE/%s", sharename);
-	tdb_store_int32(pdb->tdb, keystr, (int32)time(NULL));
-
-	/* clear the msg pending record for this queue */
-
-	snprintf(keystr, sizeof(keystr), "MSG_PENDING/%s", sharename);
-
-	if ( !tdb_store_uint32( pdb->tdb, keystr, 0 ) ) {
-		/* log a message but continue on */
-
-		DEBUG(0,("print_queue_update: failed to store MSG_PENDING flag for [%s]!\n",
-			sharename));
-	}
+	store_queue_status(pdb, sharename, &status, qcount);
 
 	release_print_db( pdb );
 
@@ -2552,12 +2893,11 @@ fail:
 
 static BOOL get_stored_queue_info(struct tdb_print_db *pdb, int snum, int *pcount, print_queue_struct **ppqueue)
 {
-	TDB_DATA data, cgdata;
+	TDB_DATA cgdata;
 	print_queue_struct *queue = NULL;
 	uint32 qcount = 0;
 	uint32 extra_count = 0;
 	int total_count = 0;
-	size_t len = 0;
 	uint32 i;
 	int max_reported_jobs = lp_max_reported_jobs(snum);
 	BOOL ret = False;
@@ -2570,49 +2910,21 @@ static BOOL get_stored_queue_info(struct tdb_print_db *pdb, int snum, int *pcoun
 	*pcount = 0;
 	*ppqueue = NULL;
 
-	ZERO_STRUCT(data);
 	ZERO_STRUCT(cgdata);
 
-	/* Get the stored queue data. */
-	data = tdb_fetch(pdb->tdb, string_tdb_data("INFO/linear_queue_array"));
-	
-	if (data.dptr && data.dsize >= sizeof(qcount))
-		len += tdb_unpack(data.dptr + len, data.dsize - len, "d", &qcount);
-		
 	/* Get the changed jobs list. */
 	cgdata = tdb_fetch(pdb->tdb, string_tdb_data("INFO/jobs_changed"));
 	if (cgdata.dptr != NULL && (cgdata.dsize % 4 == 0))
 		extra_count = cgdata.dsize/4;
 
-	DEBUG(5,("get_stored_queue_info: qcount = %u, extra_count = %u\n", (unsigned int)qcount, (unsigned int)extra_count));
-
-	/* Allocate the queue size. */
-	if (qcount == 0 && extra_count == 0)
-		goto out;
-
-	if ((queue = SMB_MALLOC_ARRAY(print_queue_struct, qcount + extra_count)) == NULL)
+	/* Retrieve the linearised queue data. */
+	if (!fetch_queue_struct(pdb, extra_count, &queue, &qcount))
 		goto out;
 
-	/* Retrieve the linearised queue data. */
+	DEBUG(5,("get_stored_queue_info: qcount = %u, extra_count = %u\n", (unsigned int)qcount, (unsigned int)extra_count));
 
-	for( i  = 0; i < qcount; i++) {
-		uint32 qjob, qsize, qpage_count, qstatus, qpriority, qtime;
-		len += tdb_unpack(data.dptr + len, data.dsize - len, "ddddddff",
-				&qjob,
-				&qsize,
-				&qpage_count,
-				&qstatus,
-				&qpriority,
-				&qtime,
-				queue[i].fs_user,
-				queue[i].fs_file);
-		queue[i].job = qjob;
-		queue[i].size = qsize;
-		queue[i].page_count = qpage_count;
-		queue[i].status = qstatus;
-		queue[i].priority = qpriority;
-		queue[i].time = qtime;
-	}
+	if (queue == NULL)
+		goto out;
 
 	total_count = qcount;
 
@@ -2658,7 +2970,6 @@ static BOOL get_stored_queue_info(struct tdb_print_db *pdb, int snum, int *pcoun
 
   out:
 
-	SAFE_FREE(data.dptr);
 	SAFE_FREE(cgdata.dptr);
 	return ret;
 }
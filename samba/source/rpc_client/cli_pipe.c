@@ -203,6 +203,76 @@ static NTSTATUS cli_pipe_get_current_pdu(struct rpc_pipe_client *cli, RPC_HDR *p
 	return NT_STATUS_OK;
 }
 
+/****************************************************************************
+ The response to a call is usually several fragments, each of which costs
+ a full SMBreadX round trip when read one after the other. Every response
+ fragment carries an alloc hint of the stub data still to come, so keep
+ up to "rpc client:read ahead" reads outstanding for the fragments we know
+ the server has queued. A read on an empty pipe blocks on Windows, so we
+ only ever ask for fragments that must exist.
+
+ That is only trusted as far as the fragments that have arrived bear it
+ out: all of them were full and the same size, and each alloc hint was
+ the previous one less the data that came with it. Whole fragments of
+ data_per_frag are read ahead, never the (short) last one, and no more
+ at once than have arrived so far.
+
+ Called with an empty current_pdu. Leaves it empty if reading ahead is
+ not worth it, so the caller falls back to cli_pipe_get_current_pdu().
+ ****************************************************************************/
+
+static NTSTATUS cli_pipe_read_ahead(struct rpc_pipe_client *cli,
+				prs_struct *current_pdu,
+				uint32 data_remaining,
+				uint32 data_per_frag,
+				int frags_seen)
+{
+	size_t frag_size = MAX(cli->max_recv_frag, cli->max_xmit_frag);
+	size_t nread = 0;
+	int window = lp_parm_int(-1, "rpc client", "read ahead", 4);
+	int num_frags;
+
+	if (window <= 1 || data_per_frag == 0 ||
+	    frag_size <= RPC_HEADER_LEN + RPC_HDR_RESP_LEN ||
+	    frag_size > cli_read_max_size(cli->cli)) {
+		return NT_STATUS_OK;
+	}
+
+	/*
+	 * Only the fragments that are full must exist. If the data left
+	 * is a whole number of fragments the last one is full too, but
+	 * we can't tell that from a hint that is a little too big.
+	 */
+	num_frags = data_remaining / data_per_frag;
+	num_frags = MIN(num_frags, frags_seen);
+	num_frags = MIN(num_frags, MIN(window, CLI_MAX_PIPE_READS));
+
+	if (num_frags <= 1) {
+		return NT_STATUS_OK;
+	}
+
+	if (!prs_force_grow(current_pdu, num_frags * frag_size)) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	DEBUG(5,("cli_pipe_read_ahead: %d reads of %u bytes for %u bytes "
+		"remaining on pipe %s\n", num_frags, (unsigned int)frag_size,
+		(unsigned int)data_remaining, cli->pipe_name ));
+
+	if (!cli_read_pipe_multi(cli->cli, cli->fnum, prs_data_p(current_pdu),
+				 frag_size, num_frags, &nread)) {
+		DEBUG(0,("cli_pipe_read_ahead: Error (%s) reading pipe %s\n",
+			cli_errstr(cli->cli), cli->pipe_name ));
+		return cli_get_nt_error(cli->cli);
+	}
+
+	if (!prs_set_buffer_size(current_pdu, nread)) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	return NT_STATUS_OK;
+}
+
 /****************************************************************************
  NTLMSSP specific sign/seal.
  Virtually identical to rpc_server/srv_pipe.c:api_pipe_ntlmssp_auth_process.
@@ -750,6 +820,12 @@ static NTSTATUS rpc_api_pipe(struct rpc_pipe_client *cli,
 	uint32 rdata_len = 0;
 	uint32 max_data = cli->max_xmit_frag ? cli->max_xmit_frag : RPC_MAX_PDU_FRAG_LEN;
 	uint32 current_rbuf_offset = 0;
+	uint32 call_id = IVAL(pdata, 12);
+	uint32 data_to_come = 0;
+	uint32 data_per_frag = 0;
+	uint16 frag_len = 0;
+	int frags_seen = 0;
+	BOOL read_ahead = True;
 	prs_struct current_pdu;
 	
 #ifdef DEVELOPER
@@ -846,6 +922,44 @@ static NTSTATUS rpc_api_pipe(struct rpc_pipe_client *cli,
 			goto err;
 		}
 
+		if (rhdr.call_id != call_id) {
+			DEBUG(0,("rpc_api_pipe: call_id %u in reply does not match "
+				"call_id %u of request on pipe %s\n",
+				(unsigned int)rhdr.call_id, (unsigned int)call_id,
+				cli->pipe_name ));
+			ret = NT_STATUS_INVALID_PARAMETER;
+			goto err;
+		}
+
+		if (rhdr.pkt_type != RPC_RESPONSE) {
+			read_ahead = False;
+		} else if (read_ahead) {
+			/* Stub data still to come, this fragment's included. */
+			char *p = prs_data_p(&current_pdu) + RPC_HEADER_LEN;
+			uint32 alloc_hint = current_pdu.bigendian_data ? RIVAL(p, 0) : IVAL(p, 0);
+
+			if (frags_seen == 0) {
+				data_per_frag = ret_data_len;
+				frag_len = rhdr.frag_len;
+			}
+
+			/* Only read ahead as long as the hints add up. */
+			if ((frags_seen > 0 && alloc_hint != data_to_come) ||
+			    alloc_hint < ret_data_len ||
+			    (!(rhdr.flags & RPC_FLG_LAST) &&
+			     (ret_data_len != data_per_frag ||
+			      rhdr.frag_len != frag_len))) {
+				DEBUG(5,("rpc_api_pipe: alloc hint %u of fragment %d "
+					"on pipe %s doesn't add up, not reading "
+					"ahead\n", (unsigned int)alloc_hint,
+					frags_seen, cli->pipe_name ));
+				read_ahead = False;
+			}
+
+			data_to_come = alloc_hint - ret_data_len;
+			frags_seen++;
+		}
+
 		if ((rhdr.flags & RPC_FLG_FIRST)) {
 			if (rhdr.pack_type[0] == 0) {
 				/* Set the data type correctly for big-endian data on the first packet. */
@@ -885,6 +999,16 @@ static NTSTATUS rpc_api_pipe(struct rpc_pipe_client *cli,
 		if (rhdr.flags & RPC_FLG_LAST) {
 			break; /* We're done. */
 		}
+
+		/* The second fragment is the first the hints are checked on. */
+		if (prs_data_size(&current_pdu) == 0 && read_ahead &&
+		    frags_seen > 1) {
+			ret = cli_pipe_read_ahead(cli, &current_pdu,
+					data_to_come, data_per_frag, frags_seen);
+			if (!NT_STATUS_IS_OK(ret)) {
+				goto err;
+			}
+		}
 	}
 
 	DEBUG(10,("rpc_api_pipe: Remote machine %s pipe %s fnum 0x%x returned %u bytes.\n",
@@ -1104,12 +1228,19 @@ static NTSTATUS create_bind_or_alt_ctx_internal(enum RPC_PKT_TYPE pkt_type,
 	uint16 auth_len = prs_offset(pauth_info);
 	uint8 ss_padding_len = 0;
 	uint16 frag_len = 0;
+	int max_recv_frag;
 
 	/* create the RPC context. */
 	init_rpc_context(&rpc_ctx, 0 /* context id */, abstract, transfer);
 
-	/* create the bind request RPC_HDR_RB */
-	init_rpc_hdr_rb(&hdr_rb, RPC_MAX_PDU_FRAG_LEN, RPC_MAX_PDU_FRAG_LEN, 0x0, &rpc_ctx);
+	/*
+	 * create the bind request RPC_HDR_RB. Offering a larger receive
+	 * fragment means fewer fragments (and SMBreadX calls) per reply
+	 * from servers that honour it.
+	 */
+	max_recv_frag = lp_parm_int(-1, "rpc client", "max recv frag", RPC_MAX_PDU_FRAG_LEN);
+	max_recv_frag = MIN(MAX(max_recv_frag, RPC_MAX_PDU_FRAG_LEN), 0xFFF8);
+	init_rpc_hdr_rb(&hdr_rb, RPC_MAX_PDU_FRAG_LEN, (uint16)max_recv_frag, 0x0, &rpc_ctx);
 
 	/* Start building the frag length. */
 	frag_len = RPC_HEADER_LEN + RPC_HDR_RB_LEN(&hdr_rb);
@@ -78,7 +78,7 @@ static void send_sync_message(void)
 {
         TDB_CONTEXT *tdb;
 
-        tdb = tdb_open_log(lock_path("connections.tdb"), 0,
+        tdb = tdb_open_log(volatile_path("connections.tdb"), 0,
                            TDB_DEFAULT, O_RDONLY, 0);
 
         if (!tdb) {
@@ -258,6 +258,7 @@ static BOOL create_next_pdu_ntlmssp(pipes_struct *p)
 	p->out_data.data_sent_length += data_len;
 	p->out_data.current_pdu_len = p->hdr.frag_len;
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&outgoing_pdu);
 	return True;
@@ -436,6 +437,7 @@ static BOOL create_next_pdu_schannel(pipes_struct *p)
 	p->out_data.data_sent_length += data_len;
 	p->out_data.current_pdu_len = p->hdr.frag_len;
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&outgoing_pdu);
 	return True;
@@ -543,13 +545,13 @@ static BOOL create_next_pdu_noauth(pipes_struct *p)
 		return False;
 	}
 
-	/* Copy the data into the PDU. */
+	/*
+	 * The data is not copied into the PDU, read_from_internal_pipe()
+	 * takes it straight from rdata.
+	 */
 
-	if(!prs_append_some_prs_data(&outgoing_pdu, &p->out_data.rdata, p->out_data.data_sent_length, data_len)) {
-		DEBUG(0,("create_next_pdu_noauth: failed to copy %u bytes of data.\n", (unsigned int)data_len));
-		prs_mem_free(&outgoing_pdu);
-		return False;
-	}
+	p->out_data.current_pdu_data_offset = p->out_data.data_sent_length;
+	p->out_data.current_pdu_data_len = data_len;
 
 	/*
 	 * Setup the counts for this PDU.
@@ -838,6 +840,7 @@ static BOOL setup_bind_nak(pipes_struct *p)
 	p->out_data.data_sent_length = 0;
 	p->out_data.current_pdu_len = prs_offset(&outgoing_rpc);
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	if (p->auth.auth_data_free_func) {
 		(*p->auth.auth_data_free_func)(&p->auth);
@@ -913,6 +916,7 @@ BOOL setup_fault_pdu(pipes_struct *p, NTSTATUS status)
 	p->out_data.data_sent_length = 0;
 	p->out_data.current_pdu_len = prs_offset(&outgoing_pdu);
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&outgoing_pdu);
 	return True;
@@ -961,6 +965,7 @@ BOOL setup_cancel_ack_reply(pipes_struct *p, prs_struct *rpc_in_p)
 	p->out_data.data_sent_length = 0;
 	p->out_data.current_pdu_len = prs_offset(&outgoing_pdu);
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&outgoing_pdu);
 	return True;
@@ -1726,6 +1731,7 @@ BOOL api_pipe_bind_req(pipes_struct *p, prs_struct *rpc_in_p)
 	p->out_data.data_sent_length = 0;
 	p->out_data.current_pdu_len = prs_offset(&outgoing_rpc);
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&out_hdr_ba);
 	prs_mem_free(&out_auth);
@@ -1918,6 +1924,7 @@ BOOL api_pipe_alter_context(pipes_struct *p, prs_struct *rpc_in_p)
 	p->out_data.data_sent_length = 0;
 	p->out_data.current_pdu_len = prs_offset(&outgoing_rpc);
 	p->out_data.current_pdu_sent = 0;
+	p->out_data.current_pdu_data_len = 0;
 
 	prs_mem_free(&out_hdr_ba);
 	prs_mem_free(&out_auth);
@@ -146,6 +146,7 @@ static BOOL pipe_init_outgoing_data(pipes_struct *p)
 	o_data->data_sent_length = 0;
 	o_data->current_pdu_len = 0;
 	o_data->current_pdu_sent = 0;
+	o_data->current_pdu_data_len = 0;
 
 	memset(o_data->current_pdu, '\0', sizeof(o_data->current_pdu));
 
@@ -997,6 +998,33 @@ ssize_t read_from_pipe(smb_np_struct *p, char *data, size_t n,
 	return p->namedpipe_read(p->np_state, data, n, is_data_outstanding);
 }
 
+/****************************************************************************
+ Copy len bytes of the current PDU, starting at offset, to data. The PDU
+ is the headers in current_pdu followed by current_pdu_data_len bytes of
+ rdata (see create_next_pdu_noauth()).
+****************************************************************************/
+
+static void copy_current_pdu(output_data *o_data, char *data,
+			     uint32 offset, uint32 len)
+{
+	uint32 hdr_len = o_data->current_pdu_len - o_data->current_pdu_data_len;
+
+	if (offset < hdr_len) {
+		uint32 n = MIN(len, hdr_len - offset);
+
+		memcpy(data, &o_data->current_pdu[offset], (size_t)n);
+		data += n;
+		offset += n;
+		len -= n;
+	}
+
+	if (len > 0) {
+		memcpy(data, prs_data_p(&o_data->rdata) +
+		       o_data->current_pdu_data_offset + (offset - hdr_len),
+		       (size_t)len);
+	}
+}
+
 /****************************************************************************
  Replies to a request to read data from a pipe.
 
@@ -1053,7 +1081,7 @@ pipe %s. We can only service %d sized reads.\n", (unsigned int)n, p->name, RPC_M
 returning %d bytes.\n", p->name, (unsigned int)p->out_data.current_pdu_len, 
 			(unsigned int)p->out_data.current_pdu_sent, (int)data_returned));
 
-		memcpy( data, &p->out_data.current_pdu[p->out_data.current_pdu_sent], (size_t)data_returned);
+		copy_current_pdu(&p->out_data, data, p->out_data.current_pdu_sent, (uint32)data_returned);
 		p->out_data.current_pdu_sent += (uint32)data_returned;
 		goto out;
 	}
@@ -1089,7 +1117,7 @@ returning %d bytes.\n", p->name, (unsigned int)p->out_data.current_pdu_len,
 
 	data_returned = MIN(n, p->out_data.current_pdu_len);
 
-	memcpy( data, p->out_data.current_pdu, (size_t)data_returned);
+	copy_current_pdu(&p->out_data, data, 0, (uint32)data_returned);
 	p->out_data.current_pdu_sent += (uint32)data_returned;
 
   out:
@@ -32,17 +32,65 @@ extern struct generic_mapping file_generic_mapping;
 
 /* Use for enumerating connections, pipes, & files */
 
+/* rough size of a FILE_INFO_3 on the wire, to turn the client's
+   preferred maximum length into a number of entries */
+#define FILE_INFO_3_SIZE 128
+
+/* file owners are looked up once per uid and enumeration, not once
+   per open file */
+#define FILE_ENUM_USER_CACHE 16
+
 struct file_enum_count {
 	TALLOC_CTX *ctx;
-	int count;
+	uint32 resume;		/* entries to skip */
+	uint32 max_entries;	/* entries to return at most */
+	uint32 total;		/* entries seen so far */
+	int count;		/* entries returned */
 	FILE_INFO_3 *info;
+	struct {
+		uid_t uid;
+		const char *name;
+	} users[FILE_ENUM_USER_CACHE];
 };
 
-struct sess_file_count {
-	pid_t pid;
-	uid_t uid;
-	int count;
-};
+/****************************************************************************
+ Count one more open file or pipe, and return the slot to fill in for it
+ if it is in the range the client asked for. NULL means only counting
+ it, so the caller can skip the expensive bits.
+****************************************************************************/
+
+static FILE_INFO_3 *file_enum_slot(struct file_enum_count *fenum)
+{
+	FILE_INFO_3 *f;
+	uint32 i = fenum->total++;
+
+	if (i < fenum->resume || (uint32)fenum->count >= fenum->max_entries) {
+		return NULL;
+	}
+
+	f = TALLOC_REALLOC_ARRAY( fenum->ctx, fenum->info, FILE_INFO_3, fenum->count+1 );
+	if ( !f ) {
+		DEBUG(0,("file_enum_slot: realloc failed for %d items\n", fenum->count+1));
+		/* return what we have, the client resumes from there */
+		fenum->max_entries = fenum->count;
+		return NULL;
+	}
+	fenum->info = f;
+
+	return &fenum->info[fenum->count++];
+}
+
+static const char *file_enum_uidtoname(struct file_enum_count *fenum, uid_t uid)
+{
+	int i = uid % FILE_ENUM_USER_CACHE;
+
+	if (fenum->users[i].name == NULL || fenum->users[i].uid != uid) {
+		fenum->users[i].uid = uid;
+		fenum->users[i].name = talloc_strdup(fenum->ctx, uidtoname(uid));
+	}
+
+	return fenum->users[i].name;
+}
 
 /****************************************************************************
  Count the entries belonging to a service in the connection db.
@@ -60,27 +108,20 @@ static int pipe_enum_fn( TDB_CONTEXT *the_tdb, TDB_DATA kbuf, TDB_DATA dbuf, voi
  
 	if ( process_exists(prec.pid) ) {
 		FILE_INFO_3 *f;
-		int i = fenum->count;
 		pstring fullpath;
 		
-		snprintf( fullpath, sizeof(fullpath), "\\PIPE\\%s", prec.name );
-		
-		f = TALLOC_REALLOC_ARRAY( fenum->ctx, fenum->info, FILE_INFO_3, i+1 );
-		if ( !f ) {
-			DEBUG(0,("conn_enum_fn: realloc failed for %d items\n", i+1));
-			return 1;
+		if ( (f = file_enum_slot(fenum)) == NULL ) {
+			return 0;
 		}
-		fenum->info = f;
-		
+
+		snprintf( fullpath, sizeof(fullpath), "\\PIPE\\%s", prec.name );
 		
-		init_srv_file_info3( &fenum->info[i], 
+		init_srv_file_info3( f, 
 			(uint32)((procid_to_pid(&prec.pid)<<16) & prec.pnum),
 			(FILE_READ_DATA|FILE_WRITE_DATA), 
 			0,
-			uidtoname( prec.uid ),
+			file_enum_uidtoname( fenum, prec.uid ),
 			fullpath );
-			
-		fenum->count++;
 	}
 
 	return 0;
@@ -89,10 +130,8 @@ static int pipe_enum_fn( TDB_CONTEXT *the_tdb, TDB_DATA kbuf, TDB_DATA dbuf, voi
 /*******************************************************************
 ********************************************************************/
 
-static WERROR net_enum_pipes( TALLOC_CTX *ctx, FILE_INFO_3 **info, 
-                              uint32 *count, uint32 resume )
+static WERROR net_enum_pipes( struct file_enum_count *fenum )
 {
-	struct file_enum_count fenum;
 	TDB_CONTEXT *conn_tdb = conn_tdb_ctx();
 
 	if ( !conn_tdb ) {
@@ -100,57 +139,46 @@ static WERROR net_enum_pipes( TALLOC_CTX *ctx, FILE_INFO_3 **info,
 		return WERR_ACCESS_DENIED;
 	}
 	
-	fenum.ctx = ctx;
-	fenum.count = *count;
-	fenum.info = *info;
-
-	if (tdb_traverse(conn_tdb, pipe_enum_fn, &fenum) == -1) {
+	if (tdb_traverse_snapshot(conn_tdb, pipe_enum_fn, fenum) == -1) {
 		DEBUG(0,("net_enum_pipes: traverse of connections.tdb failed with error %s.\n",
 			tdb_errorstr(conn_tdb) ));
 		return WERR_NOMEM;
 	}
 	
-	*info  = fenum.info;
-	*count = fenum.count;
-	
-	return WERR_OK;}
+	return WERR_OK;
+}
 
 /*******************************************************************
 ********************************************************************/
 
-/* global needed to make use of the share_mode_forall() callback */
-static struct file_enum_count f_enum_cnt;
-
 static void enum_file_fn( const struct share_mode_entry *e, 
                           const char *sharepath, const char *fname, void *state )
 {
-	struct file_enum_count *fenum = &f_enum_cnt;
+	struct file_enum_count *fenum = (struct file_enum_count *)state;
  
-	/* If the pid was not found delete the entry from connections.tdb */
+	/* skip deferred opens and entries of dead processes */
 
-	if ( process_exists(e->pid) ) {
+	if ( is_valid_share_mode_entry(e) && process_exists(e->pid) ) {
 		FILE_INFO_3 *f;
-		int i = fenum->count;
 		files_struct fsp;
 		struct byte_range_lock *brl;
 		int num_locks = 0;
 		pstring fullpath;
 		uint32 permissions;
 		
-		f = TALLOC_REALLOC_ARRAY( fenum->ctx, fenum->info, FILE_INFO_3, i+1 );			
-		if ( !f ) {
-			DEBUG(0,("conn_enum_fn: realloc failed for %d items\n", i+1));
+		if ( (f = file_enum_slot(fenum)) == NULL ) {
 			return;
 		}
-		fenum->info = f;
 
-		/* need to count the number of locks on a file */
+		/* need to count the number of locks on a file, just
+		   looking: don't clean up brlock.tdb from here */
 		
 		ZERO_STRUCT( fsp );		
 		fsp.dev   = e->dev;
 		fsp.inode = e->inode;
+		fsp.lockdb_clean = True;
 		
-		if ( (brl = brl_get_locks(NULL,&fsp)) != NULL ) {
+		if ( (brl = brl_get_locks_readonly(NULL,&fsp)) != NULL ) {
 			num_locks = brl->num_locks;
 			TALLOC_FREE( brl );
 		}
@@ -166,14 +194,12 @@ static void enum_file_fn( const struct share_mode_entry *e,
 		permissions = e->share_access & (FILE_READ_DATA|FILE_WRITE_DATA);
 
 		/* now fill in the FILE_INFO_3 struct */
-		init_srv_file_info3( &fenum->info[i], 
+		init_srv_file_info3( f, 
 			e->share_file_id,
 			permissions,
 			num_locks,
-			uidtoname(e->uid),
+			file_enum_uidtoname(fenum, e->uid),
 			fullpath );
-			
-		fenum->count++;
 	}
 
 	return;
@@ -183,17 +209,9 @@ static void enum_file_fn( const struct share_mode_entry *e,
 /*******************************************************************
 ********************************************************************/
 
-static WERROR net_enum_files( TALLOC_CTX *ctx, FILE_INFO_3 **info, 
-                              uint32 *count, uint32 resume )
+static WERROR net_enum_files( struct file_enum_count *fenum )
 {
-	f_enum_cnt.ctx = ctx;
-	f_enum_cnt.count = *count;
-	f_enum_cnt.info = *info;
-	
-	share_mode_forall( enum_file_fn, NULL );
-	
-	*info  = f_enum_cnt.info;
-	*count = f_enum_cnt.count;
+	share_mode_forall( enum_file_fn, fenum );
 	
 	return WERR_OK;
 }
@@ -814,38 +832,6 @@ static void init_srv_sess_info_0(SRV_SESS_INFO_0 *ss0, uint32 *snum, uint32 *sto
 	SAFE_FREE(session_list);
 }
 
-/*******************************************************************
-********************************************************************/
-
-/* global needed to make use of the share_mode_forall() callback */
-static struct sess_file_count s_file_cnt;
-
-static void sess_file_fn( const struct share_mode_entry *e, 
-                          const char *sharepath, const char *fname, void *state )
-{
-	struct sess_file_count *sess = &s_file_cnt;
- 
-	if ( (procid_to_pid(&e->pid) == sess->pid) && (sess->uid == e->uid) ) {
-		sess->count++;
-	}
-	
-	return;
-}
-
-/*******************************************************************
-********************************************************************/
-
-static int net_count_files( uid_t uid, pid_t pid )
-{
-	s_file_cnt.count = 0;
-	s_file_cnt.uid = uid;
-	s_file_cnt.pid = pid;
-	
-	share_mode_forall( sess_file_fn, NULL );
-	
-	return s_file_cnt.count;
-}
-
 /*******************************************************************
  fill in a sess info level 1 structure.
  ********************************************************************/
@@ -875,25 +861,18 @@ static void init_srv_sess_info_1(SRV_SESS_INFO_1 *ss1, uint32 *snum, uint32 *sto
 	
 
 	for (; (*snum) < (*stot) && num_entries < MAX_SESS_ENTRIES; (*snum)++) {
-		uint32 num_files;
 		uint32 connect_time;
-		struct passwd *pw = sys_getpwnam(session_list[*snum].username);
 		BOOL guest;
 			
-		if ( !pw ) {
-			DEBUG(10,("init_srv_sess_info_1: failed to find owner: %s\n",
-				session_list[*snum].username));
-			continue;
-		}
-				
+		/* the session's smbd keeps num_files up to date, see
+		   session_file_opened() */
 		connect_time = (uint32)(now - session_list[*snum].connect_start);
-		num_files = net_count_files(pw->pw_uid, session_list[*snum].pid);
 		guest = strequal( session_list[*snum].username, lp_guestaccount() );
 					
 		init_srv_sess_info1( &ss1->info_1[num_entries], 
 		                     session_list[*snum].remote_machine,
 				     session_list[*snum].username, 
-				     num_files,
+				     session_list[*snum].num_files,
 				     connect_time,
 				     0, 
 				     guest);
@@ -1125,36 +1104,58 @@ static void init_srv_r_net_conn_enum(SRV_R_NET_CONN_ENUM *r_n,
  makes a SRV_R_NET_FILE_ENUM structure.
 ********************************************************************/
 
-static WERROR net_file_enum_3( SRV_R_NET_FILE_ENUM *r, uint32 resume_hnd )
+static WERROR net_file_enum_3( SRV_R_NET_FILE_ENUM *r, uint32 resume_hnd,
+			       uint32 preferred_len )
 {
-	TALLOC_CTX *ctx = get_talloc_ctx();
 	SRV_FILE_INFO_CTR *ctr = &r->ctr;
+	struct file_enum_count fenum;
 
 	/* TODO -- Windows enumerates 
 	   (b) active pipes
 	   (c) open directories and files */
 
-	r->status = net_enum_files( ctx, &ctr->file.info3, &ctr->num_entries, resume_hnd );
+	/* one pass over locking.tdb and connections.tdb: the resume
+	   handle is the number of entries already returned, entries
+	   outside the requested window are only counted */
+
+	ZERO_STRUCT(fenum);
+	fenum.ctx = get_talloc_ctx();
+	fenum.resume = resume_hnd;
+	if (preferred_len == (uint32)-1) {
+		fenum.max_entries = (uint32)-1;
+	} else {
+		fenum.max_entries = MAX(preferred_len / FILE_INFO_3_SIZE, 1);
+	}
+
+	resume_hnd = 0;
+
+	r->status = net_enum_files( &fenum );
 	if ( !W_ERROR_IS_OK(r->status))
 		goto done;
 		
-	r->status = net_enum_pipes( ctx, &ctr->file.info3, &ctr->num_entries, resume_hnd );
+	r->status = net_enum_pipes( &fenum );
 	if ( !W_ERROR_IS_OK(r->status))
 		goto done;
 	
 	r->level = ctr->level = 3;
-	r->total_entries = ctr->num_entries;
-	/* ctr->num_entries = r->total_entries - resume_hnd; */
+	r->total_entries = fenum.total;
+	ctr->num_entries = fenum.count;
 	ctr->num_entries2 = ctr->num_entries;
 	ctr->ptr_file_info = 1;
 
 	r->status = WERR_OK;
 
+	if (fenum.resume + fenum.count < fenum.total) {
+		resume_hnd = fenum.resume + fenum.count;
+		r->status = WERR_MORE_DATA;
+	}
+
 done:
+	ctr->file.info3 = fenum.info;
 	if ( ctr->num_entries > 0 ) 
 		ctr->ptr_entries = 1;
 
-	init_enum_hnd(&r->enum_hnd, 0);
+	init_enum_hnd(&r->enum_hnd, resume_hnd);
 
 	return r->status;
 }
@@ -1166,7 +1167,8 @@ WERROR _srv_net_file_enum(pipes_struct *p, SRV_Q_NET_FILE_ENUM *q_u, SRV_R_NET_F
 {
 	switch ( q_u->level ) {
 	case 3:
-		return net_file_enum_3( r_u, get_enum_hnd(&q_u->enum_hnd) );	
+		return net_file_enum_3( r_u, get_enum_hnd(&q_u->enum_hnd),
+					q_u->preferred_len );
 	default:
 		return WERR_UNKNOWN_LEVEL;
 	}
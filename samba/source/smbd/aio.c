@@ -213,10 +213,10 @@ BOOL schedule_aio_read_and_X(connection_struct *conn,
 		return False;
 	}
 
-	/* Only do this on non-chained and non-chaining reads not using the
-	 * write cache. */
+	/* Only do this on non-chained and non-chaining reads not touching
+	 * dirty data in the write cache. */
         if (chain_size !=0 || (CVAL(inbuf,smb_vwv0) != 0xFF)
-	    || (lp_write_cache_size(SNUM(conn)) != 0) ) {
+	    || write_cache_range_dirty(fsp, startpos, smb_maxcnt) ) {
 		return False;
 	}
 
@@ -296,10 +296,12 @@ BOOL schedule_aio_write_and_X(connection_struct *conn,
 		return False;
 	}
 
-	/* Only do this on non-chained and non-chaining reads not using the
-	 * write cache. */
+	/* Only do this on non-chained and non-chaining writes not using the
+	 * write cache. An aio write going around the cache would leave
+	 * wcp->file_size stale, and the next cached write would truncate
+	 * the file back to it. */
         if (chain_size !=0 || (CVAL(inbuf,smb_vwv0) != 0xFF)
-	    || (lp_write_cache_size(SNUM(conn)) != 0) ) {
+	    || (lp_write_cache_size(SNUM(conn)) != 0) || (fsp->wcp != NULL) ) {
 		return False;
 	}
 
@@ -0,0 +1,292 @@
+/*
+   Unix SMB/CIFS implementation.
+   DOS attribute and EA size cache
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "includes.h"
+
+/****************************************************************************
+ Attribute cache code used by dos_mode() and the EA size info levels.
+
+ Every directory listing entry otherwise costs a getxattr for the DOS
+ attributes and a listxattr plus one getxattr per EA for the EA size. The
+ cache is keyed by (dev, inode) and every entry remembers the ctime of the
+ inode it was filled from. Setting an xattr updates the ctime, so an entry
+ goes stale by itself as soon as anybody (including other smbds) changes
+ the file.
+*****************************************************************************/
+
+static TDB_CONTEXT *tdb_attr_cache;
+
+struct attr_cache_key {
+	SMB_DEV_T dev;
+	SMB_INO_T inode;
+};
+
+#define ATTR_CACHE_HAVE_DOSATTR	0x01	/* dosattr is valid */
+#define ATTR_CACHE_NO_DOSATTR	0x02	/* the file has no DOSATTRIB EA */
+#define ATTR_CACHE_HAVE_EA_SIZE	0x04	/* ea_size is valid */
+
+struct attr_cache_entry {
+	struct timespec ctime;
+	uint32 flags;
+	uint32 dosattr;
+	uint32 ea_size;
+};
+
+/*
+ * Don't trust ctimes this close to the current time. On filesystems with
+ * one second timestamps a change made later in the same second would not
+ * be noticed.
+ */
+
+#define ATTR_CACHE_RACY_SECONDS 2
+
+static TDB_DATA attr_cache_key(const SMB_STRUCT_STAT *sbuf,
+			       struct attr_cache_key *key)
+{
+	TDB_DATA kbuf;
+
+	ZERO_STRUCTP(key);
+	key->dev = sbuf->st_dev;
+	key->inode = sbuf->st_ino;
+
+	kbuf.dptr = (char *)key;
+	kbuf.dsize = sizeof(*key);
+	return kbuf;
+}
+
+/****************************************************************************
+ Fetch the cache entry matching this stat, if there is a current one.
+****************************************************************************/
+
+static BOOL attr_cache_fetch_entry(const SMB_STRUCT_STAT *sbuf,
+				   struct attr_cache_entry *entry)
+{
+	struct attr_cache_key key;
+	struct timespec ctime;
+	TDB_DATA data;
+
+	data = tdb_fetch(tdb_attr_cache, attr_cache_key(sbuf, &key));
+	if (data.dptr == NULL) {
+		return False;
+	}
+
+	if (data.dsize != sizeof(*entry)) {
+		SAFE_FREE(data.dptr);
+		return False;
+	}
+
+	memcpy(entry, data.dptr, sizeof(*entry));
+	SAFE_FREE(data.dptr);
+
+	/* The inode changed since we looked. */
+	ctime = get_ctimespec(sbuf);
+	return (timespec_compare(&ctime, &entry->ctime) == 0);
+}
+
+static BOOL attr_cache_fetch(const SMB_STRUCT_STAT *sbuf,
+			     struct attr_cache_entry *entry)
+{
+	if (!lp_attr_cache() || !tdb_attr_cache) {
+		return False;
+	}
+
+	DO_PROFILE_INC(attrcache_lookups);
+
+	if (!attr_cache_fetch_entry(sbuf, entry)) {
+		DO_PROFILE_INC(attrcache_misses);
+		return False;
+	}
+
+	DO_PROFILE_INC(attrcache_hits);
+	return True;
+}
+
+/****************************************************************************
+ Merge new information into the cache entry for this stat.
+****************************************************************************/
+
+static void attr_cache_update(const SMB_STRUCT_STAT *sbuf,
+			      uint32 flags, uint32 dosattr, uint32 ea_size)
+{
+	struct attr_cache_key key;
+	struct attr_cache_entry entry;
+	size_t ac_size = lp_max_attr_cache_size();
+	TDB_DATA data;
+
+	if (!lp_attr_cache() || !tdb_attr_cache) {
+		return;
+	}
+
+	if (get_ctimespec(sbuf).tv_sec + ATTR_CACHE_RACY_SECONDS > time(NULL)) {
+		return;
+	}
+
+	if (ac_size && (tdb_map_size(tdb_attr_cache) > ac_size*1024)) {
+		reset_attr_cache();
+		if (!tdb_attr_cache) {
+			return;
+		}
+	}
+
+	if (!attr_cache_fetch_entry(sbuf, &entry)) {
+		ZERO_STRUCT(entry);
+		entry.ctime = get_ctimespec(sbuf);
+	}
+
+	if (flags & (ATTR_CACHE_HAVE_DOSATTR|ATTR_CACHE_NO_DOSATTR)) {
+		entry.flags &= ~(ATTR_CACHE_HAVE_DOSATTR|ATTR_CACHE_NO_DOSATTR);
+		entry.dosattr = dosattr;
+	}
+	if (flags & ATTR_CACHE_HAVE_EA_SIZE) {
+		entry.ea_size = ea_size;
+	}
+	entry.flags |= flags;
+
+	data.dptr = (char *)&entry;
+	data.dsize = sizeof(entry);
+
+	if (tdb_store(tdb_attr_cache, attr_cache_key(sbuf, &key), data,
+		      TDB_REPLACE) != 0) {
+		DEBUG(0,("attr_cache_update: Error storing entry for "
+			 "inode %.0f\n", (double)sbuf->st_ino));
+	}
+}
+
+/**
+ * Look up the DOS attributes stored in the DOSATTRIB EA of a file.
+ *
+ * @param sbuf     A current stat of the file.
+ * @param pfound   Set to whether the file has a DOSATTRIB EA at all.
+ * @param pattr    The attributes from the EA, if there is one.
+ *
+ * @return True if the cache could answer the question.
+ */
+
+BOOL attr_cache_fetch_dosattr(const SMB_STRUCT_STAT *sbuf,
+			      BOOL *pfound, uint32 *pattr)
+{
+	struct attr_cache_entry entry;
+
+	if (!attr_cache_fetch(sbuf, &entry)) {
+		return False;
+	}
+
+	if (entry.flags & ATTR_CACHE_HAVE_DOSATTR) {
+		*pfound = True;
+		*pattr = entry.dosattr;
+		return True;
+	}
+
+	if (entry.flags & ATTR_CACHE_NO_DOSATTR) {
+		*pfound = False;
+		return True;
+	}
+
+	return False;
+}
+
+/**
+ * Remember the DOSATTRIB EA of a file, or the fact that it has none.
+ */
+
+void attr_cache_store_dosattr(const SMB_STRUCT_STAT *sbuf,
+			      BOOL found, uint32 attr)
+{
+	attr_cache_update(sbuf,
+			  found ? ATTR_CACHE_HAVE_DOSATTR : ATTR_CACHE_NO_DOSATTR,
+			  found ? attr : 0, 0);
+}
+
+/**
+ * Look up the total size of the client visible EAs of a file.
+ *
+ * @return True if the cache could answer the question.
+ */
+
+BOOL attr_cache_fetch_ea_size(const SMB_STRUCT_STAT *sbuf, size_t *psize)
+{
+	struct attr_cache_entry entry;
+
+	if (!attr_cache_fetch(sbuf, &entry)) {
+		return False;
+	}
+
+	if (!(entry.flags & ATTR_CACHE_HAVE_EA_SIZE)) {
+		return False;
+	}
+
+	*psize = entry.ea_size;
+	return True;
+}
+
+/**
+ * Remember the total size of the client visible EAs of a file.
+ */
+
+void attr_cache_store_ea_size(const SMB_STRUCT_STAT *sbuf, size_t size)
+{
+	attr_cache_update(sbuf, ATTR_CACHE_HAVE_EA_SIZE, 0, (uint32)size);
+}
+
+/**
+ * Forget everything cached about an inode. Called before we change its
+ * EAs ourselves, so we never depend on the ctime update for our own
+ * changes.
+ */
+
+void attr_cache_delete(SMB_DEV_T dev, SMB_INO_T inode)
+{
+	struct attr_cache_key key;
+	TDB_DATA kbuf;
+
+	if (!tdb_attr_cache) {
+		return;
+	}
+
+	ZERO_STRUCT(key);
+	key.dev = dev;
+	key.inode = inode;
+
+	kbuf.dptr = (char *)&key;
+	kbuf.dsize = sizeof(key);
+
+	tdb_delete(tdb_attr_cache, kbuf);
+}
+
+/***************************************************************************
+ Initializes or clears the attribute cache.
+**************************************************************************/
+
+BOOL reset_attr_cache( void )
+{
+	if (tdb_attr_cache) {
+		tdb_close(tdb_attr_cache);
+		tdb_attr_cache = NULL;
+	}
+
+	if (!lp_attr_cache())
+		return True;
+
+	tdb_attr_cache = tdb_open_ex("attrcache", 1031, TDB_INTERNAL,
+				     (O_RDWR|O_CREAT), 0644, NULL, NULL);
+
+	if (!tdb_attr_cache)
+		return False;
+	return True;
+}
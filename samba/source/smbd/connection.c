@@ -29,7 +29,7 @@ static TDB_CONTEXT *tdb;
 TDB_CONTEXT *conn_tdb_ctx(void)
 {
 	if (!tdb)
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_DEFAULT, 
+		tdb = tdb_open_log(volatile_path("connections.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_VOLATILE|TDB_DEFAULT, 
 			       O_RDWR | O_CREAT, 0644);
 
 	return tdb;
@@ -145,10 +145,11 @@ int count_current_connections( const char *sharename, BOOL clear  )
 
 	/*
 	 * This has a race condition, but locking the chain before hand is worse
-	 * as it leads to deadlock.
+	 * as it leads to deadlock. A snapshot traverse holds no locks while
+	 * count_fn runs, so we don't hold up tree connects in other smbds.
 	 */
 
-	if (tdb_traverse(tdb, count_fn, &cs) == -1) {
+	if (tdb_traverse_snapshot(tdb, count_fn, &cs) == -1) {
 		DEBUG(0,("claim_connection: traverse of connections.tdb failed with error %s.\n",
 			tdb_errorstr(tdb) ));
 		return False;
@@ -550,6 +550,53 @@ int dptr_dnum(struct dptr_struct *dptr)
 	return dptr->dnum;
 }
 
+/****************************************************************************
+ Return (talloced) up to max_names of the raw names the next ReadDirName
+ calls will return, leaving the directory position where it was. No veto
+ or visibility checks are done - the caller just gets a hint of what is
+ coming.
+****************************************************************************/
+
+int dptr_peek_names(TALLOC_CTX *mem_ctx, struct dptr_struct *dptr,
+		    int max_names, char ***pnames)
+{
+	struct smb_Dir *dirp = dptr->dir_hnd;
+	long saved_offset = dirp->offset;
+	unsigned int saved_file_number = dirp->file_number;
+	long offset = saved_offset;
+	char **names;
+	const char *n;
+	int num = 0;
+
+	*pnames = NULL;
+
+	if (max_names <= 0 || saved_offset == END_OF_DIRECTORY_OFFSET) {
+		return 0;
+	}
+
+	names = TALLOC_ARRAY(mem_ctx, char *, max_names);
+	if (names == NULL) {
+		return 0;
+	}
+
+	while (num < max_names && (n = ReadDirName(dirp, &offset)) != NULL) {
+		names[num] = talloc_strdup(names, n);
+		if (names[num] == NULL) {
+			break;
+		}
+		num++;
+	}
+
+	SeekDir(dirp, saved_offset);
+	dirp->file_number = saved_file_number;
+
+	if (num == 0) {
+		TALLOC_FREE(names);
+	}
+	*pnames = names;
+	return num;
+}
+
 /****************************************************************************
  Return the next visible file name, skipping veto'd and invisible files.
 ****************************************************************************/
@@ -256,6 +256,8 @@ static BOOL get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
 	ssize_t sizeret;
 	fstring attrstr;
 	unsigned int dosattr;
+	BOOL found;
+	uint32 cached_attr;
 
 	if (!lp_store_dos_attributes(SNUM(conn))) {
 		return False;
@@ -264,10 +266,21 @@ static BOOL get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
 	/* Don't reset pattr to zero as we may already have filename-based attributes we
 	   need to preserve. */
 
+	if (attr_cache_fetch_dosattr(sbuf, &found, &cached_attr)) {
+		if (!found) {
+			return False;
+		}
+		dosattr = cached_attr;
+		DEBUG(10,("get_ea_dos_attribute: %s cached attr = 0x%x\n", path, dosattr));
+		goto done;
+	}
+
 	sizeret = SMB_VFS_GETXATTR(conn, path, SAMBA_XATTR_DOS_ATTRIB, attrstr, sizeof(attrstr));
 	if (sizeret == -1) {
 #if defined(ENOTSUP) && defined(ENOATTR)
-		if ((errno != ENOTSUP) && (errno != ENOATTR) && (errno != EACCES) && (errno != EPERM)) {
+		if (errno == ENOATTR) {
+			attr_cache_store_dosattr(sbuf, False, 0);
+		} else if ((errno != ENOTSUP) && (errno != EACCES) && (errno != EPERM)) {
 			DEBUG(1,("get_ea_dos_attributes: Cannot get attribute from EA on file %s: Error = %s\n",
 				path, strerror(errno) ));
 			set_store_dos_attributes(SNUM(conn), False);
@@ -285,6 +298,10 @@ static BOOL get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
                 return False;
         }
 
+	attr_cache_store_dosattr(sbuf, True, dosattr);
+
+ done:
+
 	if (S_ISDIR(sbuf->st_mode)) {
 		dosattr |= aDIR;
 	}
@@ -317,6 +334,8 @@ static BOOL set_ea_dos_attribute(connection_struct *conn, const char *path, SMB_
 		return False;
 	}
 
+	attr_cache_delete(sbuf->st_dev, sbuf->st_ino);
+
 	snprintf(attrstr, sizeof(attrstr)-1, "0x%x", dosmode & SAMBA_ATTRIBUTES_MASK);
 	if (SMB_VFS_SETXATTR(conn, path, SAMBA_XATTR_DOS_ATTRIB, attrstr, strlen(attrstr), 0) == -1) {
 		if((errno != EPERM) && (errno != EACCES)) {
@@ -24,6 +24,32 @@
 
 static BOOL setup_write_cache(files_struct *, SMB_OFF_T);
 
+/****************************************************************************
+ Is any byte of the range pos..pos+n-1 held dirty in the write cache ?
+ Callers that bypass read_file() (sendfile, aio) must not read such a
+ range straight from disk.
+****************************************************************************/
+
+BOOL write_cache_range_dirty(files_struct *fsp, SMB_OFF_T pos, size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+
+	if (!wcp || !wcp->data_size || n == 0) {
+		return False;
+	}
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		if (ext->offset + (SMB_OFF_T)ext->data_size > pos) {
+			return True;
+		}
+	}
+	return False;
+}
+
 /****************************************************************************
  Read from write cache if we can.
 ****************************************************************************/
@@ -31,20 +57,56 @@ static BOOL setup_write_cache(files_struct *, SMB_OFF_T);
 static BOOL read_from_write_cache(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 {
 	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
 
 	if(!wcp) {
 		return False;
 	}
 
-	if( n > wcp->data_size || pos < wcp->offset || pos + n > wcp->offset + wcp->data_size) {
-		return False;
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (pos < ext->offset) {
+			break;
+		}
+		if (pos + n <= ext->offset + ext->data_size) {
+			memcpy(data, ext->data + (pos - ext->offset), n);
+			DO_PROFILE_INC(writecache_read_hits);
+			return True;
+		}
 	}
 
-	memcpy(data, wcp->data + (pos - wcp->offset), n);
+	return False;
+}
 
-	DO_PROFILE_INC(writecache_read_hits);
+/****************************************************************************
+ Copy any dirty cached data over a buffer just read from disk, so the
+ client sees its own unflushed writes.
+****************************************************************************/
 
-	return True;
+static void overlay_write_cache(files_struct *fsp, char *data, SMB_OFF_T pos, size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+
+	if (!wcp) {
+		return;
+	}
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T start, end;
+
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+
+		start = MAX(pos, ext->offset);
+		end = MIN(pos + (SMB_OFF_T)n, ext->offset + (SMB_OFF_T)ext->data_size);
+		if (start >= end) {
+			continue;
+		}
+
+		memcpy(data + (start - pos), ext->data + (start - ext->offset),
+		       (size_t)(end - start));
+	}
 }
 
 /****************************************************************************
@@ -70,7 +132,11 @@ ssize_t read_file(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 		return n;
 	}
 
-	flush_write_cache(fsp, READ_FLUSH);
+	/*
+	 * No need to flush here. The file on disk has already been
+	 * extended to cover the cached data, so we read what is there
+	 * and copy the dirty extents over it below.
+	 */
 
 	fsp->fh->pos = pos;
 
@@ -97,6 +163,7 @@ tryagain:
 		}
 #endif
 		if (readret > 0) {
+			overlay_write_cache(fsp, data, pos, (size_t)readret);
 			ret += readret;
 		}
 	}
@@ -113,6 +180,9 @@ tryagain:
 /* how many write cache buffers have been allocated */
 static unsigned int allocated_write_caches;
 
+/* pushes out aged dirty data while we are idle */
+static struct idle_event *write_cache_idle_event;
+
 /****************************************************************************
  *Really* write to a file.
 ****************************************************************************/
@@ -174,12 +244,12 @@ static ssize_t real_write_file(files_struct *fsp,const char *data, SMB_OFF_T pos
  Updates size on disk but doesn't flush the cache.
 ****************************************************************************/
 
-static int wcp_file_size_change(files_struct *fsp)
+static int wcp_file_size_change(files_struct *fsp, SMB_OFF_T file_size)
 {
 	int ret;
 	write_cache *wcp = fsp->wcp;
 
-	wcp->file_size = wcp->offset + wcp->data_size;
+	wcp->file_size = file_size;
 	ret = SMB_VFS_FTRUNCATE(fsp, fsp->fh->fd, wcp->file_size);
 	if (ret == -1) {
 		DEBUG(0,("wcp_file_size_change (%s): ftruncate of size %.0f error %s\n",
@@ -188,6 +258,186 @@ static int wcp_file_size_change(files_struct *fsp)
 	return ret;
 }
 
+/****************************************************************************
+ Unlink and free one dirty extent.
+****************************************************************************/
+
+static void free_write_cache_extent(write_cache *wcp, struct write_cache_extent *ext)
+{
+	DLIST_REMOVE(wcp->extents, ext);
+	wcp->num_extents--;
+	wcp->data_size -= ext->data_size;
+	SAFE_FREE(ext->data);
+	SAFE_FREE(ext);
+}
+
+/****************************************************************************
+ How many bytes of a write are not already covered by dirty extents.
+****************************************************************************/
+
+static size_t write_cache_new_bytes(write_cache *wcp, SMB_OFF_T pos, size_t n)
+{
+	struct write_cache_extent *ext;
+	size_t covered = 0;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T start, end;
+
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+
+		start = MAX(pos, ext->offset);
+		end = MIN(pos + (SMB_OFF_T)n, ext->offset + (SMB_OFF_T)ext->data_size);
+		if (start < end) {
+			covered += (size_t)(end - start);
+		}
+	}
+	return n - covered;
+}
+
+/****************************************************************************
+ Copy new data into any dirty extents it overlaps. Used before writing
+ straight to disk so a later flush can't put stale data back. Extents the
+ write covers completely are simply dropped.
+****************************************************************************/
+
+static void update_write_cache_extents(files_struct *fsp, const char *data, SMB_OFF_T pos, size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext, *next;
+	SMB_OFF_T end = pos + n;
+
+	if (!wcp->data_size) {
+		return;
+	}
+
+	for (ext = wcp->extents; ext; ext = next) {
+		SMB_OFF_T ext_end = ext->offset + ext->data_size;
+		SMB_OFF_T start, stop;
+
+		next = ext->next;
+
+		if (ext->offset >= end) {
+			break;
+		}
+		if (ext_end <= pos) {
+			continue;
+		}
+
+		if ((pos <= ext->offset) && (end >= ext_end)) {
+			DEBUG(9,("write_file: discarding overwritten write \
+cache extent: fd = %d, off=%.0f, size=%u\n", fsp->fh->fd, (double)ext->offset, (unsigned int)ext->data_size ));
+			free_write_cache_extent(wcp, ext);
+			continue;
+		}
+
+		start = MAX(pos, ext->offset);
+		stop = MIN(end, ext_end);
+		memcpy(ext->data + (start - ext->offset), data + (start - pos), (size_t)(stop - start));
+	}
+
+	if (!wcp->data_size) {
+		DO_PROFILE_DEC(writecache_num_write_caches);
+		wcp->dirty_since = 0;
+	}
+}
+
+/****************************************************************************
+ Add data to the write cache, merging it with every extent it overlaps or
+ abuts so the extent list stays sorted and non-adjacent. The caller has
+ made sure it fits.
+****************************************************************************/
+
+static BOOL write_cache_insert(files_struct *fsp, const char *data, SMB_OFF_T pos, size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext, *first = NULL, *prev = NULL;
+	SMB_OFF_T start, end = pos + n;
+	size_t new_size;
+
+	/* Find the first extent touching the new data. */
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset + (SMB_OFF_T)ext->data_size >= pos) {
+			break;
+		}
+		prev = ext;
+	}
+	if (ext && ext->offset <= end) {
+		first = ext;
+	}
+
+	if (first == NULL) {
+		/*
+		 * Nothing to merge with, this becomes an extent of
+		 * its own.
+		 */
+
+		if ((ext = SMB_MALLOC_P(struct write_cache_extent)) == NULL) {
+			return False;
+		}
+		ZERO_STRUCTP(ext);
+		if ((ext->data = (char *)SMB_MALLOC(n)) == NULL) {
+			SAFE_FREE(ext);
+			return False;
+		}
+		ext->offset = pos;
+		ext->data_size = n;
+		ext->alloc_size = n;
+		memcpy(ext->data, data, n);
+
+		if (prev) {
+			DLIST_ADD_AFTER(wcp->extents, ext, prev);
+		} else {
+			DLIST_ADD(wcp->extents, ext);
+		}
+		wcp->num_extents++;
+		wcp->data_size += n;
+		return True;
+	}
+
+	/*
+	 * Work out the range covered after merging. Any gap between
+	 * the extents we swallow is covered by the new data.
+	 */
+
+	start = MIN(pos, first->offset);
+	end = MAX(end, first->offset + (SMB_OFF_T)first->data_size);
+	for (ext = first->next; ext && ext->offset <= end; ext = ext->next) {
+		end = MAX(end, ext->offset + (SMB_OFF_T)ext->data_size);
+	}
+	new_size = (size_t)(end - start);
+
+	if (new_size > first->alloc_size) {
+		/* Grow geometrically so streaming writes don't realloc every time. */
+		size_t alloc_size = MAX(new_size, MIN(first->alloc_size * 2, wcp->alloc_size));
+		char *tmp = (char *)SMB_REALLOC(first->data, alloc_size);
+
+		if (tmp == NULL) {
+			return False;
+		}
+		first->data = tmp;
+		first->alloc_size = alloc_size;
+	}
+
+	if (first->offset > start) {
+		memmove(first->data + (first->offset - start), first->data, first->data_size);
+	}
+	wcp->data_size -= first->data_size;
+	first->offset = start;
+
+	while ((ext = first->next) != NULL && ext->offset <= end) {
+		memcpy(first->data + (ext->offset - start), ext->data, ext->data_size);
+		free_write_cache_extent(wcp, ext);
+	}
+
+	memcpy(first->data + (pos - start), data, n);
+	first->data_size = new_size;
+	wcp->data_size += new_size;
+
+	return True;
+}
+
 /****************************************************************************
  Write to a file.
 ****************************************************************************/
@@ -196,7 +446,6 @@ ssize_t write_file(files_struct *fsp, const char *data, SMB_OFF_T pos, size_t n)
 {
 	write_cache *wcp = fsp->wcp;
 	ssize_t total_written = 0;
-	int write_path = -1; 
 
 	if (fsp->print_file) {
 		fstring sharename;
@@ -270,14 +519,15 @@ nonop=%u allocated=%u active=%u direct=%u perfect=%u readhits=%u\n",
 			profile_p->writecache_num_perfect_writes,
 			profile_p->writecache_read_hits ));
 
-		DEBUG(3,("WRITECACHE: Flushes SEEK=%d, READ=%d, WRITE=%d, READRAW=%d, OPLOCK=%d, CLOSE=%d, SYNC=%d\n",
+		DEBUG(3,("WRITECACHE: Flushes SEEK=%d, READ=%d, WRITE=%d, READRAW=%d, OPLOCK=%d, CLOSE=%d, SYNC=%d, AGED=%d\n",
 			profile_p->writecache_flushed_writes[SEEK_FLUSH],
 			profile_p->writecache_flushed_writes[READ_FLUSH],
 			profile_p->writecache_flushed_writes[WRITE_FLUSH],
 			profile_p->writecache_flushed_writes[READRAW_FLUSH],
 			profile_p->writecache_flushed_writes[OPLOCK_RELEASE_FLUSH],
 			profile_p->writecache_flushed_writes[CLOSE_FLUSH],
-			profile_p->writecache_flushed_writes[SYNC_FLUSH] ));
+			profile_p->writecache_flushed_writes[SYNC_FLUSH],
+			profile_p->writecache_flushed_writes[AGED_FLUSH] ));
 	}
 #endif
 
@@ -287,425 +537,90 @@ nonop=%u allocated=%u active=%u direct=%u perfect=%u readhits=%u\n",
 		return total_written;
 	}
 
-	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) wcp->offset=%.0f wcp->data_size=%u\n",
-		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size));
+	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) wcp->num_extents=%u wcp->data_size=%u\n",
+		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n, wcp->num_extents, (unsigned int)wcp->data_size));
 
 	fsp->fh->pos = pos + n;
 
-	/* 
-	 * If we have active cache and it isn't contiguous then we flush.
+	if (n == 0) {
+		return 0;
+	}
+
+	/*
+	 * The cache holds any number of dirty extents (up to
+	 * MAX_WRITE_CACHE_EXTENTS), so non-contiguous writes no
+	 * longer force a flush. We only push the cache out when
+	 * the new data won't fit beside what is already there.
 	 * NOTE: There is a small problem with running out of disk ....
 	 */
 
-	if (wcp->data_size) {
-		BOOL cache_flush_needed = False;
-
-		if ((pos >= wcp->offset) && (pos <= wcp->offset + wcp->data_size)) {
-      
-			/* ASCII art.... JRA.
-
-      +--------------+-----
-      | Cached data  | Rest of allocated cache buffer....
-      +--------------+-----
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * Start of write overlaps or abutts the existing data.
-			 */
-
-			size_t data_used = MIN((wcp->alloc_size - (pos - wcp->offset)), n);
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
-
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
-			}
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 1;
-
-		} else if ((pos < wcp->offset) && (pos + n > wcp->offset) && 
-					(pos + n <= wcp->offset + wcp->alloc_size)) {
-
-			/* ASCII art.... JRA.
-
-                        +---------------+
-                        | Cache buffer  |
-                        +---------------+
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * End of write overlaps the existing data.
-			 */
-
-			size_t data_used = pos + n - wcp->offset;
-
-			memcpy(wcp->data, data + n - data_used, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + n > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + n - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * We don't need to move the start of data, but we
-			 * cut down the amount left by the amount used.
-			 */
-
-			n -= data_used;
-
-			/*
-			 * We cannot have used all the data here.
-			 */
-
-			cache_flush_needed = True;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 2;
-
-		} else if ( (pos >= wcp->file_size) && 
-					(wcp->offset + wcp->data_size == wcp->file_size) &&
-					(pos > wcp->offset + wcp->data_size) && 
-					(pos < wcp->offset + wcp->alloc_size) ) {
-
-			/* ASCII art.... JRA.
+	if (n <= wcp->alloc_size &&
+	    ((wcp->data_size + write_cache_new_bytes(wcp, pos, n) > wcp->alloc_size) ||
+	     (wcp->num_extents >= MAX_WRITE_CACHE_EXTENTS))) {
+		DEBUG(3,("WRITE_FLUSH: cache full: fd = %d, size = %.0f, pos = %.0f, \
+n = %u, wcp->num_extents=%u, wcp->data_size=%u\n",
+			fsp->fh->fd, (double)wcp->file_size, (double)pos, (unsigned int)n,
+			wcp->num_extents, (unsigned int)wcp->data_size ));
 
-                       End of file ---->|
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                              +-------------------+
-                                              | Data to write     |
-                                              +-------------------+
-
-	    		*/
+		if (flush_write_cache(fsp, WRITE_FLUSH) == -1) {
+			return -1;
+		}
+	}
 
-			/*
-			 * Non-contiguous write part of which fits within
-			 * the cache buffer and is extending the file
-			 * and the cache contents reflect the current
-			 * data up to the current end of the file.
-			 */
+	/*
+	 * If the write request is bigger than the cache
+	 * size write it out directly, first copying it over any
+	 * dirty data it hits.
+	 */
 
-			size_t data_used;
+	if (n <= wcp->alloc_size) {
+		BOOL was_empty = (wcp->data_size == 0);
 
-			if(pos + n <= wcp->offset + wcp->alloc_size) {
-				data_used = n;
+		if (write_cache_insert(fsp, data, pos, n)) {
+#ifdef WITH_PROFILE
+			if (was_empty) {
+				DO_PROFILE_INC(writecache_init_writes);
 			} else {
-				data_used = wcp->offset + wcp->alloc_size - pos;
-			}
-
-			/*
-			 * Fill in the non-continuous area with zeros.
-			 */
-
-			memset(wcp->data + wcp->data_size, '\0',
-				pos - (wcp->offset + wcp->data_size) );
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
+				DO_PROFILE_INC(writecache_abutted_writes);
 			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
-
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
+#endif
+			if (was_empty) {
+				wcp->dirty_since = time(NULL);
+				DO_PROFILE_INC(writecache_num_write_caches);
 			}
 
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 3;
-
-                } else if ( (pos >= wcp->file_size) &&
-			    (n == 1) &&
-			    (wcp->file_size == wcp->offset + wcp->data_size) &&
-			    (pos < wcp->file_size + wcp->alloc_size)) {
-
-                        /*
-
-                End of file ---->|
-
-                 +---------------+---------------+
-                 | Cached data   | Cache buffer  |
-                 +---------------+---------------+
-
-                                 |<------- allocated size ---------------->|
-
-                                                         +--------+
-                                                         | 1 Byte |
-                                                         +--------+
-
-			MS-Office seems to do this a lot to determine if there's enough
-			space on the filesystem to write a new file.
-
-			Change to :
-
-                End of file ---->|
-                                 +-----------------------+--------+
-                                 | Zeroed Cached data    | 1 Byte |
-                                 +-----------------------+--------+
-                        */
-
-			flush_write_cache(fsp, WRITE_FLUSH);
-			wcp->offset = wcp->file_size;
-			wcp->data_size = pos - wcp->file_size + 1;
-			memset(wcp->data, '\0', wcp->data_size);
-			memcpy(wcp->data + wcp->data_size-1, data, 1);
-
 			/*
 			 * Update the file size if changed.
 			 */
 
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
+			if (pos + (SMB_OFF_T)n > wcp->file_size) {
+				if (wcp_file_size_change(fsp, pos + n) == -1) {
 					return -1;
 				}
 			}
 
-			return n;
-
-		} else {
-
-			/* ASCII art..... JRA.
-
-   Case 1).
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                                              +-------------------+
-                                                              | Data to write     |
-                                                              +-------------------+
-
-   Case 2).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-   +-------------------+
-   | Data to write     |
-   +-------------------+
-
-    Case 3).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-                  +-----------------------------------------------------+
-                  | Data to write                                       |
-                  +-----------------------------------------------------+
-
-		  */
-
- 			/*
-			 * Write is bigger than buffer, or there is no overlap on the
-			 * low or high ends.
-			 */
-
-			DEBUG(9,("write_file: non cacheable write : fd = %d, pos = %.0f, len = %u, current cache pos = %.0f \
-len = %u\n",fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			/*
-			 * If write would fit in the cache, and is larger than
-			 * the data already in the cache, flush the cache and
-			 * preferentially copy the data new data into it. Otherwise
-			 * just write the data directly.
-			 */
-
-			if ( n <= wcp->alloc_size && n > wcp->data_size) {
-				cache_flush_needed = True;
-			} else {
-				ssize_t ret = real_write_file(fsp, data, pos, n);
-
-				/*
-				 * If the write overlaps the entire cache, then
-				 * discard the current contents of the cache.
-				 * Fix from Rasmus Borup Hansen rbh@math.ku.dk.
-				 */
-
-				if ((pos <= wcp->offset) &&
-						(pos + n >= wcp->offset + wcp->data_size) ) {
-					DEBUG(9,("write_file: discarding overwritten write \
-cache: fd = %d, off=%.0f, size=%u\n", fsp->fh->fd, (double)wcp->offset, (unsigned int)wcp->data_size ));
-					wcp->data_size = 0;
-				}
-
-				DO_PROFILE_INC(writecache_direct_writes);
-				if (ret == -1) {
-					return ret;
-				}
-
-				if (pos + ret > wcp->file_size) {
-					wcp->file_size = pos + ret;
-				}
-
-				return ret;
-			}
-
-			write_path = 4;
+			DEBUG(9,("write_file: cached pos = %.0f n = %u, wcp->num_extents = %u wcp->data_size = %u\n",
+				(double)pos, (unsigned int)n, wcp->num_extents, (unsigned int)wcp->data_size));
 
+			return n; /* .... that's a write :) */
 		}
 
-		if (cache_flush_needed) {
-			DEBUG(3,("WRITE_FLUSH:%d: due to noncontinuous write: fd = %d, size = %.0f, pos = %.0f, \
-n = %u, wcp->offset=%.0f, wcp->data_size=%u\n",
-				write_path, fsp->fh->fd, (double)wcp->file_size, (double)pos, (unsigned int)n,
-				(double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			flush_write_cache(fsp, WRITE_FLUSH);
-		}
+		DEBUG(0,("write_file: malloc fail caching %u bytes, writing directly.\n",
+			(unsigned int)n ));
 	}
 
-	/*
-	 * If the write request is bigger than the cache
-	 * size, write it all out.
-	 */
-
-	if (n > wcp->alloc_size ) {
-		ssize_t ret = real_write_file(fsp, data, pos, n);
-		if (ret == -1) {
-			return -1;
-		}
+	update_write_cache_extents(fsp, data, pos, n);
 
-		if (pos + ret > wcp->file_size) {
-			wcp->file_size = pos + n;
-		}
-
-		DO_PROFILE_INC(writecache_direct_writes);
-		return total_written + n;
+	total_written = real_write_file(fsp, data, pos, n);
+	if (total_written == -1) {
+		return -1;
 	}
 
-	/*
-	 * If there's any data left, cache it.
-	 */
-
-	if (n) {
-#ifdef WITH_PROFILE
-		if (wcp->data_size) {
-			DO_PROFILE_INC(writecache_abutted_writes);
-		} else {
-			DO_PROFILE_INC(writecache_init_writes);
-		}
-#endif
-		memcpy(wcp->data+wcp->data_size, data, n);
-		if (wcp->data_size == 0) {
-			wcp->offset = pos;
-			DO_PROFILE_INC(writecache_num_write_caches);
-		}
-		wcp->data_size += n;
-
-		/*
-		 * Update the file size if changed.
-		 */
-
-		if (wcp->offset + wcp->data_size > wcp->file_size) {
-			if (wcp_file_size_change(fsp) == -1) {
-				return -1;
-			}
-		}
-		DEBUG(9,("wcp->offset = %.0f wcp->data_size = %u cache return %u\n",
-			(double)wcp->offset, (unsigned int)wcp->data_size, (unsigned int)n));
-
-		total_written += n;
-		return total_written; /* .... that's a write :) */
+	if (pos + total_written > wcp->file_size) {
+		wcp->file_size = pos + total_written;
 	}
-  
+
+	DO_PROFILE_INC(writecache_direct_writes);
 	return total_written;
 }
 
@@ -729,13 +644,30 @@ void delete_write_cache(files_struct *fsp)
 	allocated_write_caches--;
 
 	SMB_ASSERT(wcp->data_size == 0);
+	SMB_ASSERT(wcp->extents == NULL);
 
-	SAFE_FREE(wcp->data);
 	SAFE_FREE(fsp->wcp);
 
 	DEBUG(10,("delete_write_cache: File %s deleted write cache\n", fsp->fsp_name ));
 }
 
+/****************************************************************************
+ Idle handler pushing out write caches that have been dirty for a while,
+ so data doesn't sit in smbd memory while a client leaves a file open.
+ It stops itself once no write caches are left.
+****************************************************************************/
+
+static BOOL write_cache_idle_flush(const struct timeval *now, void *private_data)
+{
+	if (allocated_write_caches == 0) {
+		write_cache_idle_event = NULL;
+		return False;
+	}
+
+	file_flush_aged_write_caches(now->tv_sec - WRITE_CACHE_MAX_AGE);
+	return True;
+}
+
 /****************************************************************************
  Setup the write cache structure.
 ****************************************************************************/
@@ -758,18 +690,20 @@ static BOOL setup_write_cache(files_struct *fsp, SMB_OFF_T file_size)
 		return False;
 	}
 
+	/*
+	 * Extent buffers are allocated as data arrives, alloc_size
+	 * only bounds the total amount of dirty data.
+	 */
+
+	ZERO_STRUCTP(wcp);
 	wcp->file_size = file_size;
-	wcp->offset = 0;
 	wcp->alloc_size = alloc_size;
-	wcp->data_size = 0;
-	if((wcp->data = (char *)SMB_MALLOC(wcp->alloc_size)) == NULL) {
-		DEBUG(0,("setup_write_cache: malloc fail for buffer size %u.\n",
-			(unsigned int)wcp->alloc_size ));
-		SAFE_FREE(wcp);
-		return False;
-	}
 
-	memset(wcp->data, '\0', wcp->alloc_size );
+	if (write_cache_idle_event == NULL) {
+		write_cache_idle_event = add_idle_event(NULL,
+					timeval_set(WRITE_CACHE_FLUSH_INTERVAL, 0),
+					write_cache_idle_flush, NULL);
+	}
 
 	fsp->wcp = wcp;
 	DO_PROFILE_INC(writecache_allocated_write_caches);
@@ -806,38 +740,90 @@ on file %s with write cache size = %lu\n", fsp->fsp_name, (unsigned long)fsp->wc
 ssize_t flush_write_cache(files_struct *fsp, enum flush_reason_enum reason)
 {
 	write_cache *wcp = fsp->wcp;
-	size_t data_size;
-	ssize_t ret;
+	struct write_cache_extent *ext;
+	ssize_t ret, total = 0;
+	int saved_errno = 0;
 
 	if(!wcp || !wcp->data_size) {
 		return 0;
 	}
 
-	data_size = wcp->data_size;
-	wcp->data_size = 0;
-
 	DO_PROFILE_DEC_INC(writecache_num_write_caches,writecache_flushed_writes[reason]);
 
-	DEBUG(9,("flushing write cache: fd = %d, off=%.0f, size=%u\n",
-		fsp->fh->fd, (double)wcp->offset, (unsigned int)data_size));
+	DEBUG(9,("flushing write cache: fd = %d, extents=%u, size=%u\n",
+		fsp->fh->fd, wcp->num_extents, (unsigned int)wcp->data_size));
 
 #ifdef WITH_PROFILE
-	if(data_size == wcp->alloc_size) {
+	if(wcp->data_size == wcp->alloc_size) {
 		DO_PROFILE_INC(writecache_num_perfect_writes);
 	}
 #endif
 
-	ret = real_write_file(fsp, wcp->data, wcp->offset, data_size);
-
 	/*
-	 * Ensure file size if kept up to date if write extends file.
+	 * Extents are kept in offset order, so this is one pass up
+	 * the file with a single write per extent. As before, data
+	 * that fails to write is dropped and the error returned.
 	 */
 
-	if ((ret != -1) && (wcp->offset + ret > wcp->file_size)) {
-		wcp->file_size = wcp->offset + ret;
+	while ((ext = wcp->extents) != NULL) {
+		ret = real_write_file(fsp, ext->data, ext->offset, ext->data_size);
+
+		if (ret == -1) {
+			saved_errno = errno;
+		} else {
+			total += ret;
+
+			/*
+			 * Ensure file size if kept up to date if write extends file.
+			 */
+
+			if (ext->offset + ret > wcp->file_size) {
+				wcp->file_size = ext->offset + ret;
+			}
+		}
+
+		free_write_cache_extent(wcp, ext);
 	}
 
-	return ret;
+	wcp->dirty_since = 0;
+
+	if (saved_errno) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	return total;
+}
+
+/*******************************************************************
+ Flush a write cache that has been dirty since before dirty_before.
+ Called from the idle handler, so act as the user who opened the
+ file and put the old position back afterwards.
+********************************************************************/
+
+void flush_aged_write_cache(files_struct *fsp, time_t dirty_before)
+{
+	write_cache *wcp = fsp->wcp;
+	SMB_OFF_T pos;
+
+	if (!wcp || !wcp->data_size || wcp->dirty_since > dirty_before) {
+		return;
+	}
+
+	if (!change_to_user(fsp->conn, fsp->vuid) ||
+	    !set_current_service(fsp->conn, 0, True)) {
+		change_to_root_user();
+		return;
+	}
+
+	pos = fsp->fh->pos;
+	if (flush_write_cache(fsp, AGED_FLUSH) == -1) {
+		DEBUG(0,("flush_aged_write_cache: flush of %s failed: %s\n",
+			fsp->fsp_name, strerror(errno) ));
+	}
+	fsp->fh->pos = pos;
+
+	change_to_root_user();
 }
 
 /*******************************************************************
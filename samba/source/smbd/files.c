@@ -419,6 +419,22 @@ void file_sync_all(connection_struct *conn)
 	}
 }
 
+/****************************************************************************
+ Flush write caches holding data dirtied before dirty_before.
+****************************************************************************/
+
+void file_flush_aged_write_caches(time_t dirty_before)
+{
+	files_struct *fsp, *next;
+
+	for (fsp=Files;fsp;fsp=next) {
+		next=fsp->next;
+		if (fsp->wcp && (fsp->fh->fd != -1)) {
+			flush_aged_write_cache(fsp, dirty_before);
+		}
+	}
+}
+
 /****************************************************************************
  Free up a fsp.
 ****************************************************************************/
@@ -447,6 +463,8 @@ void file_free(files_struct *fsp)
 	/* Ensure this event will never fire. */
 	TALLOC_FREE(fsp->oplock_timeout);
 
+	session_file_closed(fsp);
+
 	bitmap_clear(file_bmap, fsp->fnum - FILE_HANDLE_OFFSET);
 	files_used--;
 
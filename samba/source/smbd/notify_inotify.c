@@ -20,12 +20,22 @@
 
 /*
   notify implementation using inotify
+
+  With "notify:broker = yes" the parent smbd forks a broker process that
+  owns the only inotify instance. smbds send it their watches over the
+  messaging layer, the kernel sees one watch per directory however many
+  clients look at it, and bursts of MODIFIED events for the same name
+  are coalesced before they are passed on. If the broker can't be
+  reached an smbd falls back to its own inotify fd.
 */
 
 #include "includes.h"
 
 #ifdef HAVE_INOTIFY
 
+extern SIG_ATOMIC_T got_sig_term;
+extern SIG_ATOMIC_T reload_after_sighup;
+
 #ifdef HAVE_ASM_TYPES_H
 #include <asm/types.h>
 #endif
@@ -88,6 +98,33 @@ struct inotify_watch_context {
 };
 
 
+/*
+  header of the broker messages, followed by a nul terminated path
+  (WATCH) or file name (EVENT). UNWATCH is just the header.
+*/
+struct notify_broker_msg {
+	uint32 watch_id;
+	uint32 filter;		/* WATCH: the windows completion filter */
+	uint32 action;		/* EVENT: the notify action */
+};
+
+/* a watch an smbd has handed to the broker */
+struct broker_watch_context {
+	struct broker_watch_context *next, *prev;
+	struct sys_notify_context *ctx;
+	uint32 watch_id;
+	void (*callback)(struct sys_notify_context *ctx, 
+			 void *private_data,
+			 struct notify_event *ev);
+	void *private_data;
+};
+
+/* set in the parent smbd, inherited by the smbds it forks */
+static pid_t notify_broker_pid = (pid_t)-1;
+
+static struct broker_watch_context *broker_watches;
+static uint32 broker_next_watch_id;
+
 /*
   destroy the inotify private context
 */
@@ -353,6 +390,130 @@ static int watch_destructor(struct inotify_watch_context *w)
 }
 
 
+/*
+  an event for one of our watches from the broker
+*/
+static void broker_event_received(int msg_type, struct process_id src,
+				  void *buf, size_t len, void *private_data)
+{
+	struct notify_broker_msg msg;
+	struct broker_watch_context *bw;
+	struct notify_event ne;
+
+	if (len <= sizeof(msg) || ((char *)buf)[len-1] != '\0' ||
+	    procid_to_pid(&src) != notify_broker_pid) {
+		DEBUG(1, ("broker_event_received: bad message\n"));
+		return;
+	}
+
+	memcpy(&msg, buf, sizeof(msg));
+
+	for (bw = broker_watches; bw; bw = bw->next) {
+		if (bw->watch_id == msg.watch_id) {
+			break;
+		}
+	}
+	if (bw == NULL) {
+		/* crossed with our UNWATCH */
+		return;
+	}
+
+	ne.action = msg.action;
+	ne.path = (char *)buf + sizeof(msg);
+
+	DEBUG(10, ("broker_event_received: watch %u action %d path %s\n",
+		   (unsigned)msg.watch_id, ne.action, ne.path));
+
+	bw->callback(bw->ctx, bw->private_data, &ne);
+}
+
+/*
+  tell the broker we lost interest
+*/
+static int broker_watch_destructor(struct broker_watch_context *bw)
+{
+	struct notify_broker_msg msg;
+
+	DLIST_REMOVE(broker_watches, bw);
+
+	ZERO_STRUCT(msg);
+	msg.watch_id = bw->watch_id;
+
+	message_send_pid(pid_to_procid(notify_broker_pid),
+			 MSG_SMB_NOTIFY_BROKER_UNWATCH, &msg, sizeof(msg),
+			 True);
+	return 0;
+}
+
+/*
+  hand a watch to the broker. Returns False if the broker is not there,
+  the caller then watches the directory itself.
+*/
+static BOOL broker_watch(struct sys_notify_context *ctx,
+			 const char *path, uint32_t filter,
+			 void (*callback)(struct sys_notify_context *ctx, 
+					  void *private_data,
+					  struct notify_event *ev),
+			 void *private_data, void **handle)
+{
+	static BOOL registered;
+	struct broker_watch_context *bw;
+	struct notify_broker_msg msg;
+	size_t path_len = strlen(path) + 1;
+	char *buf;
+	NTSTATUS status;
+
+	bw = TALLOC_ZERO_P(ctx, struct broker_watch_context);
+	if (bw == NULL) {
+		return False;
+	}
+
+	buf = TALLOC_ARRAY(bw, char, sizeof(msg) + path_len);
+	if (buf == NULL) {
+		talloc_free(bw);
+		return False;
+	}
+
+	if (!registered) {
+		message_register(MSG_SMB_NOTIFY_BROKER_EVENT,
+				 broker_event_received, NULL);
+		registered = True;
+	}
+
+	bw->ctx = ctx;
+	bw->watch_id = ++broker_next_watch_id;
+	bw->callback = callback;
+	bw->private_data = private_data;
+
+	ZERO_STRUCT(msg);
+	msg.watch_id = bw->watch_id;
+	msg.filter = filter;
+	memcpy(buf, &msg, sizeof(msg));
+	memcpy(buf + sizeof(msg), path, path_len);
+
+	status = message_send_pid(pid_to_procid(notify_broker_pid),
+				  MSG_SMB_NOTIFY_BROKER_WATCH,
+				  buf, sizeof(msg) + path_len, True);
+	TALLOC_FREE(buf);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(1, ("Could not reach the notify broker (%s), using "
+			  "inotify directly\n", nt_errstr(status)));
+		notify_broker_pid = (pid_t)-1;
+		talloc_free(bw);
+		return False;
+	}
+
+	DEBUG(10, ("broker_watch: watch %u for %s filter %x\n",
+		   (unsigned)bw->watch_id, path, filter));
+
+	DLIST_ADD(broker_watches, bw);
+	talloc_set_destructor(bw, broker_watch_destructor);
+
+	*handle = bw;
+	return True;
+}
+
 /*
   add a watch. The watch is removed when the caller calls
   talloc_free() on *handle
@@ -372,21 +533,30 @@ NTSTATUS inotify_watch(struct sys_notify_context *ctx,
 	uint32_t filter = e->filter;
 	void **handle = (void **)handle_p;
 
+	mask = inotify_map(e);
+	if (mask == 0) {
+		/* this filter can't be handled by inotify */
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	if (notify_broker_pid != (pid_t)-1 &&
+	    broker_watch(ctx, e->path, filter, callback, private_data,
+			 handle)) {
+		return NT_STATUS_OK;
+	}
+
 	/* maybe setup the inotify fd */
 	if (ctx->private_data == NULL) {
 		NTSTATUS status;
 		status = inotify_setup(ctx);
-		NT_STATUS_NOT_OK_RETURN(status);
+		if (!NT_STATUS_IS_OK(status)) {
+			e->filter = filter;
+			return status;
+		}
 	}
 
 	in = talloc_get_type(ctx->private_data, struct inotify_private);
 
-	mask = inotify_map(e);
-	if (mask == 0) {
-		/* this filter can't be handled by inotify */
-		return NT_STATUS_INVALID_PARAMETER;
-	}
-
 	/* using IN_MASK_ADD allows us to cope with inotify() returning the same
 	   watch descriptor for muliple watches on the same path */
 	mask |= (IN_MASK_ADD | IN_ONLYDIR);
@@ -432,4 +602,355 @@ NTSTATUS inotify_watch(struct sys_notify_context *ctx,
 	return NT_STATUS_OK;
 }
 
+
+/*
+  the broker side. Every WATCH message becomes a subscription holding an
+  ordinary inotify watch of the broker, so watches on the same directory
+  share the kernel watch (see watch_destructor).
+*/
+
+struct broker_pending {
+	struct broker_pending *next, *prev;
+	char *name;
+};
+
+struct broker_subscription {
+	struct broker_subscription *next, *prev;
+	struct process_id pid;
+	uint32 watch_id;
+	void *watch;
+	BOOL gone;
+	/* coalesced MODIFIED events waiting to be sent */
+	struct broker_pending *pending;
+	int num_pending;
+	struct timed_event *te;
+};
+
+#define BROKER_MAX_PENDING 256
+
+static struct sys_notify_context *broker_ctx;
+static struct broker_subscription *broker_subscriptions;
+static BOOL broker_gc_needed;
+static unsigned broker_events_coalesced;
+
+static void broker_send(struct broker_subscription *sub,
+			uint32 action, const char *name)
+{
+	struct notify_broker_msg msg;
+	size_t name_len = strlen(name) + 1;
+	char *buf;
+	NTSTATUS status;
+
+	if (sub->gone) {
+		return;
+	}
+
+	buf = TALLOC_ARRAY(sub, char, sizeof(msg) + name_len);
+	if (buf == NULL) {
+		return;
+	}
+
+	ZERO_STRUCT(msg);
+	msg.watch_id = sub->watch_id;
+	msg.action = action;
+	memcpy(buf, &msg, sizeof(msg));
+	memcpy(buf + sizeof(msg), name, name_len);
+
+	status = message_send_pid(sub->pid, MSG_SMB_NOTIFY_BROKER_EVENT,
+				  buf, sizeof(msg) + name_len, True);
+	TALLOC_FREE(buf);
+
+	if (NT_STATUS_EQUAL(status, NT_STATUS_INVALID_HANDLE)) {
+		struct broker_subscription *s;
+
+		DEBUG(10, ("notify broker: dropping watches of %s, it's "
+			   "gone\n", procid_str_static(&sub->pid)));
+
+		/* freed outside of the inotify dispatch loop */
+		for (s = broker_subscriptions; s; s = s->next) {
+			if (procid_equal(&s->pid, &sub->pid)) {
+				s->gone = True;
+			}
+		}
+		broker_gc_needed = True;
+	}
+}
+
+static void broker_flush_pending(struct broker_subscription *sub)
+{
+	struct broker_pending *p;
+
+	TALLOC_FREE(sub->te);
+
+	while ((p = sub->pending) != NULL) {
+		broker_send(sub, NOTIFY_ACTION_MODIFIED, p->name);
+		DLIST_REMOVE(sub->pending, p);
+		talloc_free(p);
+	}
+	sub->num_pending = 0;
+}
+
+static void broker_flush_handler(struct event_context *ev,
+				 struct timed_event *te,
+				 const struct timeval *now,
+				 void *private_data)
+{
+	struct broker_subscription *sub = talloc_get_type_abort(
+		private_data, struct broker_subscription);
+
+	sub->te = NULL;
+	TALLOC_FREE(te);
+	broker_flush_pending(sub);
+}
+
+/*
+  called by inotify_dispatch() for a subscription
+*/
+static void broker_event_callback(struct sys_notify_context *ctx,
+				  void *private_data, struct notify_event *ev)
+{
+	struct broker_subscription *sub = talloc_get_type_abort(
+		private_data, struct broker_subscription);
+	struct broker_pending *p;
+	int msec;
+
+	if (ev->action != NOTIFY_ACTION_MODIFIED) {
+		/* keep the order the client sees */
+		broker_flush_pending(sub);
+		broker_send(sub, ev->action, ev->path);
+		return;
+	}
+
+	msec = lp_parm_int(-1, "notify", "broker coalesce", 200);
+	if (msec <= 0) {
+		broker_send(sub, ev->action, ev->path);
+		return;
+	}
+
+	for (p = sub->pending; p; p = p->next) {
+		if (strcmp(p->name, ev->path) == 0) {
+			broker_events_coalesced++;
+			return;
+		}
+	}
+
+	if (sub->num_pending == BROKER_MAX_PENDING) {
+		broker_flush_pending(sub);
+	}
+
+	p = TALLOC_P(sub, struct broker_pending);
+	if (p == NULL) {
+		broker_send(sub, ev->action, ev->path);
+		return;
+	}
+	p->name = talloc_strdup(p, ev->path);
+	if (p->name == NULL) {
+		talloc_free(p);
+		broker_send(sub, ev->action, ev->path);
+		return;
+	}
+	DLIST_ADD_END(sub->pending, p, struct broker_pending *);
+	sub->num_pending++;
+
+	if (sub->te == NULL) {
+		sub->te = event_add_timed(ctx->ev, sub,
+					  timeval_current_ofs(msec / 1000,
+							      (msec % 1000) * 1000),
+					  "broker_flush_handler",
+					  broker_flush_handler, sub);
+	}
+}
+
+static int broker_subscription_destructor(struct broker_subscription *sub)
+{
+	DLIST_REMOVE(broker_subscriptions, sub);
+	return 0;
+}
+
+static void broker_watch_received(int msg_type, struct process_id src,
+				  void *buf, size_t len, void *private_data)
+{
+	struct notify_broker_msg msg;
+	struct broker_subscription *sub;
+	struct notify_entry e;
+	NTSTATUS status;
+
+	if (len <= sizeof(msg) || ((char *)buf)[len-1] != '\0') {
+		DEBUG(1, ("broker_watch_received: bad message\n"));
+		return;
+	}
+
+	memcpy(&msg, buf, sizeof(msg));
+
+	sub = TALLOC_ZERO_P(broker_ctx, struct broker_subscription);
+	if (sub == NULL) {
+		return;
+	}
+	sub->pid = src;
+	sub->watch_id = msg.watch_id;
+
+	ZERO_STRUCT(e);
+	e.path = (char *)buf + sizeof(msg);
+	e.filter = msg.filter;
+
+	status = inotify_watch(broker_ctx, &e, broker_event_callback, sub,
+			       &sub->watch);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(3, ("notify broker: could not watch %s for %s: %s\n",
+			  e.path, procid_str_static(&src), nt_errstr(status)));
+		talloc_free(sub);
+		return;
+	}
+	talloc_steal(sub, sub->watch);
+
+	DLIST_ADD(broker_subscriptions, sub);
+	talloc_set_destructor(sub, broker_subscription_destructor);
+
+	DEBUG(10, ("notify broker: %s watches %s as %u\n",
+		   procid_str_static(&src), e.path, (unsigned)msg.watch_id));
+}
+
+static void broker_unwatch_received(int msg_type, struct process_id src,
+				    void *buf, size_t len, void *private_data)
+{
+	struct notify_broker_msg msg;
+	struct broker_subscription *sub;
+
+	if (len < sizeof(msg)) {
+		return;
+	}
+
+	memcpy(&msg, buf, sizeof(msg));
+
+	for (sub = broker_subscriptions; sub; sub = sub->next) {
+		if (sub->watch_id == msg.watch_id &&
+		    procid_equal(&sub->pid, &src)) {
+			talloc_free(sub);
+			return;
+		}
+	}
+}
+
+static void broker_gc(void)
+{
+	struct broker_subscription *sub, *next;
+
+	if (!broker_gc_needed) {
+		return;
+	}
+	broker_gc_needed = False;
+
+	for (sub = broker_subscriptions; sub; sub = next) {
+		next = sub->next;
+		if (sub->gone) {
+			talloc_free(sub);
+		}
+	}
+}
+
+static void notify_broker_loop(pid_t parent_pid)
+{
+	struct event_context *ev;
+	time_t last_report = time(NULL);
+
+	ev = event_context_init(NULL);
+	broker_ctx = TALLOC_ZERO_P(ev, struct sys_notify_context);
+	if (ev == NULL || broker_ctx == NULL) {
+		exit(1);
+	}
+	broker_ctx->ev = ev;
+
+	message_register(MSG_SMB_NOTIFY_BROKER_WATCH,
+			 broker_watch_received, NULL);
+	message_register(MSG_SMB_NOTIFY_BROKER_UNWATCH,
+			 broker_unwatch_received, NULL);
+
+	while (1) {
+		fd_set r_fds, w_fds;
+		struct timeval now, timeout;
+		int maxfd = 0;
+		int ret;
+
+		FD_ZERO(&r_fds);
+		FD_ZERO(&w_fds);
+		timeout = timeval_set(60, 0);
+		GetTimeOfDay(&now);
+
+		event_add_to_select_args(ev, &now, &r_fds, &w_fds,
+					 &timeout, &maxfd);
+
+		ret = sys_select(maxfd+1, &r_fds, &w_fds, NULL, &timeout);
+
+		if (got_sig_term) {
+			exit_server_cleanly(NULL);
+		}
+
+		/* the parent smbd exits when idle, so do we */
+		if (getppid() != parent_pid) {
+			DEBUG(3, ("notify broker: parent gone, exiting\n"));
+			exit(0);
+		}
+
+		if (reload_after_sighup) {
+			change_to_root_user();
+			reload_services(False);
+			reload_after_sighup = 0;
+		}
+
+		message_dispatch();
+
+		if (ret == -1) {
+			FD_ZERO(&r_fds);
+			FD_ZERO(&w_fds);
+			ret = 0;
+		}
+		run_events(ev, ret, &r_fds, &w_fds);
+
+		broker_gc();
+
+		if (time(NULL) - last_report >= 600) {
+			DEBUG(3, ("notify broker: %u MODIFIED events "
+				  "coalesced\n", broker_events_coalesced));
+			last_report = time(NULL);
+		}
+	}
+}
+
+/*
+  fork the notify broker if "notify:broker" is set. Called by the parent
+  smbd before it forks any client smbds.
+*/
+void start_notify_broker(void)
+{
+	pid_t parent_pid = sys_getpid();
+	pid_t pid;
+
+	if (!lp_parm_bool(-1, "notify", "broker", False) ||
+	    !lp_parm_bool(-1, "notify", "inotify", True)) {
+		return;
+	}
+
+	pid = sys_fork();
+	if (pid == -1) {
+		DEBUG(0, ("start_notify_broker: fork failed: %s\n",
+			  strerror(errno)));
+		return;
+	}
+
+	if (pid != 0) {
+		notify_broker_pid = pid;
+		return;
+	}
+
+	/* Child. */
+	DEBUG(3, ("start_notify_broker: notify broker started\n"));
+
+	if (tdb_reopen_all(1) == -1) {
+		DEBUG(0, ("tdb_reopen_all failed.\n"));
+		exit(1);
+	}
+
+	notify_broker_loop(parent_pid);
+}
+
 #endif
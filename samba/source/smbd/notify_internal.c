@@ -22,6 +22,11 @@
   this is the change notify database. It implements mechanisms for
   storing current change notify waiters in a tdb, and checking if a
   given event matches any of the stored notify waiiters.
+
+  There is one record per watched directory, keyed by the directory
+  path (see struct notify_db_entry). A change only has to look at the
+  records of the directories above the changed path, and adding or
+  removing a watch only rewrites the record of that one directory.
 */
 
 #include "includes.h"
@@ -32,7 +37,8 @@ struct notify_context {
 	struct server_id server;
 	struct messaging_context *messaging_ctx;
 	struct notify_list *list;
-	struct notify_array *array;
+	struct notify_cache *cache;
+	int num_cached;
 	int seqnum;
 	struct sys_notify_context *sys_notify_ctx;
 };
@@ -43,16 +49,26 @@ struct notify_list {
 	void *private_data;
 	void (*callback)(void *, const struct notify_event *);
 	void *sys_notify_handle;
-	int depth;
+	char *path;		/* set if the watch is in the database */
+};
+
+/*
+  recently looked up directory records, valid while the tdb seqnum
+  does not change
+*/
+struct notify_cache {
+	struct notify_cache *next, *prev;
+	char *path;
+	int num_entries;
+	struct notify_db_entry *entries;
 };
 
-#define NOTIFY_KEY "notify array"
+#define NOTIFY_CACHE_SIZE	64
 
 #define NOTIFY_ENABLE		"notify:enable"
 #define NOTIFY_ENABLE_DEFAULT	True
 
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server);
+static NTSTATUS notify_remove_all(struct notify_context *notify);
 static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
 			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data);
 
@@ -64,7 +80,7 @@ static int notify_destructor(struct notify_context *notify)
 	messaging_deregister(notify->messaging_ctx, MSG_PVFS_NOTIFY, notify);
 
 	if (notify->list != NULL) {
-		notify_remove_all(notify, &notify->server);
+		notify_remove_all(notify);
 	}
 
 	return 0;
@@ -91,8 +107,8 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 		return NULL;
 	}
 
-	notify->w = tdb_wrap_open(notify, lock_path("notify.tdb"),
-				  0, TDB_SEQNUM|TDB_CLEAR_IF_FIRST,
+	notify->w = tdb_wrap_open(notify, volatile_path("notify.tdb"),
+				  0, TDB_SEQNUM|TDB_CLEAR_IF_FIRST|TDB_VOLATILE,
 				  O_RDWR|O_CREAT, 0644);
 	if (notify->w == NULL) {
 		talloc_free(notify);
@@ -102,7 +118,8 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	notify->server = server;
 	notify->messaging_ctx = messaging_ctx;
 	notify->list = NULL;
-	notify->array = NULL;
+	notify->cache = NULL;
+	notify->num_cached = 0;
 	notify->seqnum = tdb_get_seqnum(notify->w->tdb);
 
 	talloc_set_destructor(notify, notify_destructor);
@@ -117,133 +134,167 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	return notify;
 }
 
-
 /*
-  lock the notify db
+  the database key of a directory
 */
-static NTSTATUS notify_lock(struct notify_context *notify)
+static TDB_DATA notify_key(TALLOC_CTX *mem_ctx, const char *path)
 {
-	if (tdb_lock_bystring(notify->w->tdb, NOTIFY_KEY) != 0) {
-		return NT_STATUS_INTERNAL_DB_CORRUPTION;
-	}
-	return NT_STATUS_OK;
+	TDB_DATA key;
+
+	key.dptr = talloc_asprintf(mem_ctx, "%s%s", NOTIFY_DB_PREFIX, path);
+	key.dsize = (key.dptr != NULL) ? strlen(key.dptr) + 1 : 0;
+	return key;
 }
 
 /*
-  unlock the notify db
+  drop the cached directory records
 */
-static void notify_unlock(struct notify_context *notify)
+static void notify_cache_flush(struct notify_context *notify)
 {
-	tdb_unlock_bystring(notify->w->tdb, NOTIFY_KEY);
+	while (notify->cache != NULL) {
+		struct notify_cache *c = notify->cache;
+		DLIST_REMOVE(notify->cache, c);
+		talloc_free(c);
+	}
+	notify->num_cached = 0;
 }
 
 /*
-  load the notify array
+  find the watches on one directory. The returned array belongs to the
+  cache and stays valid until the next call.
 */
-static NTSTATUS notify_load(struct notify_context *notify)
+static int notify_fetch_path(struct notify_context *notify, const char *path,
+			     struct notify_db_entry **pentries)
 {
-	TDB_DATA dbuf;
-	DATA_BLOB blob;
-	NTSTATUS status;
+	struct notify_cache *c;
+	TDB_DATA key, dbuf;
 	int seqnum;
 
-	seqnum = tdb_get_seqnum(notify->w->tdb);
+	*pentries = NULL;
 
-	if (seqnum == notify->seqnum && notify->array != NULL) {
-		return NT_STATUS_OK;
+	seqnum = tdb_get_seqnum(notify->w->tdb);
+	if (seqnum != notify->seqnum) {
+		notify_cache_flush(notify);
+		notify->seqnum = seqnum;
 	}
 
-	notify->seqnum = seqnum;
-
-	talloc_free(notify->array);
-	notify->array = TALLOC_ZERO_P(notify, struct notify_array);
-	NT_STATUS_HAVE_NO_MEMORY(notify->array);
+	for (c = notify->cache; c != NULL; c = c->next) {
+		if (strcmp(c->path, path) == 0) {
+			DLIST_PROMOTE(notify->cache, c);
+			*pentries = c->entries;
+			return c->num_entries;
+		}
+	}
 
-	dbuf = tdb_fetch_bystring(notify->w->tdb, NOTIFY_KEY);
-	if (dbuf.dptr == NULL) {
-		return NT_STATUS_OK;
+	c = TALLOC_ZERO_P(notify, struct notify_cache);
+	if (c == NULL) {
+		return 0;
 	}
 
-	blob.data = (uint8 *)dbuf.dptr;
-	blob.length = dbuf.dsize;
+	c->path = talloc_strdup(c, path);
+	key = notify_key(c, path);
+	if (c->path == NULL || key.dptr == NULL) {
+		talloc_free(c);
+		return 0;
+	}
 
-	status = ndr_pull_struct_blob(&blob, notify->array, notify->array, 
-				      (ndr_pull_flags_fn_t)ndr_pull_notify_array);
+	dbuf = tdb_fetch(notify->w->tdb, key);
+	if (dbuf.dptr != NULL) {
+		c->num_entries = dbuf.dsize / sizeof(struct notify_db_entry);
+		c->entries = (struct notify_db_entry *)talloc_memdup(
+			c, dbuf.dptr,
+			c->num_entries * sizeof(struct notify_db_entry));
+		SAFE_FREE(dbuf.dptr);
+		if (c->entries == NULL) {
+			c->num_entries = 0;
+		}
+	}
 
-	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_load:\n"));
-		NDR_PRINT_DEBUG(notify_array, notify->array);
+	if (notify->num_cached == NOTIFY_CACHE_SIZE) {
+		struct notify_cache *last = notify->cache;
+		while (last->next != NULL) {
+			last = last->next;
+		}
+		DLIST_REMOVE(notify->cache, last);
+		talloc_free(last);
+		notify->num_cached--;
 	}
 
-	free(dbuf.dptr);
+	DLIST_ADD(notify->cache, c);
+	notify->num_cached++;
 
-	return status;
+	*pentries = c->entries;
+	return c->num_entries;
 }
 
 /*
-  compare notify entries for sorting
+  remove the entries of one directory that match server and, if
+  private_data is non-zero, private_data
 */
-static int notify_compare(const void *p1, const void *p2)
+static NTSTATUS notify_remove_entries(struct notify_context *notify,
+				      const char *path,
+				      const struct server_id *server,
+				      uint64 private_data)
 {
-	const struct notify_entry *e1 = (const struct notify_entry *)p1;
-	const struct notify_entry *e2 = (const struct notify_entry *)p2;
-	return strcmp(e1->path, e2->path);
-}
+	struct notify_db_entry *entries;
+	TDB_DATA key, dbuf;
+	NTSTATUS status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	int i, num_entries, ret;
 
-/*
-  save the notify array
-*/
-static NTSTATUS notify_save(struct notify_context *notify)
-{
-	TDB_DATA dbuf;
-	DATA_BLOB blob;
-	NTSTATUS status;
-	int ret;
-	TALLOC_CTX *tmp_ctx;
+	key = notify_key(notify, path);
+	if (key.dptr == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	if (tdb_chainlock(notify->w->tdb, key) != 0) {
+		talloc_free(key.dptr);
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
 
-	/* if possible, remove some depth arrays */
-	while (notify->array->num_depths > 0 &&
-	       notify->array->depth[notify->array->num_depths-1].num_entries == 0) {
-		notify->array->num_depths--;
+	dbuf = tdb_fetch(notify->w->tdb, key);
+	if (dbuf.dptr == NULL) {
+		goto done;
 	}
 
-	/* we might just be able to delete the record */
-	if (notify->array->num_depths == 0) {
-		ret = tdb_delete_bystring(notify->w->tdb, NOTIFY_KEY);
-		if (ret != 0) {
-			return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	entries = (struct notify_db_entry *)dbuf.dptr;
+	num_entries = dbuf.dsize / sizeof(struct notify_db_entry);
+
+	for (i = 0; i < num_entries; i++) {
+		if (!cluster_id_equal(server, &entries[i].server) ||
+		    (private_data != 0 &&
+		     private_data != entries[i].private_data)) {
+			continue;
 		}
-		return NT_STATUS_OK;
+		if (i < num_entries-1) {
+			memmove(&entries[i], &entries[i+1],
+				sizeof(entries[i])*(num_entries-(i+1)));
+		}
+		num_entries--;
+		i--;
+		status = NT_STATUS_OK;
 	}
 
-	tmp_ctx = talloc_new(notify);
-	NT_STATUS_HAVE_NO_MEMORY(tmp_ctx);
-
-	status = ndr_push_struct_blob(&blob, tmp_ctx, notify->array, 
-				      (ndr_push_flags_fn_t)ndr_push_notify_array);
 	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(tmp_ctx);
-		return status;
+		goto done;
 	}
 
-	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_save:\n"));
-		NDR_PRINT_DEBUG(notify_array, notify->array);
+	if (num_entries == 0) {
+		ret = tdb_delete(notify->w->tdb, key);
+	} else {
+		dbuf.dsize = num_entries * sizeof(struct notify_db_entry);
+		ret = tdb_store(notify->w->tdb, key, dbuf, TDB_REPLACE);
 	}
-
-	dbuf.dptr = (char *)blob.data;
-	dbuf.dsize = blob.length;
-		
-	ret = tdb_store_bystring(notify->w->tdb, NOTIFY_KEY, dbuf, TDB_REPLACE);
-	talloc_free(tmp_ctx);
 	if (ret != 0) {
-		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+		status = NT_STATUS_INTERNAL_DB_CORRUPTION;
 	}
 
-	return NT_STATUS_OK;
+done:
+	tdb_chainunlock(notify->w->tdb, key);
+	SAFE_FREE(dbuf.dptr);
+	talloc_free(key.dptr);
+	return status;
 }
 
-
 /*
   handle incoming notify messages
 */
@@ -291,57 +342,36 @@ static void sys_notify_callback(struct sys_notify_context *ctx,
 }
 
 /*
-  add an entry to the notify array
+  add an entry to the record of its directory
 */
-static NTSTATUS notify_add_array(struct notify_context *notify, struct notify_entry *e,
-				 void *private_data, int depth)
+static NTSTATUS notify_add_db(struct notify_context *notify,
+			      struct notify_entry *e, void *private_data)
 {
-	int i;
-	struct notify_depth *d;
-	struct notify_entry *ee;
-
-	/* possibly expand the depths array */
-	if (depth >= notify->array->num_depths) {
-		d = talloc_realloc(notify->array, notify->array->depth, 
-				   struct notify_depth, depth+1);
-		NT_STATUS_HAVE_NO_MEMORY(d);
-		for (i=notify->array->num_depths;i<=depth;i++) {
-			ZERO_STRUCT(d[i]);
-		}
-		notify->array->depth = d;
-		notify->array->num_depths = depth+1;
-	}
-	d = &notify->array->depth[depth];
-
-	/* expand the entries array */
-	ee = talloc_realloc(notify->array->depth, d->entries, struct notify_entry,
-			    d->num_entries+1);
-	NT_STATUS_HAVE_NO_MEMORY(ee);
-	d->entries = ee;
-
-	d->entries[d->num_entries] = *e;
-	d->entries[d->num_entries].private_data = private_data;
-	d->entries[d->num_entries].server = notify->server;
-	d->entries[d->num_entries].path_len = strlen(e->path);
-	d->num_entries++;
+	struct notify_db_entry entry;
+	TDB_DATA key, dbuf;
+	int ret;
 
-	d->max_mask |= e->filter;
-	d->max_mask_subdir |= e->subdir_filter;
+	ZERO_STRUCT(entry);
+	entry.server = notify->server;
+	entry.filter = e->filter;
+	entry.subdir_filter = e->subdir_filter;
+	entry.private_data = (uint64)(unsigned long)private_data;
 
-	if (d->num_entries > 1) {
-		qsort(d->entries, d->num_entries, sizeof(d->entries[0]), notify_compare);
+	key = notify_key(notify, e->path);
+	if (key.dptr == NULL) {
+		return NT_STATUS_NO_MEMORY;
 	}
 
-	/* recalculate the maximum masks */
-	d->max_mask = 0;
-	d->max_mask_subdir = 0;
+	dbuf.dptr = (char *)&entry;
+	dbuf.dsize = sizeof(entry);
 
-	for (i=0;i<d->num_entries;i++) {
-		d->max_mask |= d->entries[i].filter;
-		d->max_mask_subdir |= d->entries[i].subdir_filter;
+	ret = tdb_append(notify->w->tdb, key, dbuf);
+	talloc_free(key.dptr);
+	if (ret != 0) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
 	}
 
-	return notify_save(notify);
+	return NT_STATUS_OK;
 }
 
 /*
@@ -353,38 +383,26 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 		    void *private_data)
 {
 	struct notify_entry e = *e0;
-	NTSTATUS status;
+	NTSTATUS status = NT_STATUS_OK;
 	char *tmp_path = NULL;
 	struct notify_list *listel;
 	size_t len;
-	int depth;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
 		return NT_STATUS_NOT_IMPLEMENTED;
 	}
 
-	status = notify_lock(notify);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify);
-	if (!NT_STATUS_IS_OK(status)) {
-		goto done;
-	}
-
 	/* cope with /. on the end of the path */
 	len = strlen(e.path);
 	if (len > 1 && e.path[len-1] == '.' && e.path[len-2] == '/') {
 		tmp_path = talloc_strndup(notify, e.path, len-2);
 		if (tmp_path == NULL) {
-			status = NT_STATUS_NO_MEMORY;
-			goto done;
+			return NT_STATUS_NO_MEMORY;
 		}
 		e.path = tmp_path;
 	}
 
-	depth = count_chars(e.path, '/');
-
 	listel = TALLOC_ZERO_P(notify, struct notify_list);
 	if (listel == NULL) {
 		status = NT_STATUS_NO_MEMORY;
@@ -393,7 +411,6 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 
 	listel->private_data = private_data;
 	listel->callback = callback;
-	listel->depth = depth;
 	DLIST_ADD(notify->list, listel);
 
 	/* ignore failures from sys_notify */
@@ -412,14 +429,21 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 
 	/* if the system notify handler couldn't handle some of the
 	   filter bits, or couldn't handle a request for recursion
-	   then we need to install it in the array used for the
+	   then we need to install it in the database used for the
 	   intra-samba notify handling */
 	if (e.filter != 0 || e.subdir_filter != 0) {
-		status = notify_add_array(notify, &e, private_data, depth);
+		listel->path = talloc_strdup(listel, e.path);
+		if (listel->path == NULL) {
+			status = NT_STATUS_NO_MEMORY;
+			goto done;
+		}
+		status = notify_add_db(notify, &e, private_data);
+		if (!NT_STATUS_IS_OK(status)) {
+			TALLOC_FREE(listel->path);
+		}
 	}
 
 done:
-	notify_unlock(notify);
 	talloc_free(tmp_path);
 
 	return status;
@@ -430,10 +454,8 @@ done:
 */
 NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 {
-	NTSTATUS status;
+	NTSTATUS status = NT_STATUS_OK;
 	struct notify_list *listel;
-	int i, depth;
-	struct notify_depth *d;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
@@ -450,100 +472,43 @@ NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
 	}
 
-	depth = listel->depth;
-
-	talloc_free(listel);
-
-	status = notify_lock(notify);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify);
-	if (!NT_STATUS_IS_OK(status)) {
-		notify_unlock(notify);
-		return status;
-	}
-
-	if (depth >= notify->array->num_depths) {
-		notify_unlock(notify);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
-
-	/* we only have to search at the depth of this element */
-	d = &notify->array->depth[depth];
-
-	for (i=0;i<d->num_entries;i++) {
-		if (private_data == d->entries[i].private_data &&
-		    cluster_id_equal(&notify->server, &d->entries[i].server)) {
-			break;
-		}
-	}
-	if (i == d->num_entries) {
-		notify_unlock(notify);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
-
-	if (i < d->num_entries-1) {
-		memmove(&d->entries[i], &d->entries[i+1], 
-			sizeof(d->entries[i])*(d->num_entries-(i+1)));
+	if (listel->path != NULL) {
+		status = notify_remove_entries(
+			notify, listel->path, &notify->server,
+			(uint64)(unsigned long)private_data);
 	}
-	d->num_entries--;
-
-	status = notify_save(notify);
 
-	notify_unlock(notify);
+	talloc_free(listel);
 
 	return status;
 }
 
 /*
-  remove all notify watches for a messaging server
+  remove all notify watches of this server. We know which directories
+  they are on, so there is no need to look at the whole database.
 */
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server)
+static NTSTATUS notify_remove_all(struct notify_context *notify)
 {
-	NTSTATUS status;
-	int i, depth, del_count=0;
-
-	status = notify_lock(notify);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify);
-	if (!NT_STATUS_IS_OK(status)) {
-		notify_unlock(notify);
-		return status;
-	}
+	struct notify_list *listel;
 
-	/* we have to search for all entries across all depths, looking for matches
-	   for the server id */
-	for (depth=0;depth<notify->array->num_depths;depth++) {
-		struct notify_depth *d = &notify->array->depth[depth];
-		for (i=0;i<d->num_entries;i++) {
-			if (cluster_id_equal(server, &d->entries[i].server)) {
-				if (i < d->num_entries-1) {
-					memmove(&d->entries[i], &d->entries[i+1], 
-						sizeof(d->entries[i])*(d->num_entries-(i+1)));
-				}
-				i--;
-				d->num_entries--;
-				del_count++;
-			}
+	for (listel=notify->list;listel;listel=listel->next) {
+		if (listel->path != NULL) {
+			notify_remove_entries(notify, listel->path,
+					      &notify->server,
+					      (uint64)(unsigned long)listel->private_data);
+			TALLOC_FREE(listel->path);
 		}
 	}
 
-	if (del_count > 0) {
-		status = notify_save(notify);
-	}
-
-	notify_unlock(notify);
-
-	return status;
+	return NT_STATUS_OK;
 }
 
 
 /*
   send a notify message to another messaging server
 */
-static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *e,
+static NTSTATUS notify_send(struct notify_context *notify,
+			    struct notify_db_entry *e,
 			    const char *path, uint32_t action)
 {
 	struct notify_event ev;
@@ -553,7 +518,7 @@ static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *
 
 	ev.action = action;
 	ev.path = path;
-	ev.private_data = e->private_data;
+	ev.private_data = (void *)(unsigned long)e->private_data;
 
 	tmp_ctx = talloc_new(notify);
 
@@ -574,16 +539,15 @@ static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *
 /*
   trigger a notify message for anyone waiting on a matching event
 
-  This function is called a lot, and needs to be very fast. The unusual data structure
-  and traversal is designed to be fast in the average case, even for large numbers of
-  notifies
+  This function is called a lot, and needs to be very fast. Only the
+  records of the directories above path are looked at, and those are
+  cached until someone adds or removes a watch.
 */
 void notify_trigger(struct notify_context *notify,
 		    uint32_t action, uint32_t filter, const char *path)
 {
-	NTSTATUS status;
-	int depth;
-	const char *p, *next_p;
+	const char *p;
+	char *dir;
 
 	DEBUG(10, ("notify_trigger called action=0x%x, filter=0x%x, "
 		   "path=%s\n", (unsigned)action, (unsigned)filter, path));
@@ -593,94 +557,60 @@ void notify_trigger(struct notify_context *notify,
 		return;
 	}
 
- again:
-	status = notify_load(notify);
-	if (!NT_STATUS_IS_OK(status)) {
+	dir = talloc_strdup(notify, path);
+	if (dir == NULL) {
 		return;
 	}
 
-	/* loop along the given path, working with each directory depth separately */
-	for (depth=0,p=path;
-	     p && depth < notify->array->num_depths;
-	     p=next_p,depth++) {
-		int p_len = p - path;
-		int min_i, max_i, i;
-		struct notify_depth *d = &notify->array->depth[depth];
-		next_p = strchr(p+1, '/');
-
-		/* see if there are any entries at this depth */
-		if (d->num_entries == 0) continue;
-		
-		/* try to skip based on the maximum mask. If next_p is
-		 NULL then we know it will be a 'this directory'
-		 match, otherwise it must be a subdir match */
-		if (next_p != NULL) {
-			if (0 == (filter & d->max_mask_subdir)) {
-				continue;
-			}
-		} else {
-			if (0 == (filter & d->max_mask)) {
+	/* loop along the given path, looking at each parent directory */
+	for (p = strchr(path, '/'); p != NULL; p = strchr(p+1, '/')) {
+		size_t dir_len = PTR_DIFF(p, path);
+		BOOL is_parent = (strchr(p+1, '/') == NULL);
+		struct notify_db_entry *entries;
+		struct server_id gone;
+		BOOL have_gone = False;
+		int i, num_entries;
+
+		/* the root directory is "/", all others have no trailing / */
+		memcpy(dir, path, dir_len);
+		dir[dir_len == 0 ? 1 : dir_len] = '\0';
+
+		num_entries = notify_fetch_path(notify, dir, &entries);
+
+		for (i=0;i<num_entries;i++) {
+			struct notify_db_entry *e = &entries[i];
+			NTSTATUS status;
+
+			if (0 == (filter & (is_parent ? e->filter
+					    : e->subdir_filter))) {
 				continue;
 			}
-		}
 
-		/* we know there is an entry here worth looking
-		 for. Use a bisection search to find the first entry
-		 with a matching path */
-		min_i = 0;
-		max_i = d->num_entries-1;
-
-		while (min_i < max_i) {
-			struct notify_entry *e;
-			int cmp;
-			i = (min_i+max_i)/2;
-			e = &d->entries[i];
-			cmp = strncmp(path, e->path, p_len);
-			if (cmp == 0) {
-				if (p_len == e->path_len) {
-					max_i = i;
-				} else {
-					max_i = i-1;
-				}
-			} else if (cmp < 0) {
-				max_i = i-1;
-			} else {
-				min_i = i+1;
+			if (have_gone && cluster_id_equal(&gone, &e->server)) {
+				continue;
 			}
-		}
 
-		if (min_i != max_i) {
-			/* none match */
-			continue;
-		}
-
-		/* we now know that the entries start at min_i */
-		for (i=min_i;i<d->num_entries;i++) {
-			struct notify_entry *e = &d->entries[i];
-			if (p_len != e->path_len ||
-			    strncmp(path, e->path, p_len) != 0) break;
-			if (next_p != NULL) {
-				if (0 == (filter & e->subdir_filter)) {
-					continue;
-				}
-			} else {
-				if (0 == (filter & e->filter)) {
-					continue;
-				}
-			}
-			status = notify_send(notify, e,	path + e->path_len + 1,
-					     action);
+			status = notify_send(notify, e, p + 1, action);
 
 			if (NT_STATUS_EQUAL(
 				    status, NT_STATUS_INVALID_HANDLE)) {
-				struct server_id server = e->server;
-
 				DEBUG(10, ("Deleting notify entries for "
 					   "process %s because it's gone\n",
 					   procid_str_static(&e->server.id)));
-				notify_remove_all(notify, &server);
-				goto again;
+				gone = e->server;
+				have_gone = True;
 			}
 		}
+
+		/*
+		 * Entries of a dead server are only cleaned up in the
+		 * directories we come across, the rest go when somebody
+		 * triggers on them.
+		 */
+		if (have_gone) {
+			notify_remove_entries(notify, dir, &gone, 0);
+		}
 	}
+
+	talloc_free(dir);
 }
@@ -738,7 +738,13 @@ int reply_ntcreate_and_X(connection_struct *conn,
 		
 	new_file_attributes = set_posix_case_semantics(conn, file_attributes);
 		
-	status = unix_convert(conn, fname, False, NULL, &sbuf);
+	/* A replayed deferred open already knows its name. */
+	if (get_deferred_open_name(conn, SVAL(inbuf,smb_mid),
+				   fname, sizeof(fname), &sbuf)) {
+		status = NT_STATUS_OK;
+	} else {
+		status = unix_convert(conn, fname, False, NULL, &sbuf);
+	}
 	if (!NT_STATUS_IS_OK(status)) {
 		restore_case_semantics(conn, file_attributes);
 		END_PROFILE(SMBntcreateX);
@@ -1407,7 +1413,13 @@ static int call_nt_transact_create(connection_struct *conn, char *inbuf, char *o
 		return ERROR_NT(status);
 	}
 
-	status = unix_convert(conn, fname, False, NULL, &sbuf);
+	/* A replayed deferred open already knows its name. */
+	if (get_deferred_open_name(conn, SVAL(inbuf,smb_mid),
+				   fname, sizeof(fname), &sbuf)) {
+		status = NT_STATUS_OK;
+	} else {
+		status = unix_convert(conn, fname, False, NULL, &sbuf);
+	}
 	if (!NT_STATUS_IS_OK(status)) {
 		restore_case_semantics(conn, file_attributes);
 		return ERROR_NT(status);
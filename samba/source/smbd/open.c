@@ -32,6 +32,14 @@ struct deferred_open_record {
 	BOOL delayed_for_oplocks;
 	SMB_DEV_T dev;
 	SMB_INO_T inode;
+	pstring fname; /* Name as resolved by the first pass. */
+};
+
+/* What a replayed open still has to clean up from its last pass. */
+struct deferred_open_resume {
+	BOOL entry_pending; /* Our deferred entry is still in the share mode record. */
+	SMB_DEV_T dev;
+	SMB_INO_T inode;
 };
 
 /****************************************************************************
@@ -1067,7 +1075,9 @@ BOOL map_open_params_to_ntcreate(const char *fname, int deny_mode, int open_func
 
 }
 
-static void schedule_defer_open(struct share_mode_lock *lck, struct timeval request_time)
+static void schedule_defer_open(struct share_mode_lock *lck,
+				const char *fname,
+				struct timeval request_time)
 {
 	struct deferred_open_record state;
 
@@ -1097,14 +1107,101 @@ static void schedule_defer_open(struct share_mode_lock *lck, struct timeval requ
 	state.delayed_for_oplocks = True;
 	state.dev = lck->dev;
 	state.inode = lck->ino;
+	pstrcpy(state.fname, fname);
 
 	if (!request_timed_out(request_time, timeout)) {
 		defer_open(lck, request_time, timeout, &state);
 	}
 }
 
+/****************************************************************************
+ A replayed open has just locked the share mode record. If our deferred
+ entry from the last pass lives there, drop it now under the same lock
+ instead of taking the lock once more just for that.
+****************************************************************************/
+
+static void resume_deferred_open(struct share_mode_lock *lck, uint16 mid,
+				 struct deferred_open_resume *resume)
+{
+	if (resume == NULL || !resume->entry_pending) {
+		return;
+	}
+
+	if ((lck->dev != resume->dev) || (lck->ino != resume->inode)) {
+		return;
+	}
+
+	del_deferred_open_entry(lck, mid);
+	resume->entry_pending = False;
+}
+
+/****************************************************************************
+ If this request is the replay of a deferred open, return the name the
+ first pass resolved so the caller can skip unix_convert(). The stat is
+ always redone as the file may have changed while we waited, and the name
+ is only used if it still refers to the file we deferred on.
+****************************************************************************/
+
+BOOL get_deferred_open_name(connection_struct *conn, uint16 mid,
+			    char *fname, size_t fname_len,
+			    SMB_STRUCT_STAT *psbuf)
+{
+	struct pending_message_list *pml = get_open_deferred_message(mid);
+	struct deferred_open_record *state;
+	SMB_STRUCT_STAT sbuf;
+	int ret;
+
+	if ((pml == NULL) || !pml->processed ||
+	    (pml->private_data.length != sizeof(*state))) {
+		return False;
+	}
+
+	state = (struct deferred_open_record *)pml->private_data.data;
+	if (state->fname[0] == '\0') {
+		return False;
+	}
+
+	if (lp_posix_pathnames()) {
+		ret = SMB_VFS_LSTAT(conn, state->fname, &sbuf);
+	} else {
+		ret = SMB_VFS_STAT(conn, state->fname, &sbuf);
+	}
+
+	if ((ret != 0) || (sbuf.st_dev != state->dev) ||
+	    (sbuf.st_ino != state->inode)) {
+		return False;
+	}
+
+	DEBUG(10,("get_deferred_open_name: mid %u reusing name %s\n",
+		  (unsigned int)mid, state->fname));
+
+	safe_strcpy(fname, state->fname, fname_len - 1);
+	*psbuf = sbuf;
+	return True;
+}
+
+static NTSTATUS open_file_ntcreate_internal(connection_struct *conn,
+				const char *fname,
+				SMB_STRUCT_STAT *psbuf,
+				uint32 access_mask,
+				uint32 share_access,
+				uint32 create_disposition,
+				uint32 create_options,
+				uint32 new_dos_attributes,
+				int oplock_request,
+				int *pinfo,
+				files_struct **result,
+				struct timeval request_time,
+				struct deferred_open_resume *resume);
+
 /****************************************************************************
  Open a file with a share mode.
+
+ When this is the replay of an open we deferred earlier, the deferred
+ entry we left in the share mode record is removed by the main pass once
+ it holds the lock on that record anyway. Only if it never gets there
+ (early error, or the name now refers to another file) do we take the
+ lock separately here.
 ****************************************************************************/
 
 NTSTATUS open_file_ntcreate(connection_struct *conn,
@@ -1119,6 +1216,71 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 				 			/* Information (FILE_EXISTS etc.) */
 			    int *pinfo,
 			    files_struct **result)
+{
+	struct pending_message_list *pml = NULL;
+	struct deferred_open_resume resume;
+	struct timeval request_time = timeval_zero();
+	uint16 mid = get_current_mid();
+	NTSTATUS status;
+
+	ZERO_STRUCT(resume);
+
+	if (!conn->printer && (pml = get_open_deferred_message(mid)) != NULL) {
+		struct deferred_open_record *state =
+			(struct deferred_open_record *)pml->private_data.data;
+
+		/* Remember the absolute time of the original
+		   request with this mid. We'll use it later to
+		   see if this has timed out. */
+
+		request_time = pml->request_time;
+
+		resume.entry_pending = True;
+		resume.dev = state->dev;
+		resume.inode = state->inode;
+
+		/* Ensure we don't reprocess this message. */
+		remove_deferred_open_smb_message(mid);
+	}
+
+	status = open_file_ntcreate_internal(conn, fname, psbuf,
+					     access_mask, share_access,
+					     create_disposition, create_options,
+					     new_dos_attributes, oplock_request,
+					     pinfo, result, request_time,
+					     &resume);
+
+	if (resume.entry_pending) {
+		/* Remove the deferred open entry under lock. */
+		struct share_mode_lock *lck;
+
+		lck = get_share_mode_lock(NULL, resume.dev, resume.inode,
+					  NULL, NULL);
+		if (lck == NULL) {
+			DEBUG(0, ("could not get share mode lock\n"));
+		} else {
+			del_deferred_open_entry(lck, mid);
+			TALLOC_FREE(lck);
+		}
+	}
+
+	return status;
+}
+
+static NTSTATUS open_file_ntcreate_internal(connection_struct *conn,
+			    const char *fname,
+			    SMB_STRUCT_STAT *psbuf,
+			    uint32 access_mask,		/* access bits (FILE_READ_DATA etc.) */
+			    uint32 share_access,	/* share constants (FILE_SHARE_READ etc) */
+			    uint32 create_disposition,	/* FILE_OPEN_IF etc. */
+			    uint32 create_options,	/* options such as delete on close. */
+			    uint32 new_dos_attributes,	/* attributes used for new file. */
+			    int oplock_request, 	/* internal Samba oplock codes. */
+				 			/* Information (FILE_EXISTS etc.) */
+			    int *pinfo,
+			    files_struct **result,
+			    struct timeval request_time,
+			    struct deferred_open_resume *resume)
 {
 	int flags=0;
 	int flags2=0;
@@ -1134,9 +1296,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 	mode_t unx_mode = (mode_t)0;
 	int info;
 	uint32 existing_dos_attributes = 0;
-	struct pending_message_list *pml = NULL;
 	uint16 mid = get_current_mid();
-	struct timeval request_time = timeval_zero();
 	struct share_mode_lock *lck = NULL;
 	uint32 open_access_mask = access_mask;
 	NTSTATUS status;
@@ -1183,29 +1343,6 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 		   create_disposition, create_options, unx_mode,
 		   oplock_request));
 
-	if ((pml = get_open_deferred_message(mid)) != NULL) {
-		struct deferred_open_record *state =
-			(struct deferred_open_record *)pml->private_data.data;
-
-		/* Remember the absolute time of the original
-		   request with this mid. We'll use it later to
-		   see if this has timed out. */
-
-		request_time = pml->request_time;
-
-		/* Remove the deferred open entry under lock. */
-		lck = get_share_mode_lock(NULL, state->dev, state->inode, NULL, NULL);
-		if (lck == NULL) {
-			DEBUG(0, ("could not get share mode lock\n"));
-		} else {
-			del_deferred_open_entry(lck, mid);
-			TALLOC_FREE(lck);
-		}
-
-		/* Ensure we don't reprocess this message. */
-		remove_deferred_open_smb_message(mid);
-	}
-
 	status = check_name(conn, fname);
 	if (!NT_STATUS_IS_OK(status)) {
 		return status;
@@ -1436,9 +1573,11 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			return NT_STATUS_SHARING_VIOLATION;
 		}
 
+		resume_deferred_open(lck, mid, resume);
+
 		/* First pass - send break only on batch oplocks. */
 		if (delay_for_oplocks(lck, fsp, 1, oplock_request)) {
-			schedule_defer_open(lck, request_time);
+			schedule_defer_open(lck, fname, request_time);
 			TALLOC_FREE(lck);
 			file_free(fsp);
 			return NT_STATUS_SHARING_VIOLATION;
@@ -1456,7 +1595,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			/* Second pass - send break for both batch or
 			 * exclusive oplocks. */
 			if (delay_for_oplocks(lck, fsp, 2, oplock_request)) {
-				schedule_defer_open(lck, request_time);
+				schedule_defer_open(lck, fname, request_time);
 				TALLOC_FREE(lck);
 				file_free(fsp);
 				return NT_STATUS_SHARING_VIOLATION;
@@ -1565,6 +1704,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 				state.delayed_for_oplocks = False;
 				state.dev = dev;
 				state.inode = inode;
+				pstrcpy(state.fname, fname);
 
 				if (!request_timed_out(request_time,
 						       timeout)) {
@@ -1633,6 +1773,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			state.delayed_for_oplocks = False;
 			state.dev = dev;
 			state.inode = inode;
+			pstrcpy(state.fname, fname);
 
 			timeout_usecs = lp_parm_int(SNUM(conn),
 						"smbd","sharedelay",
@@ -1686,9 +1827,11 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			return NT_STATUS_SHARING_VIOLATION;
 		}
 
+		resume_deferred_open(lck, mid, resume);
+
 		/* First pass - send break only on batch oplocks. */
 		if (delay_for_oplocks(lck, fsp, 1, oplock_request)) {
-			schedule_defer_open(lck, request_time);
+			schedule_defer_open(lck, fname, request_time);
 			TALLOC_FREE(lck);
 			fd_close(conn, fsp);
 			file_free(fsp);
@@ -1705,7 +1848,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			/* Second pass - send break for both batch or
 			 * exclusive oplocks. */
 			if (delay_for_oplocks(lck, fsp, 2, oplock_request)) {
-				schedule_defer_open(lck, request_time);
+				schedule_defer_open(lck, fname, request_time);
 				TALLOC_FREE(lck);
 				fd_close(conn, fsp);
 				file_free(fsp);
@@ -1722,6 +1865,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 			state.delayed_for_oplocks = False;
 			state.dev = dev;
 			state.inode = inode;
+			pstrcpy(state.fname, fname);
 
 			/* Do it all over again immediately. In the second
 			 * round we will find that the file existed and handle
@@ -1829,6 +1973,7 @@ NTSTATUS open_file_ntcreate(connection_struct *conn,
 	}
 
 	set_share_mode(lck, fsp, current_user.ut.uid, 0, fsp->oplock_type, new_file_created);
+	session_file_opened(fsp);
 
 	/* Handle strange delete on close create semantics. */
 	if ((create_options & FILE_DELETE_ON_CLOSE) && can_set_initial_delete_on_close(lck)) {
@@ -2222,6 +2367,7 @@ NTSTATUS open_directory(connection_struct *conn,
 	}
 
 	set_share_mode(lck, fsp, current_user.ut.uid, 0, NO_OPLOCK, True);
+	session_file_opened(fsp);
 
 	/* For directories the delete on close bit at open time seems
 	   always to be honored on close... See test 19 in Samba4 BASE-DELETE. */
@@ -2243,7 +2243,8 @@ void send_file_readbraw(connection_struct *conn, files_struct *fsp, SMB_OFF_T st
 	 */
 
 	if ( (chain_size == 0) && (nread > 0) &&
-	    (fsp->wcp == NULL) && (fsp->is_sendfile_capable) ) {
+	    !write_cache_range_dirty(fsp, startpos, nread) &&
+	    (fsp->is_sendfile_capable) ) {
 		DATA_BLOB header;
 
 		_smb_setlen(outbuf,nread);
@@ -2586,7 +2587,8 @@ int send_file_readX(connection_struct *conn, char *inbuf,char *outbuf,int length
 	 */
 
 	if ((chain_size == 0) && (CVAL(inbuf,smb_vwv0) == 0xFF) &&
-	    (fsp->is_sendfile_capable) && (fsp->wcp == NULL) ) {
+	    (fsp->is_sendfile_capable) &&
+	    !write_cache_range_dirty(fsp, startpos, smb_maxcnt) ) {
 		SMB_STRUCT_STAT sbuf;
 		DATA_BLOB header;
 
@@ -682,6 +682,7 @@ BOOL reload_services(BOOL test)
 
 	mangle_reset_cache();
 	reset_stat_cache();
+	reset_attr_cache();
 
 	/* this forces service parameters to be flushed */
 	set_current_service(NULL,0,True);
@@ -1066,6 +1067,11 @@ extern void build_options(BOOL screen);
 		return -1;
 	}
 
+#ifdef HAVE_KRB5
+	/* children inherit the keytab index instead of each reading it */
+	ads_keytab_index_preload();
+#endif
+
 	/* Setup the main smbd so that we can get messages. */
 	/* don't worry about general printing messages here */
 
@@ -1078,6 +1084,9 @@ extern void build_options(BOOL screen);
 	if (server_mode != SERVER_MODE_INETD &&
 	    server_mode != SERVER_MODE_INTERACTIVE) {
 		start_background_queue(); 
+#ifdef HAVE_INOTIFY
+		start_notify_broker();
+#endif
 	}
 
 	/* Always attempt to initialize DMAPI. We will only use it later if
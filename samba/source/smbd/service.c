@@ -1279,6 +1279,7 @@ void close_cnum(connection_struct *conn, uint16 vuid)
 	} else {
 		file_close_conn(conn);
 		dptr_closecnum(conn);
+		stat_prefetch_close_conn(conn);
 	}
 
 	change_to_root_user();
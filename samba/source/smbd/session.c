@@ -39,7 +39,7 @@ BOOL session_init(void)
 	if (tdb)
 		return True;
 
-	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_DEFAULT, 
+	tdb = tdb_open_log(volatile_path("sessionid.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_VOLATILE|TDB_DEFAULT, 
 		       O_RDWR | O_CREAT, 0644);
 	if (!tdb) {
 		DEBUG(1,("session_init: failed to open sessionid tdb\n"));
@@ -179,6 +179,8 @@ void session_yield(user_struct *vuser)
 	struct in_addr *client_ip;
 	TDB_DATA key;
 
+	TALLOC_FREE(vuser->num_files_te);
+
 	if (!tdb) return;
 
 	if (!vuser->session_keystr) {
@@ -210,6 +212,103 @@ void session_yield(user_struct *vuser)
 	tdb_delete(tdb, key);
 }
 
+/********************************************************************
+ The open file count of a session lives in its sessionid.tdb record,
+ so NetSessionEnum can read it instead of counting share modes in
+ locking.tdb for every session. Opens and closes only change the
+ count in the user_struct, the record follows within
+ SESSION_NUM_FILES_DELAY seconds.
+********************************************************************/
+
+static void session_num_files_handler(struct event_context *ev,
+				      struct timed_event *te,
+				      const struct timeval *now,
+				      void *private_data)
+{
+	user_struct *vuser = (user_struct *)private_data;
+	struct sessionid *sessionid;
+	TDB_DATA key, dbuf;
+
+	TALLOC_FREE(vuser->num_files_te);
+
+	if (!tdb || !vuser->session_keystr) {
+		return;
+	}
+
+	key.dptr = vuser->session_keystr;
+	key.dsize = strlen(vuser->session_keystr)+1;
+
+	/* only this process writes its session records */
+	dbuf = tdb_fetch(tdb, key);
+	if (dbuf.dsize != sizeof(struct sessionid)) {
+		SAFE_FREE(dbuf.dptr);
+		return;
+	}
+
+	sessionid = (struct sessionid *)dbuf.dptr;
+	if (sessionid->num_files != vuser->num_files) {
+		sessionid->num_files = vuser->num_files;
+		if (tdb_store(tdb, key, dbuf, TDB_MODIFY) != 0) {
+			DEBUG(3,("session_num_files_handler: could not update "
+				 "%s: %s\n", vuser->session_keystr,
+				 tdb_errorstr(tdb)));
+		}
+	}
+	SAFE_FREE(dbuf.dptr);
+}
+
+static void session_num_files_changed(user_struct *vuser)
+{
+	if (vuser->num_files_te != NULL) {
+		return;
+	}
+
+	vuser->num_files_te = event_add_timed(smbd_event_context(), NULL,
+				timeval_current_ofs(SESSION_NUM_FILES_DELAY, 0),
+				"session_num_files_handler",
+				session_num_files_handler, vuser);
+}
+
+/********************************************************************
+ called when fsp got its share mode entry
+********************************************************************/
+
+void session_file_opened(files_struct *fsp)
+{
+	user_struct *vuser = get_valid_user_struct(fsp->vuid);
+
+	if (vuser == NULL || vuser->session_keystr == NULL) {
+		return;
+	}
+
+	fsp->session_counted = True;
+	vuser->num_files++;
+	session_num_files_changed(vuser);
+}
+
+/********************************************************************
+ called when fsp is freed
+********************************************************************/
+
+void session_file_closed(files_struct *fsp)
+{
+	user_struct *vuser;
+
+	if (!fsp->session_counted) {
+		return;
+	}
+
+	fsp->session_counted = False;
+
+	if ((vuser = get_valid_user_struct(fsp->vuid)) == NULL ||
+	    vuser->num_files == 0) {
+		return;
+	}
+
+	vuser->num_files--;
+	session_num_files_changed(vuser);
+}
+
 /********************************************************************
 ********************************************************************/
 
@@ -221,7 +320,7 @@ BOOL session_traverse(int (*fn)(TDB_CONTEXT *, TDB_DATA, TDB_DATA, void *),
 		return False;
 	}
 
-	tdb_traverse(tdb, fn, state);
+	tdb_traverse_snapshot(tdb, fn, state);
 	return True;
 }
 
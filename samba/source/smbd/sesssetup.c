@@ -219,6 +219,131 @@ static BOOL make_krb5_skew_error(DATA_BLOB *pblob_out)
 }
 #endif
 
+/****************************************************************************
+ Cache of the server_info built from a Kerberos ticket.
+
+ Clients often set up several sessions with the same service ticket
+ (reconnects, drives plus printers, several users on a terminal server
+ going through the same machine). Each time they send the same PAC, and
+ turning it into a server_info costs a getpwnam, group lookups and
+ create_local_token(). So remember the result for a while, keyed by the
+ client principal and a digest of the verified PAC, which includes the
+ ticket's authtime and signatures. The ticket itself is still verified
+ on every session setup, and PAM account restrictions are still checked.
+****************************************************************************/
+
+#define KRB5_SERVER_INFO_CACHE_SIZE 16
+
+struct krb5_server_info_cache {
+	struct krb5_server_info_cache *prev, *next;
+	char *principal;
+	uint8 pac_digest[16];
+	time_t expires;
+	fstring real_username;
+	fstring pam_user;	/* check pam account restrictions for, or "" */
+	BOOL was_mapped;
+	auth_serversupplied_info *server_info;
+};
+
+static struct krb5_server_info_cache *krb5_server_info_cache;
+static int krb5_server_info_cache_count;
+
+static void krb5_server_info_cache_remove(struct krb5_server_info_cache *e)
+{
+	DLIST_REMOVE(krb5_server_info_cache, e);
+	krb5_server_info_cache_count--;
+	TALLOC_FREE(e);
+}
+
+static BOOL krb5_server_info_cache_fetch(const char *principal,
+					 PAC_DATA *pac_data,
+					 auth_serversupplied_info **server_info,
+					 fstring real_username,
+					 fstring pam_user)
+{
+	struct krb5_server_info_cache *e, *next;
+	time_t now = time(NULL);
+
+	for (e = krb5_server_info_cache; e; e = next) {
+		next = e->next;
+
+		if (e->expires <= now) {
+			krb5_server_info_cache_remove(e);
+			continue;
+		}
+
+		if (strcmp(e->principal, principal) != 0 ||
+		    memcmp(e->pac_digest, pac_data->digest,
+			   sizeof(e->pac_digest)) != 0) {
+			continue;
+		}
+
+		*server_info = copy_serverinfo(e->server_info);
+		if (*server_info == NULL) {
+			return False;
+		}
+		(*server_info)->was_mapped = e->was_mapped;
+
+		fstrcpy(real_username, e->real_username);
+		fstrcpy(pam_user, e->pam_user);
+
+		DLIST_PROMOTE(krb5_server_info_cache, e);
+
+		DEBUG(5,("krb5_server_info_cache_fetch: reusing server info "
+			 "for %s\n", principal));
+		return True;
+	}
+
+	return False;
+}
+
+static void krb5_server_info_cache_store(const char *principal,
+					 PAC_DATA *pac_data,
+					 auth_serversupplied_info *server_info,
+					 const char *real_username,
+					 const char *pam_user)
+{
+	struct krb5_server_info_cache *e;
+	int ttl = lp_parm_int(-1, "kerberos", "server info cache time", 300);
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	e = TALLOC_ZERO_P(NULL, struct krb5_server_info_cache);
+	if (e == NULL) {
+		return;
+	}
+
+	e->principal = talloc_strdup(e, principal);
+	e->server_info = copy_serverinfo(server_info);
+	if (e->principal == NULL || e->server_info == NULL) {
+		TALLOC_FREE(e->server_info);
+		TALLOC_FREE(e);
+		return;
+	}
+	talloc_steal(e, e->server_info);
+
+	memcpy(e->pac_digest, pac_data->digest, sizeof(e->pac_digest));
+	e->expires = time(NULL) + ttl;
+	e->was_mapped = server_info->was_mapped;
+	fstrcpy(e->real_username, real_username);
+	fstrcpy(e->pam_user, pam_user);
+
+	DLIST_ADD(krb5_server_info_cache, e);
+	krb5_server_info_cache_count++;
+
+	while (krb5_server_info_cache_count > KRB5_SERVER_INFO_CACHE_SIZE) {
+		struct krb5_server_info_cache *last;
+
+		for (last = krb5_server_info_cache; last->next;
+		     last = last->next) {
+			;
+		}
+		krb5_server_info_cache_remove(last);
+	}
+}
+
 /****************************************************************************
  Reply to a session setup spnego negotiate packet for kerberos.
 ****************************************************************************/
@@ -249,12 +374,15 @@ static int reply_spnego_kerberos(connection_struct *conn,
 	BOOL username_was_mapped;
 	PAC_LOGON_INFO *logon_info = NULL;
 	BOOL trustaccount = False;
+	char *full_principal = NULL;
+	fstring pam_user;
 
 	ZERO_STRUCT(ticket);
 	ZERO_STRUCT(pac_data);
 	ZERO_STRUCT(ap_rep);
 	ZERO_STRUCT(ap_rep_wrapped);
 	ZERO_STRUCT(response);
+	pam_user[0] = '\0';
 
 	/* Normally we will always invalidate the intermediate vuid. */
 	*p_invalidate_vuid = True;
@@ -376,6 +504,33 @@ skip_lkdc_verify:
 		}
 	}
 
+	if (logon_info) {
+		full_principal = talloc_asprintf(mem_ctx, "%s@%s", client, p+1);
+	}
+
+	if (full_principal &&
+	    krb5_server_info_cache_fetch(full_principal, pac_data,
+					 &server_info, real_username,
+					 pam_user)) {
+		if (pam_user[0]) {
+			ret = smb_pam_accountcheck(pam_user);
+			if (!NT_STATUS_IS_OK(ret)) {
+				DEBUG(1, ("PAM account restriction prevents user login\n"));
+				data_blob_free(&ap_rep);
+				data_blob_free(&session_key);
+				SAFE_FREE(client);
+				TALLOC_FREE(server_info);
+				TALLOC_FREE(mem_ctx);
+				return ERROR_NT(nt_status_squash(ret));
+			}
+		}
+
+		/* setup the string used by %U */
+		sub_set_smb_name( real_username );
+		reload_services(True);
+		goto register_session;
+	}
+
 	/* this gives a fully qualified user name (ie. with full realm).
 	   that leads to very long usernames, but what else can we do? */
 
@@ -465,6 +620,7 @@ skip_lkdc_verify:
 			TALLOC_FREE(mem_ctx);
 			return ERROR_NT(nt_status_squash(ret));
 		}
+		fstrcpy(pam_user, pw->pw_name);
 	}
 
 	if (!pw) {
@@ -554,6 +710,14 @@ skip_lkdc_verify:
 		}
 	}
 
+	if (full_principal) {
+		krb5_server_info_cache_store(full_principal, pac_data,
+					     server_info, real_username,
+					     pam_user);
+	}
+
+  register_session:
+
 	/* register_vuid keeps the server info */
 	/* register_vuid takes ownership of session_key, no need to free after this.
  	   A better interface would copy it.... */
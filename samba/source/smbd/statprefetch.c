@@ -0,0 +1,540 @@
+/*
+   Unix SMB/CIFS implementation.
+   Directory listing stat prefetch
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "includes.h"
+
+extern struct current_user current_user;
+
+/****************************************************************************
+ Stat prefetch for trans2 FIND_FIRST/FIND_NEXT.
+
+ A directory listing stats every entry one after the other. On filesystems
+ where a stat is a network round trip (NFS, AFP, cluster filesystems) the
+ listing takes one round trip per file even though the server could answer
+ many of them at the same time.
+
+ Each smbd keeps a pool of "stat prefetch processes" helpers for the
+ connection and user it is serving. Before the marshalling loop we peek at
+ the next batch of names in the directory and queue them on a request pipe
+ shared by the helpers. Requests and replies are fixed size records no
+ larger than PIPE_BUF, so they never interleave, and at most
+ STAT_PREFETCH_WINDOW_PER_PROC per helper are in flight. smbd never waits
+ to write a request and drains the result pipe as it goes, so neither
+ side can block the other. get_lanman2_dir_entry() then
+ picks up the results in directory order, falling back to stat'ing itself
+ for anything the helpers did not (or could not) answer.
+
+ When the reply buffer is full the rest of the batch is simply abandoned.
+ Every batch carries a generation number, and answers to older batches
+ are read and dropped while waiting for the current one.
+
+ smbd does not use threads (see the notes about libpthread in configure.in),
+ so the helpers are processes. They inherit the user context and current
+ directory of the request that started them, so the pool is rebuilt
+ whenever the connection or user changes, and shut down in close_cnum().
+ They are orphaned through an intermediate process so that init reaps
+ them, and exit by themselves once smbd closes the pipes.
+*****************************************************************************/
+
+/* Not worth it for fewer names than this. */
+#define STAT_PREFETCH_MIN_BATCH 32
+
+/* Upper bound on one batch, about a full 64k reply of short names. */
+#define STAT_PREFETCH_MAX_BATCH 512
+
+/* Upper bound on the number of helpers in a pool. */
+#define STAT_PREFETCH_MAX_PROCESSES 16
+
+/* Requests queued or being worked on, per helper. */
+#define STAT_PREFETCH_WINDOW_PER_PROC 2
+
+/* Give up on the pool if the helpers go quiet for this long (seconds). */
+#define STAT_PREFETCH_TIMEOUT 30
+
+struct stat_prefetch_request {
+	uint32 generation;
+	int32 index;
+	int32 use_lstat;
+	pstring path;
+};
+
+struct stat_prefetch_record {
+	uint32 generation;
+	int32 index;
+	int32 err;
+	SMB_STRUCT_STAT st;
+};
+
+struct stat_prefetch_result {
+	BOOL done;
+	int err;
+	SMB_STRUCT_STAT st;
+};
+
+struct stat_prefetch_pool {
+	connection_struct *conn;
+	uint16 vuid;
+	int num_procs;
+	int req_fd;
+	int res_fd;
+	uint32 generation;
+	int outstanding;
+};
+
+struct stat_prefetch_batch {
+	TALLOC_CTX *mem_ctx;
+	uint32 generation;
+	BOOL use_lstat;
+	int num_names;
+	char **paths;
+	struct stat_prefetch_result *results;
+	int cursor;
+	int next_send;
+};
+
+/* One pool and at most one directory listing in progress per smbd. */
+static struct stat_prefetch_pool *current_pool;
+static struct stat_prefetch_batch *current_batch;
+
+/****************************************************************************
+ The body of a helper process. Never returns.
+****************************************************************************/
+
+static void stat_prefetch_child(connection_struct *conn, int req_fd,
+				int res_fd)
+{
+	struct stat_prefetch_request req;
+	struct stat_prefetch_record rec;
+
+	while (sys_read(req_fd, &req, sizeof(req)) == sizeof(req)) {
+		int ret;
+
+		req.path[sizeof(req.path)-1] = '\0';
+
+		ZERO_STRUCT(rec);
+		rec.generation = req.generation;
+		rec.index = req.index;
+
+		if (req.use_lstat) {
+			ret = SMB_VFS_LSTAT(conn, req.path, &rec.st);
+		} else {
+			ret = SMB_VFS_STAT(conn, req.path, &rec.st);
+		}
+		rec.err = (ret == 0) ? 0 : errno;
+
+		if (write(res_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+			break;
+		}
+	}
+
+	/* smbd has closed the pipes. */
+	_exit(0);
+}
+
+/****************************************************************************
+ Shut down the pool. The helpers see EOF (or EPIPE) and exit.
+****************************************************************************/
+
+static void stat_prefetch_pool_free(void)
+{
+	struct stat_prefetch_pool *pool = current_pool;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	current_pool = NULL;
+
+	close(pool->req_fd);
+	close(pool->res_fd);
+
+	DEBUG(10,("stat_prefetch_pool_free: %d helpers for %s\n",
+		  pool->num_procs, lp_servicename(SNUM(pool->conn))));
+
+	SAFE_FREE(pool);
+}
+
+/****************************************************************************
+ Start num_procs helpers in the current user context.
+****************************************************************************/
+
+static struct stat_prefetch_pool *stat_prefetch_pool_new(
+	connection_struct *conn, int num_procs)
+{
+	struct stat_prefetch_pool *pool;
+	int req[2], res[2];
+	pid_t pid;
+
+	if (pipe(req) == -1) {
+		DEBUG(3,("stat_prefetch_pool_new: pipe failed: %s\n",
+			 strerror(errno)));
+		return NULL;
+	}
+	if (pipe(res) == -1) {
+		DEBUG(3,("stat_prefetch_pool_new: pipe failed: %s\n",
+			 strerror(errno)));
+		close(req[0]);
+		close(req[1]);
+		return NULL;
+	}
+
+	pid = sys_fork();
+	if (pid == -1) {
+		DEBUG(3,("stat_prefetch_pool_new: fork failed: %s\n",
+			 strerror(errno)));
+		close(req[0]);
+		close(req[1]);
+		close(res[0]);
+		close(res[1]);
+		return NULL;
+	}
+
+	if (pid == 0) {
+		int i;
+
+		close(req[1]);
+		close(res[0]);
+
+		/* Don't keep the client connection open after smbd exits. */
+		close(smbd_server_fd());
+
+		for (i = 0; i < num_procs; i++) {
+			if (sys_fork() == 0) {
+				stat_prefetch_child(conn, req[0], res[1]);
+			}
+		}
+		_exit(0);
+	}
+
+	close(req[0]);
+	close(res[1]);
+
+	/* The helpers now belong to init. */
+	sys_waitpid(pid, NULL, 0);
+
+	/* Only smbd writes requests, and it must never wait for room. */
+	set_blocking(req[1], False);
+
+	pool = SMB_MALLOC_P(struct stat_prefetch_pool);
+	if (pool == NULL) {
+		close(req[1]);
+		close(res[0]);
+		return NULL;
+	}
+
+	ZERO_STRUCTP(pool);
+	pool->conn = conn;
+	pool->vuid = current_user.vuid;
+	pool->num_procs = num_procs;
+	pool->req_fd = req[1];
+	pool->res_fd = res[0];
+
+	DEBUG(10,("stat_prefetch_pool_new: %d helpers for %s\n",
+		  num_procs, lp_servicename(SNUM(conn))));
+
+	return pool;
+}
+
+/****************************************************************************
+ The connection is going away, take its helpers with it.
+****************************************************************************/
+
+void stat_prefetch_close_conn(connection_struct *conn)
+{
+	if (current_pool != NULL && current_pool->conn == conn) {
+		stat_prefetch_end();
+		stat_prefetch_pool_free();
+	}
+}
+
+/****************************************************************************
+ Throw away the current batch. Answers still on their way are dropped
+ when they arrive.
+****************************************************************************/
+
+void stat_prefetch_end(void)
+{
+	struct stat_prefetch_batch *batch = current_batch;
+
+	if (batch == NULL) {
+		return;
+	}
+
+	current_batch = NULL;
+
+	DEBUG(10,("stat_prefetch_end: %d of %d names consumed, %d sent\n",
+		  batch->cursor, batch->num_names, batch->next_send));
+
+	talloc_destroy(batch->mem_ctx);
+}
+
+/****************************************************************************
+ Queue as many of the batch's names as the window allows.
+****************************************************************************/
+
+static BOOL stat_prefetch_send(struct stat_prefetch_batch *batch)
+{
+	struct stat_prefetch_pool *pool = current_pool;
+	struct stat_prefetch_request req;
+	int window = pool->num_procs * STAT_PREFETCH_WINDOW_PER_PROC;
+
+	while (pool->outstanding < window &&
+	       batch->next_send < batch->num_names) {
+		int i = batch->next_send++;
+
+		if (batch->results[i].done) {
+			/* Not one for the helpers. */
+			continue;
+		}
+
+		ZERO_STRUCT(req);
+		req.generation = batch->generation;
+		req.index = i;
+		req.use_lstat = batch->use_lstat;
+		pstrcpy(req.path, batch->paths[i]);
+
+		if (write(pool->req_fd, &req, sizeof(req)) != sizeof(req)) {
+			if (errno == EAGAIN) {
+				/* Pipe full, send it later. */
+				batch->next_send--;
+				break;
+			}
+			DEBUG(3,("stat_prefetch_send: write failed: %s\n",
+				 strerror(errno)));
+			return False;
+		}
+		pool->outstanding++;
+	}
+
+	return True;
+}
+
+/****************************************************************************
+ Start prefetching the stat information for the next (at most) max_names
+ entries of a wildcard search. Does nothing unless "stat prefetch processes"
+ is set for the share and the batch is big enough to be worth it.
+****************************************************************************/
+
+void stat_prefetch_start(connection_struct *conn, struct dptr_struct *dptr,
+			 int max_names, BOOL use_lstat)
+{
+	struct stat_prefetch_batch *batch;
+	TALLOC_CTX *mem_ctx;
+	int nprocs = lp_stat_prefetch_processes(SNUM(conn));
+	BOOL needslash = (conn->dirpath[strlen(conn->dirpath)-1] != '/');
+	char **names;
+	int i;
+
+	stat_prefetch_end();
+
+	nprocs = MIN(nprocs, STAT_PREFETCH_MAX_PROCESSES);
+
+	if (nprocs <= 0 || !dptr_has_wild(dptr) ||
+	    sizeof(struct stat_prefetch_request) > PIPE_BUF ||
+	    sizeof(struct stat_prefetch_record) > PIPE_BUF) {
+		return;
+	}
+
+	max_names = MIN(max_names, STAT_PREFETCH_MAX_BATCH);
+	if (max_names < STAT_PREFETCH_MIN_BATCH) {
+		return;
+	}
+
+	if (current_pool != NULL &&
+	    (current_pool->conn != conn ||
+	     current_pool->vuid != current_user.vuid ||
+	     current_pool->num_procs != nprocs)) {
+		stat_prefetch_pool_free();
+	}
+
+	mem_ctx = talloc_init("stat_prefetch");
+	if (mem_ctx == NULL) {
+		return;
+	}
+
+	batch = TALLOC_ZERO_P(mem_ctx, struct stat_prefetch_batch);
+	if (batch == NULL) {
+		talloc_destroy(mem_ctx);
+		return;
+	}
+	batch->mem_ctx = mem_ctx;
+	batch->use_lstat = use_lstat;
+
+	batch->num_names = dptr_peek_names(mem_ctx, dptr, max_names, &names);
+	if (batch->num_names < STAT_PREFETCH_MIN_BATCH) {
+		talloc_destroy(mem_ctx);
+		return;
+	}
+
+	/* Same path construction as get_lanman2_dir_entry(). */
+	batch->paths = TALLOC_ARRAY(mem_ctx, char *, batch->num_names);
+	batch->results = TALLOC_ZERO_ARRAY(mem_ctx, struct stat_prefetch_result,
+					   batch->num_names);
+	if (batch->paths == NULL || batch->results == NULL) {
+		talloc_destroy(mem_ctx);
+		return;
+	}
+
+	for (i = 0; i < batch->num_names; i++) {
+		batch->paths[i] = talloc_asprintf(mem_ctx, "%s%s%s",
+						  conn->dirpath,
+						  needslash ? "/" : "",
+						  names[i]);
+		if (batch->paths[i] == NULL) {
+			talloc_destroy(mem_ctx);
+			return;
+		}
+		if (strlen(batch->paths[i]) >= sizeof(pstring)) {
+			/* Doesn't fit a request, the caller stats it. */
+			batch->results[i].done = True;
+			batch->results[i].err = ENAMETOOLONG;
+		}
+	}
+
+	if (current_pool == NULL) {
+		current_pool = stat_prefetch_pool_new(conn, nprocs);
+		if (current_pool == NULL) {
+			talloc_destroy(mem_ctx);
+			return;
+		}
+	}
+
+	batch->generation = ++current_pool->generation;
+
+	if (!stat_prefetch_send(batch)) {
+		stat_prefetch_pool_free();
+		talloc_destroy(mem_ctx);
+		return;
+	}
+
+	current_batch = batch;
+
+	DO_PROFILE_INC(statprefetch_batches);
+
+	DEBUG(10,("stat_prefetch_start: %d names in %s with %d helpers\n",
+		  batch->num_names, conn->dirpath, current_pool->num_procs));
+}
+
+/****************************************************************************
+ Read results from the helpers until the one for index arrives, keeping
+ the window full as we go.
+****************************************************************************/
+
+static BOOL stat_prefetch_wait(struct stat_prefetch_batch *batch, int index)
+{
+	struct stat_prefetch_record rec;
+
+	while (!batch->results[index].done) {
+		struct stat_prefetch_pool *pool = current_pool;
+		struct timeval timeout;
+		fd_set fds;
+		ssize_t ret;
+
+		if (pool == NULL) {
+			return False;
+		}
+
+		if (!stat_prefetch_send(batch) || pool->outstanding == 0) {
+			goto broken;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(pool->res_fd, &fds);
+		timeout.tv_sec = STAT_PREFETCH_TIMEOUT;
+		timeout.tv_usec = 0;
+
+		if (sys_select_intr(pool->res_fd+1, &fds, NULL, NULL,
+				    &timeout) != 1) {
+			DEBUG(3,("stat_prefetch_wait: no answer from the "
+				 "helpers\n"));
+			goto broken;
+		}
+
+		ret = sys_read(pool->res_fd, &rec, sizeof(rec));
+		if (ret != sizeof(rec)) {
+			/* All helpers gone. */
+			goto broken;
+		}
+
+		pool->outstanding--;
+
+		if (rec.generation != batch->generation) {
+			/* Left over from an abandoned batch. */
+			continue;
+		}
+		if (rec.index < 0 || rec.index >= batch->num_names) {
+			goto broken;
+		}
+
+		batch->results[rec.index].done = True;
+		batch->results[rec.index].err = rec.err;
+		batch->results[rec.index].st = rec.st;
+	}
+
+	return True;
+
+ broken:
+	/* The window accounting can't be trusted any more, start over
+	 * with a new pool next time. */
+	stat_prefetch_pool_free();
+	return False;
+}
+
+/****************************************************************************
+ Get the prefetched stat of pathreal. Returns False if the caller should
+ do the stat itself.
+****************************************************************************/
+
+BOOL stat_prefetch_fetch(const char *pathreal, BOOL use_lstat,
+			 SMB_STRUCT_STAT *psbuf)
+{
+	struct stat_prefetch_batch *batch = current_batch;
+	int i;
+
+	if (batch == NULL || batch->use_lstat != use_lstat) {
+		return False;
+	}
+
+	/*
+	 * The caller skips names that don't match the mask or are not
+	 * visible, so search forward from where we were.
+	 */
+
+	for (i = batch->cursor; i < batch->num_names; i++) {
+		if (strcmp(batch->paths[i], pathreal) == 0) {
+			break;
+		}
+	}
+
+	if (i == batch->num_names) {
+		DO_PROFILE_INC(statprefetch_misses);
+		return False;
+	}
+
+	batch->cursor = i + 1;
+
+	if (!stat_prefetch_wait(batch, i) || batch->results[i].err != 0) {
+		DO_PROFILE_INC(statprefetch_misses);
+		return False;
+	}
+
+	DO_PROFILE_INC(statprefetch_hits);
+	*psbuf = batch->results[i].st;
+	return True;
+}
@@ -293,16 +293,26 @@ static unsigned int fill_ea_buffer(TALLOC_CTX *mem_ctx, char *pdata, unsigned in
 	return ret_data_size;
 }
 
-static unsigned int estimate_ea_size(connection_struct *conn, files_struct *fsp, const char *fname)
+static unsigned int estimate_ea_size(connection_struct *conn, files_struct *fsp, const char *fname,
+				     SMB_STRUCT_STAT *psbuf)
 {
 	size_t total_ea_len = 0;
 	TALLOC_CTX *mem_ctx = NULL;
+	BOOL cacheable = (psbuf != NULL && VALID_STAT(*psbuf));
 
 	if (!lp_ea_support(SNUM(conn))) {
 		return 0;
 	}
+	if (cacheable && attr_cache_fetch_ea_size(psbuf, &total_ea_len)) {
+		return total_ea_len;
+	}
 	mem_ctx = talloc_init("estimate_ea_size");
-	(void)get_ea_list_from_file(mem_ctx, conn, fsp, fname, &total_ea_len);
+	if (get_ea_list_from_file(mem_ctx, conn, fsp, fname, &total_ea_len) != NULL ||
+	    total_ea_len == 0) {
+		if (cacheable) {
+			attr_cache_store_ea_size(psbuf, total_ea_len);
+		}
+	}
 	talloc_destroy(mem_ctx);
 	return total_ea_len;
 }
@@ -338,6 +348,11 @@ NTSTATUS set_ea(connection_struct *conn, files_struct *fsp, const char *fname, s
 		return NT_STATUS_EAS_NOT_SUPPORTED;
 	}
 
+	/* Without an fsp the ctime change invalidates the cached EA size. */
+	if (fsp) {
+		attr_cache_delete(fsp->dev, fsp->inode);
+	}
+
 	for (;ea_list; ea_list = ea_list->next) {
 		int ret;
 		fstring unix_ea_name;
@@ -945,7 +960,7 @@ static int call_trans2open(connection_struct *conn, char *inbuf, char *outbuf, i
 	SIVAL(params,20,inode);
 	SSVAL(params,24,0); /* Padding. */
 	if (flags & 8) {
-		uint32 ea_size = estimate_ea_size(conn, fsp, fname);
+		uint32 ea_size = estimate_ea_size(conn, fsp, fname, &sbuf);
 		SIVAL(params, 26, ea_size);
 	} else {
 		SIVAL(params, 26, 0);
@@ -1198,12 +1213,15 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			pstrcat(pathreal,dname);
 
 			if (INFO_LEVEL_IS_UNIX(info_level)) {
-				if (SMB_VFS_LSTAT(conn,pathreal,&sbuf) != 0) {
+				if (!stat_prefetch_fetch(pathreal, True, &sbuf) &&
+				    SMB_VFS_LSTAT(conn,pathreal,&sbuf) != 0) {
 					DEBUG(5,("get_lanman2_dir_entry:Couldn't lstat [%s] (%s)\n",
 						pathreal,strerror(errno)));
 					continue;
 				}
-			} else if (!VALID_STAT(sbuf) && SMB_VFS_STAT(conn,pathreal,&sbuf) != 0) {
+			} else if (!VALID_STAT(sbuf) &&
+				   !stat_prefetch_fetch(pathreal, False, &sbuf) &&
+				   SMB_VFS_STAT(conn,pathreal,&sbuf) != 0) {
 				pstring link_target;
 
 				/* Needed to show the msdfs symlinks as 
@@ -1316,7 +1334,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			SIVAL(p,16,(uint32)allocation_size);
 			SSVAL(p,20,mode);
 			{
-				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal);
+				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal, &sbuf);
 				SIVAL(p,22,ea_size); /* Extended attributes */
 			}
 			p += 27;
@@ -1413,7 +1431,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			SIVAL(p,0,nt_extmode); p += 4;
 			q = p; p += 4; /* q is placeholder for name length. */
 			{
-				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal);
+				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal, &sbuf);
 				SIVAL(p,0,ea_size); /* Extended attributes */
 				p += 4;
 			}
@@ -1483,7 +1501,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			SIVAL(p,0,nt_extmode); p += 4;
 			q = p; p += 4; /* q is placeholder for name length. */
 			{
-				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal);
+				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal, &sbuf);
 				SIVAL(p,0,ea_size); /* Extended attributes */
 				p +=4;
 			}
@@ -1530,7 +1548,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			SIVAL(p,0,nt_extmode); p += 4;
 			q = p; p += 4; /* q is placeholder for name length. */
 			{
-				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal);
+				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal, &sbuf);
 				SIVAL(p,0,ea_size); /* Extended attributes */
 				p +=4;
 			}
@@ -1562,7 +1580,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 			SIVAL(p,0,nt_extmode); p += 4;
 			q = p; p += 4; /* q is placeholder for name length */
 			{
-				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal);
+				unsigned int ea_size = estimate_ea_size(conn, NULL, pathreal, &sbuf);
 				SIVAL(p,0,ea_size); /* Extended attributes */
 				p +=4;
 			}
@@ -1862,6 +1880,10 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 	space_remaining = max_data_bytes;
 	out_of_space = False;
 
+	stat_prefetch_start(conn, conn->dirptr,
+			    MIN(maxentries, max_data_bytes / DIRLEN_GUESS),
+			    INFO_LEVEL_IS_UNIX(info_level));
+
 	for (i=0;(i<maxentries) && !finished && !out_of_space;i++) {
 		BOOL got_exact_match = False;
 
@@ -1897,6 +1919,8 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 
 		space_remaining = max_data_bytes - PTR_DIFF(p,pdata);
 	}
+
+	stat_prefetch_end();
   
 	talloc_destroy(ea_ctx);
 
@@ -2176,6 +2200,10 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 		finished = !dptr_SearchDir(conn->dirptr, resume_name, &current_pos, &st);
 	} /* end if resume_name && !continue_bit */
 
+	stat_prefetch_start(conn, conn->dirptr,
+			    MIN((int)maxentries, max_data_bytes / DIRLEN_GUESS),
+			    INFO_LEVEL_IS_UNIX(info_level));
+
 	for (i=0;(i<(int)maxentries) && !finished && !out_of_space ;i++) {
 		BOOL got_exact_match = False;
 
@@ -2211,6 +2239,8 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 
 		space_remaining = max_data_bytes - PTR_DIFF(p,pdata);
 	}
+
+	stat_prefetch_end();
   
 	talloc_destroy(ea_ctx);
 
@@ -3638,7 +3668,7 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 
 		case SMB_INFO_QUERY_EA_SIZE:
 		{
-			unsigned int ea_size = estimate_ea_size(conn, fsp, fname);
+			unsigned int ea_size = estimate_ea_size(conn, fsp, fname, &sbuf);
 			DEBUG(10,("call_trans2qfilepathinfo: SMB_INFO_QUERY_EA_SIZE\n"));
 			data_size = 26;
 			srv_put_dos_date2(pdata,0,create_time);
@@ -3749,7 +3779,7 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 		case SMB_FILE_EA_INFORMATION:
 		case SMB_QUERY_FILE_EA_INFO:
 		{
-			unsigned int ea_size = estimate_ea_size(conn, fsp, fname);
+			unsigned int ea_size = estimate_ea_size(conn, fsp, fname, &sbuf);
 			DEBUG(10,("call_trans2qfilepathinfo: SMB_FILE_EA_INFORMATION\n"));
 			data_size = 4;
 			SIVAL(pdata,0,ea_size);
@@ -3803,7 +3833,7 @@ total_data=%u (should be %u)\n", (unsigned int)total_data, (unsigned int)IVAL(pd
 		case SMB_QUERY_FILE_ALL_INFO:
 		case SMB_FILE_ALL_INFORMATION:
 		{
-			unsigned int ea_size = estimate_ea_size(conn, fsp, fname);
+			unsigned int ea_size = estimate_ea_size(conn, fsp, fname, &sbuf);
 			DEBUG(10,("call_trans2qfilepathinfo: SMB_FILE_ALL_INFORMATION\n"));
 			put_long_date_timespec(pdata,create_time_ts);
 			put_long_date_timespec(pdata+8,atime_ts);
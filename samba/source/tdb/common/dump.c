@@ -34,27 +34,30 @@ static tdb_off_t tdb_dump_record(struct tdb_context *tdb, int hash,
 	struct list_struct rec;
 	tdb_off_t tailer_ofs, tailer;
 
-	if (tdb->methods->tdb_read(tdb, offset, (char *)&rec, 
-				   sizeof(rec), DOCONV()) == -1) {
-		printf("ERROR: failed to read record at %u\n", offset);
+	if (tdb_rec_header_read(tdb, offset, &rec) == -1) {
+		printf("ERROR: failed to read record at %llu\n",
+		       (unsigned long long)offset);
 		return 0;
 	}
 
-	printf(" rec: hash=%d offset=0x%08x next=0x%08x rec_len=%d "
-	       "key_len=%d data_len=%d full_hash=0x%x magic=0x%x\n",
-	       hash, offset, rec.next, rec.rec_len, rec.key_len, rec.data_len,
-	       rec.full_hash, rec.magic);
+	printf(" rec: hash=%d offset=0x%08llx next=0x%08llx rec_len=%llu "
+	       "key_len=%llu data_len=%llu full_hash=0x%x magic=0x%x\n",
+	       hash, (unsigned long long)offset, (unsigned long long)rec.next,
+	       (unsigned long long)rec.rec_len, (unsigned long long)rec.key_len,
+	       (unsigned long long)rec.data_len, rec.full_hash, rec.magic);
 
-	tailer_ofs = offset + sizeof(rec) + rec.rec_len - sizeof(tdb_off_t);
+	tailer_ofs = offset + TDB_REC_SIZE + rec.rec_len - TDB_OFF_SIZE;
 
 	if (tdb_ofs_read(tdb, tailer_ofs, &tailer) == -1) {
-		printf("ERROR: failed to read tailer at %u\n", tailer_ofs);
+		printf("ERROR: failed to read tailer at %llu\n",
+		       (unsigned long long)tailer_ofs);
 		return rec.next;
 	}
 
-	if (tailer != rec.rec_len + sizeof(rec)) {
-		printf("ERROR: tailer does not match record! tailer=%u totalsize=%u\n",
-				(unsigned int)tailer, (unsigned int)(rec.rec_len + sizeof(rec)));
+	if (tailer != rec.rec_len + TDB_REC_SIZE) {
+		printf("ERROR: tailer does not match record! tailer=%llu totalsize=%llu\n",
+		       (unsigned long long)tailer,
+		       (unsigned long long)(rec.rec_len + TDB_REC_SIZE));
 	}
 	return rec.next;
 }
@@ -94,45 +97,49 @@ void tdb_dump_all(struct tdb_context *tdb)
 int tdb_printfreelist(struct tdb_context *tdb)
 {
 	int ret;
-	long total_free = 0;
-	tdb_off_t offset, rec_ptr;
+	tdb_len_t total_free = 0;
+	tdb_off_t rec_ptr;
 	struct list_struct rec;
+	u32 list;
 
-	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
+	if ((ret = tdb_lock_freelists(tdb)) != 0)
 		return ret;
 
-	offset = FREELIST_TOP;
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
-		return 0;
-	}
-
-	printf("freelist top=[0x%08x]\n", rec_ptr );
-	while (rec_ptr) {
-		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
-					   sizeof(rec), DOCONV()) == -1) {
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+	for (list = 0; list < tdb_num_freelists(tdb); list++) {
+		/* read in the freelist top */
+		if (tdb_ofs_read(tdb, tdb_freelist_top(tdb, list), &rec_ptr) == -1) {
+			tdb_unlock_freelists(tdb);
+			return 0;
 		}
 
-		if (rec.magic != TDB_FREE_MAGIC) {
-			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+		if (tdb->header.freelist_classes) {
+			printf("size class %u ", list);
+		}
+		printf("freelist top=[0x%08llx]\n", (unsigned long long)rec_ptr );
+		while (rec_ptr) {
+			if (tdb_rec_header_read(tdb, rec_ptr, &rec) == -1) {
+				tdb_unlock_freelists(tdb);
+				return -1;
+			}
+
+			if (rec.magic != TDB_FREE_MAGIC) {
+				printf("bad magic 0x%08x in free list\n", rec.magic);
+				tdb_unlock_freelists(tdb);
+				return -1;
+			}
+
+			printf("entry offset=[0x%08llx], rec.rec_len = [0x%08llx (%llu)] (end = 0x%08llx)\n", 
+			       (unsigned long long)rec_ptr, (unsigned long long)rec.rec_len,
+			       (unsigned long long)rec.rec_len,
+			       (unsigned long long)(rec_ptr + rec.rec_len));
+			total_free += rec.rec_len;
+
+			/* move to the next record */
+			rec_ptr = rec.next;
 		}
-
-		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
-		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
-
-		/* move to the next record */
-		rec_ptr = rec.next;
 	}
-	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
-               (int)total_free);
+	printf("total rec_len = [0x%08llx (%llu)]\n", (unsigned long long)total_free, 
+               (unsigned long long)total_free);
 
-	return tdb_unlock(tdb, -1, F_WRLCK);
+	return tdb_unlock_freelists(tdb);
 }
-
@@ -31,31 +31,136 @@
 /* read a freelist record and check for simple errors */
 int rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct list_struct *rec)
 {
-	if (tdb->methods->tdb_read(tdb, off, rec, sizeof(*rec),DOCONV()) == -1)
+	if (tdb_rec_header_read(tdb, off, rec) == -1)
 		return -1;
 
 	if (rec->magic == TDB_MAGIC) {
 		/* this happens when a app is showdown while deleting a record - we should
 		   not completely fail when this happens */
-		TDB_LOG((tdb, TDB_DEBUG_WARNING, "rec_free_read non-free magic 0x%x at offset=%d - fixing\n", 
-			 rec->magic, off));
+		TDB_LOG((tdb, TDB_DEBUG_WARNING, "rec_free_read non-free magic 0x%x at offset=%llu - fixing\n", 
+			 rec->magic, (unsigned long long)off));
 		rec->magic = TDB_FREE_MAGIC;
-		if (tdb->methods->tdb_write(tdb, off, rec, sizeof(*rec)) == -1)
+		if (tdb_rec_write(tdb, off, rec) == -1)
 			return -1;
 	}
 
 	if (rec->magic != TDB_FREE_MAGIC) {
 		/* Ensure ecode is set for log fn. */
 		tdb->ecode = TDB_ERR_CORRUPT;
-		TDB_LOG((tdb, TDB_DEBUG_WARNING, "rec_free_read bad magic 0x%x at offset=%d\n", 
-			   rec->magic, off));
+		TDB_LOG((tdb, TDB_DEBUG_WARNING, "rec_free_read bad magic 0x%x at offset=%llu\n", 
+			   rec->magic, (unsigned long long)off));
 		return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
 	}
-	if (tdb->methods->tdb_oob(tdb, rec->next+sizeof(*rec), 0) != 0)
+	if (tdb->methods->tdb_oob(tdb, rec->next+TDB_REC_SIZE, 0) != 0)
 		return -1;
 	return 0;
 }
 
+/* number of free lists: 1 for the classic layout */
+u32 tdb_num_freelists(struct tdb_context *tdb)
+{
+	return tdb->header.freelist_classes ? tdb->header.freelist_classes : 1;
+}
+
+/* offset of the head of free list "list" */
+tdb_off_t tdb_freelist_top(struct tdb_context *tdb, u32 list)
+{
+	if (list == 0) {
+		return FREELIST_TOP;
+	}
+	if (TDB_IS64) {
+		return offsetof(struct tdb_header, freelist_class_top64) +
+			(list-1)*sizeof(u64);
+	}
+	return offsetof(struct tdb_header, freelist_class_top) +
+		(list-1)*sizeof(u32);
+}
+
+/* the size class list a free record of rec_len bytes belongs on */
+static u32 size_class(struct tdb_context *tdb, tdb_len_t rec_len)
+{
+	u32 c = 0;
+
+	rec_len >>= TDB_SIZE_CLASS_SHIFT;
+	while (rec_len != 0 && c+1 < tdb->header.freelist_classes) {
+		rec_len >>= 1;
+		c++;
+	}
+	return c;
+}
+
+static int class_lock(struct tdb_context *tdb, u32 c)
+{
+	return tdb_lock(tdb, TDB_SIZE_CLASS_LIST(c), F_WRLCK);
+}
+
+static int class_unlock(struct tdb_context *tdb, u32 c)
+{
+	return tdb_unlock(tdb, TDB_SIZE_CLASS_LIST(c), F_WRLCK);
+}
+
+/*
+  The classic layout serialises all allocation on the freelist lock, and
+  callers take it around a sequence of allocations and frees. With size
+  classes every list is locked on its own inside tdb_allocate() and
+  tdb_free(), so stores into different chains don't meet here at all.
+ */
+int tdb_lock_freelist(struct tdb_context *tdb)
+{
+	if (tdb->header.freelist_classes) {
+		return 0;
+	}
+	return tdb_lock(tdb, -1, F_WRLCK);
+}
+
+int tdb_unlock_freelist(struct tdb_context *tdb)
+{
+	if (tdb->header.freelist_classes) {
+		return 0;
+	}
+	return tdb_unlock(tdb, -1, F_WRLCK);
+}
+
+/*
+  lock every free list, for walking them or rearranging free space. The
+  expansion lock (-1) comes first: tdb_expand() holds it while freeing
+  the new space, nobody holds a class lock while waiting for anything.
+ */
+int tdb_lock_freelists(struct tdb_context *tdb)
+{
+	u32 c;
+
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+		return -1;
+	}
+	for (c = 0; c < tdb->header.freelist_classes; c++) {
+		if (class_lock(tdb, c) == -1) {
+			while (c-- > 0) {
+				class_unlock(tdb, c);
+			}
+			tdb_unlock(tdb, -1, F_WRLCK);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int tdb_unlock_freelists(struct tdb_context *tdb)
+{
+	u32 c;
+	int ret = 0;
+
+	for (c = tdb->header.freelist_classes; c-- > 0; ) {
+		if (class_unlock(tdb, c) == -1) {
+			ret = -1;
+		}
+	}
+	if (tdb_unlock(tdb, -1, F_WRLCK) == -1) {
+		ret = -1;
+	}
+	return ret;
+}
+
 
 
 /* Remove an element from the freelist.  Must have alloc lock. */
@@ -73,7 +178,8 @@ static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off, tdb_off_
 		/* Follow chain (next offset is at start of record) */
 		last_ptr = i;
 	}
-	TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%d\n", off));
+	TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%llu\n",
+		 (unsigned long long)off));
 	return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
 }
 
@@ -85,17 +191,144 @@ static int update_tailer(struct tdb_context *tdb, tdb_off_t offset,
 	tdb_off_t totalsize;
 
 	/* Offset of tailer from record header */
-	totalsize = sizeof(*rec) + rec->rec_len;
-	return tdb_ofs_write(tdb, offset + totalsize - sizeof(tdb_off_t),
+	totalsize = TDB_REC_SIZE + rec->rec_len;
+	return tdb_ofs_write(tdb, offset + totalsize - TDB_OFF_SIZE,
 			 &totalsize);
 }
 
+/* Remove a record from size class list c, must hold its lock. Unlike
+   remove_from_freelist() not finding it is not an error: the caller
+   only looked at the record without the lock. */
+static int remove_from_class(struct tdb_context *tdb, u32 c, tdb_off_t off,
+			     tdb_off_t next)
+{
+	tdb_off_t last_ptr, i;
+
+	last_ptr = tdb_freelist_top(tdb, c);
+	while (tdb_ofs_read(tdb, last_ptr, &i) != -1 && i != 0) {
+		if (i == off) {
+			return tdb_ofs_write(tdb, last_ptr, &next);
+		}
+		last_ptr = i;
+	}
+	return -1;
+}
+
+/*
+  Take a neighbouring free record off its list so that tdb_free() can
+  merge it. We saw it without any lock, so check under the lock of its
+  list that it is still free, still the same size and still listed. It
+  is then marked dead so that nobody else tries to merge it.
+ */
+static int claim_free_record(struct tdb_context *tdb, tdb_off_t off,
+			     tdb_len_t rec_len)
+{
+	struct list_struct r;
+	u32 c = size_class(tdb, rec_len);
+	int ret = -1;
+
+	if (class_lock(tdb, c) == -1) {
+		return -1;
+	}
+
+	if (tdb_rec_header_read(tdb, off, &r) == -1 ||
+	    r.magic != TDB_FREE_MAGIC || r.rec_len != rec_len ||
+	    remove_from_class(tdb, c, off, r.next) == -1) {
+		goto out;
+	}
+
+	r.magic = TDB_DEAD_MAGIC;
+	ret = tdb_rec_write(tdb, off, &r);
+ out:
+	class_unlock(tdb, c);
+	return ret;
+}
+
+/*
+  tdb_free() for size classes. No lock is held while merging: the
+  record being freed is on no list and not marked free, so only we
+  touch it, and neighbours are claimed one at a time under their own
+  list lock. Two neighbours freed at the same moment may end up not
+  merged, tdb_defrag() picks those up.
+ */
+static int tdb_free_class(struct tdb_context *tdb, tdb_off_t offset,
+			  struct list_struct *rec)
+{
+	tdb_off_t right, left;
+	u32 c;
+
+	/* set an initial tailer, so if we fail we don't leave a bogus record */
+	if (update_tailer(tdb, offset, rec) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed!\n"));
+		return -1;
+	}
+
+	right = offset + TDB_REC_SIZE + rec->rec_len;
+	if (right + TDB_REC_SIZE <= tdb->map_size) {
+		struct list_struct r;
+
+		if (tdb_rec_header_read(tdb, right, &r) == 0 &&
+		    r.magic == TDB_FREE_MAGIC &&
+		    claim_free_record(tdb, right, r.rec_len) == 0) {
+			rec->rec_len += TDB_REC_SIZE + r.rec_len;
+		}
+	}
+
+	left = offset - TDB_OFF_SIZE;
+	if (left > TDB_DATA_START(tdb->header.hash_size)) {
+		struct list_struct l;
+		tdb_off_t leftsize;
+
+		if (tdb_ofs_read(tdb, left, &leftsize) == 0 &&
+		    leftsize > TDB_REC_SIZE && leftsize != TDB_PAD_U32 &&
+		    leftsize != TDB_PAD_U64 &&
+		    leftsize < offset - TDB_DATA_START(tdb->header.hash_size) &&
+		    tdb_rec_header_read(tdb, offset - leftsize, &l) == 0 &&
+		    l.magic == TDB_FREE_MAGIC &&
+		    TDB_REC_SIZE + l.rec_len == leftsize &&
+		    claim_free_record(tdb, offset - leftsize, l.rec_len) == 0) {
+			offset -= leftsize;
+			rec->rec_len += leftsize;
+		}
+	}
+
+	if (update_tailer(tdb, offset, rec) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %llu\n",
+			 (unsigned long long)offset));
+		return -1;
+	}
+
+	/* Now, prepend to the free list of its class */
+	c = size_class(tdb, rec->rec_len);
+	if (class_lock(tdb, c) == -1) {
+		return -1;
+	}
+
+	rec->magic = TDB_FREE_MAGIC;
+
+	if (tdb_ofs_read(tdb, tdb_freelist_top(tdb, c), &rec->next) == -1 ||
+	    tdb_rec_write(tdb, offset, rec) == -1 ||
+	    tdb_ofs_write(tdb, tdb_freelist_top(tdb, c), &offset) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%llu\n",
+			 (unsigned long long)offset));
+		class_unlock(tdb, c);
+		return -1;
+	}
+
+	class_unlock(tdb, c);
+	return 0;
+}
+
 /* Add an element into the freelist. Merge adjacent records if
    neccessary. */
 int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
 {
 	tdb_off_t right, left;
 
+	if (tdb->header.freelist_classes) {
+		return tdb_free_class(tdb, offset, rec);
+	}
+
 	/* Allocation and tailer lock */
 	if (tdb_lock(tdb, -1, F_WRLCK) != 0)
 		return -1;
@@ -107,55 +340,61 @@ int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
 	}
 
 	/* Look right first (I'm an Australian, dammit) */
-	right = offset + sizeof(*rec) + rec->rec_len;
-	if (right + sizeof(*rec) <= tdb->map_size) {
+	right = offset + TDB_REC_SIZE + rec->rec_len;
+	if (right + TDB_REC_SIZE <= tdb->map_size) {
 		struct list_struct r;
 
-		if (tdb->methods->tdb_read(tdb, right, &r, sizeof(r), DOCONV()) == -1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: right read failed at %u\n", right));
+		if (tdb_rec_header_read(tdb, right, &r) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: right read failed at %llu\n",
+				 (unsigned long long)right));
 			goto left;
 		}
 
 		/* If it's free, expand to include it. */
 		if (r.magic == TDB_FREE_MAGIC) {
 			if (remove_from_freelist(tdb, right, r.next) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: right free failed at %u\n", right));
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: right free failed at %llu\n",
+					 (unsigned long long)right));
 				goto left;
 			}
-			rec->rec_len += sizeof(r) + r.rec_len;
+			rec->rec_len += TDB_REC_SIZE + r.rec_len;
 		}
 	}
 
 left:
 	/* Look left */
-	left = offset - sizeof(tdb_off_t);
+	left = offset - TDB_OFF_SIZE;
 	if (left > TDB_DATA_START(tdb->header.hash_size)) {
 		struct list_struct l;
 		tdb_off_t leftsize;
 		
 		/* Read in tailer and jump back to header */
 		if (tdb_ofs_read(tdb, left, &leftsize) == -1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left offset read failed at %u\n", left));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left offset read failed at %llu\n",
+				 (unsigned long long)left));
 			goto update;
 		}
 
 		/* it could be uninitialised data */
-		if (leftsize == 0 || leftsize == TDB_PAD_U32) {
+		if (leftsize == 0 || leftsize == TDB_PAD_U32 ||
+		    leftsize == TDB_PAD_U64) {
 			goto update;
 		}
 
 		left = offset - leftsize;
 
 		/* Now read in record */
-		if (tdb->methods->tdb_read(tdb, left, &l, sizeof(l), DOCONV()) == -1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left read failed at %u (%u)\n", left, leftsize));
+		if (tdb_rec_header_read(tdb, left, &l) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left read failed at %llu (%llu)\n",
+				 (unsigned long long)left, (unsigned long long)leftsize));
 			goto update;
 		}
 
 		/* If it's free, expand to include it. */
 		if (l.magic == TDB_FREE_MAGIC) {
 			if (remove_from_freelist(tdb, left, l.next) == -1) {
-				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left free failed at %u\n", left));
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left free failed at %llu\n",
+					 (unsigned long long)left));
 				goto update;
 			} else {
 				offset = left;
@@ -166,7 +405,8 @@ left:
 
 update:
 	if (update_tailer(tdb, offset, rec) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %u\n", offset));
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: update_tailer failed at %llu\n",
+			 (unsigned long long)offset));
 		goto fail;
 	}
 
@@ -176,7 +416,8 @@ update:
 	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec->next) == -1 ||
 	    tdb_rec_write(tdb, offset, rec) == -1 ||
 	    tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%d\n", offset));
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%llu\n",
+			 (unsigned long long)offset));
 		goto fail;
 	}
 
@@ -208,8 +449,8 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, tdb_len_t length, tdb
 		length = TDB_ALIGN(length, TDB_ALIGNMENT);
 		
 		/* Right piece to go on free list */
-		newrec.rec_len = rec->rec_len - (sizeof(*rec) + length);
-		newrec_ptr = rec_ptr + sizeof(*rec) + length;
+		newrec.rec_len = rec->rec_len - (TDB_REC_SIZE + length);
+		newrec_ptr = rec_ptr + TDB_REC_SIZE + length;
 		
 		/* And left record is shortened */
 		rec->rec_len = length;
@@ -249,6 +490,140 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, tdb_len_t length, tdb
 	return rec_ptr;
 }
 
+/*
+  tdb_allocate_ofs() for size classes, called with the lock of list c.
+  Drops the lock before freeing the split off remainder, which can go
+  to any list: we never wait for a list lock while holding another.
+ */
+static tdb_off_t tdb_allocate_ofs_class(struct tdb_context *tdb, u32 c,
+					tdb_len_t length, tdb_off_t rec_ptr,
+					struct list_struct *rec, tdb_off_t last_ptr)
+{
+	struct list_struct newrec;
+	tdb_off_t newrec_ptr;
+
+	memset(&newrec, '\0', sizeof(newrec));
+
+	if (rec->rec_len > length + MIN_REC_SIZE) {
+		length = TDB_ALIGN(length, TDB_ALIGNMENT);
+		newrec.rec_len = rec->rec_len - (TDB_REC_SIZE + length);
+		newrec_ptr = rec_ptr + TDB_REC_SIZE + length;
+		rec->rec_len = length;
+	} else {
+		newrec_ptr = 0;
+	}
+
+	if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1) {
+		goto fail;
+	}
+
+	rec->magic = TDB_MAGIC;
+	if (tdb_rec_write(tdb, rec_ptr, rec) == -1) {
+		goto fail;
+	}
+
+	if (newrec_ptr) {
+		if (update_tailer(tdb, rec_ptr, rec) == -1) {
+			goto fail;
+		}
+		/* whatever was left of an old header here must not
+		   look free to a neighbour before tdb_free() is done */
+		newrec.magic = TDB_DEAD_MAGIC;
+		if (tdb_rec_write(tdb, newrec_ptr, &newrec) == -1) {
+			goto fail;
+		}
+	}
+
+	class_unlock(tdb, c);
+
+	if (newrec_ptr && tdb_free_class(tdb, newrec_ptr, &newrec) == -1) {
+		return 0;
+	}
+	return rec_ptr;
+
+ fail:
+	class_unlock(tdb, c);
+	return 0;
+}
+
+/*
+  tdb_allocate() for size classes. The list of the wanted size gets a
+  bounded best fit search, anything on the lists above is big enough so
+  the first fit there is taken.
+ */
+static tdb_off_t tdb_allocate_class(struct tdb_context *tdb, tdb_len_t length,
+				    struct list_struct *rec)
+{
+	u32 c;
+
+	/* Extra bytes required for tailer */
+	length += TDB_OFF_SIZE;
+
+ again:
+	for (c = size_class(tdb, length); c < tdb->header.freelist_classes; c++) {
+		tdb_off_t rec_ptr, last_ptr;
+		struct {
+			tdb_off_t rec_ptr, last_ptr;
+			tdb_len_t rec_len;
+		} bestfit;
+		int n;
+
+		if (class_lock(tdb, c) == -1) {
+			return 0;
+		}
+
+		last_ptr = tdb_freelist_top(tdb, c);
+		if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1) {
+			goto fail;
+		}
+
+		bestfit.rec_ptr = 0;
+		bestfit.last_ptr = 0;
+		bestfit.rec_len = 0;
+
+		for (n = 0; rec_ptr && n < TDB_SIZE_CLASS_SEARCH; n++) {
+			if (rec_free_read(tdb, rec_ptr, rec) == -1) {
+				goto fail;
+			}
+
+			if (rec->rec_len >= length &&
+			    (bestfit.rec_ptr == 0 ||
+			     rec->rec_len < bestfit.rec_len)) {
+				bestfit.rec_len = rec->rec_len;
+				bestfit.rec_ptr = rec_ptr;
+				bestfit.last_ptr = last_ptr;
+				if (bestfit.rec_len < 2*length) {
+					break;
+				}
+			}
+
+			last_ptr = rec_ptr;
+			rec_ptr = rec->next;
+		}
+
+		if (bestfit.rec_ptr != 0) {
+			if (rec_free_read(tdb, bestfit.rec_ptr, rec) == -1) {
+				goto fail;
+			}
+			return tdb_allocate_ofs_class(tdb, c, length,
+						      bestfit.rec_ptr, rec,
+						      bestfit.last_ptr);
+		}
+
+		class_unlock(tdb, c);
+	}
+
+	/* we didn't find enough space. See if we can expand the
+	   database and if we can then try again */
+	if (tdb_expand(tdb, length + TDB_REC_SIZE) == 0)
+		goto again;
+	return 0;
+
+ fail:
+	class_unlock(tdb, c);
+	return 0;
+}
+
 /* allocate some space from the free list. The offset returned points
    to a unconnected list_struct within the database with room for at
    least length bytes of total data
@@ -263,11 +638,15 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct list_st
 		tdb_len_t rec_len;
 	} bestfit;
 
+	if (tdb->header.freelist_classes) {
+		return tdb_allocate_class(tdb, length, rec);
+	}
+
 	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
 		return 0;
 
 	/* Extra bytes required for tailer */
-	length += sizeof(tdb_off_t);
+	length += TDB_OFF_SIZE;
 
  again:
 	last_ptr = FREELIST_TOP;
@@ -322,10 +701,139 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct list_st
 
 	/* we didn't find enough space. See if we can expand the
 	   database and if we can then try again */
-	if (tdb_expand(tdb, length + sizeof(*rec)) == 0)
+	if (tdb_expand(tdb, length + TDB_REC_SIZE) == 0)
 		goto again;
  fail:
 	tdb_unlock(tdb, -1, F_WRLCK);
 	return 0;
 }
 
+
+/* put a (merged) free record found by tdb_defrag() on its list */
+static int defrag_put(struct tdb_context *tdb, tdb_off_t off,
+		      struct list_struct *rec)
+{
+	tdb_off_t top = tdb_freelist_top(tdb, size_class(tdb, rec->rec_len));
+
+	rec->magic = TDB_FREE_MAGIC;
+	if (update_tailer(tdb, off, rec) == -1 ||
+	    tdb_ofs_read(tdb, top, &rec->next) == -1 ||
+	    tdb_rec_write(tdb, off, rec) == -1 ||
+	    tdb_ofs_write(tdb, top, &off) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Defragment the free space: merge all runs of adjacent free records and
+  put every free record on the list of its size (for a classic database
+  the single freelist). Walks the records in file order, so it also picks
+  up free space that a crashed process left off the lists.
+
+  Safe while other processes use the database: it takes the allrecord
+  lock, so nobody is inside a chain operation (and so nobody is holding
+  or waiting for a freelist lock) and no transaction can be open.
+ */
+int tdb_defrag(struct tdb_context *tdb)
+{
+	struct list_struct rec, run;
+	tdb_off_t off, run_off, start, recovery_head;
+	u32 c, nlists;
+	int pass, ret = -1;
+
+	if (tdb->read_only || tdb->traverse_read) {
+		return TDB_ERRCODE(TDB_ERR_RDONLY, -1);
+	}
+
+	if (tdb->transaction) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_defrag: not allowed inside a transaction\n"));
+		return TDB_ERRCODE(TDB_ERR_EINVAL, -1);
+	}
+
+	if (tdb_lockall(tdb) == -1) {
+		return -1;
+	}
+
+	/* must know about any previous expansions by another process */
+	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+
+	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
+		goto out;
+	}
+
+	nlists = tdb_num_freelists(tdb);
+	start = FREELIST_TOP + TDB_HASHTABLE_SIZE(tdb);
+
+	/*
+	 * Pass 0 only checks that the records tile the file, so that we
+	 * never start rewriting the free lists of a database we can't
+	 * walk. Pass 1 empties the lists and rebuilds them.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		run_off = 0;
+		memset(&run, '\0', sizeof(run));
+
+		if (pass == 1) {
+			tdb_off_t zero = 0;
+
+			for (c = 0; c < nlists; c++) {
+				if (tdb_ofs_write(tdb, tdb_freelist_top(tdb, c), &zero) == -1) {
+					goto out;
+				}
+			}
+		}
+
+		for (off = start; off + TDB_REC_SIZE <= tdb->map_size;
+		     off += TDB_REC_SIZE + rec.rec_len) {
+			if (tdb_rec_header_read(tdb, off, &rec) == -1) {
+				goto out;
+			}
+
+			if (rec.rec_len > tdb->map_size - off - TDB_REC_SIZE ||
+			    (rec.magic != TDB_MAGIC && rec.magic != TDB_DEAD_MAGIC &&
+			     rec.magic != TDB_FREE_MAGIC &&
+			     rec.magic != TDB_RECOVERY_MAGIC &&
+			     !(off == recovery_head && rec.magic == 0))) {
+				TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_defrag: bad record at offset %llu "
+					 "(magic 0x%x len %llu)\n", (unsigned long long)off,
+					 rec.magic, (unsigned long long)rec.rec_len));
+				tdb->ecode = TDB_ERR_CORRUPT;
+				if (pass == 1) {
+					/* can't happen, pass 0 walked the same */
+					TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_defrag: free lists lost!\n"));
+				}
+				goto out;
+			}
+
+			if (pass == 0) {
+				continue;
+			}
+
+			if (rec.magic == TDB_FREE_MAGIC) {
+				if (run_off == 0) {
+					run_off = off;
+					run = rec;
+				} else {
+					run.rec_len += TDB_REC_SIZE + rec.rec_len;
+				}
+				continue;
+			}
+
+			if (run_off != 0 && defrag_put(tdb, run_off, &run) == -1) {
+				goto out;
+			}
+			run_off = 0;
+		}
+
+		if (pass == 1 && run_off != 0 && defrag_put(tdb, run_off, &run) == -1) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+ out:
+	tdb_unlockall(tdb);
+	return ret;
+}
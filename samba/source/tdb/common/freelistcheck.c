@@ -48,7 +48,8 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 {
 	struct tdb_context *mem_tdb = NULL;
 	struct list_struct rec;
-	tdb_off_t rec_ptr, last_ptr;
+	tdb_off_t rec_ptr;
+	u32 list;
 	int ret = -1;
 
 	*pnum_entries = 0;
@@ -59,43 +60,46 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 		return -1;
 	}
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (tdb_lock_freelists(tdb) == -1) {
 		tdb_close(mem_tdb);
 		return 0;
 	}
 
-	last_ptr = FREELIST_TOP;
+	/* With size classes there is a list per class. A record on two
+	   of them is as corrupt as a loop in one. */
 
-	/* Store the FREELIST_TOP record. */
-	if (seen_insert(mem_tdb, last_ptr) == -1) {
-		ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
-		goto fail;
-	}
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1) {
-		goto fail;
-	}
-
-	while (rec_ptr) {
-
-		/* If we can't store this record (we've seen it
-		   before) then the free list has a loop and must
-		   be corrupt. */
+	for (list = 0; list < tdb_num_freelists(tdb); list++) {
 
-		if (seen_insert(mem_tdb, rec_ptr)) {
+		/* Store the list top record. */
+		if (seen_insert(mem_tdb, tdb_freelist_top(tdb, list)) == -1) {
 			ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
 			goto fail;
 		}
 
-		if (rec_free_read(tdb, rec_ptr, &rec) == -1) {
+		/* read in the freelist top */
+		if (tdb_ofs_read(tdb, tdb_freelist_top(tdb, list), &rec_ptr) == -1) {
 			goto fail;
 		}
 
-		/* move to the next record */
-		last_ptr = rec_ptr;
-		rec_ptr = rec.next;
-		*pnum_entries += 1;
+		while (rec_ptr) {
+
+			/* If we can't store this record (we've seen it
+			   before) then the free list has a loop and must
+			   be corrupt. */
+
+			if (seen_insert(mem_tdb, rec_ptr)) {
+				ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+				goto fail;
+			}
+
+			if (rec_free_read(tdb, rec_ptr, &rec) == -1) {
+				goto fail;
+			}
+
+			/* move to the next record */
+			rec_ptr = rec.next;
+			*pnum_entries += 1;
+		}
 	}
 
 	ret = 0;
@@ -103,6 +107,6 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
   fail:
 
 	tdb_close(mem_tdb);
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_freelists(tdb);
 	return ret;
 }
@@ -43,8 +43,9 @@ static int tdb_oob(struct tdb_context *tdb, tdb_off_t len, int probe)
 		if (!probe) {
 			/* Ensure ecode is set for log fn. */
 			tdb->ecode = TDB_ERR_IO;
-			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_oob len %d beyond internal malloc size %d\n",
-				 (int)len, (int)tdb->map_size));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_oob len %llu beyond internal malloc size %llu\n",
+				 (unsigned long long)len,
+				 (unsigned long long)tdb->map_size));
 		}
 		return TDB_ERRCODE(TDB_ERR_IO, -1);
 	}
@@ -53,12 +54,13 @@ static int tdb_oob(struct tdb_context *tdb, tdb_off_t len, int probe)
 		return TDB_ERRCODE(TDB_ERR_IO, -1);
 	}
 
-	if (st.st_size < (size_t)len) {
+	if ((tdb_off_t)st.st_size < len) {
 		if (!probe) {
 			/* Ensure ecode is set for log fn. */
 			tdb->ecode = TDB_ERR_IO;
-			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_oob len %d beyond eof at %d\n",
-				 (int)len, (int)st.st_size));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_oob len %llu beyond eof at %llu\n",
+				 (unsigned long long)len,
+				 (unsigned long long)st.st_size));
 		}
 		return TDB_ERRCODE(TDB_ERR_IO, -1);
 	}
@@ -94,8 +96,9 @@ static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 		if ((written != (ssize_t)len) && (written != -1)) {
 			/* try once more */
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_write: wrote only "
-				 "%d of %d bytes at %d, trying once more\n",
-				 (uint32_t)written, len, off));
+				 "%d of %llu bytes at %llu, trying once more\n",
+				 (int)written, (unsigned long long)len,
+				 (unsigned long long)off));
 			errno = ENOSPC;
 			written = pwrite(tdb->fd, (void *)((char *)buf+written),
 					 len-written,
@@ -104,13 +107,14 @@ static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 		if (written == -1) {
 			/* Ensure ecode is set for log fn. */
 			tdb->ecode = TDB_ERR_IO;
-			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_write failed at %d "
-				 "len=%d (%s)\n", off, len, strerror(errno)));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_write failed at %llu "
+				 "len=%llu (%s)\n", (unsigned long long)off,
+				 (unsigned long long)len, strerror(errno)));
 			return TDB_ERRCODE(TDB_ERR_IO, -1);
 		} else if (written != (ssize_t)len) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_write: failed to "
-				 "write %d bytes at %d in two attempts\n",
-				 len, off));
+				 "write %llu bytes at %llu in two attempts\n",
+				 (unsigned long long)len, (unsigned long long)off));
 			errno = ENOSPC;
 			return TDB_ERRCODE(TDB_ERR_IO, -1);
 		}
@@ -143,10 +147,11 @@ static int tdb_read(struct tdb_context *tdb, tdb_off_t off, void *buf,
 		if (ret != (ssize_t)len) {
 			/* Ensure ecode is set for log fn. */
 			tdb->ecode = TDB_ERR_IO;
-			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_read failed at %d "
-				 "len=%d ret=%d (%s) map_size=%d\n",
-				 (int)off, (int)len, (int)ret, strerror(errno),
-				 (int)tdb->map_size));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_read failed at %llu "
+				 "len=%llu ret=%d (%s) map_size=%llu\n",
+				 (unsigned long long)off, (unsigned long long)len,
+				 (int)ret, strerror(errno),
+				 (unsigned long long)tdb->map_size));
 			return TDB_ERRCODE(TDB_ERR_IO, -1);
 		}
 	}
@@ -165,14 +170,21 @@ static int tdb_read(struct tdb_context *tdb, tdb_off_t off, void *buf,
 static void tdb_next_hash_chain(struct tdb_context *tdb, u32 *chain)
 {
 	u32 h = *chain;
-	if (tdb->map_ptr) {
+	if (tdb->map_ptr && TDB_IS64) {
+		/* the hash table is 8 byte aligned in TDB_VERSION64 files */
+		for (;h < tdb->header.hash_size;h++) {
+			if (0 != *(u64 *)(TDB_HASH_TOP(h) + (unsigned char *)tdb->map_ptr)) {
+				break;
+			}
+		}
+	} else if (tdb->map_ptr) {
 		for (;h < tdb->header.hash_size;h++) {
 			if (0 != *(u32 *)(TDB_HASH_TOP(h) + (unsigned char *)tdb->map_ptr)) {
 				break;
 			}
 		}
 	} else {
-		u32 off=0;
+		tdb_off_t off=0;
 		for (;h < tdb->header.hash_size;h++) {
 			if (tdb_ofs_read(tdb, TDB_HASH_TOP(h), &off) != 0 || off != 0) {
 				break;
@@ -205,10 +217,21 @@ void tdb_mmap(struct tdb_context *tdb)
 		return;
 
 #ifdef HAVE_MMAP
-	if (!(tdb->flags & TDB_NOMMAP)) {
+	if (!(tdb->flags & TDB_NOMMAP) &&
+	    (size_t)tdb->map_size == tdb->map_size) {
+		/* a file bigger than the address space is only
+		   accessed with pread/pwrite */
+		int flags = MAP_SHARED|MAP_FILE;
+
+#ifdef MAP_POPULATE
+		/* fault a volatile database in here, not page by page
+		   later with the chain locks held */
+		if (tdb->flags & TDB_VOLATILE)
+			flags |= MAP_POPULATE;
+#endif
 		tdb->map_ptr = mmap(NULL, tdb->map_size, 
 				    PROT_READ|(tdb->read_only? 0:PROT_WRITE), 
-				    MAP_SHARED|MAP_FILE, tdb->fd, 0);
+				    flags, tdb->fd, 0);
 
 		/*
 		 * NB. When mmap fails it returns MAP_FAILED *NOT* NULL !!!!
@@ -216,8 +239,8 @@ void tdb_mmap(struct tdb_context *tdb)
 
 		if (tdb->map_ptr == MAP_FAILED) {
 			tdb->map_ptr = NULL;
-			TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_mmap failed for size %d (%s)\n", 
-				 tdb->map_size, strerror(errno)));
+			TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_mmap failed for size %llu (%s)\n", 
+				 (unsigned long long)tdb->map_size, strerror(errno)));
 		}
 	} else {
 		tdb->map_ptr = NULL;
@@ -238,6 +261,16 @@ static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t ad
 		return -1;
 	}
 
+#ifdef HAVE_POSIX_FALLOCATE
+	/* a volatile database lives on tmpfs, where writing the pad
+	   bytes buys nothing: allocating the pages is enough to get
+	   ENOSPC now rather than SIGBUS on a later mmap write */
+	if ((tdb->flags & TDB_VOLATILE) &&
+	    posix_fallocate(tdb->fd, size, addition) == 0) {
+		return 0;
+	}
+#endif
+
 	if (ftruncate(tdb->fd, size+addition) == -1) {
 		char b = 0;
 		ssize_t written = pwrite(tdb->fd,  &b, 1, (size+addition) - 1);
@@ -250,8 +283,8 @@ static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t ad
 			errno = ENOSPC;
 		}
 		if (written != 1) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "expand_file to %d failed (%s)\n", 
-				 size+addition, strerror(errno)));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "expand_file to %llu failed (%s)\n", 
+				 (unsigned long long)(size+addition), strerror(errno)));
 			return -1;
 		}
 	}
@@ -289,25 +322,22 @@ static int tdb_expand_file(struct tdb_context *tdb, tdb_off_t size, tdb_off_t ad
 }
 
 
-/* expand the database at least size bytes by expanding the underlying
-   file and doing the mmap again if necessary */
-int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
+/* grow the file by exactly size bytes, remap it and put the new space
+   on the free list. The caller holds the free list lock */
+static int tdb_expand_locked(struct tdb_context *tdb, tdb_off_t size)
 {
 	struct list_struct rec;
 	tdb_off_t offset;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_ERROR, "lock failed in tdb_expand\n"));
+	/* the old format can't address anything past 4GB */
+	if (!TDB_IS64 && tdb->map_size + size > TDB_MAX_OFF32) {
+		tdb->ecode = TDB_ERR_OOM;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_expand: %s would grow past "
+			 "4GB, convert it to the 64 bit format with "
+			 "tdbbackup -c\n", tdb->name ? tdb->name : "tdb"));
 		return -1;
 	}
 
-	/* must know about any previous expansions by another process */
-	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
-
-	/* always make room for at least 10 more records, and round
-           the database up to a multiple of the page size */
-	size = TDB_ALIGN(tdb->map_size + size*10, tdb->page_size) - tdb->map_size;
-
 	if (!(tdb->flags & TDB_INTERNAL))
 		tdb_munmap(tdb);
 
@@ -320,7 +350,7 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 	/* expand the file itself */
 	if (!(tdb->flags & TDB_INTERNAL)) {
 		if (tdb->methods->tdb_expand_file(tdb, tdb->map_size, size) != 0)
-			goto fail;
+			return -1;
 	}
 
 	tdb->map_size += size;
@@ -330,7 +360,7 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 						    tdb->map_size);
 		if (!new_map_ptr) {
 			tdb->map_size -= size;
-			goto fail;
+			return -1;
 		}
 		tdb->map_ptr = new_map_ptr;
 	} else {
@@ -346,30 +376,115 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 
 	/* form a new freelist record */
 	memset(&rec,'\0',sizeof(rec));
-	rec.rec_len = size - sizeof(rec);
+	rec.rec_len = size - TDB_REC_SIZE;
 
 	/* link it into the free list */
 	offset = tdb->map_size - size;
-	if (tdb_free(tdb, offset, &rec) == -1)
-		goto fail;
+	return tdb_free(tdb, offset, &rec);
+}
+
+/* expand the database at least size bytes by expanding the underlying
+   file and doing the mmap again if necessary */
+int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
+{
+	int ret;
 
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "lock failed in tdb_expand\n"));
+		return -1;
+	}
+
+	/* must know about any previous expansions by another process */
+	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+
+	/* always make room for at least 10 more records, and round
+           the database up to a multiple of the page size */
+	size = TDB_ALIGN(tdb->map_size + size*10, tdb->page_size) - tdb->map_size;
+
+	ret = tdb_expand_locked(tdb, size);
 	tdb_unlock(tdb, -1, F_WRLCK);
-	return 0;
- fail:
+	return ret;
+}
+
+/*
+  grow the database to at least size bytes in one go, so a database
+  that is known to get big doesn't go through many small expansions
+  (and remaps). The new space goes on the free list. This is a no-op
+  if the database is already big enough, so every opener can call it
+*/
+int tdb_reserve(struct tdb_context *tdb, size_t size)
+{
+	int ret = 0;
+
+	if (tdb->read_only || tdb->traverse_read) {
+		return TDB_ERRCODE(TDB_ERR_RDONLY, -1);
+	}
+
+	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "lock failed in tdb_reserve\n"));
+		return -1;
+	}
+
+	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+
+	if ((tdb_off_t)size > tdb->map_size) {
+		ret = tdb_expand_locked(tdb, TDB_ALIGN((tdb_off_t)size - tdb->map_size,
+						       tdb->page_size));
+	}
+
 	tdb_unlock(tdb, -1, F_WRLCK);
-	return -1;
+	return ret;
+}
+
+/* convert a tdb_off_t to and from its TDB_OFF_SIZE bytes on disk */
+void tdb_off_pack(struct tdb_context *tdb, tdb_off_t off, void *buf)
+{
+	if (TDB_IS64) {
+		u64 v = DOCONV() ? TDB_BYTEREV64(off) : off;
+		memcpy(buf, &v, sizeof(v));
+	} else {
+		u32 v = DOCONV() ? TDB_BYTEREV((u32)off) : (u32)off;
+		memcpy(buf, &v, sizeof(v));
+	}
+}
+
+tdb_off_t tdb_off_unpack(struct tdb_context *tdb, const void *buf)
+{
+	if (TDB_IS64) {
+		u64 v;
+		memcpy(&v, buf, sizeof(v));
+		return DOCONV() ? TDB_BYTEREV64(v) : v;
+	} else {
+		u32 v;
+		memcpy(&v, buf, sizeof(v));
+		return DOCONV() ? TDB_BYTEREV(v) : v;
+	}
 }
 
 /* read/write a tdb_off_t */
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d)
 {
-	return tdb->methods->tdb_read(tdb, offset, (char*)d, sizeof(*d), DOCONV());
+	unsigned char buf[8];
+
+	if (tdb->methods->tdb_read(tdb, offset, buf, TDB_OFF_SIZE, 0) == -1) {
+		return -1;
+	}
+	*d = tdb_off_unpack(tdb, buf);
+	return 0;
 }
 
 int tdb_ofs_write(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d)
 {
-	tdb_off_t off = *d;
-	return tdb->methods->tdb_write(tdb, offset, CONVERT(off), sizeof(*d));
+	unsigned char buf[8];
+
+	if (!TDB_IS64 && *d > TDB_MAX_OFF32) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_ofs_write: %llu does not "
+			 "fit the 32 bit format\n", (unsigned long long)*d));
+		return TDB_ERRCODE(TDB_ERR_IO, -1);
+	}
+	tdb_off_pack(tdb, *d, buf);
+	return tdb->methods->tdb_write(tdb, offset, buf, TDB_OFF_SIZE);
 }
 
 
@@ -386,8 +501,8 @@ char *tdb_alloc_read(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t len)
 	if (!(buf = (char *)malloc(len))) {
 		/* Ensure ecode is set for log fn. */
 		tdb->ecode = TDB_ERR_OOM;
-		TDB_LOG((tdb, TDB_DEBUG_ERROR,"tdb_alloc_read malloc failed len=%d (%s)\n",
-			   len, strerror(errno)));
+		TDB_LOG((tdb, TDB_DEBUG_ERROR,"tdb_alloc_read malloc failed len=%llu (%s)\n",
+			   (unsigned long long)len, strerror(errno)));
 		return TDB_ERRCODE(TDB_ERR_OOM, buf);
 	}
 	if (tdb->methods->tdb_read(tdb, offset, buf, len, 0) == -1) {
@@ -431,24 +546,78 @@ int tdb_parse_data(struct tdb_context *tdb, TDB_DATA key,
 	return result;
 }
 
+/* convert a record header to and from its TDB_REC_SIZE bytes on disk */
+void tdb_rec_pack(struct tdb_context *tdb, const struct list_struct *rec, void *buf)
+{
+	unsigned char *p = (unsigned char *)buf;
+	u32 v[2];
+
+	tdb_off_pack(tdb, rec->next, p);
+	tdb_off_pack(tdb, rec->rec_len, p + TDB_OFF_SIZE);
+	tdb_off_pack(tdb, rec->key_len, p + 2*TDB_OFF_SIZE);
+	tdb_off_pack(tdb, rec->data_len, p + 3*TDB_OFF_SIZE);
+	v[0] = rec->full_hash;
+	v[1] = rec->magic;
+	memcpy(p + 4*TDB_OFF_SIZE, CONVERT(v), sizeof(v));
+}
+
+void tdb_rec_unpack(struct tdb_context *tdb, const void *buf, struct list_struct *rec)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	u32 v[2];
+
+	rec->next = tdb_off_unpack(tdb, p);
+	rec->rec_len = tdb_off_unpack(tdb, p + TDB_OFF_SIZE);
+	rec->key_len = tdb_off_unpack(tdb, p + 2*TDB_OFF_SIZE);
+	rec->data_len = tdb_off_unpack(tdb, p + 3*TDB_OFF_SIZE);
+	memcpy(v, p + 4*TDB_OFF_SIZE, sizeof(v));
+	CONVERT(v);
+	rec->full_hash = v[0];
+	rec->magic = v[1];
+}
+
+/* read a record header without any checks */
+int tdb_rec_header_read(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
+{
+	unsigned char buf[40];
+
+	if (tdb->methods->tdb_read(tdb, offset, buf, TDB_REC_SIZE, 0) == -1)
+		return -1;
+	tdb_rec_unpack(tdb, buf, rec);
+	return 0;
+}
+
 /* read/write a record */
 int tdb_rec_read(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
 {
-	if (tdb->methods->tdb_read(tdb, offset, rec, sizeof(*rec),DOCONV()) == -1)
+	if (tdb_rec_header_read(tdb, offset, rec) == -1)
 		return -1;
 	if (TDB_BAD_MAGIC(rec)) {
 		/* Ensure ecode is set for log fn. */
 		tdb->ecode = TDB_ERR_CORRUPT;
-		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_rec_read bad magic 0x%x at offset=%d\n", rec->magic, offset));
+		TDB_LOG((tdb, TDB_DEBUG_FATAL,"tdb_rec_read bad magic 0x%x at offset=%llu\n",
+			 rec->magic, (unsigned long long)offset));
 		return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
 	}
-	return tdb->methods->tdb_oob(tdb, rec->next+sizeof(*rec), 0);
+	return tdb->methods->tdb_oob(tdb, rec->next+TDB_REC_SIZE, 0);
 }
 
 int tdb_rec_write(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
 {
-	struct list_struct r = *rec;
-	return tdb->methods->tdb_write(tdb, offset, CONVERT(r), sizeof(r));
+	unsigned char buf[40];
+
+	if (!TDB_IS64 && (rec->next > TDB_MAX_OFF32 ||
+			  rec->rec_len > TDB_MAX_OFF32 ||
+			  rec->key_len > TDB_MAX_OFF32 ||
+			  rec->data_len > TDB_MAX_OFF32)) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rec_write: record at %llu "
+			 "does not fit the 32 bit format\n",
+			 (unsigned long long)offset));
+		return TDB_ERRCODE(TDB_ERR_IO, -1);
+	}
+	tdb_rec_pack(tdb, rec, buf);
+	return tdb->methods->tdb_write(tdb, offset, buf, TDB_REC_SIZE);
 }
 
 static const struct tdb_methods io_methods = {
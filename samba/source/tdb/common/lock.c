@@ -80,8 +80,8 @@ int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset,
 		if (!probe && lck_type != F_SETLK) {
 			/* Ensure error code is set for log fun to examine. */
 			tdb->ecode = TDB_ERR_LOCK;
-			TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_brlock failed (fd=%d) at offset %d rw_type=%d lck_type=%d len=%d\n", 
-				 tdb->fd, offset, rw_type, lck_type, (int)len));
+			TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_brlock failed (fd=%d) at offset %llu rw_type=%d lck_type=%d len=%d\n", 
+				 tdb->fd, (unsigned long long)offset, rw_type, lck_type, (int)len));
 		}
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
 	}
@@ -111,16 +111,19 @@ int tdb_brlock_upgrade(struct tdb_context *tdb, tdb_off_t offset, size_t len)
 		tv.tv_usec = 1;
 		select(0, NULL, NULL, NULL, &tv);
 	}
-	TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_brlock_upgrade failed at offset %d\n", offset));
+	TDB_LOG((tdb, TDB_DEBUG_TRACE,"tdb_brlock_upgrade failed at offset %llu\n",
+		 (unsigned long long)offset));
 	return -1;
 }
 
 
-/* lock a list in the database. list -1 is the alloc list */
-int tdb_lock(struct tdb_context *tdb, int list, int ltype)
+/* lock a list in the database. list -1 is the alloc list, lists below
+   that the size class free lists. op is F_SETLKW to wait for the lock
+   or F_SETLK to fail with EAGAIN if somebody else holds it */
+static int _tdb_lock(struct tdb_context *tdb, int list, int ltype, int op)
 {
 	struct tdb_lock_type *new_lck;
-	int i;
+	int i, ret;
 
 	/* a global lock allows us to avoid per chain locks */
 	if (tdb->global_lock.count && 
@@ -132,7 +135,8 @@ int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
 	}
 
-	if (list < -1 || list >= (int)tdb->header.hash_size) {
+	if (list < TDB_SIZE_CLASS_LIST(tdb->header.freelist_classes) + 1 ||
+	    list >= (int)tdb->header.hash_size) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR,"tdb_lock: invalid list %d for ltype=%d\n", 
 			   list, ltype));
 		return -1;
@@ -169,11 +173,21 @@ int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 	tdb->lockrecs = new_lck;
 
 	/* Since fcntl locks don't nest, we do a lock for the first one,
-	   and simply bump the count for future ones */
-	if (tdb->methods->tdb_brlock(tdb,FREELIST_TOP+4*list,ltype,F_SETLKW,
-				     0, 1)) {
-		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_lock failed on list %d "
-			 "ltype=%d (%s)\n",  list, ltype, strerror(errno)));
+	   and simply bump the count for future ones. Inside a transaction
+	   the transaction's allrecord lock covers the chains, the
+	   transaction methods don't do chain locks and neither do we. */
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_lock(tdb, list, ltype, op);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb,FREELIST_TOP+4*list,ltype,
+					       op, 0, 1);
+	}
+	if (ret) {
+		if (op == F_SETLKW) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_lock failed on "
+				 "list %d ltype=%d (%s)\n", list, ltype,
+				 strerror(errno)));
+		}
 		return -1;
 	}
 
@@ -187,6 +201,17 @@ int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 	return 0;
 }
 
+int tdb_lock(struct tdb_context *tdb, int list, int ltype)
+{
+	return _tdb_lock(tdb, list, ltype, F_SETLKW);
+}
+
+/* as tdb_lock(), but fail instead of waiting for another process */
+int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype)
+{
+	return _tdb_lock(tdb, list, ltype, F_SETLK);
+}
+
 /* unlock the database: returns void because it's too late for errors. */
 	/* changed to return int it may be interesting to know there
 	   has been an error  --simo */
@@ -210,7 +235,8 @@ int tdb_unlock(struct tdb_context *tdb, int list, int ltype)
 		return 0;
 
 	/* Sanity checks */
-	if (list < -1 || list >= (int)tdb->header.hash_size) {
+	if (list < TDB_SIZE_CLASS_LIST(tdb->header.freelist_classes) + 1 ||
+	    list >= (int)tdb->header.hash_size) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlock: list %d invalid (%d)\n", list, tdb->header.hash_size));
 		return ret;
 	}
@@ -239,8 +265,12 @@ int tdb_unlock(struct tdb_context *tdb, int list, int ltype)
 	 * anyway.
 	 */
 
-	ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP+4*list, F_UNLCK,
-				       F_SETLKW, 0, 1);
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_unlock(tdb, list);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP+4*list, F_UNLCK,
+					       F_SETLKW, 0, 1);
+	}
 	tdb->num_locks--;
 
 	/*
@@ -297,6 +327,13 @@ static int _tdb_lockall(struct tdb_context *tdb, int ltype)
 		return -1;
 	}
 
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL &&
+	    tdb_mutex_allrecord_lock(tdb, ltype) == -1) {
+		tdb->methods->tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW,
+					 0, 4*tdb->header.hash_size);
+		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+	}
+
 	tdb->global_lock.count = 1;
 	tdb->global_lock.ltype = ltype;
 
@@ -320,6 +357,10 @@ static int _tdb_unlockall(struct tdb_context *tdb, int ltype)
 		return 0;
 	}
 
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
+
 	if (tdb->methods->tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 
 				     0, 4*tdb->header.hash_size)) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlockall failed (%s)\n", strerror(errno)));
@@ -363,6 +404,13 @@ int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key)
 	return tdb_lock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
 }
 
+/* lock one hash chain, failing with TDB_ERR_LOCK (and errno EAGAIN)
+   rather than waiting if another process holds it */
+int tdb_chainlock_nonblock(struct tdb_context *tdb, TDB_DATA key)
+{
+	return tdb_lock_nonblock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+}
+
 int tdb_chainunlock(struct tdb_context *tdb, TDB_DATA key)
 {
 	return tdb_unlock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
@@ -0,0 +1,488 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   trivial database library
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "tdb_private.h"
+
+/*
+  Robust mutex locking (TDB_MUTEX_LOCKING).
+
+  Every chain lock and freelist lock is an fcntl() on a byte of the
+  file. That is a system call for each lock and unlock, and with a lot
+  of processes holding locks on the same file the kernel's list of
+  posix locks gets long. With mutex locking these locks are process
+  shared pthread mutexes in "<name>.mutex" instead, mapped by every
+  user of the database. They are robust mutexes, so a process dying
+  with one held doesn't wedge everyone else: the next locker gets
+  EOWNERDEAD, which is the same as the kernel dropping the fcntl lock
+  of a dead process.
+
+  The mutexes are exclusive, so chain read locks exclude each other.
+
+  The allrecord lock (tdb_lockall() and the read lock a transaction
+  holds on the whole hash table) still takes the fcntl range lock, and
+  on top of that the allrecord mutex. Its holder records the lock type
+  in the shared area and then takes and drops every chain mutex, which
+  waits for the current chain holders. A chain locker that finds an
+  incompatible allrecord lock drops its chain mutex again and queues on
+  the allrecord mutex.
+
+  Only TDB_CLEAR_IF_FIRST databases can use mutexes: the first opener
+  initialises the .mutex file and records in the header that the
+  database uses it, so every later opener agrees on how to lock.
+
+  The .mutex file also has a sequence counter for each chain, odd while
+  somebody holds the chain mutex, and one that is odd while somebody
+  holds the allrecord lock for writing. tdb_traverse_snapshot() reads
+  chains without locking and uses them to find out whether it saw a
+  chain in the middle of a change, like a seqlock.
+*/
+
+#ifdef HAVE_ROBUST_MUTEXES
+
+#include <pthread.h>
+
+struct tdb_mutexes {
+	u32 magic;
+	u32 num_mutexes;
+	int allrecord_lock; /* F_UNLCK, F_RDLCK or F_WRLCK */
+	volatile u32 allrecord_seq;
+	pthread_mutex_t allrecord_mutex;
+	pthread_mutex_t mutexes[1]; /* the freelists, then the chains */
+	/* followed by a u32 sequence counter for each chain */
+};
+
+/* order the sequence counters against the records they cover */
+#define tdb_mb() __sync_synchronize()
+
+int tdb_mutex_supported(void)
+{
+	return 1;
+}
+
+/* the lowest list is the last size class, or -1 for a classic db */
+static u32 tdb_mutex_count(struct tdb_context *tdb)
+{
+	return tdb->header.hash_size + 1 + tdb->header.freelist_classes;
+}
+
+static pthread_mutex_t *list_mutex(struct tdb_context *tdb, int list)
+{
+	return &tdb->mutexes->mutexes[list + 1 + (int)tdb->header.freelist_classes];
+}
+
+static size_t tdb_mutex_size(u32 num)
+{
+	return offsetof(struct tdb_mutexes, mutexes) + num * sizeof(pthread_mutex_t);
+}
+
+static volatile u32 *chain_seq(struct tdb_context *tdb, u32 list)
+{
+	volatile u32 *seqs;
+
+	seqs = (volatile u32 *)((char *)tdb->mutexes +
+				tdb_mutex_size(tdb_mutex_count(tdb)));
+	return &seqs[list];
+}
+
+/* make a counter odd before changing what it covers. It already is if
+   the last holder died half way. */
+static void seq_enter(volatile u32 *seq)
+{
+	if (!(*seq & 1)) {
+		(*seq)++;
+	}
+	tdb_mb();
+}
+
+static void seq_leave(volatile u32 *seq)
+{
+	tdb_mb();
+	(*seq)++;
+}
+
+/* take a mutex, making it usable again if its owner died. With
+   nonblock set fail with EAGAIN if somebody else holds it. */
+static int mutex_take_op(struct tdb_context *tdb, pthread_mutex_t *mutex,
+			 int *owner_died, int nonblock)
+{
+	int ret;
+
+	if (nonblock) {
+		ret = pthread_mutex_trylock(mutex);
+		if (ret == EBUSY) {
+			ret = EAGAIN;
+		}
+	} else {
+		ret = pthread_mutex_lock(mutex);
+	}
+	if (ret == EOWNERDEAD) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_mutex: previous owner "
+			 "of a lock in %s died\n", tdb->name));
+		if (owner_died) {
+			*owner_died = 1;
+		}
+		ret = pthread_mutex_consistent(mutex);
+	}
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+static int mutex_take(struct tdb_context *tdb, pthread_mutex_t *mutex,
+		      int *owner_died)
+{
+	return mutex_take_op(tdb, mutex, owner_died, 0);
+}
+
+static int mutex_drop(pthread_mutex_t *mutex)
+{
+	int ret = pthread_mutex_unlock(mutex);
+
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  map the .mutex file of a database. If create is set we are the only
+  user of the database and (re)initialise it.
+*/
+int tdb_mutex_open(struct tdb_context *tdb, mode_t mode, int create)
+{
+	struct tdb_mutexes *m;
+	pthread_mutexattr_t ma;
+	struct stat st;
+	char *name;
+	size_t len, size;
+	u32 i, num;
+	int fd;
+
+	num = tdb_mutex_count(tdb);
+	size = tdb_mutex_size(num) + tdb->header.hash_size * sizeof(u32);
+
+	len = strlen(tdb->name);
+	name = (char *)malloc(len + sizeof(".mutex"));
+	if (name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(name, tdb->name, len);
+	memcpy(name + len, ".mutex", sizeof(".mutex"));
+	fd = open(name, O_RDWR | (create ? O_CREAT : 0), mode);
+	if (fd == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: could not open %s: %s\n",
+			 name, strerror(errno)));
+		free(name);
+		return -1;
+	}
+
+	if (create) {
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: could not size %s: %s\n",
+				 name, strerror(errno)));
+			goto fail;
+		}
+	} else if (fstat(fd, &st) == -1 || st.st_size != size) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: %s has the wrong size\n",
+			 name));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	m = (struct tdb_mutexes *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+				       MAP_SHARED|MAP_FILE, fd, 0);
+	if (m == (struct tdb_mutexes *)MAP_FAILED) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: could not map %s: %s\n",
+			 name, strerror(errno)));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	if (create) {
+		if (pthread_mutexattr_init(&ma) != 0) {
+			goto fail_unmap;
+		}
+		if (pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED) != 0 ||
+		    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST) != 0 ||
+		    pthread_mutex_init(&m->allrecord_mutex, &ma) != 0) {
+			pthread_mutexattr_destroy(&ma);
+			goto fail_unmap;
+		}
+		for (i = 0; i < num; i++) {
+			if (pthread_mutex_init(&m->mutexes[i], &ma) != 0) {
+				pthread_mutexattr_destroy(&ma);
+				goto fail_unmap;
+			}
+		}
+		pthread_mutexattr_destroy(&ma);
+		m->allrecord_lock = F_UNLCK;
+		m->num_mutexes = num;
+		m->magic = TDB_MUTEX_MAGIC;
+	} else if (m->magic != TDB_MUTEX_MAGIC || m->num_mutexes != num) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: %s does not match %s\n",
+			 name, tdb->name));
+		errno = EINVAL;
+		goto fail_unmap;
+	}
+
+	tdb->mutexes = m;
+	tdb->mutexes_size = size;
+	free(name);
+	return 0;
+
+ fail_unmap:
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: could not set up %s\n", name));
+	munmap((void *)m, size);
+ fail:
+	if (fd != -1) {
+		close(fd);
+	}
+	free(name);
+	return -1;
+}
+
+void tdb_mutex_close(struct tdb_context *tdb)
+{
+	if (tdb->mutexes == NULL) {
+		return;
+	}
+	munmap((void *)tdb->mutexes, tdb->mutexes_size);
+	tdb->mutexes = NULL;
+	tdb->mutexes_size = 0;
+}
+
+/*
+  lock a chain or freelist. op is F_SETLKW to wait for it, or F_SETLK
+  to fail with EAGAIN if the chain or an incompatible allrecord lock is
+  held.
+*/
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype, int op)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	pthread_mutex_t *mutex = list_mutex(tdb, list);
+	int nonblock = (op == F_SETLK);
+	int owner_died;
+
+	while (1) {
+		if (mutex_take_op(tdb, mutex, NULL, nonblock) == -1) {
+			return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+		}
+
+		/* the freelists are not covered by the allrecord lock */
+		if (list < 0) {
+			return 0;
+		}
+		if (m->allrecord_lock == F_UNLCK ||
+		    (m->allrecord_lock == F_RDLCK && ltype == F_RDLCK)) {
+			seq_enter(chain_seq(tdb, list));
+			return 0;
+		}
+
+		/* wait for the allrecord lock holder and try again */
+		if (mutex_drop(mutex) == -1) {
+			return -1;
+		}
+		if (nonblock) {
+			errno = EAGAIN;
+			return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+		}
+		owner_died = 0;
+		if (mutex_take(tdb, &m->allrecord_mutex, &owner_died) == -1) {
+			return -1;
+		}
+		if (owner_died) {
+			m->allrecord_lock = F_UNLCK;
+			if (m->allrecord_seq & 1) {
+				m->allrecord_seq++;
+			}
+		}
+		if (mutex_drop(&m->allrecord_mutex) == -1) {
+			return -1;
+		}
+	}
+}
+
+int tdb_mutex_unlock(struct tdb_context *tdb, int list)
+{
+	if (list >= 0) {
+		seq_leave(chain_seq(tdb, list));
+	}
+	return mutex_drop(list_mutex(tdb, list));
+}
+
+/* wait for everyone who holds a chain lock to let go of it */
+static int tdb_mutex_drain_chains(struct tdb_context *tdb)
+{
+	u32 i;
+
+	for (i = 0; i < tdb->header.hash_size; i++) {
+		pthread_mutex_t *mutex = list_mutex(tdb, i);
+
+		if (mutex_take(tdb, mutex, NULL) == -1 ||
+		    mutex_drop(mutex) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the caller already holds the fcntl allrecord lock */
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int owner_died = 0;
+
+	if (mutex_take(tdb, &m->allrecord_mutex, &owner_died) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_allrecord_lock: %s\n",
+			 strerror(errno)));
+		return -1;
+	}
+	if (owner_died && (m->allrecord_seq & 1)) {
+		m->allrecord_seq++;
+	}
+	m->allrecord_lock = ltype;
+	if (ltype == F_WRLCK) {
+		seq_enter(&m->allrecord_seq);
+	}
+
+	if (tdb_mutex_drain_chains(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_allrecord_lock: %s\n",
+			 strerror(errno)));
+		tdb_mutex_allrecord_unlock(tdb);
+		return -1;
+	}
+	return 0;
+}
+
+/* turn our read allrecord lock into a write one, for transaction commit */
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	tdb->mutexes->allrecord_lock = F_WRLCK;
+	seq_enter(&tdb->mutexes->allrecord_seq);
+
+	if (tdb_mutex_drain_chains(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_allrecord_upgrade: %s\n",
+			 strerror(errno)));
+		tdb->mutexes->allrecord_lock = F_RDLCK;
+		seq_leave(&tdb->mutexes->allrecord_seq);
+		return -1;
+	}
+	return 0;
+}
+
+void tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	if (tdb->mutexes->allrecord_lock == F_WRLCK) {
+		seq_leave(&tdb->mutexes->allrecord_seq);
+	}
+	tdb->mutexes->allrecord_lock = F_UNLCK;
+	mutex_drop(&tdb->mutexes->allrecord_mutex);
+}
+
+/*
+  start an unlocked look at a chain. Returns -1 if somebody is changing
+  it right now.
+*/
+int tdb_mutex_seq_begin(struct tdb_context *tdb, u32 list, u32 seq[2])
+{
+	seq[0] = tdb->mutexes->allrecord_seq;
+	seq[1] = *chain_seq(tdb, list);
+	if ((seq[0] | seq[1]) & 1) {
+		return -1;
+	}
+	tdb_mb();
+	return 0;
+}
+
+/* did the chain change since tdb_mutex_seq_begin()? */
+int tdb_mutex_seq_changed(struct tdb_context *tdb, u32 list, const u32 seq[2])
+{
+	tdb_mb();
+	return tdb->mutexes->allrecord_seq != seq[0] ||
+		*chain_seq(tdb, list) != seq[1];
+}
+
+#else /* HAVE_ROBUST_MUTEXES */
+
+/* without robust mutexes TDB_MUTEX_LOCKING is ignored when creating a
+   database, and a database that another build set up for mutexes
+   can't be opened for writing */
+
+int tdb_mutex_supported(void)
+{
+	return 0;
+}
+
+int tdb_mutex_open(struct tdb_context *tdb, mode_t mode, int create)
+{
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_open: %s uses mutex locking, "
+		 "which this build does not support\n", tdb->name));
+	errno = ENOSYS;
+	return -1;
+}
+
+void tdb_mutex_close(struct tdb_context *tdb)
+{
+}
+
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype, int op)
+{
+	return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+}
+
+int tdb_mutex_unlock(struct tdb_context *tdb, int list)
+{
+	return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+}
+
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype)
+{
+	return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+}
+
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	return TDB_ERRCODE(TDB_ERR_LOCK, -1);
+}
+
+void tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+}
+
+int tdb_mutex_seq_begin(struct tdb_context *tdb, u32 list, u32 seq[2])
+{
+	return -1;
+}
+
+int tdb_mutex_seq_changed(struct tdb_context *tdb, u32 list, const u32 seq[2])
+{
+	return 1;
+}
+
+#endif /* HAVE_ROBUST_MUTEXES */
@@ -53,15 +53,28 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	size_t size;
 	int ret = -1;
 	ssize_t written;
+	int is64 = (tdb->flags & TDB_OFFSET64) != 0;
+	const char *magic_food = is64 ? TDB_MAGIC_FOOD64 : TDB_MAGIC_FOOD;
 
 	/* We make it up in memory, then write it out if not internal */
-	size = sizeof(struct tdb_header) + (hash_size+1)*sizeof(tdb_off_t);
+	size = sizeof(struct tdb_header) + (hash_size+1)*(is64 ? 8 : 4);
 	if (!(newdb = (struct tdb_header *)calloc(size, 1)))
 		return TDB_ERRCODE(TDB_ERR_OOM, -1);
 
 	/* Fill in the header */
-	newdb->version = TDB_VERSION;
+	newdb->version = is64 ? TDB_VERSION64 : TDB_VERSION;
 	newdb->hash_size = hash_size;
+	if (tdb->flags & TDB_SIZE_CLASSES) {
+		newdb->freelist_classes = TDB_NUM_SIZE_CLASSES;
+	}
+	/* mutexes only work if everyone agrees on them, which is
+	   ensured by the first opener of a clear-if-first db setting
+	   them up */
+	if ((tdb->flags & TDB_MUTEX_LOCKING) &&
+	    (tdb->flags & TDB_CLEAR_IF_FIRST) &&
+	    !(tdb->flags & TDB_NOLOCK) && tdb_mutex_supported()) {
+		newdb->mutex_locking = 1;
+	}
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
@@ -80,7 +93,7 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	CONVERT(*newdb);
 	memcpy(&tdb->header, newdb, sizeof(tdb->header));
 	/* Don't endian-convert the magic food! */
-	memcpy(newdb->magic_food, TDB_MAGIC_FOOD, strlen(TDB_MAGIC_FOOD)+1);
+	memcpy(newdb->magic_food, magic_food, strlen(magic_food)+1);
 	/* we still have "ret == -1" here */
 	written = write(tdb->fd, newdb, size);
 	if (written == size) {
@@ -150,7 +163,7 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 {
 	struct tdb_context *tdb;
 	struct stat st;
-	int rev = 0, locked = 0;
+	int rev = 0, locked = 0, created = 0, valid;
 	unsigned char *vp;
 	u32 vertest;
 
@@ -195,6 +208,11 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		tdb->flags &= ~TDB_CLEAR_IF_FIRST;
 	}
 
+	/* nothing in a volatile database is worth an fsync */
+	if (tdb->flags & TDB_VOLATILE) {
+		tdb->flags |= TDB_NOSYNC;
+	}
+
 	/* internal databases don't mmap or lock, and start off cleared */
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->flags |= (TDB_NOLOCK | TDB_NOMMAP);
@@ -231,11 +249,22 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		}
 	}
 
+	/* both the 32 bit (TDB_VERSION) and the 64 bit (TDB_VERSION64)
+	   format are understood. New databases only get the 64 bit one
+	   with TDB_OFFSET64: older tdb code opening such a file with
+	   O_CREAT would take it for garbage and wipe it */
 	errno = 0;
-	if (read(tdb->fd, &tdb->header, sizeof(tdb->header)) != sizeof(tdb->header)
-	    || strcmp(tdb->header.magic_food, TDB_MAGIC_FOOD) != 0
-	    || (tdb->header.version != TDB_VERSION
-		&& !(rev = (tdb->header.version==TDB_BYTEREV(TDB_VERSION))))) {
+	valid = (read(tdb->fd, &tdb->header, sizeof(tdb->header)) == sizeof(tdb->header));
+	if (valid && strcmp(tdb->header.magic_food, TDB_MAGIC_FOOD64) == 0) {
+		valid = (tdb->header.version == TDB_VERSION64 ||
+			 (rev = (tdb->header.version == TDB_BYTEREV(TDB_VERSION64))));
+	} else if (valid && strcmp(tdb->header.magic_food, TDB_MAGIC_FOOD) == 0) {
+		valid = (tdb->header.version == TDB_VERSION ||
+			 (rev = (tdb->header.version == TDB_BYTEREV(TDB_VERSION))));
+	} else {
+		valid = 0;
+	}
+	if (!valid) {
 		/* its not a valid database - possibly initialise it */
 		if (!(open_flags & O_CREAT) || tdb_new_database(tdb, hash_size) == -1) {
 			if (errno == 0) {
@@ -244,11 +273,12 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 			goto fail;
 		}
 		rev = (tdb->flags & TDB_CONVERT);
+		created = 1;
 	}
 	vp = (unsigned char *)&tdb->header.version;
 	vertest = (((u32)vp[0]) << 24) | (((u32)vp[1]) << 16) |
 		  (((u32)vp[2]) << 8) | (u32)vp[3];
-	tdb->flags |= (vertest==TDB_VERSION) ? TDB_BIGENDIAN : 0;
+	tdb->flags |= (vertest==TDB_VERSION || vertest==TDB_VERSION64) ? TDB_BIGENDIAN : 0;
 	if (!rev)
 		tdb->flags &= ~TDB_CONVERT;
 	else {
@@ -258,6 +288,21 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	if (fstat(tdb->fd, &st) == -1)
 		goto fail;
 
+	/* tell tdb_get_flags() users which format this is */
+	if (TDB_IS64) {
+		tdb->flags |= TDB_OFFSET64;
+	} else {
+		tdb->flags &= ~TDB_OFFSET64;
+	}
+
+	if (tdb->header.freelist_classes > TDB_NUM_SIZE_CLASSES) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: %s has %u size classes, "
+			 "we only know %u\n", name, tdb->header.freelist_classes,
+			 TDB_NUM_SIZE_CLASSES));
+		errno = EIO;
+		goto fail;
+	}
+
 	if (tdb->header.rwlocks != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: spinlocks no longer supported, clearing spinlock flag\n"));
 		tdb->header.rwlocks = 0;
@@ -282,6 +327,12 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	tdb->inode = st.st_ino;
 	tdb->max_dead_records = 0;
 	tdb_mmap(tdb);
+
+	if (tdb->header.mutex_locking && !(tdb->flags & TDB_NOLOCK) &&
+	    tdb_mutex_open(tdb, mode, locked || created) == -1) {
+		goto fail;	/* errno set by tdb_mutex_open */
+	}
+
 	if (locked) {
 		if (tdb->methods->tdb_brlock(tdb, ACTIVE_LOCK, F_UNLCK, F_SETLK, 0, 1) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
@@ -329,6 +380,7 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_close(tdb);
 	SAFE_FREE(tdb->name);
 	if (tdb->fd != -1)
 		if (close(tdb->fd) != 0)
@@ -358,6 +410,10 @@ int tdb_close(struct tdb_context *tdb)
 	struct tdb_context **i;
 	int ret = 0;
 
+	if (tdb->batch) {
+		tdb_transaction_batch_close(tdb);
+	}
+
 	if (tdb->transaction) {
 		tdb_transaction_cancel(tdb);
 	}
@@ -368,6 +424,7 @@ int tdb_close(struct tdb_context *tdb)
 		else
 			tdb_munmap(tdb);
 	}
+	tdb_mutex_close(tdb);
 	SAFE_FREE(tdb->name);
 	if (tdb->fd != -1)
 		ret = close(tdb->fd);
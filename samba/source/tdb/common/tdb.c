@@ -51,6 +51,9 @@ static void tdb_increment_seqnum(struct tdb_context *tdb)
 	*/
 	tdb_ofs_read(tdb, TDB_SEQNUM_OFS, &seqnum);
 	seqnum++;
+	if (!TDB_IS64) {
+		seqnum &= TDB_MAX_OFF32;
+	}
 	tdb_ofs_write(tdb, TDB_SEQNUM_OFS, &seqnum);
 
 	tdb_brlock(tdb, TDB_SEQNUM_OFS, F_UNLCK, F_SETLKW, 1, 1);
@@ -79,7 +82,7 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, u32 hash,
 
 		if (!TDB_DEAD(r) && hash==r->full_hash
 		    && key.dsize==r->key_len
-		    && tdb_parse_data(tdb, key, rec_ptr + sizeof(*r),
+		    && tdb_parse_data(tdb, key, rec_ptr + TDB_REC_SIZE,
 				      r->key_len, tdb_key_compare,
 				      NULL) == 0) {
 			return rec_ptr;
@@ -93,7 +96,7 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, u32 hash,
 tdb_off_t tdb_find_lock_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash, int locktype,
 			   struct list_struct *rec)
 {
-	u32 rec_ptr;
+	tdb_off_t rec_ptr;
 
 	if (tdb_lock(tdb, BUCKET(hash), locktype) == -1)
 		return 0;
@@ -117,12 +120,12 @@ static int tdb_update_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash, TDB_
 		return -1;
 
 	/* must be long enough key, data and tailer */
-	if (rec.rec_len < key.dsize + dbuf.dsize + sizeof(tdb_off_t)) {
+	if (rec.rec_len < key.dsize + dbuf.dsize + TDB_OFF_SIZE) {
 		tdb->ecode = TDB_SUCCESS; /* Not really an error */
 		return -1;
 	}
 
-	if (tdb->methods->tdb_write(tdb, rec_ptr + sizeof(rec) + rec.key_len,
+	if (tdb->methods->tdb_write(tdb, rec_ptr + TDB_REC_SIZE + rec.key_len,
 		      dbuf.dptr, dbuf.dsize) == -1)
 		return -1;
 
@@ -153,7 +156,7 @@ TDB_DATA tdb_fetch(struct tdb_context *tdb, TDB_DATA key)
 	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec)))
 		return tdb_null;
 
-	ret.dptr = tdb_alloc_read(tdb, rec_ptr + sizeof(rec) + rec.key_len,
+	ret.dptr = tdb_alloc_read(tdb, rec_ptr + TDB_REC_SIZE + rec.key_len,
 				  rec.data_len);
 	ret.dsize = rec.data_len;
 	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
@@ -193,7 +196,7 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 		return TDB_ERRCODE(TDB_ERR_NOEXIST, 0);
 	}
 
-	ret = tdb_parse_data(tdb, key, rec_ptr + sizeof(rec) + rec.key_len,
+	ret = tdb_parse_data(tdb, key, rec_ptr + TDB_REC_SIZE + rec.key_len,
 			     rec.data_len, parser, private_data);
 
 	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
@@ -289,7 +292,7 @@ static int tdb_purge_dead(struct tdb_context *tdb, u32 hash)
 	struct list_struct rec;
 	tdb_off_t rec_ptr;
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (tdb_lock_freelist(tdb) == -1) {
 		return -1;
 	}
 	
@@ -314,7 +317,7 @@ static int tdb_purge_dead(struct tdb_context *tdb, u32 hash)
 	}
 	res = 0;
  fail:
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_freelist(tdb);
 	return res;
 }
 
@@ -477,7 +480,7 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 		 */
 		rec_ptr = tdb_find_dead(
 			tdb, hash, &rec,
-			key.dsize + dbuf.dsize + sizeof(tdb_off_t));
+			key.dsize + dbuf.dsize + TDB_OFF_SIZE);
 
 		if (rec_ptr != 0) {
 			rec.key_len = key.dsize;
@@ -486,7 +489,7 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 			rec.magic = TDB_MAGIC;
 			if (tdb_rec_write(tdb, rec_ptr, &rec) == -1
 			    || tdb->methods->tdb_write(
-				    tdb, rec_ptr + sizeof(rec),
+				    tdb, rec_ptr + TDB_REC_SIZE,
 				    p, key.dsize + dbuf.dsize) == -1) {
 				goto fail;
 			}
@@ -500,20 +503,20 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 	 * the hash chain under the freelist lock.
 	 */
 
-	if (tdb_lock(tdb, -1, F_WRLCK) == -1) {
+	if (tdb_lock_freelist(tdb) == -1) {
 		goto fail;
 	}
 
 	if ((tdb->max_dead_records != 0)
 	    && (tdb_purge_dead(tdb, hash) == -1)) {
-		tdb_unlock(tdb, -1, F_WRLCK);
+		tdb_unlock_freelist(tdb);
 		goto fail;
 	}
 
 	/* we have to allocate some space */
 	rec_ptr = tdb_allocate(tdb, key.dsize + dbuf.dsize, &rec);
 
-	tdb_unlock(tdb, -1, F_WRLCK);
+	tdb_unlock_freelist(tdb);
 
 	if (rec_ptr == 0) {
 		goto fail;
@@ -530,7 +533,7 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 
 	/* write out and point the top of the hash chain at it */
 	if (tdb_rec_write(tdb, rec_ptr, &rec) == -1
-	    || tdb->methods->tdb_write(tdb, rec_ptr+sizeof(rec), p, key.dsize+dbuf.dsize)==-1
+	    || tdb->methods->tdb_write(tdb, rec_ptr+TDB_REC_SIZE, p, key.dsize+dbuf.dsize)==-1
 	    || tdb_ofs_write(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1) {
 		/* Need to tdb_unallocate() here */
 		goto fail;
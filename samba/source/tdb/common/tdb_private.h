@@ -36,38 +36,65 @@
 #define u32 unsigned
 #endif
 
+#ifndef u64
+#define u64 uint64_t
+#endif
+
 #ifndef HAVE_GETPAGESIZE
 #define getpagesize() 0x2000
 #endif
 
-typedef u32 tdb_len_t;
-typedef u32 tdb_off_t;
+/* offsets and lengths are 64 bit in memory whatever the file format */
+typedef u64 tdb_len_t;
+typedef u64 tdb_off_t;
 
 #ifndef offsetof
 #define offsetof(t,f) ((unsigned int)&((t *)0)->f)
 #endif
 
 #define TDB_MAGIC_FOOD "TDB file\n"
+#define TDB_MAGIC_FOOD64 "TDB64 file\n"
 #define TDB_VERSION (0x26011967 + 6)
+#define TDB_VERSION64 (0x26011967 + 7)
 #define TDB_MAGIC (0x26011999U)
 #define TDB_FREE_MAGIC (~TDB_MAGIC)
 #define TDB_DEAD_MAGIC (0xFEE1DEAD)
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
-#define TDB_ALIGNMENT 4
-#define MIN_REC_SIZE (2*sizeof(struct list_struct) + TDB_ALIGNMENT)
+#define TDB_ALIGNMENT TDB_OFF_SIZE
+#define MIN_REC_SIZE (2*TDB_REC_SIZE + TDB_ALIGNMENT)
 #define DEFAULT_HASH_SIZE 131
 #define FREELIST_TOP (sizeof(struct tdb_header))
 #define TDB_ALIGN(x,a) (((x) + (a)-1) & ~((a)-1))
 #define TDB_BYTEREV(x) (((((x)&0xff)<<24)|((x)&0xFF00)<<8)|(((x)>>8)&0xFF00)|((x)>>24))
+#define TDB_BYTEREV64(x) (((u64)TDB_BYTEREV((u32)(x)) << 32) | TDB_BYTEREV((u32)((x) >> 32)))
 #define TDB_DEAD(r) ((r)->magic == TDB_DEAD_MAGIC)
 #define TDB_BAD_MAGIC(r) ((r)->magic != TDB_MAGIC && !TDB_DEAD(r))
-#define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*sizeof(tdb_off_t))
-#define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*sizeof(tdb_off_t))
+#define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*TDB_OFF_SIZE)
+#define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*TDB_OFF_SIZE)
 #define TDB_DATA_START(hash_size) TDB_HASH_TOP(hash_size-1)
-#define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
-#define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
+#define TDB_RECOVERY_HEAD (TDB_IS64 ? offsetof(struct tdb_header, recovery_start64) : \
+			   offsetof(struct tdb_header, recovery_start))
+#define TDB_SEQNUM_OFS    (TDB_IS64 ? offsetof(struct tdb_header, sequence_number64) : \
+			   offsetof(struct tdb_header, sequence_number))
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
+#define TDB_PAD_U64  0x4242424242424242ULL
+
+/* size class free lists (TDB_SIZE_CLASSES). Free records of less than
+   1<<TDB_SIZE_CLASS_SHIFT bytes go on list 0, each further list takes
+   twice the size of the one before and the last takes everything
+   bigger. List 0 is the classic freelist at FREELIST_TOP, the others
+   live in the header. Each list has its own lock. */
+#define TDB_NUM_SIZE_CLASSES 8
+#define TDB_SIZE_CLASS_SHIFT 6
+#define TDB_SIZE_CLASS_SEARCH 16 /* free records looked at per list */
+#define TDB_SIZE_CLASS_LIST(c) (-2 - (int)(c)) /* lock "list" of class c */
+
+/* with TDB_MUTEX_LOCKING the chain and freelist locks are robust
+   process shared mutexes in a "<name>.mutex" file instead of fcntl
+   locks. Everything else still uses fcntl. */
+#define TDB_MUTEX_MAGIC (0x26011997U)
+#define tdb_have_mutexes(tdb) ((tdb)->mutexes != NULL)
 
 /* NB assumes there is a local variable called "tdb" that is the
  * current context, also takes doubly-parenthesized print-style
@@ -89,6 +116,15 @@ typedef u32 tdb_off_t;
 #define DOCONV() (tdb->flags & TDB_CONVERT)
 #define CONVERT(x) (DOCONV() ? tdb_convert(&x, sizeof(x)) : &x)
 
+/* TDB_VERSION64 files have 8 byte offsets and lengths in the hash
+   table, the free lists, the record headers and the tailers, so they
+   can grow past 4GB. The older TDB_VERSION files have 4 byte ones. */
+#define TDB_IS64 (tdb->header.version == TDB_VERSION64)
+#define TDB_OFF_SIZE (TDB_IS64 ? 8 : 4)
+#define TDB_REC_SIZE (TDB_IS64 ? 40 : 24) /* on disk list_struct */
+#define TDB_REC_MAGIC_OFS (TDB_REC_SIZE - sizeof(u32)) /* magic is last */
+#define TDB_MAX_OFF32 0xFFFFFFFFULL
+
 
 /* the body of the database is made of one list_struct for the free space
    plus a separate data list for each hash value */
@@ -106,21 +142,32 @@ struct list_struct {
 				char key[key_len];
 				char data[data_len];
 			}
-			u32 totalsize; (tailer)
+			tdb_off_t totalsize; (tailer)
 		}
 	*/
 };
 
+/* the list_struct is stored as 4 byte values in TDB_VERSION files, and
+   as 8 byte next, rec_len, key_len and data_len followed by the 4 byte
+   full_hash and magic in TDB_VERSION64 files. See tdb_rec_pack(). */
+
 
 /* this is stored at the front of every database */
 struct tdb_header {
 	char magic_food[32]; /* for /etc/magic */
 	u32 version; /* version of the code */
 	u32 hash_size; /* number of hash entries */
-	tdb_off_t rwlocks; /* obsolete - kept to detect old formats */
-	tdb_off_t recovery_start; /* offset of transaction recovery region */
-	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
-	tdb_off_t reserved[29];
+	u32 rwlocks; /* obsolete - kept to detect old formats */
+	u32 recovery_start; /* offset of transaction recovery region */
+	u32 sequence_number; /* used when TDB_SEQNUM is set */
+	u32 freelist_classes; /* 0 for the single classic freelist */
+	u32 freelist_class_top[TDB_NUM_SIZE_CLASSES-1];
+	u32 mutex_locking; /* chains are locked in the .mutex file */
+	/* TDB_VERSION64 uses these instead of the u32 offsets above */
+	u64 recovery_start64;
+	u64 sequence_number64;
+	u64 freelist_class_top64[TDB_NUM_SIZE_CLASSES-1];
+	u32 reserved[26-3*TDB_NUM_SIZE_CLASSES];
 };
 
 struct tdb_lock_type {
@@ -131,7 +178,7 @@ struct tdb_lock_type {
 
 struct tdb_traverse_lock {
 	struct tdb_traverse_lock *next;
-	u32 off;
+	tdb_off_t off;
 	u32 hash;
 	int lock_rw;
 };
@@ -172,6 +219,9 @@ struct tdb_context {
 	int page_size;
 	int max_dead_records;
 	volatile sig_atomic_t *interrupt_sig_ptr;
+	struct tdb_mutexes *mutexes; /* mapped .mutex file, see mutex.c */
+	size_t mutexes_size;
+	struct tdb_batch *batch; /* see tdb_transaction_batch_start() */
 };
 
 
@@ -181,6 +231,7 @@ struct tdb_context {
 int tdb_munmap(struct tdb_context *tdb);
 void tdb_mmap(struct tdb_context *tdb);
 int tdb_lock(struct tdb_context *tdb, int list, int ltype);
+int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype);
 int tdb_unlock(struct tdb_context *tdb, int list, int ltype);
 int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset, int rw_type, int lck_type, int probe, size_t len);
 int tdb_brlock_upgrade(struct tdb_context *tdb, tdb_off_t offset, size_t len);
@@ -197,6 +248,11 @@ int tdb_lock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_unlock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_rec_read(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec);
 int tdb_rec_write(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec);
+int tdb_rec_header_read(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec);
+void tdb_rec_pack(struct tdb_context *tdb, const struct list_struct *rec, void *buf);
+void tdb_rec_unpack(struct tdb_context *tdb, const void *buf, struct list_struct *rec);
+void tdb_off_pack(struct tdb_context *tdb, tdb_off_t off, void *buf);
+tdb_off_t tdb_off_unpack(struct tdb_context *tdb, const void *buf);
 int tdb_do_delete(struct tdb_context *tdb, tdb_off_t rec_ptr, struct list_struct *rec);
 char *tdb_alloc_read(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t len);
 int tdb_parse_data(struct tdb_context *tdb, TDB_DATA key,
@@ -210,5 +266,22 @@ void tdb_io_init(struct tdb_context *tdb);
 int tdb_expand(struct tdb_context *tdb, tdb_off_t size);
 int rec_free_read(struct tdb_context *tdb, tdb_off_t off,
 		  struct list_struct *rec);
+u32 tdb_num_freelists(struct tdb_context *tdb);
+tdb_off_t tdb_freelist_top(struct tdb_context *tdb, u32 list);
+int tdb_lock_freelist(struct tdb_context *tdb);
+int tdb_unlock_freelist(struct tdb_context *tdb);
+int tdb_lock_freelists(struct tdb_context *tdb);
+int tdb_unlock_freelists(struct tdb_context *tdb);
+int tdb_mutex_supported(void);
+int tdb_mutex_open(struct tdb_context *tdb, mode_t mode, int create);
+void tdb_mutex_close(struct tdb_context *tdb);
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype, int op);
+int tdb_mutex_unlock(struct tdb_context *tdb, int list);
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype);
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb);
+void tdb_mutex_allrecord_unlock(struct tdb_context *tdb);
+int tdb_mutex_seq_begin(struct tdb_context *tdb, u32 list, u32 seq[2]);
+int tdb_mutex_seq_changed(struct tdb_context *tdb, u32 list, const u32 seq[2]);
+void tdb_transaction_batch_close(struct tdb_context *tdb);
 
 
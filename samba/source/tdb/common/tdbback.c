@@ -91,17 +91,44 @@ static int test_fn(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA dbuf, void *state)
 }
 
 /*
-  carefully backup a tdb, validating the contents and
-  only doing the backup if its OK
-  this function is also used for restore
+  does another process hold a lock anywhere in the file? Everybody
+  using a CLEAR_IF_FIRST database holds a read lock on it all the time,
+  users of other databases only while they are in the middle of an
+  operation.
 */
-int backup_tdb(const char *old_name, const char *new_name, int hash_size)
+static int tdb_locked_by_other(TDB_CONTEXT *tdb, pid_t *pid)
+{
+	struct flock fl;
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	fl.l_pid = 0;
+
+	if (fcntl(tdb_fd(tdb), F_GETLK, &fl) != 0) {
+		return -1;
+	}
+	*pid = fl.l_pid;
+	return fl.l_type != F_UNLCK;
+}
+
+/*
+  copy old_name to new_name through a temporary file. With convert
+  set old_name and new_name are the same file, it is converted to the
+  64 bit format and stays locked until the copy has replaced it.
+  Otherwise the copy gets the format of the original.
+*/
+static int copy_tdb(const char *old_name, const char *new_name, int hash_size,
+		    int convert)
 {
 	TDB_CONTEXT *tdb;
 	TDB_CONTEXT *tdb_new;
 	char *tmp_name;
 	struct stat st;
 	int count1, count2;
+	int tdb_flags;
+	pid_t pid;
 
 	tmp_name = add_suffix(new_name, ".tmp");
 
@@ -120,14 +147,36 @@ int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 		return 1;
 	}
 
+	/* anybody still writing to the old file after the rename
+	   would lose their changes */
+	if (convert) {
+		int ret = tdb_locked_by_other(tdb, &pid);
+		if (ret != 0) {
+			if (ret == -1) {
+				perror(old_name);
+			} else {
+				fprintf(stderr,"%s is in use by process %d, "
+					"not converting it\n", old_name,
+					(int)pid);
+			}
+			tdb_close(tdb);
+			free(tmp_name);
+			return 1;
+		}
+		tdb_flags = TDB_OFFSET64;
+	} else {
+		tdb_flags = tdb_get_flags(tdb) & TDB_OFFSET64;
+	}
+
 	/* create the new tdb */
 	unlink(tmp_name);
 	tdb_new = tdb_open(tmp_name,
 			   hash_size ? hash_size : tdb_hash_size(tdb),
-			   TDB_DEFAULT, O_RDWR|O_CREAT|O_EXCL, 
+			   tdb_flags, O_RDWR|O_CREAT|O_EXCL, 
 			   st.st_mode & 0777);
 	if (!tdb_new) {
 		perror(tmp_name);
+		tdb_close(tdb);
 		free(tmp_name);
 		return 1;
 	}
@@ -155,8 +204,11 @@ int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 		return 1;
 	}
 
-	/* close the old tdb */
-	tdb_close(tdb);
+	/* close the old tdb, unless we are about to replace it */
+	if (!convert) {
+		tdb_close(tdb);
+		tdb = NULL;
+	}
 
 	/* close the new tdb and re-open read-only */
 	tdb_close(tdb_new);
@@ -165,6 +217,9 @@ int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 		fprintf(stderr,"failed to reopen %s\n", tmp_name);
 		unlink(tmp_name);
 		perror(tmp_name);
+		if (tdb) {
+			tdb_close(tdb);
+		}
 		free(tmp_name);
 		return 1;
 	}
@@ -175,6 +230,9 @@ int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 		fprintf(stderr,"failed to copy %s\n", old_name);
 		tdb_close(tdb_new);
 		unlink(tmp_name);
+		if (tdb) {
+			tdb_close(tdb);
+		}
 		free(tmp_name);
 		return 1;
 	}
@@ -184,19 +242,44 @@ int backup_tdb(const char *old_name, const char *new_name, int hash_size)
 
 	/* close the new tdb and rename it to .bak */
 	tdb_close(tdb_new);
-	unlink(new_name);
+	if (!convert) {
+		unlink(new_name);
+	}
 	if (rename(tmp_name, new_name) != 0) {
 		perror(new_name);
+		if (tdb) {
+			tdb_close(tdb);
+		}
 		free(tmp_name);
 		return 1;
 	}
 
+	if (tdb) {
+		tdb_close(tdb);
+	}
 	free(tmp_name);
 
 	return 0;
 }
 
+/*
+  carefully backup a tdb, validating the contents and
+  only doing the backup if its OK
+  this function is also used for restore
+*/
+int backup_tdb(const char *old_name, const char *new_name, int hash_size)
+{
+	return copy_tdb(old_name, new_name, hash_size, 0);
+}
 
+/*
+  convert a tdb to the 64 bit format in place. Refuses if another
+  process holds a lock on it.
+*/
+int convert_tdb(const char *fname, int hash_size)
+{
+	return copy_tdb(fname, fname, hash_size, 1);
+}
 
 /*
   verify a tdb and if it is corrupt then restore from *.bak
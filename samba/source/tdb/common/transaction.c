@@ -72,9 +72,26 @@
   - the commit stategy involves first saving away all modified data
     into a linearised buffer in the transaction recovery area, then
     marking the transaction recovery area with a magic value to
-    indicate a valid recovery record. In total 4 fsync/msync calls are
-    needed per commit to prevent race conditions. It might be possible
-    to reduce this to 3 or even 2 with some more work.
+    indicate a valid recovery record. In TDB_VERSION files 4
+    fsync/msync calls are needed per commit to prevent race
+    conditions. TDB_VERSION64 files write the recovery data and the
+    magic in one go, with a checksum of the data in the full_hash
+    field of the recovery record, so a recovery record that didn't
+    make it to disk completely is recognised and ignored. That saves
+    one sync.
+
+  - bytes that a transaction wrote but didn't change are neither saved
+    in the recovery area nor written back on commit. This matters
+    for the copy of the hash table every transaction carries.
+
+  - tdb_transaction_batch_start() makes the following transactions
+    logical ones within a single real transaction, which is committed
+    once enough of them have been committed or the oldest of them is
+    old enough, so many small transactions share one set of
+    syncs. A logical transaction can still be cancelled on its own:
+    every write in the batch is logged, and a cancel throws away the
+    transaction elements and replays the log up to where the logical
+    transaction started.
 
   - check for a valid recovery record on open of the tdb, while the
     global lock is held. Automatically recover from the transaction
@@ -90,6 +107,7 @@
 
 int transaction_brlock(struct tdb_context *tdb, tdb_off_t offset, 
 		       int rw_type, int lck_type, int probe, size_t len);
+static int transaction_batch_commit(struct tdb_context *tdb);
 
 struct tdb_transaction_el {
 	struct tdb_transaction_el *next, *prev;
@@ -103,8 +121,9 @@ struct tdb_transaction_el {
 */
 struct tdb_transaction {
 	/* we keep a mirrored copy of the tdb hash heads here so
-	   tdb_next_hash_chain() can operate efficiently */
-	u32 *hash_heads;
+	   tdb_next_hash_chain() can operate efficiently. They are
+	   in the on disk format, TDB_OFF_SIZE bytes each */
+	unsigned char *hash_heads;
 
 	/* the original io methods - used to do IOs to the real db */
 	const struct tdb_methods *io_methods;
@@ -130,6 +149,30 @@ struct tdb_transaction {
 	tdb_len_t old_map_size;
 };
 
+/*
+  a batch of transactions, see tdb_transaction_batch_start()
+*/
+struct tdb_batch {
+	unsigned int max_count;
+	unsigned int max_msecs;
+
+	/* logical transactions committed to the real transaction, and
+	   when the first of them was */
+	unsigned int count;
+	struct timeval first;
+
+	/* a logical transaction is open, started at savepoint in the
+	   log with the file map_size long */
+	int logical;
+	tdb_len_t savepoint;
+	tdb_len_t savepoint_map_size;
+
+	/* every write to the real transaction: offset, length, data */
+	unsigned char *log;
+	tdb_len_t log_size;
+	tdb_len_t log_used;
+};
+
 
 /*
   read while in a transaction. We need to check first if the data is in our list
@@ -186,7 +229,8 @@ static int transaction_read(struct tdb_context *tdb, tdb_off_t off, void *buf,
 	return tdb->transaction->io_methods->tdb_read(tdb, off, buf, len, cv);
 
 fail:
-	TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_read: failed at off=%d len=%d\n", off, len));
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_read: failed at off=%llu len=%llu\n",
+		 (unsigned long long)off, (unsigned long long)len));
 	tdb->ecode = TDB_ERR_IO;
 	tdb->transaction->transaction_error = 1;
 	return -1;
@@ -207,10 +251,9 @@ static int transaction_write(struct tdb_context *tdb, tdb_off_t off,
 	
 	/* if the write is to a hash head, then update the transaction
 	   hash heads */
-	if (len == sizeof(tdb_off_t) && off >= FREELIST_TOP &&
+	if (len == TDB_OFF_SIZE && off >= FREELIST_TOP &&
 	    off < FREELIST_TOP+TDB_HASHTABLE_SIZE(tdb)) {
-		u32 chain = (off-FREELIST_TOP) / sizeof(tdb_off_t);
-		memcpy(&tdb->transaction->hash_heads[chain], buf, len);
+		memcpy(tdb->transaction->hash_heads + (off-FREELIST_TOP), buf, len);
 	}
 
 	/* first see if we can replace an existing entry */
@@ -311,12 +354,64 @@ static int transaction_write(struct tdb_context *tdb, tdb_off_t off,
 	return 0;
 
 fail:
-	TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_write: failed at off=%d len=%d\n", off, len));
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_write: failed at off=%llu len=%llu\n",
+		 (unsigned long long)off, (unsigned long long)len));
 	tdb->ecode = TDB_ERR_IO;
 	tdb->transaction->transaction_error = 1;
 	return -1;
 }
 
+/*
+  remember a write in a batch, so it can be replayed
+*/
+static int transaction_log_write(struct tdb_context *tdb, tdb_off_t off,
+				 const void *buf, tdb_len_t len)
+{
+	struct tdb_batch *batch = tdb->batch;
+	tdb_len_t need = batch->log_used + sizeof(off) + sizeof(len) + len;
+	unsigned char *p;
+
+	if (need > batch->log_size) {
+		tdb_len_t size = batch->log_size * 2;
+
+		if (size < need) {
+			size = need;
+		}
+		if ((size_t)size != size ||
+		    (p = (unsigned char *)realloc(batch->log, size)) == NULL) {
+			tdb->ecode = TDB_ERR_OOM;
+			tdb->transaction->transaction_error = 1;
+			return -1;
+		}
+		batch->log = p;
+		batch->log_size = size;
+	}
+
+	p = batch->log + batch->log_used;
+	memcpy(p, &off, sizeof(off));
+	memcpy(p + sizeof(off), &len, sizeof(len));
+	if (buf) {
+		memcpy(p + sizeof(off) + sizeof(len), buf, len);
+	} else {
+		memset(p + sizeof(off) + sizeof(len), TDB_PAD_BYTE, len);
+	}
+	batch->log_used = need;
+	return 0;
+}
+
+/*
+  the tdb_write method during a transaction
+*/
+static int transaction_write_method(struct tdb_context *tdb, tdb_off_t off,
+				    const void *buf, tdb_len_t len)
+{
+	if (tdb->batch && len != 0 &&
+	    transaction_log_write(tdb, off, buf, len) == -1) {
+		return -1;
+	}
+	return transaction_write(tdb, off, buf, len);
+}
+
 /*
   accelerated hash chain head search, using the cached hash heads
 */
@@ -325,7 +420,8 @@ static void transaction_next_hash_chain(struct tdb_context *tdb, u32 *chain)
 	u32 h = *chain;
 	for (;h < tdb->header.hash_size;h++) {
 		/* the +1 takes account of the freelist */
-		if (0 != tdb->transaction->hash_heads[h+1]) {
+		if (0 != tdb_off_unpack(tdb, tdb->transaction->hash_heads +
+					(h+1)*TDB_OFF_SIZE)) {
 			break;
 		}
 	}
@@ -351,7 +447,7 @@ static int transaction_expand_file(struct tdb_context *tdb, tdb_off_t size,
 {
 	/* add a write to the transaction elements, so subsequent
 	   reads see the zero data */
-	if (transaction_write(tdb, size, NULL, addition) != 0) {
+	if (transaction_write_method(tdb, size, NULL, addition) != 0) {
 		return -1;
 	}
 
@@ -369,7 +465,7 @@ int transaction_brlock(struct tdb_context *tdb, tdb_off_t offset,
 
 static const struct tdb_methods transaction_methods = {
 	transaction_read,
-	transaction_write,
+	transaction_write_method,
 	transaction_next_hash_chain,
 	transaction_oob,
 	transaction_expand_file,
@@ -377,6 +473,104 @@ static const struct tdb_methods transaction_methods = {
 };
 
 
+/*
+  free all the transaction elements
+*/
+static void transaction_drop_elements(struct tdb_context *tdb)
+{
+	while (tdb->transaction->elements) {
+		struct tdb_transaction_el *el = tdb->transaction->elements;
+		tdb->transaction->elements = el->next;
+		free(el->data);
+		free(el);
+	}
+	tdb->transaction->elements_last = NULL;
+}
+
+/*
+  remove any locks created during the transaction
+*/
+static void transaction_drop_locks(struct tdb_context *tdb)
+{
+	if (tdb->global_lock.count != 0) {
+		tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 4*tdb->header.hash_size);
+		tdb->global_lock.count = 0;
+	}
+
+	if (tdb->num_locks != 0) {
+		int i;
+		for (i=0;i<tdb->num_lockrecs;i++) {
+			tdb_brlock(tdb,FREELIST_TOP+4*tdb->lockrecs[i].list,
+				   F_UNLCK,F_SETLKW, 0, 1);
+		}
+		tdb->num_locks = 0;
+		tdb->num_lockrecs = 0;
+		SAFE_FREE(tdb->lockrecs);
+	}
+}
+
+/*
+  start a logical transaction in a batch
+*/
+static int transaction_batch_begin(struct tdb_context *tdb)
+{
+	if (tdb->num_locks != 0 || tdb->global_lock.count) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_start: cannot start a transaction with locks held\n"));
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	tdb->batch->logical = 1;
+	tdb->batch->savepoint = tdb->batch->log_used;
+	tdb->batch->savepoint_map_size = tdb->map_size;
+	return 0;
+}
+
+/*
+  throw away the open logical transaction of a batch: rebuild the real
+  transaction from the log of the writes before it
+*/
+static int transaction_batch_rollback(struct tdb_context *tdb)
+{
+	struct tdb_transaction *tr = tdb->transaction;
+	struct tdb_batch *batch = tdb->batch;
+	tdb_len_t ofs, len;
+	tdb_off_t off;
+
+	batch->logical = 0;
+	batch->log_used = batch->savepoint;
+
+	transaction_drop_elements(tdb);
+	transaction_drop_locks(tdb);
+	tr->transaction_error = 0;
+
+	/* start again from the hash heads the real transaction started
+	   with, primed as in tdb_transaction_start() */
+	if (tr->io_methods->tdb_read(tdb, FREELIST_TOP, tr->hash_heads,
+				     TDB_HASHTABLE_SIZE(tdb), 0) != 0 ||
+	    transaction_write(tdb, FREELIST_TOP, tr->hash_heads,
+			      TDB_HASHTABLE_SIZE(tdb)) != 0) {
+		goto fail;
+	}
+
+	for (ofs = 0; ofs < batch->log_used; ofs += sizeof(off) + sizeof(len) + len) {
+		memcpy(&off, batch->log + ofs, sizeof(off));
+		memcpy(&len, batch->log + ofs + sizeof(off), sizeof(len));
+		if (transaction_write(tdb, off, batch->log + ofs + sizeof(off) + sizeof(len),
+				      len) != 0) {
+			goto fail;
+		}
+	}
+
+	tdb->map_size = batch->savepoint_map_size;
+	return 0;
+
+fail:
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_cancel: failed to replay the batch\n"));
+	tr->transaction_error = 1;
+	return -1;
+}
+
 /*
   start a tdb transaction. No token is returned, as only a single
   transaction is allowed to be pending per tdb_context
@@ -392,6 +586,9 @@ int tdb_transaction_start(struct tdb_context *tdb)
 
 	/* cope with nested tdb_transaction_start() calls */
 	if (tdb->transaction != NULL) {
+		if (tdb->batch && !tdb->batch->logical) {
+			return transaction_batch_begin(tdb);
+		}
 		tdb->transaction->nesting++;
 		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_transaction_start: nesting %d\n", 
 			 tdb->transaction->nesting));
@@ -441,19 +638,28 @@ int tdb_transaction_start(struct tdb_context *tdb)
 		goto fail;
 	}
 
+	/* with mutex locking the chain holders don't see the fcntl lock */
+	if (tdb_have_mutexes(tdb) &&
+	    tdb_mutex_allrecord_lock(tdb, F_RDLCK) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_start: failed to get hash mutexes\n"));
+		tdb->ecode = TDB_ERR_LOCK;
+		tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
+		goto fail;
+	}
+
 	/* setup a copy of the hash table heads so the hash scan in
 	   traverse can be fast */
-	tdb->transaction->hash_heads = (u32 *)
-		calloc(tdb->header.hash_size+1, sizeof(u32));
+	tdb->transaction->hash_heads = (unsigned char *)
+		calloc(tdb->header.hash_size+1, TDB_OFF_SIZE);
 	if (tdb->transaction->hash_heads == NULL) {
 		tdb->ecode = TDB_ERR_OOM;
-		goto fail;
+		goto fail_allrecord;
 	}
 	if (tdb->methods->tdb_read(tdb, FREELIST_TOP, tdb->transaction->hash_heads,
 				   TDB_HASHTABLE_SIZE(tdb), 0) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_start: failed to read hash heads\n"));
 		tdb->ecode = TDB_ERR_IO;
-		goto fail;
+		goto fail_allrecord;
 	}
 
 	/* make sure we know about any file expansions already done by
@@ -472,13 +678,17 @@ int tdb_transaction_start(struct tdb_context *tdb)
 			      TDB_HASHTABLE_SIZE(tdb)) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_start: failed to prime hash table\n"));
 		tdb->ecode = TDB_ERR_IO;
-		goto fail;
+		goto fail_allrecord;
 	}
 
 	return 0;
 	
-fail:
+fail_allrecord:
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
 	tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
+fail:
 	tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 	SAFE_FREE(tdb->transaction->hash_heads);
 	SAFE_FREE(tdb->transaction);
@@ -502,37 +712,26 @@ int tdb_transaction_cancel(struct tdb_context *tdb)
 		return 0;
 	}		
 
-	tdb->map_size = tdb->transaction->old_map_size;
-
-	/* free all the transaction elements */
-	while (tdb->transaction->elements) {
-		struct tdb_transaction_el *el = tdb->transaction->elements;
-		tdb->transaction->elements = el->next;
-		free(el->data);
-		free(el);
+	/* in a batch only the logical transaction goes */
+	if (tdb->batch) {
+		if (!tdb->batch->logical) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_cancel: no transaction\n"));
+			return -1;
+		}
+		return transaction_batch_rollback(tdb);
 	}
 
-	/* remove any global lock created during the transaction */
-	if (tdb->global_lock.count != 0) {
-		tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 4*tdb->header.hash_size);
-		tdb->global_lock.count = 0;
-	}
+	tdb->map_size = tdb->transaction->old_map_size;
 
-	/* remove any locks created during the transaction */
-	if (tdb->num_locks != 0) {
-		int i;
-		for (i=0;i<tdb->num_lockrecs;i++) {
-			tdb_brlock(tdb,FREELIST_TOP+4*tdb->lockrecs[i].list,
-				   F_UNLCK,F_SETLKW, 0, 1);
-		}
-		tdb->num_locks = 0;
-		tdb->num_lockrecs = 0;
-		SAFE_FREE(tdb->lockrecs);
-	}
+	transaction_drop_elements(tdb);
+	transaction_drop_locks(tdb);
 
 	/* restore the normal io methods */
 	tdb->methods = tdb->transaction->io_methods;
 
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
 	tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
 	tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 	SAFE_FREE(tdb->transaction->hash_heads);
@@ -575,12 +774,12 @@ static tdb_len_t tdb_recovery_size(struct tdb_context *tdb)
 	struct tdb_transaction_el *el;
 	tdb_len_t recovery_size = 0;
 
-	recovery_size = sizeof(u32);
+	recovery_size = TDB_OFF_SIZE;
 	for (el=tdb->transaction->elements;el;el=el->next) {
 		if (el->offset >= tdb->transaction->old_map_size) {
 			continue;
 		}
-		recovery_size += 2*sizeof(tdb_off_t) + el->length;
+		recovery_size += 2*TDB_OFF_SIZE + el->length;
 	}
 
 	return recovery_size;
@@ -598,6 +797,7 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 	struct list_struct rec;
 	const struct tdb_methods *methods = tdb->transaction->io_methods;
 	tdb_off_t recovery_head;
+	unsigned char buf[40];
 
 	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_recovery_allocate: failed to read recovery head\n"));
@@ -606,10 +806,12 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 
 	rec.rec_len = 0;
 
-	if (recovery_head != 0 && 
-	    methods->tdb_read(tdb, recovery_head, &rec, sizeof(rec), DOCONV()) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_recovery_allocate: failed to read recovery record\n"));
-		return -1;
+	if (recovery_head != 0) {
+		if (methods->tdb_read(tdb, recovery_head, buf, TDB_REC_SIZE, 0) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_recovery_allocate: failed to read recovery record\n"));
+			return -1;
+		}
+		tdb_rec_unpack(tdb, buf, &rec);
 	}
 
 	*recovery_size = tdb_recovery_size(tdb);
@@ -637,13 +839,13 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 	*recovery_size = tdb_recovery_size(tdb);
 
 	/* round up to a multiple of page size */
-	*recovery_max_size = TDB_ALIGN(sizeof(rec) + *recovery_size, tdb->page_size) - sizeof(rec);
+	*recovery_max_size = TDB_ALIGN(TDB_REC_SIZE + *recovery_size, tdb->page_size) - TDB_REC_SIZE;
 	*recovery_offset = tdb->map_size;
 	recovery_head = *recovery_offset;
 
 	if (methods->tdb_expand_file(tdb, tdb->transaction->old_map_size, 
 				     (tdb->map_size - tdb->transaction->old_map_size) +
-				     sizeof(rec) + *recovery_max_size) == -1) {
+				     TDB_REC_SIZE + *recovery_max_size) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_recovery_allocate: failed to create recovery area\n"));
 		return -1;
 	}
@@ -657,9 +859,9 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 
 	/* write the recovery header offset and sync - we can sync without a race here
 	   as the magic ptr in the recovery record has not been set */
-	CONVERT(recovery_head);
+	tdb_off_pack(tdb, recovery_head, buf);
 	if (methods->tdb_write(tdb, TDB_RECOVERY_HEAD, 
-			       &recovery_head, sizeof(tdb_off_t)) == -1) {
+			       buf, TDB_OFF_SIZE) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_recovery_allocate: failed to write recovery head\n"));
 		return -1;
 	}
@@ -668,6 +870,53 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 }
 
 
+/*
+  checksum of the recovery data in TDB_VERSION64 files
+*/
+static u32 tdb_recovery_checksum(const unsigned char *p, tdb_len_t len)
+{
+	u32 h = 0;
+	tdb_len_t i;
+
+	/* Jenkins one-at-a-time */
+	for (i = 0; i < len; i++) {
+		h += p[i];
+		h += (h << 10);
+		h ^= (h >> 6);
+	}
+	h += (h << 3);
+	h ^= (h >> 11);
+	h += (h << 15);
+	return h;
+}
+
+/*
+  cut the bytes a transaction element doesn't change off its ends. old
+  is what is on disk now, and is moved along with the element. Returns
+  0 if nothing is left.
+*/
+static tdb_len_t transaction_trim(struct tdb_transaction_el *el, unsigned char *old)
+{
+	tdb_len_t lead = 0, trail = 0;
+
+	while (lead < el->length && el->data[lead] == old[lead]) {
+		lead++;
+	}
+	if (lead == el->length) {
+		el->length = 0;
+		return 0;
+	}
+	while (el->data[el->length-1-trail] == old[el->length-1-trail]) {
+		trail++;
+	}
+
+	el->offset += lead;
+	el->length -= lead + trail;
+	memmove(el->data, el->data + lead, el->length);
+	memmove(old, old + lead, el->length);
+	return el->length;
+}
+
 /*
   setup the recovery data that will be used on a crash during commit
 */
@@ -678,10 +927,10 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	tdb_len_t recovery_size;
 	unsigned char *data, *p;
 	const struct tdb_methods *methods = tdb->transaction->io_methods;
-	struct list_struct *rec;
+	struct list_struct rec;
 	tdb_off_t recovery_offset, recovery_max_size;
 	tdb_off_t old_map_size = tdb->transaction->old_map_size;
-	u32 magic, tailer;
+	u32 magic;
 
 	/*
 	  check that the recovery area has enough space
@@ -691,24 +940,17 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 		return -1;
 	}
 
-	data = (unsigned char *)malloc(recovery_size + sizeof(*rec));
+	data = (unsigned char *)malloc(recovery_size + TDB_REC_SIZE);
 	if (data == NULL) {
 		tdb->ecode = TDB_ERR_OOM;
 		return -1;
 	}
 
-	rec = (struct list_struct *)data;
-	memset(rec, 0, sizeof(*rec));
-
-	rec->magic    = 0;
-	rec->data_len = recovery_size;
-	rec->rec_len  = recovery_max_size;
-	rec->key_len  = old_map_size;
-	CONVERT(rec);
-
 	/* build the recovery data into a single blob to allow us to do a single
-	   large write, which should be more efficient */
-	p = data + sizeof(*rec);
+	   large write, which should be more efficient. Each entry is
+	   the offset and length (TDB_OFF_SIZE bytes each) followed by
+	   the old data */
+	p = data + TDB_REC_SIZE;
 	for (el=tdb->transaction->elements;el;el=el->next) {
 		if (el->offset >= old_map_size) {
 			continue;
@@ -719,29 +961,45 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 			tdb->ecode = TDB_ERR_CORRUPT;
 			return -1;
 		}
-		memcpy(p, &el->offset, 4);
-		memcpy(p+4, &el->length, 4);
-		if (DOCONV()) {
-			tdb_convert(p, 8);
-		}
 		/* the recovery area contains the old data, not the
 		   new data, so we have to call the original tdb_read
 		   method to get it */
-		if (methods->tdb_read(tdb, el->offset, p + 8, el->length, 0) != 0) {
+		if (methods->tdb_read(tdb, el->offset, p + 2*TDB_OFF_SIZE,
+				      el->length, 0) != 0) {
 			free(data);
 			tdb->ecode = TDB_ERR_IO;
 			return -1;
 		}
-		p += 8 + el->length;
+		/* neither save nor write back what doesn't change */
+		if (transaction_trim(el, p + 2*TDB_OFF_SIZE) == 0) {
+			continue;
+		}
+		tdb_off_pack(tdb, el->offset, p);
+		tdb_off_pack(tdb, el->length, p + TDB_OFF_SIZE);
+		p += 2*TDB_OFF_SIZE + el->length;
 	}
 
 	/* and the tailer */
-	tailer = sizeof(*rec) + recovery_max_size;
-	memcpy(p, &tailer, 4);
-	CONVERT(p);
+	tdb_off_pack(tdb, TDB_REC_SIZE + recovery_max_size, p);
+	recovery_size = (p + TDB_OFF_SIZE) - (data + TDB_REC_SIZE);
+
+	memset(&rec, 0, sizeof(rec));
+
+	rec.magic    = 0;
+	rec.data_len = recovery_size;
+	rec.rec_len  = recovery_max_size;
+	rec.key_len  = old_map_size;
+
+	/* TDB_VERSION64 files write the magic right away, the checksum
+	   tells a recovery whether the rest made it to disk */
+	if (TDB_IS64) {
+		rec.magic = TDB_RECOVERY_MAGIC;
+		rec.full_hash = tdb_recovery_checksum(data + TDB_REC_SIZE, recovery_size);
+	}
+	tdb_rec_pack(tdb, &rec, data);
 
 	/* write the recovery data to the recovery area */
-	if (methods->tdb_write(tdb, recovery_offset, data, sizeof(*rec) + recovery_size) == -1) {
+	if (methods->tdb_write(tdb, recovery_offset, data, TDB_REC_SIZE + recovery_size) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: failed to write recovery data\n"));
 		free(data);
 		tdb->ecode = TDB_ERR_IO;
@@ -751,18 +1009,22 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	/* as we don't have ordered writes, we have to sync the recovery
 	   data before we update the magic to indicate that the recovery
 	   data is present */
-	if (transaction_sync(tdb, recovery_offset, sizeof(*rec) + recovery_size) == -1) {
+	if (transaction_sync(tdb, recovery_offset, TDB_REC_SIZE + recovery_size) == -1) {
 		free(data);
 		return -1;
 	}
 
 	free(data);
 
+	*magic_offset = recovery_offset + TDB_REC_MAGIC_OFS;
+
+	if (TDB_IS64) {
+		return 0;
+	}
+
 	magic = TDB_RECOVERY_MAGIC;
 	CONVERT(magic);
 
-	*magic_offset = recovery_offset + offsetof(struct list_struct, magic);
-
 	if (methods->tdb_write(tdb, *magic_offset, &magic, sizeof(magic)) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: failed to write recovery magic\n"));
 		tdb->ecode = TDB_ERR_IO;
@@ -784,6 +1046,7 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 {	
 	const struct tdb_methods *methods;
 	tdb_off_t magic_offset = 0;
+	tdb_off_t sync_start = (tdb_off_t)-1, sync_end = 0;
 	u32 zero = 0;
 
 	if (tdb->transaction == NULL) {
@@ -803,6 +1066,10 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		return 0;
 	}		
 
+	if (tdb->batch) {
+		return transaction_batch_commit(tdb);
+	}
+
 	/* check for a null transaction */
 	if (tdb->transaction->elements == NULL) {
 		tdb_transaction_cancel(tdb);
@@ -828,6 +1095,13 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
+	if (tdb_have_mutexes(tdb) && tdb_mutex_allrecord_upgrade(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: failed to upgrade hash mutexes\n"));
+		tdb->ecode = TDB_ERR_LOCK;
+		tdb_transaction_cancel(tdb);
+		return -1;
+	}
+
 	/* get the global lock - this prevents new users attaching to the database
 	   during the commit */
 	if (tdb_brlock(tdb, GLOBAL_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
@@ -866,7 +1140,9 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 	while (tdb->transaction->elements) {
 		struct tdb_transaction_el *el = tdb->transaction->elements;
 
-		if (methods->tdb_write(tdb, el->offset, el->data, el->length) == -1) {
+		if (el->length == 0) {
+			/* nothing changed, see transaction_trim() */
+		} else if (methods->tdb_write(tdb, el->offset, el->data, el->length) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed during commit\n"));
 			
 			/* we've overwritten part of the data and
@@ -880,6 +1156,13 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed\n"));
 			return -1;
+		} else {
+			if (el->offset < sync_start) {
+				sync_start = el->offset;
+			}
+			if (el->offset + el->length > sync_end) {
+				sync_end = el->offset + el->length;
+			}
 		}
 		tdb->transaction->elements = el->next;
 		free(el->data); 
@@ -888,7 +1171,8 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 
 	if (!(tdb->flags & TDB_NOSYNC)) {
 		/* ensure the new data is on disk */
-		if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+		if (sync_end > sync_start &&
+		    transaction_sync(tdb, sync_start, sync_end - sync_start) == -1) {
 			return -1;
 		}
 
@@ -928,6 +1212,149 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 }
 
 
+/*
+  commit the real transaction of a batch and start the next one
+*/
+static int transaction_batch_flush(struct tdb_context *tdb)
+{
+	struct tdb_batch *batch = tdb->batch;
+
+	tdb->batch = NULL;
+	if (tdb_transaction_commit(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: batch of %u transactions failed\n",
+			 batch->count));
+		SAFE_FREE(batch->log);
+		free(batch);
+		return -1;
+	}
+	if (tdb_transaction_start(tdb) == -1) {
+		/* what we have is on disk, just the batch is over */
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: cannot continue batch\n"));
+		SAFE_FREE(batch->log);
+		free(batch);
+		return 0;
+	}
+	batch->count = 0;
+	batch->log_used = 0;
+	tdb->batch = batch;
+	return 0;
+}
+
+/*
+  commit a logical transaction. The batch goes to disk when it is full
+  or the oldest transaction in it has waited long enough.
+*/
+static int transaction_batch_commit(struct tdb_context *tdb)
+{
+	struct tdb_batch *batch = tdb->batch;
+	struct timeval now;
+	unsigned int msecs;
+
+	if (!batch->logical) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: no transaction\n"));
+		return -1;
+	}
+
+	if (tdb->num_locks || tdb->global_lock.count) {
+		tdb->ecode = TDB_ERR_LOCK;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: locks pending on commit\n"));
+		transaction_batch_rollback(tdb);
+		return -1;
+	}
+
+	batch->logical = 0;
+
+	gettimeofday(&now, NULL);
+	if (batch->count++ == 0) {
+		batch->first = now;
+	}
+	msecs = (now.tv_sec - batch->first.tv_sec) * 1000 +
+		(now.tv_usec - batch->first.tv_usec) / 1000;
+
+	if ((batch->max_count && batch->count >= batch->max_count) ||
+	    (batch->max_msecs && msecs >= batch->max_msecs)) {
+		return transaction_batch_flush(tdb);
+	}
+	return 0;
+}
+
+/*
+  start a batch: until tdb_transaction_batch_end() transactions are
+  only logical ones, committed to disk together when max_count of them
+  have been committed or max_msecs after the first of them was (0 for
+  no limit). The limits are checked on commit, so whoever starts a
+  batch must end it once it has nothing more to add. Other writers
+  wait for the whole batch.
+*/
+int tdb_transaction_batch_start(struct tdb_context *tdb, unsigned int max_count,
+				unsigned int max_msecs)
+{
+	struct tdb_batch *batch;
+
+	if (tdb->transaction != NULL || tdb->batch != NULL) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_batch_start: already in a transaction\n"));
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	batch = (struct tdb_batch *)calloc(sizeof(struct tdb_batch), 1);
+	if (batch == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	batch->max_count = max_count;
+	batch->max_msecs = max_msecs;
+
+	if (tdb_transaction_start(tdb) == -1) {
+		free(batch);
+		return -1;
+	}
+	tdb->batch = batch;
+	return 0;
+}
+
+/*
+  commit what the batch has and end it
+*/
+int tdb_transaction_batch_end(struct tdb_context *tdb)
+{
+	struct tdb_batch *batch = tdb->batch;
+	int ret;
+
+	if (batch == NULL) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_batch_end: no batch\n"));
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	if (batch->logical) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_batch_end: a transaction is still open\n"));
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	tdb->batch = NULL;
+	ret = tdb_transaction_commit(tdb);
+	SAFE_FREE(batch->log);
+	free(batch);
+	return ret;
+}
+
+
+/*
+  tdb_close() in a batch: an unfinished transaction goes, what the batch
+  has is committed, as its user was told it was
+*/
+void tdb_transaction_batch_close(struct tdb_context *tdb)
+{
+	tdb->transaction->nesting = 0;
+	if (tdb->batch->logical) {
+		transaction_batch_rollback(tdb);
+	}
+	tdb_transaction_batch_end(tdb);
+}
+
+
 /*
   recover from an aborted transaction. Must be called with exclusive
   database write access already established (including the global
@@ -935,7 +1362,7 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 */
 int tdb_transaction_recover(struct tdb_context *tdb)
 {
-	tdb_off_t recovery_head, recovery_eof;
+	tdb_off_t recovery_head, recovery_eof, zero_off = 0;
 	unsigned char *data, *p;
 	u32 zero = 0;
 	struct list_struct rec;
@@ -953,8 +1380,7 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	}
 
 	/* read the recovery record */
-	if (tdb->methods->tdb_read(tdb, recovery_head, &rec, 
-				   sizeof(rec), DOCONV()) == -1) {
+	if (tdb_rec_header_read(tdb, recovery_head, &rec) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read recovery record\n"));		
 		tdb->ecode = TDB_ERR_IO;
 		return -1;
@@ -973,6 +1399,13 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 
 	recovery_eof = rec.key_len;
 
+	/* in TDB_VERSION64 files the magic is written along with the
+	   data, so the header itself may be half written */
+	if (TDB_IS64 && (rec.data_len > rec.rec_len ||
+			 tdb->methods->tdb_oob(tdb, recovery_head + TDB_REC_SIZE + rec.data_len, 1) != 0)) {
+		goto incomplete;
+	}
+
 	data = (unsigned char *)malloc(rec.data_len);
 	if (data == NULL) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to allocate recovery data\n"));		
@@ -981,30 +1414,35 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	}
 
 	/* read the full recovery data */
-	if (tdb->methods->tdb_read(tdb, recovery_head + sizeof(rec), data,
+	if (tdb->methods->tdb_read(tdb, recovery_head + TDB_REC_SIZE, data,
 				   rec.data_len, 0) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read recovery data\n"));		
+		free(data);
 		tdb->ecode = TDB_ERR_IO;
 		return -1;
 	}
 
+	if (TDB_IS64 && tdb_recovery_checksum(data, rec.data_len) != rec.full_hash) {
+		free(data);
+		goto incomplete;
+	}
+
 	/* recover the file data */
 	p = data;
-	while (p+8 < data + rec.data_len) {
-		u32 ofs, len;
-		if (DOCONV()) {
-			tdb_convert(p, 8);
-		}
-		memcpy(&ofs, p, 4);
-		memcpy(&len, p+4, 4);
+	while (p+2*TDB_OFF_SIZE < data + rec.data_len) {
+		tdb_off_t ofs, len;
 
-		if (tdb->methods->tdb_write(tdb, ofs, p+8, len) == -1) {
+		ofs = tdb_off_unpack(tdb, p);
+		len = tdb_off_unpack(tdb, p + TDB_OFF_SIZE);
+
+		if (tdb->methods->tdb_write(tdb, ofs, p+2*TDB_OFF_SIZE, len) == -1) {
 			free(data);
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to recover %d bytes at offset %d\n", len, ofs));
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to recover %llu bytes at offset %llu\n",
+				 (unsigned long long)len, (unsigned long long)ofs));
 			tdb->ecode = TDB_ERR_IO;
 			return -1;
 		}
-		p += 8 + len;
+		p += 2*TDB_OFF_SIZE + len;
 	}
 
 	free(data);
@@ -1017,7 +1455,7 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 
 	/* if the recovery area is after the recovered eof then remove it */
 	if (recovery_eof <= recovery_head) {
-		if (tdb_ofs_write(tdb, TDB_RECOVERY_HEAD, &zero) == -1) {
+		if (tdb_ofs_write(tdb, TDB_RECOVERY_HEAD, &zero_off) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to remove recovery head\n"));
 			tdb->ecode = TDB_ERR_IO;
 			return -1;			
@@ -1025,8 +1463,8 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	}
 
 	/* remove the recovery magic */
-	if (tdb_ofs_write(tdb, recovery_head + offsetof(struct list_struct, magic), 
-			  &zero) == -1) {
+	if (tdb->methods->tdb_write(tdb, recovery_head + TDB_REC_MAGIC_OFS,
+				    &zero, sizeof(zero)) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to remove recovery magic\n"));
 		tdb->ecode = TDB_ERR_IO;
 		return -1;			
@@ -1048,9 +1486,22 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 		return -1;
 	}
 
-	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_transaction_recover: recovered %d byte database\n", 
-		 recovery_eof));
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_transaction_recover: recovered %llu byte database\n", 
+		 (unsigned long long)recovery_eof));
 
 	/* all done */
 	return 0;
+
+incomplete:
+	/* the commit died before the recovery data was on disk, so it
+	   never got to change anything. Just drop the magic. */
+	TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_transaction_recover: ignoring incomplete recovery data\n"));
+	if (tdb->methods->tdb_write(tdb, recovery_head + TDB_REC_MAGIC_OFS,
+				    &zero, sizeof(zero)) == -1 ||
+	    transaction_sync(tdb, recovery_head + TDB_REC_MAGIC_OFS, sizeof(zero)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to remove recovery magic\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
 }
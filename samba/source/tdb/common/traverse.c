@@ -28,7 +28,8 @@
 
 #include "tdb_private.h"
 
-/* Uses traverse lock: 0 = finish, -1 = error, other = record offset */
+/* Uses traverse lock: 0 = finish, -1 = error, 1 = found the record at
+   tlock->off (offsets don't fit an int in 64 bit databases) */
 static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tlock,
 			 struct list_struct *rec)
 {
@@ -108,7 +109,7 @@ static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tloc
 				/* Woohoo: we found one! */
 				if (tdb_lock_record(tdb, tlock->off) != 0)
 					goto fail;
-				return tlock->off;
+				return 1;
 			}
 
 			/* Try to clean dead ones from old traverses */
@@ -156,7 +157,7 @@ static int tdb_traverse_internal(struct tdb_context *tdb,
 	while ((ret = tdb_next_lock(tdb, tl, &rec)) > 0) {
 		count++;
 		/* now read the full record */
-		key.dptr = tdb_alloc_read(tdb, tl->off + sizeof(rec), 
+		key.dptr = tdb_alloc_read(tdb, tl->off + TDB_REC_SIZE, 
 					  rec.key_len + rec.data_len);
 		if (!key.dptr) {
 			ret = -1;
@@ -251,6 +252,200 @@ int tdb_traverse(struct tdb_context *tdb,
 }
 
 
+/* a hash chain copied out by tdb_traverse_snapshot(): key_len and
+   data_len of each live record followed by its key and data */
+struct tdb_chain_copy {
+	unsigned char *buf;
+	tdb_len_t size;
+	tdb_len_t used;
+	u32 count;
+};
+
+/* how often to look at a busy chain before taking its lock */
+#define TDB_SNAPSHOT_RETRIES 8
+
+static int tdb_copy_grow(struct tdb_context *tdb, struct tdb_chain_copy *copy,
+			 tdb_len_t len)
+{
+	unsigned char *buf;
+	tdb_len_t size;
+
+	if (copy->used + len <= copy->size) {
+		return 0;
+	}
+	size = copy->size * 2;
+	if (size < copy->used + len) {
+		size = copy->used + len;
+	}
+	if ((size_t)size != size ||
+	    !(buf = (unsigned char *)realloc(copy->buf, size))) {
+		return TDB_ERRCODE(TDB_ERR_OOM, -1);
+	}
+	copy->buf = buf;
+	copy->size = size;
+	return 0;
+}
+
+/*
+  copy the live records of a chain. Without the chain lock anything can
+  happen under us, so then we don't trust (or log about) what we find
+  and just return -1. The caller then checks the sequence counters.
+*/
+static int tdb_copy_chain(struct tdb_context *tdb, u32 hash,
+			  struct tdb_chain_copy *copy, int locked)
+{
+	struct list_struct rec;
+	tdb_off_t off;
+	tdb_len_t len;
+
+	copy->used = 0;
+	copy->count = 0;
+
+	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &off) == -1) {
+		return -1;
+	}
+
+	while (off) {
+		if (locked) {
+			if (tdb_rec_read(tdb, off, &rec) == -1) {
+				return -1;
+			}
+		} else {
+			if (tdb->methods->tdb_oob(tdb, off + TDB_REC_SIZE, 1) != 0 ||
+			    tdb_rec_header_read(tdb, off, &rec) == -1 ||
+			    TDB_BAD_MAGIC(&rec)) {
+				return -1;
+			}
+		}
+
+		if (off == rec.next) {
+			if (locked) {
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_copy_chain: loop detected.\n"));
+			}
+			return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+		}
+
+		if (!TDB_DEAD(&rec)) {
+			len = rec.key_len + rec.data_len;
+			if (len > rec.rec_len ||
+			    (!locked && tdb->methods->tdb_oob(tdb, off + TDB_REC_SIZE + len, 1) != 0)) {
+				return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+			}
+			if (tdb_copy_grow(tdb, copy, 2*sizeof(tdb_len_t) + len) == -1) {
+				return -1;
+			}
+			memcpy(copy->buf + copy->used, &rec.key_len, sizeof(tdb_len_t));
+			memcpy(copy->buf + copy->used + sizeof(tdb_len_t),
+			       &rec.data_len, sizeof(tdb_len_t));
+			if (len && tdb->methods->tdb_read(tdb, off + TDB_REC_SIZE,
+							  copy->buf + copy->used + 2*sizeof(tdb_len_t),
+							  len, 0) == -1) {
+				return -1;
+			}
+			copy->used += 2*sizeof(tdb_len_t) + len;
+			copy->count++;
+		}
+
+		off = rec.next;
+	}
+	return 0;
+}
+
+/*
+  copy a chain. With mutex locking we first try without taking the
+  chain lock and keep the copy if the chain's sequence counter didn't
+  move. Otherwise (or if it keeps moving) we copy it under a read lock.
+*/
+static int tdb_snapshot_chain(struct tdb_context *tdb, u32 hash,
+			      struct tdb_chain_copy *copy)
+{
+	u32 seq[2];
+	int i, ret;
+
+	if (tdb_have_mutexes(tdb) && tdb->global_lock.count == 0) {
+		for (i = 0; i < TDB_SNAPSHOT_RETRIES; i++) {
+			if (tdb_mutex_seq_begin(tdb, hash, seq) == -1) {
+				continue;
+			}
+			ret = tdb_copy_chain(tdb, hash, copy, 0);
+			if (!tdb_mutex_seq_changed(tdb, hash, seq)) {
+				if (ret == -1) {
+					/* stable and still bad: really corrupt */
+					break;
+				}
+				return 0;
+			}
+		}
+	}
+
+	if (tdb_lock(tdb, hash, F_RDLCK) == -1) {
+		return -1;
+	}
+	ret = tdb_copy_chain(tdb, hash, copy, 1);
+	tdb_unlock(tdb, hash, F_RDLCK);
+	return ret;
+}
+
+/*
+  a traverse that never holds a lock while fn runs and never makes
+  writers wait for more than a chain copy. Each chain is copied in one
+  go and fn is called on the copies, so every chain is seen as it was
+  at one moment; records added or deleted in chains already (or not
+  yet) copied may or may not be seen, as with the other traverses.
+  With TDB_MUTEX_LOCKING chains are read without taking any lock at
+  all. fn may modify the database.
+*/
+int tdb_traverse_snapshot(struct tdb_context *tdb,
+			  tdb_traverse_func fn, void *private_data)
+{
+	struct tdb_chain_copy copy;
+	TDB_DATA key, dbuf;
+	tdb_len_t ofs, lens[2];
+	u32 hash, i;
+	int count = 0;
+
+	/* the transaction methods see the uncommitted records */
+	if (tdb->transaction) {
+		return tdb_traverse_read(tdb, fn, private_data);
+	}
+
+	memset(&copy, 0, sizeof(copy));
+
+	for (hash = 0; hash < tdb->header.hash_size; hash++) {
+		/* see tdb_next_lock(). Chain 0 is always read properly */
+		if (hash != 0) {
+			tdb->methods->next_hash_chain(tdb, &hash);
+			if (hash == tdb->header.hash_size) {
+				break;
+			}
+		}
+
+		if (tdb_snapshot_chain(tdb, hash, &copy) == -1) {
+			count = -1;
+			break;
+		}
+
+		for (i = 0, ofs = 0; i < copy.count; i++) {
+			memcpy(lens, copy.buf + ofs, sizeof(lens));
+			key.dptr = (char *)copy.buf + ofs + sizeof(lens);
+			key.dsize = lens[0];
+			dbuf.dptr = key.dptr + lens[0];
+			dbuf.dsize = lens[1];
+			ofs += sizeof(lens) + lens[0] + lens[1];
+
+			count++;
+			if (fn && fn(tdb, key, dbuf, private_data)) {
+				goto out;
+			}
+		}
+	}
+
+ out:
+	SAFE_FREE(copy.buf);
+	return count;
+}
+
+
 /* find the first entry in the database and return its key */
 TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 {
@@ -268,7 +463,7 @@ TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 		return tdb_null;
 	/* now read the key */
 	key.dsize = rec.key_len;
-	key.dptr =tdb_alloc_read(tdb,tdb->travlocks.off+sizeof(rec),key.dsize);
+	key.dptr =tdb_alloc_read(tdb,tdb->travlocks.off + TDB_REC_SIZE,key.dsize);
 
 	/* Unlock the hash chain of the record we just read. */
 	if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
@@ -289,7 +484,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 		if (tdb_lock(tdb,tdb->travlocks.hash,tdb->travlocks.lock_rw))
 			return tdb_null;
 		if (tdb_rec_read(tdb, tdb->travlocks.off, &rec) == -1
-		    || !(k = tdb_alloc_read(tdb,tdb->travlocks.off+sizeof(rec),
+		    || !(k = tdb_alloc_read(tdb,tdb->travlocks.off + TDB_REC_SIZE,
 					    rec.key_len))
 		    || memcmp(k, oldkey.dptr, oldkey.dsize) != 0) {
 			/* No, it wasn't: unlock it and start from scratch */
@@ -324,7 +519,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 	   unlocks old record */
 	if (tdb_next_lock(tdb, &tdb->travlocks, &rec) > 0) {
 		key.dsize = rec.key_len;
-		key.dptr = tdb_alloc_read(tdb, tdb->travlocks.off+sizeof(rec),
+		key.dptr = tdb_alloc_read(tdb, tdb->travlocks.off + TDB_REC_SIZE,
 					  key.dsize);
 		/* Unlock the chain of this new record */
 		if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
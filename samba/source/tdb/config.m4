@@ -14,12 +14,13 @@ if test x"$tdbdir" = "x"; then
 fi
 TDBOBJ="common/tdb.o common/dump.o common/transaction.o common/error.o common/traverse.o"
 TDBOBJ="$TDBOBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/open.o"
+TDBOBJ="$TDBOBJ common/mutex.o"
 AC_SUBST(TDBOBJ)
 
 libreplacedir=../lib/replace
 AC_SUBST(libreplacedir)
 
-AC_CHECK_FUNCS(mmap pread pwrite getpagesize utime)
+AC_CHECK_FUNCS(mmap pread pwrite getpagesize utime posix_fallocate)
 AC_CHECK_HEADERS(getopt.h sys/select.h sys/time.h)
 
 AC_HAVE_DECL(pread, [#include <unistd.h>])
@@ -47,6 +47,10 @@ extern "C" {
 #define TDB_BIGENDIAN 32 /* header is big-endian (internal use) */
 #define TDB_NOSYNC   64 /* don't use synchronous transactions */
 #define TDB_SEQNUM   128 /* maintain a sequence number */
+#define TDB_SIZE_CLASSES 256 /* create with size class free lists */
+#define TDB_MUTEX_LOCKING 512 /* lock chains with robust mutexes, needs TDB_CLEAR_IF_FIRST */
+#define TDB_OFFSET64 1024 /* create in the 64 bit offset format, which older tdb code can't read */
+#define TDB_VOLATILE 2048 /* never needs to survive a restart, e.g. a CLEAR_IF_FIRST tdb on tmpfs */
 
 #define TDB_ERRCODE(code, ret) ((tdb->ecode = (code)), ret)
 
@@ -114,6 +118,7 @@ TDB_DATA tdb_firstkey(struct tdb_context *tdb);
 TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA key);
 int tdb_traverse(struct tdb_context *tdb, tdb_traverse_func fn, void *);
 int tdb_traverse_read(struct tdb_context *tdb, tdb_traverse_func fn, void *);
+int tdb_traverse_snapshot(struct tdb_context *tdb, tdb_traverse_func fn, void *);
 int tdb_exists(struct tdb_context *tdb, TDB_DATA key);
 int tdb_lockall(struct tdb_context *tdb);
 int tdb_unlockall(struct tdb_context *tdb);
@@ -127,13 +132,18 @@ int tdb_transaction_start(struct tdb_context *tdb);
 int tdb_transaction_commit(struct tdb_context *tdb);
 int tdb_transaction_cancel(struct tdb_context *tdb);
 int tdb_transaction_recover(struct tdb_context *tdb);
+int tdb_transaction_batch_start(struct tdb_context *tdb, unsigned int max_count,
+				unsigned int max_msecs);
+int tdb_transaction_batch_end(struct tdb_context *tdb);
 int tdb_get_seqnum(struct tdb_context *tdb);
 int tdb_hash_size(struct tdb_context *tdb);
 size_t tdb_map_size(struct tdb_context *tdb);
+int tdb_reserve(struct tdb_context *tdb, size_t size);
 int tdb_get_flags(struct tdb_context *tdb);
 
 /* Low level locking functions: use with care */
 int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key);
+int tdb_chainlock_nonblock(struct tdb_context *tdb, TDB_DATA key);
 int tdb_chainunlock(struct tdb_context *tdb, TDB_DATA key);
 int tdb_chainlock_read(struct tdb_context *tdb, TDB_DATA key);
 int tdb_chainunlock_read(struct tdb_context *tdb, TDB_DATA key);
@@ -144,6 +154,7 @@ void tdb_setalarm_sigptr(struct tdb_context *tdb, volatile sig_atomic_t *sigptr)
 void tdb_dump_all(struct tdb_context *tdb);
 int tdb_printfreelist(struct tdb_context *tdb);
 int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries);
+int tdb_defrag(struct tdb_context *tdb);
 
 extern TDB_DATA tdb_null;
 
@@ -20,4 +20,5 @@
 
 char *add_suffix(const char *name, const char *suffix);
 int backup_tdb(const char *old_name, const char *new_name, int hash_size);
+int convert_tdb(const char *fname, int hash_size);
 int verify_tdb(const char *fname, const char *bak_name);
@@ -39,6 +39,14 @@
   don't need to be backed up, so you can optimise the above a little
   by only running the backup on the critical databases.
 
+  Backups keep the format of the database.
+     tdbbackup -c old.tdb
+  converts a database in the 32 bit format to the 64 bit one in place.
+  It refuses while another process holds a lock on the database, which
+  every user of a CLEAR_IF_FIRST database does, but a process with any
+  other database open holds no lock between operations. Stop Samba
+  first.
+
  */
 
 #ifdef STANDALONE
@@ -94,6 +102,7 @@ static void usage(void)
 	printf("   -s suffix     set the backup suffix\n");
 	printf("   -v            verify mode (restore if corrupt)\n");
 	printf("   -n hashsize   set the new hash size for the backup\n");
+	printf("   -c            convert in place to the 64 bit format\n");
 }
 		
 
@@ -103,10 +112,11 @@ static void usage(void)
 	int ret = 0;
 	int c;
 	int verify = 0;
+	int convert = 0;
 	int hashsize = 0;
 	const char *suffix = ".bak";
 
-	while ((c = getopt(argc, argv, "vhs:n:")) != -1) {
+	while ((c = getopt(argc, argv, "vchs:n:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage();
@@ -114,6 +124,9 @@ static void usage(void)
 		case 'v':
 			verify = 1;
 			break;
+		case 'c':
+			convert = 1;
+			break;
 		case 's':
 			suffix = optarg;
 			break;
@@ -137,7 +150,13 @@ static void usage(void)
 
 		bak_name = add_suffix(fname, suffix);
 
-		if (verify) {
+		if (convert) {
+			/* the backup goes to a temporary file that
+			   is renamed over the original */
+			if (convert_tdb(fname, hashsize) != 0) {
+				ret = 1;
+			}
+		} else if (verify) {
 			if (verify_tdb(fname, bak_name) != 0) {
 				ret = 1;
 			}
@@ -61,6 +61,8 @@ enum commands {
 	CMD_DELETE,
 	CMD_LIST_HASH_FREE,
 	CMD_LIST_FREE,
+	CMD_DEFRAG,
+	CMD_REPACK,
 	CMD_INFO,
 	CMD_FIRST,
 	CMD_NEXT,
@@ -89,6 +91,8 @@ COMMAND_TABLE cmd_table[] = {
 	{"delete",	CMD_DELETE},
 	{"list",	CMD_LIST_HASH_FREE},
 	{"free",	CMD_LIST_FREE},
+	{"defrag",	CMD_DEFRAG},
+	{"repack",	CMD_REPACK},
 	{"info",	CMD_INFO},
 	{"first",	CMD_FIRST},
 	{"1",		CMD_FIRST},
@@ -196,6 +200,9 @@ static void help(void)
 "  delete    key        : delete a record by key\n"
 "  list                 : print the database hash table and freelist\n"
 "  free                 : print the database freelist\n"
+"  defrag               : merge adjacent free space (safe while in use)\n"
+"  repack    [classic]  : rewrite the database with size class free lists,\n"
+"                         or the classic single freelist (must not be in use)\n"
 "  ! command            : execute system command\n"             
 "  1 | first            : print the first record\n"
 "  n | next             : print the next record\n"
@@ -444,6 +451,127 @@ static void info_tdb(void)
 		printf("%d records totalling %d bytes\n", count, total_bytes);
 }
 
+static void defrag_tdb(void)
+{
+	int before, after;
+
+	if (tdb_validate_freelist(tdb, &before) == -1) {
+		printf("Freelist is corrupt: %s\n", tdb_errorstr(tdb));
+		return;
+	}
+	if (tdb_defrag(tdb) == -1) {
+		printf("Defrag failed: %s\n", tdb_errorstr(tdb));
+		return;
+	}
+	if (tdb_validate_freelist(tdb, &after) == -1) {
+		printf("Freelist is corrupt after defrag: %s\n", tdb_errorstr(tdb));
+		return;
+	}
+	printf("%d free records merged into %d\n", before, after);
+}
+
+static int repack_failed;
+
+static int repack_fn(TDB_CONTEXT *the_tdb, TDB_DATA key, TDB_DATA dbuf, void *state)
+{
+	TDB_CONTEXT *dst_tdb = (TDB_CONTEXT *)state;
+
+	if (tdb_store(dst_tdb, key, dbuf, TDB_INSERT) == -1) {
+		repack_failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Rewrite the database into a new file, which leaves no free space
+  inside at all, and rename it over the old one. Other processes
+  holding the old file open would keep using it, so this is only for
+  databases that are not in use.
+ */
+static void repack_tdb(const char *how)
+{
+	TDB_CONTEXT *new_tdb;
+	const char *name = tdb_name(tdb);
+	char *tmp_name;
+	struct stat st;
+	int flags = TDB_SIZE_CLASSES;
+	int count;
+
+	if (how && strcmp(how, "classic") == 0) {
+		flags = TDB_DEFAULT;
+	} else if (how) {
+		terror("repack takes no argument or \"classic\"");
+		return;
+	}
+
+	if (fstat(tdb_fd(tdb), &st) != 0) {
+		printf("Could not stat %s: %s\n", name, strerror(errno));
+		return;
+	}
+
+	tmp_name = malloc(strlen(name) + 8);
+	if (tmp_name == NULL) {
+		terror("out of memory");
+		return;
+	}
+	sprintf(tmp_name, "%s.repack", name);
+
+	unlink(tmp_name);
+	new_tdb = tdb_open(tmp_name, tdb_hash_size(tdb), flags,
+			   O_RDWR|O_CREAT|O_EXCL, st.st_mode & 0777);
+	if (new_tdb == NULL) {
+		printf("Could not create %s: %s\n", tmp_name, strerror(errno));
+		free(tmp_name);
+		return;
+	}
+
+	if (tdb_lockall(tdb) != 0) {
+		printf("Could not lock %s\n", name);
+		goto fail;
+	}
+
+	repack_failed = 0;
+	count = tdb_traverse(tdb, repack_fn, new_tdb);
+	tdb_unlockall(tdb);
+
+	if (count < 0 || repack_failed) {
+		printf("Copying %s failed\n", name);
+		goto fail;
+	}
+
+	if (fsync(tdb_fd(new_tdb)) != 0 || tdb_close(new_tdb) != 0) {
+		new_tdb = NULL;
+		printf("Writing %s failed: %s\n", tmp_name, strerror(errno));
+		goto fail;
+	}
+
+	if (rename(tmp_name, name) != 0) {
+		printf("Could not rename %s: %s\n", tmp_name, strerror(errno));
+		unlink(tmp_name);
+		free(tmp_name);
+		return;
+	}
+	free(tmp_name);
+
+	printf("%d records repacked\n", count);
+
+	/* we still have the old file open */
+	tmp_name = strdup(name);
+	if (tmp_name != NULL) {
+		open_tdb(tmp_name);
+		free(tmp_name);
+	}
+	return;
+
+ fail:
+	if (new_tdb) {
+		tdb_close(new_tdb);
+	}
+	unlink(tmp_name);
+	free(tmp_name);
+}
+
 static char *tdb_getline(const char *prompt)
 {
 	static char thisline[1024];
@@ -576,6 +704,14 @@ static int do_command(void)
 	    case CMD_LIST_FREE:
 		tdb_printfreelist(tdb);
 		return 0;
+	    case CMD_DEFRAG:
+		bIterate = 0;
+		defrag_tdb();
+		return 0;
+	    case CMD_REPACK:
+		bIterate = 0;
+		repack_tdb(arg1);
+		return 0;
 	    case CMD_INFO:
 		info_tdb();
 		return 0;
@@ -12,22 +12,41 @@
 #include <getopt.h>
 #endif
 
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 
 #define REOPEN_PROB 30
 #define DELETE_PROB 8
 #define STORE_PROB 4
 #define APPEND_PROB 6
 #define TRANSACTION_PROB 10
+#define BATCH_PROB 50
 #define LOCKSTORE_PROB 5
 #define TRAVERSE_PROB 20
 #define TRAVERSE_READ_PROB 20
+#define TRAVERSE_SNAPSHOT_PROB 20
 #define CULL_PROB 100
+#define DEFRAG_PROB 500
 #define KEYLEN 3
 #define DATALEN 100
 
 static struct tdb_context *db;
 static int in_transaction;
+static int in_batch;
 static int error_count;
+static int num_fsyncs;
+
+#ifdef SYS_fsync
+/* count the syncs for -S. tdbtorture is linked against the static
+   libtdb, so this is the fsync() the transaction code calls. */
+int fsync(int fd)
+{
+	num_fsyncs++;
+	return syscall(SYS_fsync, fd);
+}
+#endif
 
 #ifdef PRINTF_ATTRIBUTE
 static void tdb_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...) PRINTF_ATTRIBUTE(3,4);
@@ -82,6 +101,26 @@ static int cull_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 	return 0;
 }
 
+/* snapshot traverses read without locks: check they never see a torn
+   record. Keys are letters and both keys and data end in a nul (data
+   can be empty, see LOCKSTORE_PROB). */
+static int snapshot_traverse(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
+			     void *state)
+{
+	size_t i;
+
+	if (key.dsize < 2 || key.dsize > KEYLEN+1 || key.dptr[key.dsize-1] != 0 ||
+	    (dbuf.dsize != 0 && dbuf.dptr[dbuf.dsize-1] != 0)) {
+		fatal("snapshot traverse saw a bad record");
+	}
+	for (i = 0; i < key.dsize-1; i++) {
+		if (key.dptr[i] < 'a' || key.dptr[i] > 'z') {
+			fatal("snapshot traverse saw a bad key");
+		}
+	}
+	return 0;
+}
+
 static void addrec_db(void)
 {
 	int klen, dlen;
@@ -100,6 +139,23 @@ static void addrec_db(void)
 	data.dptr = (unsigned char *)d;
 	data.dsize = dlen+1;
 
+#if BATCH_PROB
+	if (in_transaction == 0 && !in_batch && random() % BATCH_PROB == 0) {
+		if (tdb_transaction_batch_start(db, 8, 50) != 0) {
+			fatal("tdb_transaction_batch_start failed");
+		}
+		in_batch = 1;
+		goto next;
+	}
+	if (in_transaction == 0 && in_batch && random() % BATCH_PROB == 0) {
+		if (tdb_transaction_batch_end(db) != 0) {
+			fatal("tdb_transaction_batch_end failed");
+		}
+		in_batch = 0;
+		goto next;
+	}
+#endif
+
 #if TRANSACTION_PROB
 	if (in_transaction == 0 && random() % TRANSACTION_PROB == 0) {
 		if (tdb_transaction_start(db) != 0) {
@@ -125,7 +181,7 @@ static void addrec_db(void)
 #endif
 
 #if REOPEN_PROB
-	if (in_transaction == 0 && random() % REOPEN_PROB == 0) {
+	if (in_transaction == 0 && !in_batch && random() % REOPEN_PROB == 0) {
 		tdb_reopen_all(0);
 		goto next;
 	} 
@@ -169,6 +225,20 @@ static void addrec_db(void)
 	} 
 #endif
 
+#if LOCKSTORE_PROB
+	if (random() % LOCKSTORE_PROB == 0) {
+		/* somebody else holding the chain is not an error */
+		if (tdb_chainlock_nonblock(db, key) != 0) {
+			goto next;
+		}
+		if (tdb_store(db, key, data, TDB_REPLACE) != 0) {
+			fatal("tdb_store failed");
+		}
+		tdb_chainunlock(db, key);
+		goto next;
+	}
+#endif
+
 #if TRAVERSE_PROB
 	if (random() % TRAVERSE_PROB == 0) {
 		tdb_traverse(db, cull_traverse, NULL);
@@ -176,6 +246,15 @@ static void addrec_db(void)
 	}
 #endif
 
+#if DEFRAG_PROB
+	if (in_transaction == 0 && !in_batch && random() % DEFRAG_PROB == 0) {
+		if (tdb_defrag(db) != 0) {
+			fatal("tdb_defrag failed");
+		}
+		goto next;
+	}
+#endif
+
 #if TRAVERSE_READ_PROB
 	if (random() % TRAVERSE_READ_PROB == 0) {
 		tdb_traverse_read(db, NULL, NULL);
@@ -183,6 +262,15 @@ static void addrec_db(void)
 	}
 #endif
 
+#if TRAVERSE_SNAPSHOT_PROB
+	if (random() % TRAVERSE_SNAPSHOT_PROB == 0) {
+		if (tdb_traverse_snapshot(db, snapshot_traverse, NULL) == -1) {
+			fatal("tdb_traverse_snapshot failed");
+		}
+		goto next;
+	}
+#endif
+
 	data = tdb_fetch(db, key);
 	if (data.dptr) free(data.dptr);
 
@@ -191,6 +279,60 @@ next:
 	free(d);
 }
 
+/* one iteration of the lock benchmark (-B): a chain lock and unlock
+   on a random key, every fourth one a read lock */
+static void lockbench_db(void)
+{
+	char *k;
+	TDB_DATA key;
+	int ret;
+
+	k = randbuf(KEYLEN);
+	key.dptr = (unsigned char *)k;
+	key.dsize = KEYLEN+1;
+
+	if (random() % 4 == 0) {
+		ret = tdb_chainlock_read(db, key);
+		if (ret == 0) {
+			ret = tdb_chainunlock_read(db, key);
+		}
+	} else {
+		ret = tdb_chainlock(db, key);
+		if (ret == 0) {
+			ret = tdb_chainunlock(db, key);
+		}
+	}
+	if (ret != 0) {
+		fatal("chain lock failed");
+	}
+
+	free(k);
+}
+
+/* one iteration of the sync benchmark (-S): a transaction storing a
+   record */
+static void syncbench_db(void)
+{
+	char *k, *d;
+	TDB_DATA key, data;
+
+	k = randbuf(KEYLEN);
+	d = randbuf(DATALEN);
+	key.dptr = (unsigned char *)k;
+	key.dsize = KEYLEN+1;
+	data.dptr = (unsigned char *)d;
+	data.dsize = DATALEN+1;
+
+	if (tdb_transaction_start(db) != 0 ||
+	    tdb_store(db, key, data, TDB_REPLACE) != 0 ||
+	    tdb_transaction_commit(db) != 0) {
+		fatal("transaction failed");
+	}
+
+	free(k);
+	free(d);
+}
+
 static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
                        void *state)
 {
@@ -200,7 +342,14 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE] [-C] [-M] [-O] [-V] [-B] [-S BATCH]\n");
+	printf("  -C   use size class free lists\n");
+	printf("  -M   use mutex locking\n");
+	printf("  -O   use the 64 bit offset format\n");
+	printf("  -V   open with TDB_VOLATILE and tdb_reserve() 1MB\n");
+	printf("  -B   only time chain locks, e.g. -B -n 64 with and without -M\n");
+	printf("  -S   only do one record transactions, BATCH of them (1 for no\n"
+	       "       batching) per tdb_transaction_batch_start(), and count fsyncs\n");
 	exit(0);
 }
 
@@ -210,14 +359,20 @@ static void usage(void)
 	int num_procs = 3;
 	int num_loops = 5000;
 	int hash_size = 2;
+	int tdb_flags = TDB_CLEAR_IF_FIRST;
+	int lock_bench = 0;
+	int sync_batch = 0;
+	struct timeval start, end;
 	int c;
 	extern char *optarg;
 	pid_t *pids;
+	int ready[2], go[2], n;
+	char b = 0;
 
 	struct tdb_logging_context log_ctx;
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:CMOVBS:h")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -231,26 +386,71 @@ static void usage(void)
 		case 's':
 			seed = strtol(optarg, NULL, 0);
 			break;
+		case 'C':
+			tdb_flags |= TDB_SIZE_CLASSES;
+			break;
+		case 'M':
+			tdb_flags |= TDB_MUTEX_LOCKING;
+			break;
+		case 'O':
+			tdb_flags |= TDB_OFFSET64;
+			break;
+		case 'V':
+			tdb_flags |= TDB_VOLATILE;
+			break;
+		case 'B':
+			lock_bench = 1;
+			break;
+		case 'S':
+			sync_batch = strtol(optarg, NULL, 0);
+			break;
 		default:
 			usage();
 		}
 	}
 
 	unlink("torture.tdb");
+	unlink("torture.tdb.mutex");
 
 	pids = calloc(sizeof(pid_t), num_procs);
 	pids[0] = getpid();
+	if (pipe(ready) != 0 || pipe(go) != 0) {
+		fatal("pipe failed");
+	}
+	gettimeofday(&start, NULL);
 
 	for (i=0;i<num_procs-1;i++) {
 		if ((pids[i+1]=fork()) == 0) break;
 	}
 
-	db = tdb_open_ex("torture.tdb", hash_size, TDB_CLEAR_IF_FIRST, 
+	db = tdb_open_ex("torture.tdb", hash_size, tdb_flags, 
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
 	if (!db) {
 		fatal("db open failed");
 	}
 
+	/* TDB_CLEAR_IF_FIRST wipes the database for an opener that finds
+	   nobody else using it, and tdb_reopen_all() lets go of it for a
+	   moment. So nobody starts before everybody has it open. */
+	if (getpid() == pids[0]) {
+		close(go[0]);
+		for (n = 0; n < num_procs-1; n++) {
+			read(ready[0], &b, 1);
+		}
+		close(go[1]);
+	} else {
+		close(go[1]);
+		write(ready[1], &b, 1);
+		read(go[0], &b, 1);
+		close(go[0]);
+	}
+	close(ready[0]);
+	close(ready[1]);
+
+	if ((tdb_flags & TDB_VOLATILE) && tdb_reserve(db, 1024*1024) != 0) {
+		fatal("tdb_reserve failed");
+	}
+
 	if (seed == -1) {
 		seed = (getpid() + time(NULL)) & 0x7FFFFFFF;
 	}
@@ -263,14 +463,42 @@ static void usage(void)
 	srand(seed + i);
 	srandom(seed + i);
 
+	if (sync_batch > 1 && tdb_transaction_batch_start(db, sync_batch, 1000) != 0) {
+		fatal("tdb_transaction_batch_start failed");
+	}
+
 	for (i=0;i<num_loops && error_count == 0;i++) {
-		addrec_db();
+		if (lock_bench) {
+			lockbench_db();
+		} else if (sync_batch) {
+			syncbench_db();
+		} else {
+			addrec_db();
+		}
+	}
+
+	if (in_transaction && tdb_transaction_commit(db) != 0) {
+		fatal("tdb_transaction_commit failed");
+	}
+
+	if ((in_batch || sync_batch > 1) && tdb_transaction_batch_end(db) != 0) {
+		fatal("tdb_transaction_batch_end failed");
+	}
+
+	if (sync_batch) {
+		printf("%d transactions in batches of %d: %d fsyncs\n",
+		       num_loops, sync_batch, num_fsyncs);
 	}
 
 	if (error_count == 0) {
+		int num_free;
+
 		tdb_traverse_read(db, NULL, NULL);
 		tdb_traverse(db, traverse_fn, NULL);
 		tdb_traverse(db, traverse_fn, NULL);
+		if (tdb_validate_freelist(db, &num_free) != 0) {
+			fatal("freelist is corrupt");
+		}
 	}
 
 	tdb_close(db);
@@ -310,6 +538,27 @@ static void usage(void)
 		pids[j] = 0;
 	}
 
+	if (error_count == 0 && lock_bench) {
+		double secs;
+
+		gettimeofday(&end, NULL);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+		printf("%s locking: %.0f chain lock/unlock pairs per second\n",
+		       (tdb_flags & TDB_MUTEX_LOCKING) ? "mutex" : "fcntl",
+		       (double)num_procs * num_loops / secs);
+	}
+
+	if (error_count == 0 && sync_batch) {
+		double secs;
+
+		gettimeofday(&end, NULL);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+		printf("%.0f transactions per second\n",
+		       (double)num_procs * num_loops / secs);
+	}
+
 	if (error_count == 0) {
 		printf("OK\n");
 	}
@@ -70,11 +70,11 @@ static int net_status_sessions(int argc, const char **argv)
 			 "------------------------\n");
 	}
 
-	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0,
+	tdb = tdb_open_log(volatile_path("sessionid.tdb"), 0,
 			   TDB_DEFAULT, O_RDONLY, 0);
 
 	if (tdb == NULL) {
-		d_fprintf(stderr, "%s not initialised\n", lock_path("sessionid.tdb"));
+		d_fprintf(stderr, "%s not initialised\n", volatile_path("sessionid.tdb"));
 		return -1;
 	}
 
@@ -186,22 +186,22 @@ static int net_status_shares_parseable(int argc, const char **argv)
 	ids.num_entries = 0;
 	ids.entries = NULL;
 
-	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0,
+	tdb = tdb_open_log(volatile_path("sessionid.tdb"), 0,
 			   TDB_DEFAULT, O_RDONLY, 0);
 
 	if (tdb == NULL) {
-		d_fprintf(stderr, "%s not initialised\n", lock_path("sessionid.tdb"));
+		d_fprintf(stderr, "%s not initialised\n", volatile_path("sessionid.tdb"));
 		return -1;
 	}
 
 	tdb_traverse(tdb, collect_pid, &ids);
 	tdb_close(tdb);
 
-	tdb = tdb_open_log(lock_path("connections.tdb"), 0,
+	tdb = tdb_open_log(volatile_path("connections.tdb"), 0,
 			   TDB_DEFAULT, O_RDONLY, 0);
 
 	if (tdb == NULL) {
-		d_fprintf(stderr, "%s not initialised\n", lock_path("connections.tdb"));
+		d_fprintf(stderr, "%s not initialised\n", volatile_path("connections.tdb"));
 		d_fprintf(stderr, "This is normal if no SMB client has ever "
 			 "connected to your server.\n");
 		return -1;
@@ -226,12 +226,12 @@ static int net_status_shares(int argc, const char **argv)
 		d_printf("-------------------------------------"
 			 "------------------\n");
 
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0,
+		tdb = tdb_open_log(volatile_path("connections.tdb"), 0,
 				   TDB_DEFAULT, O_RDONLY, 0);
 
 		if (tdb == NULL) {
 			d_fprintf(stderr, "%s not initialised\n",
-				 lock_path("connections.tdb"));
+				 volatile_path("connections.tdb"));
 			d_fprintf(stderr, "This is normal if no SMB client has "
 				 "ever connected to your server.\n");
 			return -1;
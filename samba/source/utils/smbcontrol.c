@@ -62,7 +62,7 @@ static BOOL send_message(struct process_id pid, int msg_type,
 		return NT_STATUS_IS_OK(message_send_pid(pid, msg_type, buf, len,
 							duplicates));
 
-	tdb = tdb_open_log(lock_path("connections.tdb"), 0, 
+	tdb = tdb_open_log(volatile_path("connections.tdb"), 0, 
 			   TDB_DEFAULT, O_RDWR, 0);
 	if (!tdb) {
 		fprintf(stderr,"Failed to open connections database"
@@ -288,7 +288,7 @@ static BOOL do_daemon_stack_trace(const struct process_id pid,
 	} else {
 		TDB_CONTEXT * tdb;
 
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0, 
+		tdb = tdb_open_log(volatile_path("connections.tdb"), 0, 
 				   TDB_DEFAULT, O_RDONLY, 0);
 		if (!tdb) {
 			fprintf(stderr,
@@ -45,6 +45,7 @@ static int            locks_only  = 0;            /* Added by RJS */
 static BOOL processes_only=False;
 static int show_brl;
 static int show_counts = 0;
+static int notify_only = 0;
 static BOOL numeric_only = False;
 
 const char *username = NULL;
@@ -241,6 +242,70 @@ static int traverse_sessionid(TDB_CONTEXT *tdb, TDB_DATA kbuf, TDB_DATA dbuf, vo
 	return 0;
 }
 
+struct notify_totals {
+	int num_dirs;
+	int num_watches;
+};
+
+static int traverse_notify(TDB_CONTEXT *tdb, TDB_DATA kbuf, TDB_DATA dbuf, void *state)
+{
+	struct notify_totals *totals = (struct notify_totals *)state;
+	size_t prefix_len = strlen(NOTIFY_DB_PREFIX);
+	struct notify_db_entry entry;
+	int i, num_entries;
+
+	if (kbuf.dsize <= prefix_len ||
+	    strncmp(kbuf.dptr, NOTIFY_DB_PREFIX, prefix_len) != 0 ||
+	    kbuf.dptr[kbuf.dsize-1] != '\0') {
+		return 0;
+	}
+
+	num_entries = dbuf.dsize / sizeof(entry);
+
+	totals->num_dirs++;
+	totals->num_watches += num_entries;
+
+	d_printf("%7d   %s\n", num_entries, kbuf.dptr + prefix_len);
+
+	if (!verbose) {
+		return 0;
+	}
+
+	for (i = 0; i < num_entries; i++) {
+		memcpy(&entry, dbuf.dptr + i*sizeof(entry), sizeof(entry));
+		d_printf("          pid %s filter 0x%x subdir filter 0x%x\n",
+			 procid_str_static(&entry.server.id),
+			 (unsigned int)entry.filter,
+			 (unsigned int)entry.subdir_filter);
+	}
+
+	return 0;
+}
+
+static int show_notify(void)
+{
+	struct notify_totals totals;
+	TDB_CONTEXT *tdb;
+
+	tdb = tdb_open_log(volatile_path("notify.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+	if (!tdb) {
+		d_printf("%s not initialised\n", volatile_path("notify.tdb"));
+		return 0;
+	}
+
+	ZERO_STRUCT(totals);
+
+	d_printf("\nWatches   Directory\n");
+	d_printf("-------------------------------------------------------\n");
+
+	tdb_traverse_snapshot(tdb, traverse_notify, &totals);
+	tdb_close(tdb);
+
+	d_printf("\n%d change notify watches on %d directories\n",
+		 totals.num_watches, totals.num_dirs);
+	return 0;
+}
+
 #ifdef WITH_DARWIN_STATS
 u_int64_t buffer[3];
 int num_replies;
@@ -260,7 +325,7 @@ static BOOL send_status_message(struct process_id pid)
 				    NULL, 0, False /* duplicates */));
 	}
 
-	tdb = tdb_open_log(lock_path("connections.tdb"), 0,
+	tdb = tdb_open_log(volatile_path("connections.tdb"), 0,
 			   TDB_DEFAULT, O_RDWR, 0);
 	if (!tdb) {
 		fprintf(stderr,"Failed to open connections database"
@@ -336,13 +401,13 @@ static void dump_user_stats(void)
 	TDB_CONTEXT *tdb;
 	int nump = 0;
 	message_register(MSG_USR_STATS, handle_usr_stat_reply, NULL);
-	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+	tdb = tdb_open_log(volatile_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
 	if (!tdb) {
 		d_printf("\nsessionid.tdb not initialised\n");
 	} else {
 		d_printf("\nPID     Username      Group         OpCount              ByteCount            \n");
 		d_printf("------------------------------------------------------------------------------\n");
-		nump = tdb_traverse(tdb, traverse_processes, NULL);
+		nump = tdb_traverse_snapshot(tdb, traverse_processes, NULL);
 		//DEBUG(10,("Total %d procs traversed\n", nump));
 		tdb_close(tdb);
 	}
@@ -388,6 +453,7 @@ static void dump_service_stats(void)
 		{"byterange",	'B', POPT_ARG_NONE,	&show_brl, 'B', "Include byte range locks"},
 		{"numeric",	'n', POPT_ARG_NONE,	&numeric_only, 'n', "Numeric uid/gid"},
 		{"counts",	'C', POPT_ARG_NONE,	&show_counts, 'n', "Show all user op/bytes counts"},
+		{"notify",	'N', POPT_ARG_NONE,	&notify_only, 'N', "Show change notify watches only"},
 		POPT_COMMON_SAMBA
 		POPT_TABLEEND
 	};
@@ -447,8 +513,12 @@ static void dump_service_stats(void)
 			break;
 	}
 
+	if (notify_only) {
+		return show_notify();
+	}
+
 	if ( show_processes ) {
-		tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(volatile_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
 		if (!tdb) {
 			d_printf("sessionid.tdb not initialised\n");
 		} else {
@@ -456,7 +526,7 @@ static void dump_service_stats(void)
 			d_printf("PID     Username      Group         Machine                        \n");
 			d_printf("-------------------------------------------------------------------\n");
 
-			tdb_traverse(tdb, traverse_sessionid, NULL);
+			tdb_traverse_snapshot(tdb, traverse_sessionid, NULL);
 			tdb_close(tdb);
 		}
 
@@ -473,13 +543,13 @@ static void dump_service_stats(void)
 #endif /*WITH_DARWIN_STATS*/
 
 	if ( show_shares ) {
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(volatile_path("connections.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
 		if (!tdb) {
-			d_printf("%s not initialised\n", lock_path("connections.tdb"));
+			d_printf("%s not initialised\n", volatile_path("connections.tdb"));
 			d_printf("This is normal if an SMB client has never connected to your server.\n");
 		}  else  {
 			if (verbose) {
-				d_printf("Opened %s\n", lock_path("connections.tdb"));
+				d_printf("Opened %s\n", volatile_path("connections.tdb"));
 			}
 
 			if (brief) 
@@ -488,7 +558,7 @@ static void dump_service_stats(void)
 			d_printf("\nService      pid     machine       Connected at\n");
 			d_printf("-------------------------------------------------------\n");
 	
-			tdb_traverse(tdb, traverse_fn1, NULL);
+			tdb_traverse_snapshot(tdb, traverse_fn1, NULL);
 			tdb_close(tdb);
 
 			d_printf("\n");
@@ -501,10 +571,10 @@ static void dump_service_stats(void)
 	if ( show_locks ) {
 		int ret;
 
-		tdb = tdb_open_log(lock_path("locking.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(volatile_path("locking.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
 
 		if (!tdb) {
-			d_printf("%s not initialised\n", lock_path("locking.tdb"));
+			d_printf("%s not initialised\n", volatile_path("locking.tdb"));
 			d_printf("This is normal if an SMB client has never connected to your server.\n");
 			exit(0);
 		} else {
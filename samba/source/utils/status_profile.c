@@ -129,6 +129,16 @@ BOOL status_profile_dump(BOOL verbose)
 	d_printf("misses:                         %u\n", profile_p->statcache_misses);
 	d_printf("hits:                           %u\n", profile_p->statcache_hits);
 
+	profile_separator("Attribute Cache");
+	d_printf("lookups:                        %u\n", profile_p->attrcache_lookups);
+	d_printf("misses:                         %u\n", profile_p->attrcache_misses);
+	d_printf("hits:                           %u\n", profile_p->attrcache_hits);
+
+	profile_separator("Stat Prefetch");
+	d_printf("batches:                        %u\n", profile_p->statprefetch_batches);
+	d_printf("hits:                           %u\n", profile_p->statprefetch_hits);
+	d_printf("misses:                         %u\n", profile_p->statprefetch_misses);
+
 	profile_separator("Write Cache");
 	d_printf("read_hits:                      %u\n", profile_p->writecache_read_hits);
 	d_printf("abutted_writes:                 %u\n", profile_p->writecache_abutted_writes);
@@ -144,6 +154,7 @@ BOOL status_profile_dump(BOOL verbose)
 	d_printf("flushed_writes[CLOSE]:          %u\n", profile_p->writecache_flushed_writes[CLOSE_FLUSH]);
 	d_printf("flushed_writes[SYNC]:           %u\n", profile_p->writecache_flushed_writes[SYNC_FLUSH]);
 	d_printf("flushed_writes[SIZECHANGE]:     %u\n", profile_p->writecache_flushed_writes[SIZECHANGE_FLUSH]);
+	d_printf("flushed_writes[AGED]:           %u\n", profile_p->writecache_flushed_writes[AGED_FLUSH]);
 	d_printf("num_perfect_writes:             %u\n", profile_p->writecache_num_perfect_writes);
 	d_printf("num_write_caches:               %u\n", profile_p->writecache_num_write_caches);
 	d_printf("allocated_write_caches:         %u\n", profile_p->writecache_allocated_write_caches);